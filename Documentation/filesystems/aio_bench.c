@@ -0,0 +1,391 @@
+/*
+ * aio_bench: measure the cost of io_submit() and io_getevents() as the
+ * number of aio contexts and of threads using them grows.
+ *
+ * Each thread keeps -d requests in flight on one context, reaping at
+ * least one completion and resubmitting as many each time round.  The
+ * requests are -b byte reads (512 by default) of -f, /dev/zero by
+ * default, which completes them inside io_submit(), so the figures are
+ * the overhead of the aio syscalls alone.  A file opened with O_DIRECT on
+ * a RAM disk (-o) adds the block layer.
+ *
+ * With -R the reads go to random, block aligned offsets of a regular
+ * file.  -m makes that many percent of its megabytes cold: they are
+ * dropped from the page cache ten times a second, so the reads are a mix
+ * of page cache hits and misses.  Buffered reads that miss used to block
+ * in io_submit(); they are now queued and completed once the pages come
+ * in.  The mean time spent in io_submit() is printed, so running
+ *
+ *	./aio_bench -t 4 -d 32 -b 4096 -f /scratch/10G -R -m 10
+ *
+ * on kernels with and without queued buffered reads shows the
+ * difference.
+ *
+ * Threads share the -c contexts round robin, so -c 1 has every thread
+ * contend on one context.  -i sets up that many idle contexts first, to
+ * show how the lookup of a context depends on how many the process has.
+ * With -r completions are reaped from the mmap()ed ring rather than with
+ * io_getevents(), which is only called to sleep when the ring is empty.
+ *
+ *	for t in 1 2 4 8; do ./aio_bench -c 1 -t $t; ./aio_bench -c $t -t $t; done
+ *	for i in 0 16 256 4096; do ./aio_bench -c 8 -t 8 -i $i; done
+ *	./aio_bench -c 8 -t 8 -r
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <linux/aio_abi.h>
+
+/* The header of the completion ring, see include/linux/aio.h. */
+struct aio_ring {
+	unsigned	id;
+	unsigned	nr;
+	unsigned	head;
+	unsigned	tail;
+	unsigned	magic;
+	unsigned	compat_features;
+	unsigned	incompat_features;
+	unsigned	header_length;
+	struct io_event	io_events[0];
+};
+
+#define AIO_RING_MAGIC	0xa10a10a1
+
+struct context {
+	aio_context_t	id;
+	pthread_mutex_t	lock;	/* serializes reaping from the ring */
+};
+
+static struct context *contexts;
+static int nr_contexts = 1, nr_idle, nr_threads = 1, depth = 32;
+static int seconds = 10, user_reap, open_flags = O_RDONLY;
+static int buf_size = 512, random_reads, cold_percent;
+static unsigned long long file_size;
+static const char *path = "/dev/zero";
+static volatile int stop;
+
+static struct result {
+	unsigned long		done;
+	unsigned long long	submit_ns;
+} *results;
+
+#define CHUNK		(1 << 20)
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long random_offset(unsigned int *seed)
+{
+	unsigned long long blocks = file_size / buf_size;
+	unsigned long long r;
+
+	r = ((unsigned long long)rand_r(seed) << 31) ^ rand_r(seed);
+	return (r % blocks) * buf_size;
+}
+
+/* Keeps the cold megabytes of the file out of the page cache. */
+static void *evictor(void *arg)
+{
+	int fd = (long)arg;
+	unsigned long long chunk;
+
+	while (!stop) {
+		for (chunk = 0; chunk < file_size / CHUNK; chunk++)
+			if (chunk % 100 < cold_percent)
+				posix_fadvise(fd, chunk * CHUNK, CHUNK,
+					      POSIX_FADV_DONTNEED);
+		usleep(100000);
+	}
+	return NULL;
+}
+
+static long io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static long io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static long io_getevents(aio_context_t ctx, long min_nr, long nr,
+			 struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/*
+ * Take up to nr events off the ring without entering the kernel: read
+ * tail before the events, and only move head once they have been copied.
+ */
+static int ring_getevents(struct context *ctx, int nr,
+			  struct io_event *events)
+{
+	struct aio_ring *ring = (struct aio_ring *)ctx->id;
+	unsigned head, tail;
+	int i = 0;
+
+	pthread_mutex_lock(&ctx->lock);
+	head = ring->head;
+	tail = ring->tail;
+	__sync_synchronize();
+
+	while (head != tail && i < nr) {
+		events[i++] = ring->io_events[head];
+		head = (head + 1) % ring->nr;
+	}
+
+	__sync_synchronize();
+	ring->head = head;
+	pthread_mutex_unlock(&ctx->lock);
+
+	return i;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *worker(void *arg)
+{
+	long n = (long)arg;
+	struct context *ctx = &contexts[n % nr_contexts];
+	struct timespec timeout = { 0, 10000000 };
+	struct iocb *iocbs, **ptrs;
+	struct io_event *events;
+	unsigned long long submit_ns = 0;
+	unsigned int seed = n;
+	int fd, i, queued;
+	char *bufs;
+
+	fd = open(path, open_flags);
+	if (fd < 0)
+		die(path);
+
+	iocbs = calloc(depth, sizeof(*iocbs));
+	ptrs = calloc(depth, sizeof(*ptrs));
+	events = calloc(depth, sizeof(*events));
+	if (!iocbs || !ptrs || !events ||
+	    posix_memalign((void **)&bufs, 4096, depth * buf_size))
+		die("malloc");
+
+	for (i = 0; i < depth; i++) {
+		iocbs[i].aio_lio_opcode = IOCB_CMD_PREAD;
+		iocbs[i].aio_fildes = fd;
+		iocbs[i].aio_buf = (unsigned long)(bufs + i * buf_size);
+		iocbs[i].aio_nbytes = buf_size;
+		iocbs[i].aio_data = (unsigned long)&iocbs[i];
+		ptrs[i] = &iocbs[i];
+	}
+
+	/*
+	 * ptrs[0..queued) are waiting to be submitted.  io_submit() may take
+	 * only some of them when the ring is short of slots, and on a shared
+	 * context we may reap completions of other threads' requests; they
+	 * are simply resubmitted by whoever reaped them.
+	 */
+	queued = depth;
+	while (!stop) {
+		int got = 0, ret;
+
+		if (queued) {
+			unsigned long long start;
+
+			if (random_reads)
+				for (i = 0; i < queued; i++)
+					ptrs[i]->aio_offset =
+						random_offset(&seed);
+
+			start = now_ns();
+			ret = io_submit(ctx->id, queued, ptrs);
+			submit_ns += now_ns() - start;
+			if (ret < 0 && errno != EAGAIN)
+				die("io_submit");
+			if (ret > 0) {
+				queued -= ret;
+				memmove(ptrs, ptrs + ret, queued * sizeof(*ptrs));
+			}
+		}
+		if (queued == depth)
+			continue;
+
+		if (user_reap)
+			got = ring_getevents(ctx, depth - queued, events);
+		if (!got)
+			got = io_getevents(ctx->id, 1, depth - queued, events,
+					   &timeout);
+		if (got < 0 && errno != EINTR)
+			die("io_getevents");
+
+		for (i = 0; i < got; i++) {
+			if ((long long)events[i].res < 0) {
+				errno = -events[i].res;
+				die("read");
+			}
+			ptrs[queued++] = (struct iocb *)(unsigned long)events[i].data;
+		}
+		if (got > 0)
+			results[n].done += got;
+	}
+
+	results[n].submit_ns = submit_ns;
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c contexts] [-i idle contexts] "
+		"[-t threads] [-d depth]\n"
+		"\t[-s seconds] [-b block size] [-f file] [-o] [-r] "
+		"[-R [-m cold percent]]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long submit_ns = 0;
+	unsigned long total = 0;
+	struct timeval start, end;
+	pthread_t *threads, evict;
+	aio_context_t idle;
+	double elapsed;
+	long i;
+	int opt, fd = -1;
+
+	while ((opt = getopt(argc, argv, "c:i:t:d:s:b:f:orRm:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_contexts = atoi(optarg);
+			break;
+		case 'i':
+			nr_idle = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			buf_size = atoi(optarg);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'o':
+			open_flags |= O_DIRECT;
+			break;
+		case 'r':
+			user_reap = 1;
+			break;
+		case 'R':
+			random_reads = 1;
+			break;
+		case 'm':
+			cold_percent = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_contexts < 1 || nr_threads < 1 || depth < 1 || seconds < 1 ||
+	    buf_size < 1 || cold_percent < 0 || cold_percent > 100 ||
+	    (cold_percent && !random_reads))
+		usage(argv[0]);
+	if (nr_contexts > nr_threads)
+		nr_contexts = nr_threads;
+
+	if (random_reads) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			die(path);
+		file_size = lseek(fd, 0, SEEK_END);
+		if (file_size < (unsigned long long)buf_size) {
+			fprintf(stderr, "%s: too small for -R\n", path);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < nr_idle; i++) {
+		idle = 0;
+		if (io_setup(1, &idle))
+			die("io_setup (see /proc/sys/fs/aio-max-nr)");
+	}
+
+	contexts = calloc(nr_contexts, sizeof(*contexts));
+	threads = calloc(nr_threads, sizeof(*threads));
+	results = calloc(nr_threads, sizeof(*results));
+	if (!contexts || !threads || !results)
+		die("malloc");
+
+	for (i = 0; i < nr_contexts; i++) {
+		int users = (nr_threads - i + nr_contexts - 1) / nr_contexts;
+		struct aio_ring *ring;
+
+		if (io_setup(depth * users, &contexts[i].id))
+			die("io_setup (see /proc/sys/fs/aio-max-nr)");
+		pthread_mutex_init(&contexts[i].lock, NULL);
+
+		ring = (struct aio_ring *)contexts[i].id;
+		if (user_reap && ring->magic != AIO_RING_MAGIC) {
+			fprintf(stderr, "unknown completion ring layout\n");
+			return 1;
+		}
+	}
+
+	if (cold_percent &&
+	    pthread_create(&evict, NULL, evictor, (void *)(long)fd))
+		die("pthread_create");
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, worker, (void *)i))
+			die("pthread_create");
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		total += results[i].done;
+		submit_ns += results[i].submit_ns;
+	}
+	gettimeofday(&end, NULL);
+	if (cold_percent)
+		pthread_join(evict, NULL);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%d contexts (%d idle), %d threads, depth %d%s: "
+	       "%.0f requests/s, %.1f us in io_submit per request\n",
+	       nr_contexts, nr_idle, nr_threads, depth,
+	       user_reap ? ", ring reaping" : "", total / elapsed,
+	       total ? submit_ns / 1000.0 / total : 0.0);
+
+	return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * synflood: send a stream of TCP SYNs with random source addresses and
+ * ports to one listener, to measure how many SYNs per second the listener
+ * can answer.
+ *
+ * The usual setup runs the listener and the flood in two network
+ * namespaces joined by a veth pair, so that no physical NIC is involved:
+ *
+ *	ip netns add srv
+ *	ip link add veth0 type veth peer name veth1
+ *	ip link set veth1 netns srv
+ *	ip addr add 10.0.0.1/8 dev veth0 && ip link set veth0 up
+ *	ip netns exec srv ip addr add 10.0.0.2/8 dev veth1
+ *	ip netns exec srv ip link set veth1 up
+ *	ip netns exec srv sysctl -w net.ipv4.tcp_syncookies=1
+ *	ip netns exec srv nc -l -k 10.0.0.2 8000 &
+ *	ip route add 11.0.0.0/8 dev veth0	# spoofed sources reply here
+ *	./synflood -d 10.0.0.2 -p 8000 -s 11.0.0.0 -n 10000000 -t 4
+ *
+ * and compares TcpExtSyncookiesSent in /proc/net/netstat of the server
+ * namespace before and after the run.  Spread the veth interrupts over
+ * several CPUs (RPS) so that the listener sees SYNs from several CPUs
+ * at once.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <linux/ip.h>
+#include <linux/tcp.h>
+
+struct syn_packet {
+	struct iphdr	ip;
+	struct tcphdr	tcp;
+	/* MSS option, as sent by any real client */
+	unsigned char	opts[4];
+};
+
+static unsigned short csum_fold(unsigned long sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static unsigned long csum_add(unsigned long sum, const void *data, int len)
+{
+	const unsigned short *p = data;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	if (len)
+		sum += *(const unsigned char *)p;
+	return sum;
+}
+
+static void build_syn(struct syn_packet *pkt, unsigned int saddr,
+		      unsigned int daddr, unsigned short sport,
+		      unsigned short dport, unsigned int seq)
+{
+	unsigned long sum;
+	struct {
+		unsigned int	saddr;
+		unsigned int	daddr;
+		unsigned char	zero;
+		unsigned char	proto;
+		unsigned short	len;
+	} pseudo;
+
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->ip.version = 4;
+	pkt->ip.ihl = sizeof(pkt->ip) / 4;
+	pkt->ip.tot_len = htons(sizeof(*pkt));
+	pkt->ip.ttl = 64;
+	pkt->ip.protocol = IPPROTO_TCP;
+	pkt->ip.saddr = saddr;
+	pkt->ip.daddr = daddr;
+
+	pkt->tcp.source = sport;
+	pkt->tcp.dest = dport;
+	pkt->tcp.seq = htonl(seq);
+	pkt->tcp.doff = (sizeof(pkt->tcp) + sizeof(pkt->opts)) / 4;
+	pkt->tcp.syn = 1;
+	pkt->tcp.window = htons(5840);
+	pkt->opts[0] = 2;		/* TCPOPT_MSS */
+	pkt->opts[1] = 4;
+	pkt->opts[2] = 1460 >> 8;
+	pkt->opts[3] = 1460 & 0xff;
+
+	pseudo.saddr = saddr;
+	pseudo.daddr = daddr;
+	pseudo.zero = 0;
+	pseudo.proto = IPPROTO_TCP;
+	pseudo.len = htons(sizeof(pkt->tcp) + sizeof(pkt->opts));
+
+	sum = csum_add(0, &pseudo, sizeof(pseudo));
+	sum = csum_add(sum, &pkt->tcp, sizeof(pkt->tcp) + sizeof(pkt->opts));
+	pkt->tcp.check = csum_fold(sum);
+}
+
+static void flood(int id, unsigned int daddr, unsigned short dport,
+		  unsigned int snet, unsigned long count)
+{
+	struct sockaddr_in sin;
+	struct syn_packet pkt;
+	unsigned int seed = getpid();
+	unsigned long i;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = daddr;
+
+	for (i = 0; i < count; i++) {
+		unsigned int host = rand_r(&seed) & 0x00ffffff;
+
+		build_syn(&pkt, htonl(ntohl(snet) | host), daddr,
+			  htons(1024 + (rand_r(&seed) % 60000)), dport,
+			  rand_r(&seed));
+		if (sendto(fd, &pkt, sizeof(pkt), 0,
+			   (struct sockaddr *)&sin, sizeof(sin)) < 0 &&
+		    errno != ENOBUFS) {
+			fprintf(stderr, "flooder %d: ", id);
+			perror("sendto");
+			exit(1);
+		}
+	}
+	exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s -d daddr -p dport [-s source net] [-n count] [-t procs]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int daddr = 0, snet = inet_addr("11.0.0.0");
+	unsigned short dport = 0;
+	unsigned long count = 1000000;
+	int procs = 1, i, c, status;
+	struct timeval start, stop;
+	double secs;
+
+	while ((c = getopt(argc, argv, "d:p:s:n:t:")) != -1) {
+		switch (c) {
+		case 'd':
+			daddr = inet_addr(optarg);
+			break;
+		case 'p':
+			dport = htons(atoi(optarg));
+			break;
+		case 's':
+			snet = inet_addr(optarg);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			procs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!daddr || !dport || procs < 1)
+		usage(argv[0]);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < procs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (!pid)
+			flood(i, daddr, dport, snet, count / procs);
+	}
+	for (i = 0; i < procs; i++) {
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			return 1;
+	}
+	gettimeofday(&stop, NULL);
+
+	secs = (stop.tv_sec - start.tv_sec) +
+	       (stop.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%lu SYNs in %.3f sec, %.0f SYNs/sec\n",
+	       count / procs * procs, secs, (count / procs * procs) / secs);
+	return 0;
+}
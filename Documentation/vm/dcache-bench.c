@@ -0,0 +1,231 @@
+/*
+ * dcache-bench: fill the dentry cache on every node of a NUMA machine,
+ * then allocate memory on one node until it reclaims, and report how
+ * long the allocations took and which nodes lost their dentries.
+ *
+ * A child pinned to the cpus of each node looks up -n names that do not
+ * exist in directory -d, which leaves that many unused negative dentries
+ * cached in the node's memory.  The parent then pins itself to node -N,
+ * faults in -m MB of anonymous memory a megabyte at a time, and prints
+ * the average and worst time per megabyte.  The reclaimable slab memory
+ * of each node, from /sys/devices/system/node/node<n>/meminfo, is printed
+ * before and after.
+ *
+ * A machine with several nodes is not needed; a guest with fake ones is
+ * enough, e.g. qemu -m 4G with numa=fake=4 on the kernel command line:
+ *
+ *	./dcache-bench -n 4000000 -N 0 -m 900
+ *
+ * The dentry and inode caches used to be shrunk as a whole, whichever
+ * node was short of memory, so that reclaim on node 0 freed dentries on
+ * all nodes, most of which did node 0 no good, and had to free more of
+ * them to get the same memory back.  They are now kept on per node lists
+ * and shrunk on the node being reclaimed: only node 0 should lose slab
+ * memory, and the worst time per megabyte should be lower.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_NODES	64
+
+static unsigned long nr_names = 1000000;
+static const char *dir = ".";
+static int nr_nodes;
+static long page_size;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int count_nodes(void)
+{
+	char path[64];
+	int nr = 0;
+
+	for (;;) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+			 nr);
+		if (access(path, F_OK) || nr == MAX_NODES)
+			return nr ? nr : 1;
+		nr++;
+	}
+}
+
+/* Run on the cpus of a node, from its cpulist, e.g. "0-3,8-11". */
+static void pin_node(int nid)
+{
+	char path[64], list[1024], *p;
+	cpu_set_t set;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 nid);
+	f = fopen(path, "r");
+	if (!f)
+		return;		/* not NUMA */
+	if (!fgets(list, sizeof(list), f))
+		list[0] = '\0';
+	fclose(f);
+
+	CPU_ZERO(&set);
+	for (p = list; *p >= '0' && *p <= '9'; ) {
+		int first = strtol(p, &p, 10), last = first;
+
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		while (first <= last)
+			CPU_SET(first++, &set);
+		if (*p == ',')
+			p++;
+	}
+	if (!CPU_COUNT(&set)) {
+		fprintf(stderr, "node %d has no cpus\n", nid);
+		exit(1);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set))
+		die("sched_setaffinity");
+}
+
+/* The reclaimable slab memory of a node in kB, -1 if unknown. */
+static long long node_sreclaimable(int nid)
+{
+	char path[64], line[256];
+	long long val = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/meminfo",
+		 nid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		char *p = strstr(line, "SReclaimable:");
+
+		if (p) {
+			val = atoll(p + strlen("SReclaimable:"));
+			break;
+		}
+	}
+	fclose(f);
+	return val;
+}
+
+static void fill_dcache(int nid)
+{
+	char name[4096];
+	struct stat st;
+	unsigned long i;
+
+	pin_node(nid);
+	for (i = 0; i < nr_names; i++) {
+		snprintf(name, sizeof(name), "%s/dcache-bench-%d-%lu",
+			 dir, nid, i);
+		stat(name, &st);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n names per node] [-d directory] "
+		"[-N node to reclaim] [-m MB]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long size = 512ULL << 20, off, start, mb_ns;
+	unsigned long long total = 0, worst = 0;
+	long long before[MAX_NODES];
+	unsigned char *mem;
+	int target = 0, opt, nid;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "n:d:N:m:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_names = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'N':
+			target = atoi(optarg);
+			break;
+		case 'm':
+			size = atoll(optarg) << 20;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	nr_nodes = count_nodes();
+	if (!nr_names || !size || target < 0 || target >= nr_nodes)
+		usage(argv[0]);
+
+	start = now_ns();
+	for (nid = 0; nid < nr_nodes; nid++) {
+		switch (fork()) {
+		case -1:
+			die("fork");
+		case 0:
+			fill_dcache(nid);
+			exit(0);
+		}
+	}
+	while (wait(NULL) > 0)
+		;
+	printf("%d nodes, %lu names per node looked up in %.1f s\n",
+	       nr_nodes, nr_names, (now_ns() - start) / 1e9);
+
+	for (nid = 0; nid < nr_nodes; nid++)
+		before[nid] = node_sreclaimable(nid);
+
+	pin_node(target);
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		die("mmap");
+	for (off = 0; off < size; ) {
+		unsigned long long end = off + (1 << 20);
+
+		start = now_ns();
+		for (; off < end && off < size; off += page_size)
+			mem[off] = 1;
+		mb_ns = now_ns() - start;
+		total += mb_ns;
+		if (mb_ns > worst)
+			worst = mb_ns;
+	}
+	printf("node %d, %llu MB: %.1f us per MB, worst %.1f us\n", target,
+	       size >> 20, total / 1e3 / (size >> 20), worst / 1e3);
+
+	printf("node  SReclaimable kB before     after\n");
+	for (nid = 0; nid < nr_nodes; nid++)
+		printf("%4d %22lld %9lld\n", nid, before[nid],
+		       node_sreclaimable(nid));
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * dirty-bench: run several sequential writers, like "dd if=/dev/zero
+ * of=fileN bs=4k" one per file, and report their aggregate throughput and
+ * how long each was held up in balance_dirty_pages().
+ *
+ * Every write() that takes longer than -t milliseconds (1 by default) is
+ * counted as a pause; writes of a few pages into the page cache take
+ * microseconds unless the writer is throttled.  For each writer the number
+ * of pauses, the share of the run spent in them and their 50th, 90th and
+ * 99th percentile and longest length are printed.
+ *
+ * Run it on a scratch filesystem for long enough that the page cache
+ * fills up and the writers settle at the speed of the disk, e.g.
+ *
+ *	for n in 1 2 4 8 16 32; do ./dirty-bench -n $n -s 60 -d /scratch; done
+ *
+ * The writers of a kernel that throttles by making them write back pages
+ * themselves seek the disk between their files, and show both a lower
+ * aggregate throughput and a long tail of pauses as their number grows.
+ * With balance_dirty_pages() pacing them by the disk's bandwidth, each is
+ * paused for a few tens of milliseconds at a time, evenly.
+ * The writeback:balance_dirty_pages trace event has the details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Pauses are binned by the millisecond, the last bin takes the rest. */
+#define NR_BINS		2000
+
+struct result {
+	unsigned long long	bytes;
+	unsigned long long	paused_ns;
+	unsigned long		pauses;
+	unsigned long		bins[NR_BINS];
+};
+
+static int nr_writers = 8, seconds = 30, block_size = 4096;
+static int threshold_ms = 1;
+static unsigned long long file_size;
+static const char *dir = ".";
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void writer(int n, struct result *res)
+{
+	unsigned long long end, pos = 0;
+	char path[4096], *buf;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/dirty-bench.%d", dir, n);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(path);
+	buf = calloc(1, block_size);
+	if (!buf)
+		die("malloc");
+
+	end = now_ns() + seconds * 1000000000ULL;
+	for (;;) {
+		unsigned long long start = now_ns(), took;
+		ssize_t ret;
+
+		if (start >= end)
+			break;
+
+		if (file_size && pos + block_size > file_size) {
+			pos = 0;
+			if (lseek(fd, 0, SEEK_SET) < 0)
+				die("lseek");
+		}
+
+		ret = write(fd, buf, block_size);
+		if (ret < 0)
+			die("write");
+		pos += ret;
+		res->bytes += ret;
+
+		took = now_ns() - start;
+		if (took >= threshold_ms * 1000000ULL) {
+			unsigned long ms = took / 1000000;
+
+			res->pauses++;
+			res->paused_ns += took;
+			res->bins[ms < NR_BINS ? ms : NR_BINS - 1]++;
+		}
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+/* The pause length that p percent of the pauses do not exceed, in ms. */
+static unsigned long percentile(struct result *res, int p)
+{
+	unsigned long want = (res->pauses * p + 99) / 100, seen = 0;
+	unsigned long ms;
+
+	for (ms = 0; ms < NR_BINS; ms++) {
+		seen += res->bins[ms];
+		if (seen && seen >= want)
+			return ms;
+	}
+	return 0;
+}
+
+static unsigned long longest(struct result *res)
+{
+	unsigned long ms;
+
+	for (ms = NR_BINS; ms > 0; ms--)
+		if (res->bins[ms - 1])
+			return ms - 1;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n writers] [-s seconds] [-b block size] "
+		"[-f file size in MB]\n"
+		"\t[-t pause threshold in ms] [-d directory]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long bytes = 0, start, elapsed;
+	struct result *results;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:s:b:f:t:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_writers = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			block_size = atoi(optarg);
+			break;
+		case 'f':
+			file_size = atoll(optarg) << 20;
+			break;
+		case 't':
+			threshold_ms = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_writers < 1 || seconds < 1 || block_size < 1 ||
+	    threshold_ms < 1 ||
+	    (file_size && file_size < (unsigned long long)block_size))
+		usage(argv[0]);
+
+	results = mmap(NULL, nr_writers * sizeof(*results),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	if (results == MAP_FAILED)
+		die("mmap");
+
+	start = now_ns();
+	for (i = 0; i < nr_writers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("fork");
+		if (!pid) {
+			writer(i, &results[i]);
+			exit(0);
+		}
+	}
+	for (i = 0; i < nr_writers; i++)
+		if (wait(NULL) < 0)
+			die("wait");
+	elapsed = now_ns() - start;
+
+	printf("writer     MB/s   pauses  paused%%  p50ms  p90ms  p99ms  maxms\n");
+	for (i = 0; i < nr_writers; i++) {
+		struct result *res = &results[i];
+
+		bytes += res->bytes;
+		printf("%6d %8.1f %8lu %7.1f%% %6lu %6lu %6lu %6lu\n", i,
+		       res->bytes * 1000.0 / elapsed,
+		       res->pauses, res->paused_ns * 100.0 / elapsed,
+		       percentile(res, 50), percentile(res, 90),
+		       percentile(res, 99), longest(res));
+	}
+	printf("total  %8.1f MB/s\n", bytes * 1000.0 / elapsed);
+
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * fork-bench: build a process tree like a pre-forking server's, with many
+ * children sharing the anonymous memory of their parent, then time forks
+ * and exits in it while the children keep the shared memory under reclaim.
+ *
+ * The parent writes to -m MB of anonymous memory and forks -n children,
+ * which inherit it copy-on-write.  With -w the children keep reading all
+ * of it, otherwise they sleep.  The parent then forks a child that exits
+ * straight away -f times, and prints the time per fork+exit and how many
+ * pages were swapped in and out meanwhile, from /proc/vmstat.  Finally it
+ * kills the children and prints how long it took to reap them all.
+ *
+ * For every shared page that reclaim or migration looks at, the rmap walk
+ * visits a vma in each of the children.  Make the memory not fit, e.g.
+ * in a memory cgroup, with some swap:
+ *
+ *	mkdir /cgroup/memory/fb && echo 256M > /cgroup/memory/fb/memory.limit_in_bytes
+ *	echo $$ > /cgroup/memory/fb/tasks
+ *	./fork-bench -n 1000 -m 512 -w
+ *
+ * Every page belongs to the same anon_vma tree, whose lock used to be a
+ * spinlock taken by all rmap walks as well as by every fork and exit.  It
+ * is now a rwlock that the walks only take for reading, so that several
+ * reclaimers can walk it at once, and only fork and exit, which change
+ * the lists, take it for writing.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+static int nr_children = 100, nr_forks = 10000, walk;
+static unsigned long long size = 64ULL << 20;
+static long page_size;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* Read a counter from /proc/vmstat, -1 if the kernel does not have it. */
+static long long vmstat(const char *name)
+{
+	char line[256];
+	size_t len = strlen(name);
+	long long val = -1;
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (!f)
+		die("/proc/vmstat");
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, name, len) && line[len] == ' ') {
+			val = atoll(line + len + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return val;
+}
+
+static void child(volatile unsigned char *mem)
+{
+	unsigned long long off;
+	unsigned char sum = 0;
+
+	if (!walk) {
+		for (;;)
+			pause();
+	}
+	for (;;) {
+		for (off = 0; off < size; off += page_size)
+			sum += mem[off];
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n children] [-m MB shared] "
+		"[-f forks] [-w]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long start, elapsed, off;
+	long long pswpin, pswpout;
+	unsigned char *mem;
+	pid_t *pids;
+	int opt, i;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "n:m:f:w")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_children = atoi(optarg);
+			break;
+		case 'm':
+			size = atoll(optarg) << 20;
+			break;
+		case 'f':
+			nr_forks = atoi(optarg);
+			break;
+		case 'w':
+			walk = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_children < 0 || !size || nr_forks < 1)
+		usage(argv[0]);
+
+	pids = calloc(nr_children, sizeof(*pids));
+	if (!pids)
+		die("malloc");
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		die("mmap");
+	for (off = 0; off < size; off += page_size)
+		mem[off] = 1;
+
+	for (i = 0; i < nr_children; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			die("fork");
+		if (!pids[i])
+			child(mem);
+	}
+
+	pswpin = vmstat("pswpin");
+	pswpout = vmstat("pswpout");
+	start = now_ns();
+	for (i = 0; i < nr_forks; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("fork");
+		if (!pid)
+			_exit(0);
+		if (waitpid(pid, NULL, 0) < 0)
+			die("waitpid");
+	}
+	elapsed = now_ns() - start;
+	printf("%d children, %llu MB: %.1f us per fork+exit, "
+	       "pswpin %lld pswpout %lld\n", nr_children, size >> 20,
+	       elapsed / 1e3 / nr_forks, vmstat("pswpin") - pswpin,
+	       vmstat("pswpout") - pswpout);
+
+	start = now_ns();
+	for (i = 0; i < nr_children; i++)
+		kill(pids[i], SIGKILL);
+	for (i = 0; i < nr_children; i++)
+		if (waitpid(pids[i], NULL, 0) < 0)
+			die("waitpid");
+	printf("reaped %d children in %.1f ms\n", nr_children,
+	       (now_ns() - start) / 1e6);
+	return 0;
+}
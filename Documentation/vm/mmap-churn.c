@@ -0,0 +1,143 @@
+/*
+ * mmap-churn: keep a large number of mappings of assorted sizes, the way
+ * a JVM or a malloc with many arenas does, and time how long it takes to
+ * unmap one of them and map a new one, over and over.
+ *
+ * -n mappings (100000 by default) of 1 to -s pages (16) are set up, each
+ * with one of three protections picked at random so that neighbours rarely
+ * merge.  Then -i times a random one is unmapped and replaced by a new
+ * mapping of a random size at an address of the kernel's choosing.  The
+ * time per mmap()/munmap() pair and the number of VMAs at the end, from
+ * /proc/self/maps, are printed.
+ *
+ * The default needs vm.max_map_count raised above the number of mappings:
+ *
+ *	sysctl -w vm.max_map_count=262144
+ *	for n in 1000 10000 100000; do ./mmap-churn -n $n; done
+ *
+ * get_unmapped_area() used to walk the list of VMAs to find a hole, from
+ * where its last search ended, so the time per pair grew with the number
+ * of mappings whenever the holes nearby were too small.  It now descends
+ * the VMA rbtree, skipping subtrees without a large enough gap, and the
+ * time should grow with the logarithm of the number only.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+struct mapping {
+	void	*addr;
+	size_t	len;
+};
+
+static const int prots[] = { PROT_NONE, PROT_READ, PROT_READ | PROT_WRITE };
+
+static long page_size;
+static int max_pages = 16;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void map_one(struct mapping *m)
+{
+	m->len = (1 + rand() % max_pages) * page_size;
+	m->addr = mmap(NULL, m->len, prots[rand() % 3],
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m->addr == MAP_FAILED)
+		die("mmap (see /proc/sys/vm/max_map_count)");
+}
+
+static int count_vmas(void)
+{
+	char line[512];
+	int nr = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		die("/proc/self/maps");
+	while (fgets(line, sizeof(line), f))
+		if (strchr(line, '\n'))
+			nr++;
+	fclose(f);
+	return nr;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n mappings] [-i iterations] "
+		"[-s max pages per mapping]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int nr_maps = 100000, iterations = 100000, opt, i;
+	unsigned long long start, setup, churn;
+	struct mapping *maps;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "n:i:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_maps = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			max_pages = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_maps < 1 || iterations < 1 || max_pages < 1)
+		usage(argv[0]);
+
+	maps = calloc(nr_maps, sizeof(*maps));
+	if (!maps)
+		die("malloc");
+	srand(1);
+
+	start = now_ns();
+	for (i = 0; i < nr_maps; i++)
+		map_one(&maps[i]);
+	setup = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		struct mapping *m = &maps[rand() % nr_maps];
+
+		if (munmap(m->addr, m->len))
+			die("munmap");
+		map_one(m);
+	}
+	churn = now_ns() - start;
+
+	printf("%d mappings, %d vmas: setup %.0f ms, %.2f us per "
+	       "munmap+mmap\n", nr_maps, count_vmas(), setup / 1e6,
+	       churn / 1e3 / iterations);
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * mmap-scan: mmap() a file and read one byte of every page of it, the way
+ * a program reads a large data file or the dynamic linker touches a big
+ * library at startup, and report how long that took and how many page
+ * faults it cost.
+ *
+ * Run it on a file that is already in the page cache, with the fault
+ * around window (/proc/sys/vm/fault_around_bytes) at the page size, which
+ * maps only the page faulted on, and at its default:
+ *
+ *	cat /scratch/1G > /dev/null
+ *	for b in 4096 65536; do
+ *		echo $b > /proc/sys/vm/fault_around_bytes
+ *		./mmap-scan -r 5 /scratch/1G
+ *	done
+ *
+ * With the window at 64k each fault maps sixteen cached pages, so the scan
+ * should take about a sixteenth of the minor faults.  -s strides through
+ * the file by that many pages, to see how a sparse access pattern fares.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-r runs] [-s stride in pages] file\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	int runs = 1, stride = 1, opt, fd, i;
+	struct stat st;
+
+	while ((opt = getopt(argc, argv, "r:s:")) != -1) {
+		switch (opt) {
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 's':
+			stride = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || runs < 1 || stride < 1)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0)
+		die(argv[optind]);
+	if (fstat(fd, &st))
+		die("fstat");
+	if (!st.st_size) {
+		fprintf(stderr, "%s: empty file\n", argv[optind]);
+		return 1;
+	}
+
+	printf("run     ms   minflt   majflt\n");
+	for (i = 0; i < runs; i++) {
+		unsigned long long start, elapsed;
+		struct rusage before, after;
+		volatile unsigned char sum = 0;
+		unsigned char *map;
+		off_t off;
+
+		getrusage(RUSAGE_SELF, &before);
+		start = now_ns();
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			die("mmap");
+		for (off = 0; off < st.st_size; off += stride * page_size)
+			sum += map[off];
+		munmap(map, st.st_size);
+
+		elapsed = now_ns() - start;
+		getrusage(RUSAGE_SELF, &after);
+
+		printf("%3d %6.1f %8ld %8ld\n", i, elapsed / 1e6,
+		       after.ru_minflt - before.ru_minflt,
+		       after.ru_majflt - before.ru_majflt);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * numa-bench: have tasks fault in their memory on one node, move them to
+ * another, and report, once a second, how fast they get through their
+ * memory and how much of it is still on the node they left.
+ *
+ * -n worker processes pin themselves to the cpus of node -s and write to
+ * -m MB of anonymous memory each, which then comes from that node.  They
+ * then pin themselves to node -d and keep walking their memory, one
+ * cache line at a time.  For each of -p one second passes the time per
+ * walk is printed, with the share of the pages still on another node
+ * than -d, from /proc/<pid>/numa_maps, and the change in the NUMA
+ * balancing counters in /proc/vmstat.
+ *
+ *	./numa-bench -n 4 -m 512 -s 0 -d 1
+ *	echo 0 > /proc/sys/kernel/numa_balancing
+ *	./numa-bench -n 4 -m 512 -s 0 -d 1
+ *
+ * Without NUMA balancing, nothing moves the memory and all of it stays
+ * remote.  With it, the first passes take NUMA hinting faults and move
+ * the pages to node -d, at a rate limited by the scan size and period
+ * in /proc/sys/kernel/numa_balancing_*: the remote share should fall to
+ * nearly zero, and the time per walk with it on a machine where remote
+ * memory is slower.  A guest with fake nodes shows the pages moving but
+ * not the speedup.  Transparent huge pages are not moved, so the memory
+ * is madvised MADV_NOHUGEPAGE.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#ifndef MADV_NOHUGEPAGE
+#define MADV_NOHUGEPAGE	15
+#endif
+
+#define MAX_NODES	64
+
+static const char *counters[] = {
+	"numa_pte_updates", "numa_hint_faults", "numa_hint_faults_local",
+	"numa_pages_migrated",
+};
+#define NR_COUNTERS	(sizeof(counters) / sizeof(counters[0]))
+
+/* What a worker reports after each pass */
+struct result {
+	unsigned long long walks;
+	unsigned long long ns;
+	unsigned long pages;
+	unsigned long remote;
+};
+
+static int nr_workers = 1, nr_passes = 20, src_node, dst_node = 1;
+static unsigned long long size = 256ULL << 20;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* Read a counter from /proc/vmstat, -1 if the kernel does not have it. */
+static long long vmstat(const char *name)
+{
+	char line[256];
+	size_t len = strlen(name);
+	long long val = -1;
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (!f)
+		die("/proc/vmstat");
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, name, len) && line[len] == ' ') {
+			val = atoll(line + len + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return val;
+}
+
+/* Run on the cpus of a node, from its cpulist, e.g. "0-3,8-11". */
+static void pin_node(int nid)
+{
+	char path[64], list[1024], *p;
+	cpu_set_t set;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 nid);
+	f = fopen(path, "r");
+	if (!f)
+		die(path);
+	if (!fgets(list, sizeof(list), f))
+		list[0] = '\0';
+	fclose(f);
+
+	CPU_ZERO(&set);
+	for (p = list; *p >= '0' && *p <= '9'; ) {
+		int first = strtol(p, &p, 10), last = first;
+
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		while (first <= last)
+			CPU_SET(first++, &set);
+		if (*p == ',')
+			p++;
+	}
+	if (!CPU_COUNT(&set)) {
+		fprintf(stderr, "node %d has no cpus\n", nid);
+		exit(1);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set))
+		die("sched_setaffinity");
+}
+
+/*
+ * Count the pages of the mapping at @addr, and those of them on another
+ * node than dst_node, from the N<node>=<pages> fields of numa_maps.
+ */
+static void count_pages(void *addr, struct result *res)
+{
+	char line[4096], *p;
+	FILE *f;
+
+	res->pages = res->remote = 0;
+	f = fopen("/proc/self/numa_maps", "r");
+	if (!f)
+		die("/proc/self/numa_maps");
+	while (fgets(line, sizeof(line), f)) {
+		if (strtoul(line, &p, 16) != (unsigned long)addr)
+			continue;
+		while ((p = strstr(p, " N"))) {
+			int nid;
+			unsigned long nr;
+
+			if (sscanf(p, " N%d=%lu", &nid, &nr) == 2) {
+				res->pages += nr;
+				if (nid != dst_node)
+					res->remote += nr;
+			}
+			p++;
+		}
+		break;
+	}
+	fclose(f);
+}
+
+static void worker(int cmd_fd, int result_fd)
+{
+	unsigned long long off, start;
+	volatile unsigned char *mem;
+	struct result res;
+	char cmd;
+
+	pin_node(src_node);
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		die("mmap");
+	madvise((void *)mem, size, MADV_NOHUGEPAGE);
+	for (off = 0; off < size; off += 4096)
+		mem[off] = 1;
+	pin_node(dst_node);
+
+	while (read(cmd_fd, &cmd, 1) == 1) {
+		res.walks = 0;
+		start = now_ns();
+		do {
+			for (off = 0; off < size; off += 64)
+				mem[off]++;
+			res.walks++;
+			res.ns = now_ns() - start;
+		} while (res.ns < 1000000000ULL);
+		count_pages((void *)mem, &res);
+		if (write(result_fd, &res, sizeof(res)) != sizeof(res))
+			die("write");
+	}
+	exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n workers] [-m MB per worker] "
+		"[-s node to fault in on] [-d node to run on] [-p passes]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	long long before[NR_COUNTERS], after;
+	int *cmd, result[2];
+	struct result res;
+	char path[64];
+	int opt, pass, i;
+
+	while ((opt = getopt(argc, argv, "n:m:s:d:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_workers = atoi(optarg);
+			break;
+		case 'm':
+			size = atoll(optarg) << 20;
+			break;
+		case 's':
+			src_node = atoi(optarg);
+			break;
+		case 'd':
+			dst_node = atoi(optarg);
+			break;
+		case 'p':
+			nr_passes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_workers < 1 || !size || nr_passes < 1 || src_node < 0 ||
+	    dst_node < 0 || src_node >= MAX_NODES || dst_node >= MAX_NODES ||
+	    src_node == dst_node)
+		usage(argv[0]);
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+		 dst_node);
+	if (access(path, F_OK)) {
+		fprintf(stderr, "no node %d, a machine with two nodes or "
+			"more is needed\n", dst_node);
+		return 1;
+	}
+
+	/* A pipe each, so that every worker runs exactly one pass a time */
+	cmd = calloc(nr_workers, sizeof(*cmd));
+	if (!cmd)
+		die("malloc");
+	if (pipe(result))
+		die("pipe");
+	for (i = 0; i < nr_workers; i++) {
+		int fds[2];
+
+		if (pipe(fds))
+			die("pipe");
+		switch (fork()) {
+		case -1:
+			die("fork");
+		case 0:
+			/* Only the parent may hold the write ends, for EOF */
+			while (i--)
+				close(cmd[i]);
+			close(fds[1]);
+			close(result[0]);
+			worker(fds[0], result[1]);
+		}
+		close(fds[0]);
+		cmd[i] = fds[1];
+	}
+	close(result[1]);
+
+	printf("%d workers, %llu MB each, node %d to node %d\n",
+	       nr_workers, size >> 20, src_node, dst_node);
+	printf("pass  ms/walk remote%%  pte_updates  hint_faults "
+	       "       local     migrated\n");
+	for (pass = 1; pass <= nr_passes; pass++) {
+		unsigned long long walks = 0, ns = 0;
+		unsigned long pages = 0, remote = 0;
+
+		for (i = 0; i < NR_COUNTERS; i++)
+			before[i] = vmstat(counters[i]);
+		for (i = 0; i < nr_workers; i++)
+			if (write(cmd[i], "w", 1) != 1)
+				die("write");
+		for (i = 0; i < nr_workers; i++) {
+			if (read(result[0], &res, sizeof(res)) != sizeof(res))
+				die("read");
+			walks += res.walks;
+			ns += res.ns;
+			pages += res.pages;
+			remote += res.remote;
+		}
+
+		printf("%4d %8.2f %7.1f", pass, ns / 1e6 / walks,
+		       pages ? 100.0 * remote / pages : 0.0);
+		for (i = 0; i < NR_COUNTERS; i++) {
+			after = vmstat(counters[i]);
+			if (before[i] < 0 || after < 0)
+				printf(" %12s", "-");
+			else
+				printf(" %12lld", after - before[i]);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		close(cmd[i]);
+	while (wait(NULL) > 0)
+		;
+	return 0;
+}
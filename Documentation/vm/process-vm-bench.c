@@ -0,0 +1,295 @@
+/*
+ * process-vm-bench: pass a message back and forth between two processes
+ * and report the bandwidth, with the message going through a pipe,
+ * through shared memory, or straight from one process to the other with
+ * process_vm_writev().
+ *
+ * A parent and a child pinned to cpus -c and -C send each other a -s
+ * byte message -n times each way, so that it ends up in a private buffer
+ * of the receiver, as a message passing library would need it:
+ *
+ *   pipe: write() it to a pipe that the other process read()s it from;
+ *   shm:  memcpy() it to a shared mapping, which the other process
+ *         memcpy()s it out of, after a byte on a pipe said it was there;
+ *   pvm:  process_vm_writev() it to the buffer of the other process, and
+ *         send a byte on a pipe to say it is there.
+ *
+ * For each the time per round trip and the bandwidth are printed:
+ *
+ *	./process-vm-bench -s 65536
+ *	./process-vm-bench -s 4194304 -n 500
+ *
+ * The pipe and the shared mapping copy each message twice, once into the
+ * kernel or the shared mapping and once out of it.  process_vm_writev()
+ * copies it once, from the pages of the sender to those of the receiver,
+ * which should show as a higher bandwidth for the larger messages, where
+ * the copies and not the wakeups take the time.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+/* The standard numbers, if the headers do not know them */
+#ifndef __NR_process_vm_readv
+#if defined(__x86_64__)
+#define __NR_process_vm_readv	310
+#define __NR_process_vm_writev	311
+#elif defined(__i386__)
+#define __NR_process_vm_readv	347
+#define __NR_process_vm_writev	348
+#elif defined(__arm__)
+#define __NR_process_vm_readv	(__NR_SYSCALL_BASE + 376)
+#define __NR_process_vm_writev	(__NR_SYSCALL_BASE + 377)
+#else
+#define __NR_process_vm_readv	270
+#define __NR_process_vm_writev	271
+#endif
+#endif
+
+enum method { PIPE, SHM, PVM, NR_METHODS };
+static const char *names[] = { "pipe", "shm", "pvm" };
+
+static size_t msg_size = 65536;
+static int nr_trips = 10000, cpu[2] = { 0, 1 };
+
+/* How one of the processes talks to the other */
+struct side {
+	int in, out;
+	pid_t peer;
+	unsigned char *src, *dst;
+};
+
+static unsigned char *shm;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void pin(int c)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(c % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		die("sched_setaffinity");
+}
+
+static void read_all(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret <= 0)
+			die("read");
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret <= 0)
+			die("write");
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+}
+
+static void send_msg(enum method m, struct side *s)
+{
+	struct iovec local, remote;
+	char token = 0;
+
+	switch (m) {
+	case PIPE:
+		write_all(s->out, s->src, msg_size);
+		return;
+	case SHM:
+		memcpy(shm, s->src, msg_size);
+		break;
+	case PVM:
+		/* Both buffers were mapped before fork(), at the same place */
+		local.iov_base = s->src;
+		local.iov_len = msg_size;
+		remote.iov_base = s->dst;
+		remote.iov_len = msg_size;
+		if (syscall(__NR_process_vm_writev, s->peer, &local, 1,
+			    &remote, 1, 0) != (ssize_t)msg_size)
+			die("process_vm_writev");
+		break;
+	default:
+		break;
+	}
+	write_all(s->out, &token, 1);
+}
+
+static void recv_msg(enum method m, struct side *s)
+{
+	char token;
+
+	switch (m) {
+	case PIPE:
+		read_all(s->in, s->dst, msg_size);
+		return;
+	case SHM:
+		read_all(s->in, &token, 1);
+		memcpy(s->dst, shm, msg_size);
+		return;
+	case PVM:
+		read_all(s->in, &token, 1);
+		return;
+	default:
+		break;
+	}
+}
+
+static void run(enum method m)
+{
+	unsigned long long start, ns;
+	int to_child[2], to_parent[2];
+	struct side s;
+	int i, status;
+	pid_t pid;
+
+	if (pipe(to_child) || pipe(to_parent))
+		die("pipe");
+	s.src = mmap(NULL, msg_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	s.dst = mmap(NULL, msg_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (s.src == MAP_FAILED || s.dst == MAP_FAILED)
+		die("mmap");
+	memset(s.src, 1, msg_size);
+	memset(s.dst, 0, msg_size);
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		s.in = to_child[0];
+		s.out = to_parent[1];
+		s.peer = getppid();
+		pin(cpu[1]);
+		for (i = 0; i < nr_trips; i++) {
+			recv_msg(m, &s);
+			send_msg(m, &s);
+		}
+		exit(0);
+	}
+
+	s.in = to_parent[0];
+	s.out = to_child[1];
+	s.peer = pid;
+	pin(cpu[0]);
+	start = now_ns();
+	for (i = 0; i < nr_trips; i++) {
+		send_msg(m, &s);
+		recv_msg(m, &s);
+	}
+	ns = now_ns() - start;
+
+	if (waitpid(pid, &status, 0) < 0)
+		die("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		exit(1);
+	printf("%-5s %10.2f %12.1f\n", names[m], ns / 1e3 / nr_trips,
+	       2.0 * msg_size * nr_trips / (ns / 1e9) / (1 << 20));
+
+	munmap(s.src, msg_size);
+	munmap(s.dst, msg_size);
+	close(to_child[0]);
+	close(to_child[1]);
+	close(to_parent[0]);
+	close(to_parent[1]);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s message size] [-n round trips] "
+		"[-c parent cpu] [-C child cpu] [-m pipe|shm|pvm]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int only = -1, opt, m;
+
+	while ((opt = getopt(argc, argv, "s:n:c:C:m:")) != -1) {
+		switch (opt) {
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_trips = atoi(optarg);
+			break;
+		case 'c':
+			cpu[0] = atoi(optarg);
+			break;
+		case 'C':
+			cpu[1] = atoi(optarg);
+			break;
+		case 'm':
+			for (m = 0; m < NR_METHODS; m++)
+				if (!strcmp(optarg, names[m]))
+					only = m;
+			if (only < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!msg_size || nr_trips < 1 || cpu[0] < 0 || cpu[1] < 0)
+		usage(argv[0]);
+
+	shm = mmap(NULL, msg_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+		die("mmap");
+
+	printf("%zu byte messages, %d round trips\n", msg_size, nr_trips);
+	printf("      us/round trip         MB/s\n");
+	for (m = 0; m < NR_METHODS; m++) {
+		if (only >= 0 && m != only)
+			continue;
+		if (m == PVM && syscall(__NR_process_vm_readv, getpid(),
+					NULL, 0, NULL, 0, 0) < 0 &&
+		    errno == ENOSYS) {
+			printf("%-5s not supported by this kernel\n", names[m]);
+			continue;
+		}
+		run(m);
+	}
+	return 0;
+}
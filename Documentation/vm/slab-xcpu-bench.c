@@ -0,0 +1,203 @@
+/*
+ * slab-xcpu-bench: have pairs of processes on different cpus pass datagrams
+ * to each other, so that every socket buffer is allocated on one cpu and
+ * freed on another, and report the message rate and how the slab cache
+ * of the socket buffers got its slabs.
+ *
+ * -p pairs of a sender and a receiver are pinned to cpus 2n and 2n+1 and
+ * pass -s byte datagrams over a unix socket for -t seconds.  The messages
+ * per second are printed, and, with CONFIG_SLUB_STATS, the change in the
+ * allocation and free statistics of the cache named by -c in /sys/kernel/slab.
+ *
+ *	./slab-xcpu-bench -p 4 -s 256
+ *	echo 0 > /sys/kernel/slab/skbuff_head_cache/cpu_partial
+ *	./slab-xcpu-bench -p 4 -s 256
+ *
+ * The receiver frees the buffers to slabs that are not its cpu slab.
+ * Those that were full used to go to the node partial list, and the
+ * sender's next cpu slab came from that list, both under the node's
+ * list_lock.  With the per cpu partial lists, most of these slabs go
+ * through the list of the receiving cpu instead (cpu_partial_free), and
+ * most new cpu slabs come from it (cpu_partial_alloc).  Writing 0 to
+ * cpu_partial turns that off, for comparison.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static const char *stats[] = {
+	"alloc_slowpath", "alloc_from_partial", "cpu_partial_alloc",
+	"free_slowpath", "free_add_partial", "cpu_partial_free",
+	"cpu_partial_drain",
+};
+#define NR_STATS	(sizeof(stats) / sizeof(stats[0]))
+
+static const char *cache = "skbuff_head_cache";
+static int nr_pairs = 1, msg_size = 64, seconds = 5;
+static volatile sig_atomic_t stop;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* Read the total of a slab statistic, -1 if the kernel has none. */
+static long long slab_stat(const char *name)
+{
+	char path[256];
+	long long val = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/kernel/slab/%s/%s", cache, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%lld", &val) != 1)
+		val = -1;
+	fclose(f);
+	return val;
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		die("sched_setaffinity");
+}
+
+static void on_alarm(int sig)
+{
+	stop = 1;
+}
+
+static void sender(int fd, int cpu)
+{
+	char *buf = calloc(1, msg_size);
+
+	if (!buf)
+		die("malloc");
+	pin(cpu);
+	for (;;)
+		if (send(fd, buf, msg_size, 0) < 0)
+			exit(0);	/* the receiver is gone */
+}
+
+static void receiver(int fd, int cpu, int result_fd)
+{
+	char *buf = malloc(msg_size);
+	unsigned long long nr = 0;
+
+	if (!buf)
+		die("malloc");
+	pin(cpu);
+	signal(SIGALRM, on_alarm);
+	alarm(seconds);
+	while (!stop)
+		if (recv(fd, buf, msg_size, 0) > 0)
+			nr++;
+	if (write(result_fd, &nr, sizeof(nr)) != sizeof(nr))
+		die("write");
+	exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p pairs] [-s message size] "
+		"[-t seconds] [-c slab cache]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	long long before[NR_STATS];
+	unsigned long long total = 0, nr;
+	int result[2];
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "p:s:t:c:")) != -1) {
+		switch (opt) {
+		case 'p':
+			nr_pairs = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'c':
+			cache = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_pairs < 1 || msg_size < 1 || seconds < 1)
+		usage(argv[0]);
+
+	if (pipe(result))
+		die("pipe");
+	for (i = 0; i < NR_STATS; i++)
+		before[i] = slab_stat(stats[i]);
+
+	for (i = 0; i < nr_pairs; i++) {
+		int sv[2];
+
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv))
+			die("socketpair");
+		switch (fork()) {
+		case -1:
+			die("fork");
+		case 0:
+			close(sv[1]);
+			sender(sv[0], 2 * i);
+		}
+		switch (fork()) {
+		case -1:
+			die("fork");
+		case 0:
+			close(sv[0]);
+			receiver(sv[1], 2 * i + 1, result[1]);
+		}
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	for (i = 0; i < nr_pairs; i++) {
+		if (read(result[0], &nr, sizeof(nr)) != sizeof(nr))
+			die("read");
+		total += nr;
+	}
+	while (wait(NULL) > 0)
+		;
+
+	printf("%d pairs, %d bytes: %.0f messages/s\n", nr_pairs, msg_size,
+	       (double)total / seconds);
+	if (before[0] < 0) {
+		printf("no statistics for %s (CONFIG_SLUB_STATS)\n", cache);
+		return 0;
+	}
+	for (i = 0; i < NR_STATS; i++) {
+		long long after = slab_stat(stats[i]);
+
+		if (before[i] >= 0 && after >= 0)
+			printf("%-20s %12lld\n", stats[i], after - before[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * swap-bench: have several processes dirty anonymous memory that does not
+ * all fit into RAM at once, so that they keep swapping each other out, and
+ * report how fast they get through it.
+ *
+ * Each of -n processes maps -m MB of anonymous memory and writes to every
+ * page of it, -r times over.  For every pass the aggregate throughput and
+ * the number of pages swapped in and out, from /proc/vmstat, are printed.
+ *
+ * Use a swap device in RAM, so that the device is not what limits the
+ * throughput, and make the processes need more memory than there is,
+ * e.g. on a machine booted with mem=2G:
+ *
+ *	modprobe zram num_devices=1
+ *	echo 4G > /sys/block/zram0/disksize
+ *	mkswap /dev/zram0 && swapon /dev/zram0
+ *	for n in 1 2 4 8 16; do ./swap-bench -n $n -m $((3072 / n)); done
+ *
+ * zram is not rotational, so swap on it is allocated a cluster per cpu,
+ * and on any device swapouts take their slots from a cache per cpu,
+ * without taking the global swap_lock for most of them.  The throughput
+ * should then grow with the number of processes until the cpus run out,
+ * rather than flattening as they contend on swap_lock; "perf top" shows the
+ * difference as time spent in _raw_spin_lock from get_swap_page().
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+static int nr_procs = 4, rounds = 3;
+static unsigned long long size = 256ULL << 20;
+static long page_size;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* Read a counter from /proc/vmstat, -1 if the kernel does not have it. */
+static long long vmstat(const char *name)
+{
+	char line[256];
+	size_t len = strlen(name);
+	long long val = -1;
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (!f)
+		die("/proc/vmstat");
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, name, len) && line[len] == ' ') {
+			val = atoll(line + len + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return val;
+}
+
+/*
+ * Dirty every page of the worker's memory once per pass, waiting at the
+ * barrier pipe for the parent to start each pass.
+ */
+static void worker(int start_fd, int done_fd)
+{
+	unsigned char *mem;
+	unsigned long long off;
+	char c;
+	int i;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		die("mmap");
+
+	for (i = 0; i < rounds; i++) {
+		if (read(start_fd, &c, 1) != 1)
+			die("read");
+		for (off = 0; off < size; off += page_size)
+			mem[off]++;
+		if (write(done_fd, &c, 1) != 1)
+			die("write");
+	}
+	munmap(mem, size);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n processes] [-m MB per process] "
+		"[-r passes]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int start_pipe[2], done_pipe[2];
+	int opt, i, j;
+	char c = 0;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "n:m:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_procs = atoi(optarg);
+			break;
+		case 'm':
+			size = atoll(optarg) << 20;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_procs < 1 || !size || rounds < 1)
+		usage(argv[0]);
+
+	if (pipe(start_pipe) || pipe(done_pipe))
+		die("pipe");
+
+	for (i = 0; i < nr_procs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("fork");
+		if (!pid) {
+			worker(start_pipe[0], done_pipe[1]);
+			exit(0);
+		}
+	}
+
+	printf("pass       ms      MB/s    pswpin   pswpout\n");
+	for (i = 0; i < rounds; i++) {
+		long long pswpin = vmstat("pswpin");
+		long long pswpout = vmstat("pswpout");
+		unsigned long long start, elapsed;
+
+		start = now_ns();
+		for (j = 0; j < nr_procs; j++)
+			if (write(start_pipe[1], &c, 1) != 1)
+				die("write");
+		for (j = 0; j < nr_procs; j++)
+			if (read(done_pipe[0], &c, 1) != 1)
+				die("read");
+		elapsed = now_ns() - start;
+
+		printf("%4d %8.0f %9.1f %9lld %9lld\n", i, elapsed / 1e6,
+		       nr_procs * size * 1000.0 / elapsed,
+		       vmstat("pswpin") - pswpin,
+		       vmstat("pswpout") - pswpout);
+	}
+
+	for (i = 0; i < nr_procs; i++)
+		if (wait(NULL) < 0)
+			die("wait");
+	return 0;
+}
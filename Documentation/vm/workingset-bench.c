@@ -0,0 +1,181 @@
+/*
+ * workingset-bench: read a hot file over and over while streaming through
+ * a large cold one, and report how much of the hot file stays cached.
+ *
+ * Each round reads all of the hot file (-w) and then the next -c MB of the
+ * stream file (-s), wrapping around at its end.  For every round the time
+ * taken to read the hot file, its throughput and the change in the
+ * workingset_refault and workingset_activate counters of /proc/vmstat are
+ * printed.
+ *
+ * Make the hot file larger than the inactive file list can hold, but
+ * smaller than the page cache, e.g. 60% of memory, and the stream file
+ * several times the size of memory:
+ *
+ *	./workingset-bench -w /scratch/hot -s /scratch/stream -c 512 -r 20
+ *
+ * Pages of the hot file are only activated when they are used again
+ * while still on the inactive list.  Without workingset detection, the
+ * hot file is pushed out by the stream before it is read again, so it
+ * is read from disk every round.  With it, its pages refault from
+ * within a distance the active list could have held, and are activated.
+ * After a few rounds the hot file is then read from memory, and
+ * workingset_refault drops to the stream's own refaults after it wraps.
+ * Start from a cold cache: echo 3 > /proc/sys/vm/drop_caches.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define BUF_SIZE	(1 << 16)
+
+static char buf[BUF_SIZE];
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* Read a counter from /proc/vmstat, -1 if the kernel does not have it. */
+static long long vmstat(const char *name)
+{
+	char line[256];
+	size_t len = strlen(name);
+	long long val = -1;
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (!f)
+		die("/proc/vmstat");
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, name, len) && line[len] == ' ') {
+			val = atoll(line + len + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return val;
+}
+
+/* Read len bytes of fd from pos on, wrapping around at size. */
+static void read_range(int fd, off_t pos, off_t len, off_t size)
+{
+	while (len > 0) {
+		size_t chunk = len < BUF_SIZE ? len : BUF_SIZE;
+		ssize_t ret;
+
+		if (pos >= size)
+			pos = 0;
+		if (chunk > (size_t)(size - pos))
+			chunk = size - pos;
+		ret = pread(fd, buf, chunk, pos);
+		if (ret < 0)
+			die("read");
+		if (!ret)
+			break;
+		pos += ret;
+		len -= ret;
+	}
+}
+
+static off_t file_size(int fd, const char *path)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		die(path);
+	if (!st.st_size) {
+		fprintf(stderr, "%s: empty file\n", path);
+		exit(1);
+	}
+	return st.st_size;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s -w hot file -s stream file "
+		"[-c stream MB per round] [-r rounds]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *hot_path = NULL, *stream_path = NULL;
+	off_t hot_size, stream_size, stream_pos = 0, chunk = 256 << 20;
+	int rounds = 10, opt, hot, stream, i;
+
+	while ((opt = getopt(argc, argv, "w:s:c:r:")) != -1) {
+		switch (opt) {
+		case 'w':
+			hot_path = optarg;
+			break;
+		case 's':
+			stream_path = optarg;
+			break;
+		case 'c':
+			chunk = (off_t)atoll(optarg) << 20;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!hot_path || !stream_path || chunk < 0 || rounds < 1)
+		usage(argv[0]);
+
+	hot = open(hot_path, O_RDONLY);
+	if (hot < 0)
+		die(hot_path);
+	stream = open(stream_path, O_RDONLY);
+	if (stream < 0)
+		die(stream_path);
+	hot_size = file_size(hot, hot_path);
+	stream_size = file_size(stream, stream_path);
+
+	if (vmstat("workingset_refault") < 0)
+		fprintf(stderr, "no workingset counters in /proc/vmstat\n");
+
+	printf("round  hot ms     MB/s    refault   activate\n");
+	for (i = 0; i < rounds; i++) {
+		long long refault = vmstat("workingset_refault");
+		long long activate = vmstat("workingset_activate");
+		unsigned long long start, elapsed;
+
+		start = now_ns();
+		read_range(hot, 0, hot_size, hot_size);
+		elapsed = now_ns() - start;
+
+		read_range(stream, stream_pos, chunk, stream_size);
+		stream_pos = (stream_pos + chunk) % stream_size;
+
+		printf("%5d %7.0f %8.1f %10lld %10lld\n", i, elapsed / 1e6,
+		       hot_size * 1000.0 / elapsed,
+		       vmstat("workingset_refault") - refault,
+		       vmstat("workingset_activate") - activate);
+	}
+
+	close(stream);
+	close(hot);
+	return 0;
+}
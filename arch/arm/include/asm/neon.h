@@ -0,0 +1,29 @@
+/*
+ * linux/arch/arm/include/asm/neon.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef __ASM_NEON_H
+#define __ASM_NEON_H
+
+#include <asm/hwcap.h>
+
+#define cpu_has_neon()		(!!(elf_hwcap & HWCAP_NEON))
+
+/*
+ * NEON code must be kept in its own compilation unit, built with
+ * -mfpu=neon, and only be called from between kernel_neon_begin() and
+ * kernel_neon_end() in a unit that is not: GCC is free to move NEON
+ * instructions across the calls, or to generate them on its own.
+ */
+#ifdef __ARM_NEON__
+#error "kernel_neon_begin() used from a unit built with -mfpu=neon"
+#endif
+
+void kernel_neon_begin(void);
+void kernel_neon_end(void);
+
+#endif /* __ASM_NEON_H */
@@ -137,6 +137,10 @@ long tile_compat_sys_msgrcv(int msqid,
 #undef __SYSCALL
 #define __SYSCALL(nr, call) [nr] = (compat_##call),
 
+/* __SYSCALL() already picks the compat_sys_ flavour of every call. */
+#undef __SC_COMP
+#define __SC_COMP(nr, call, compat) __SYSCALL(nr, call)
+
 /* The generic versions of these don't work for Tile. */
 #define compat_sys_msgrcv tile_compat_sys_msgrcv
 #define compat_sys_msgsnd tile_compat_sys_msgsnd
@@ -11,6 +11,8 @@
 #include <linux/cpu.h>
 #include <linux/blk-iopoll.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
 
 #include "blk.h"
 
@@ -137,6 +139,103 @@ static void blk_iopoll_softirq(struct softirq_action *h)
 	local_irq_enable();
 }
 
+/**
+ * blk_iopoll_poll - Run the iopoll handler from the calling task
+ * @iop:      The parent iopoll structure
+ *
+ * Description:
+ *     For drivers that already complete requests through blk_iopoll, this
+ *     is the body of their request queue ->poll_fn: it runs one pass of the
+ *     handler inline, as if the interrupt had just scheduled it. If the
+ *     handler uses up its weight, the rest is left to the softirq as usual.
+ *     Returns the number of completions found, or 0 if the handler was
+ *     already scheduled or is disabled.
+ **/
+int blk_iopoll_poll(struct blk_iopoll *iop)
+{
+	int work;
+
+	if (blk_iopoll_sched_prep(iop))
+		return 0;
+
+	/*
+	 * The handler expects to be on this CPU's poll list, so that it can
+	 * take itself off with blk_iopoll_complete(). With bottom halves
+	 * disabled the softirq can not run it under us.
+	 */
+	local_bh_disable();
+	local_irq_disable();
+	list_add_tail(&iop->list, &__get_cpu_var(blk_cpu_iopoll));
+	local_irq_enable();
+
+	work = iop->poll(iop, iop->weight);
+
+	if (work >= iop->weight) {
+		local_irq_disable();
+		if (blk_iopoll_disable_pending(iop))
+			__blk_iopoll_complete(iop);
+		else
+			__raise_softirq_irqoff(BLOCK_IOPOLL_SOFTIRQ);
+		local_irq_enable();
+	}
+	local_bh_enable();
+
+	return work;
+}
+EXPORT_SYMBOL(blk_iopoll_poll);
+
+/**
+ * blk_poll - Poll a queue for the completion the caller is waiting for
+ * @q:        The request queue the I/O was issued to
+ * @slept:    Whether the caller has already slept for q->poll_delay
+ *
+ * Description:
+ *     Called by a task that is waiting for its own synchronous I/O, with its
+ *     state already set to sleep and in place to be woken by the completion.
+ *     Polls @q's driver until the completion has woken the task, or until
+ *     something else wants the CPU. With a poll delay set, the first call
+ *     sleeps for that long instead, on the assumption that the I/O can not
+ *     have completed any sooner, and sets *@slept.
+ *
+ *     Returns true if the task is running again and should recheck what it
+ *     is waiting for, false if it should go to sleep as it would have done
+ *     without polling.
+ **/
+bool blk_poll(struct request_queue *q, bool *slept)
+{
+	struct task_struct *tsk = current;
+	long state = tsk->state;
+
+	if (!q || !q->poll_fn || !blk_queue_io_poll(q))
+		return false;
+
+	if (q->poll_delay && !*slept) {
+		ktime_t delay = ns_to_ktime(q->poll_delay * NSEC_PER_USEC);
+
+		blk_flush_plug(tsk);
+		schedule_hrtimeout(&delay, HRTIMER_MODE_REL);
+		*slept = true;
+		return true;
+	}
+
+	/* Nobody else will issue what the caller has plugged. */
+	blk_flush_plug(tsk);
+
+	while (!need_resched()) {
+		if (signal_pending_state(state, tsk))
+			break;
+
+		q->poll_fn(q);
+
+		if (tsk->state == TASK_RUNNING)
+			return true;
+		cpu_relax();
+	}
+
+	return false;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
 /**
  * blk_iopoll_disable - Disable iopoll on this @iop
  * @iop:      The parent iopoll structure
@@ -0,0 +1,731 @@
+/*
+ * Multi-queue request path.
+ *
+ * Bios submitted to a multi-queue device are turned into requests on the
+ * submitting CPU and staged on a per-CPU software queue.  Software queues
+ * are mapped to one of the hardware dispatch queues of the device, and
+ * running a hardware queue hands the staged requests to the driver's
+ * ->queue_rq().  Requests and their tags are preallocated per hardware
+ * queue.  Neither q->queue_lock nor an elevator is involved: the only
+ * shared state is the per-CPU software queue lock and the tag bitmap of
+ * the hardware queue.
+ *
+ * Drivers opt in with blk_mq_init_queue() instead of blk_init_queue().
+ * Flush and FUA requests are passed to the driver as they come, there is
+ * no flush sequencing and no request timeout handling for such queues.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/delay.h>
+#include <linux/bitops.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+
+/* per-CPU software staging queue */
+struct blk_mq_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	rq_list;
+	} ____cacheline_aligned_in_smp;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* bit in hctx->ctx_map */
+
+	struct request_queue	*queue;
+
+	/* incremented at dispatch time */
+	unsigned long		rq_dispatched[2];
+	unsigned long		rq_merged;
+} ____cacheline_aligned_in_smp;
+
+static struct blk_mq_ctx *__blk_mq_get_ctx(struct request_queue *q,
+					   unsigned int cpu)
+{
+	return per_cpu_ptr(q->queue_ctx, cpu);
+}
+
+/*
+ * The software queue of the current CPU.  Every software queue is locked,
+ * so it does not matter if we get migrated after picking it.
+ */
+static struct blk_mq_ctx *blk_mq_get_ctx(struct request_queue *q)
+{
+	return __blk_mq_get_ctx(q, raw_smp_processor_id());
+}
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+EXPORT_SYMBOL(blk_mq_map_queue);
+
+/*
+ * Tags.  Tags below hctx->reserved_tags are only handed out to callers of
+ * blk_mq_alloc_reserved_request(), so that drivers can always get a
+ * request for error handling or internal commands.
+ */
+static int __blk_mq_get_tag(struct blk_mq_hw_ctx *hctx, bool reserved)
+{
+	unsigned int start = reserved ? 0 : hctx->reserved_tags;
+	unsigned int end = reserved ? hctx->reserved_tags : hctx->queue_depth;
+	unsigned int tag;
+
+	do {
+		tag = find_next_zero_bit(hctx->tag_map, end, start);
+		if (tag >= end)
+			return -1;
+	} while (test_and_set_bit(tag, hctx->tag_map));
+
+	return tag;
+}
+
+static int blk_mq_get_tag(struct blk_mq_hw_ctx *hctx, gfp_t gfp,
+			  bool reserved)
+{
+	DEFINE_WAIT(wait);
+	int tag;
+
+	tag = __blk_mq_get_tag(hctx, reserved);
+	if (tag >= 0 || !(gfp & __GFP_WAIT))
+		return tag;
+
+	for (;;) {
+		prepare_to_wait(&hctx->tag_wait, &wait, TASK_UNINTERRUPTIBLE);
+		tag = __blk_mq_get_tag(hctx, reserved);
+		if (tag >= 0)
+			break;
+
+		/* make sure the requests holding the tags make progress */
+		blk_mq_run_hw_queue(hctx, false);
+		io_schedule();
+	}
+	finish_wait(&hctx->tag_wait, &wait);
+
+	return tag;
+}
+
+static void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	clear_bit(tag, hctx->tag_map);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&hctx->tag_wait))
+		wake_up(&hctx->tag_wait);
+}
+
+static bool blk_mq_hctx_busy(struct blk_mq_hw_ctx *hctx)
+{
+	return find_first_bit(hctx->tag_map, hctx->queue_depth) <
+		hctx->queue_depth;
+}
+
+struct request *blk_mq_tag_to_rq(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	return hctx->rqs[tag];
+}
+EXPORT_SYMBOL(blk_mq_tag_to_rq);
+
+static void blk_mq_rq_ctx_init(struct blk_mq_ctx *ctx, struct request *rq,
+			       unsigned int rw_flags)
+{
+	struct request_queue *q = ctx->queue;
+	int tag = rq->tag;
+
+	blk_rq_init(q, rq);
+	rq->tag = tag;
+	rq->mq_ctx = ctx;
+	rq->cmd_flags = rw_flags;
+	if (blk_queue_io_stat(q))
+		rq->cmd_flags |= REQ_IO_STAT;
+	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags))
+		rq->cpu = ctx->cpu;
+}
+
+static struct request *__blk_mq_alloc_request(struct blk_mq_hw_ctx *hctx,
+					      struct blk_mq_ctx *ctx,
+					      unsigned int rw_flags, gfp_t gfp,
+					      bool reserved)
+{
+	struct request *rq;
+	int tag;
+
+	tag = blk_mq_get_tag(hctx, gfp, reserved);
+	if (tag < 0)
+		return NULL;
+
+	rq = hctx->rqs[tag];
+	rq->tag = tag;
+	blk_mq_rq_ctx_init(ctx, rq, rw_flags);
+	return rq;
+}
+
+static struct request *blk_mq_alloc_request_ctx(struct request_queue *q,
+						int rw, gfp_t gfp,
+						bool reserved)
+{
+	struct blk_mq_ctx *ctx = blk_mq_get_ctx(q);
+	struct blk_mq_hw_ctx *hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	return __blk_mq_alloc_request(hctx, ctx, rw, gfp, reserved);
+}
+
+struct request *blk_mq_alloc_request(struct request_queue *q, int rw,
+				     gfp_t gfp)
+{
+	return blk_mq_alloc_request_ctx(q, rw, gfp, false);
+}
+EXPORT_SYMBOL(blk_mq_alloc_request);
+
+struct request *blk_mq_alloc_reserved_request(struct request_queue *q,
+					      int rw, gfp_t gfp)
+{
+	return blk_mq_alloc_request_ctx(q, rw, gfp, true);
+}
+EXPORT_SYMBOL(blk_mq_alloc_reserved_request);
+
+void blk_mq_free_request(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+	struct blk_mq_hw_ctx *hctx = q->mq_ops->map_queue(q, rq->mq_ctx->cpu);
+
+	/* this is a bio leak */
+	WARN_ON(rq->bio != NULL);
+
+	rq->cmd_flags = 0;
+	blk_mq_put_tag(hctx, rq->tag);
+}
+EXPORT_SYMBOL(blk_mq_free_request);
+
+/**
+ * blk_mq_end_io - complete a request
+ * @rq:		the request being completed
+ * @error:	%0 for success, < %0 for error
+ *
+ * Description:
+ *     Ends all I/O on @rq and gives it back to the hardware queue it was
+ *     allocated from.  Must be called with the whole request done; partial
+ *     completions are not supported on multi-queue devices.
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (blk_update_request(rq, error, blk_rq_bytes(rq)))
+		return;
+
+	blk_account_io_done(rq);
+
+	if (rq->end_io)
+		rq->end_io(rq, error);
+	else
+		blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+/**
+ * blk_mq_complete_request - complete a request from interrupt context
+ * @rq:		the request being completed
+ *
+ * Description:
+ *     If the driver registered a ->complete() handler, it is run from the
+ *     block softirq, on the submitting CPU if QUEUE_FLAG_SAME_COMP is set.
+ *     Otherwise the request is ended right away with rq->errors.
+ */
+void blk_mq_complete_request(struct request *rq)
+{
+	if (!rq->q->softirq_done_fn)
+		blk_mq_end_io(rq, rq->errors);
+	else
+		blk_complete_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_complete_request);
+
+static void blk_mq_start_request(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+
+	trace_block_rq_issue(q, rq);
+
+	rq->atomic_flags = 0;
+	rq->cmd_flags |= REQ_STARTED;
+	rq->resid_len = blk_rq_bytes(rq);
+}
+
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	int bit, queued;
+
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	hctx->run++;
+
+	/* Requests the driver pushed back last time go first */
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock(&hctx->lock);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock(&hctx->lock);
+	}
+
+	/*
+	 * Pull the staged requests off the software queues.  A queue that is
+	 * filled again after its bit was cleared sets it again, so no request
+	 * is left behind.
+	 */
+	for_each_set_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		clear_bit(bit, hctx->ctx_map);
+		ctx = hctx->ctxs[bit];
+
+		spin_lock(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock(&ctx->lock);
+	}
+
+	queued = 0;
+	while (!list_empty(&rq_list)) {
+		int ret;
+
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+
+		blk_mq_start_request(rq);
+		rq->mq_ctx->rq_dispatched[rq_is_sync(rq)]++;
+
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		if (ret == BLK_MQ_RQ_QUEUE_OK) {
+			queued++;
+			continue;
+		}
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY) {
+			rq->cmd_flags &= ~REQ_STARTED;
+			list_add(&rq->queuelist, &rq_list);
+			break;
+		}
+
+		if (ret != BLK_MQ_RQ_QUEUE_ERROR)
+			pr_err("blk-mq: bad return on queue: %d\n", ret);
+		rq->errors = -EIO;
+		blk_mq_end_io(rq, rq->errors);
+	}
+
+	hctx->queued += queued;
+
+	/*
+	 * Whatever the driver could not take waits on the dispatch list for
+	 * the next run, normally triggered by the driver restarting its
+	 * stopped queue.
+	 */
+	if (!list_empty(&rq_list)) {
+		spin_lock(&hctx->lock);
+		list_splice(&rq_list, &hctx->dispatch);
+		spin_unlock(&hctx->lock);
+	}
+}
+
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (!async)
+		__blk_mq_run_hw_queue(hctx);
+	else
+		kblockd_schedule_delayed_work(hctx->queue,
+					      &hctx->delayed_work, 0);
+}
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		blk_mq_run_hw_queue(hctx, async);
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	cancel_delayed_work(&hctx->delayed_work);
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+	blk_mq_run_hw_queue(hctx, true);
+}
+EXPORT_SYMBOL(blk_mq_start_hw_queue);
+
+void blk_mq_start_stopped_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (test_and_clear_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			blk_mq_run_hw_queue(hctx, true);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+static void blk_mq_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, delayed_work.work);
+	__blk_mq_run_hw_queue(hctx);
+}
+
+static void __blk_mq_insert_request(struct blk_mq_hw_ctx *hctx,
+				    struct blk_mq_ctx *ctx,
+				    struct request *rq, bool at_head)
+{
+	spin_lock(&ctx->lock);
+	if (at_head)
+		list_add(&rq->queuelist, &ctx->rq_list);
+	else
+		list_add_tail(&rq->queuelist, &ctx->rq_list);
+	set_bit(ctx->index_hw, hctx->ctx_map);
+	spin_unlock(&ctx->lock);
+}
+
+void blk_mq_insert_request(struct request_queue *q, struct request *rq,
+			   bool at_head, bool run_queue)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	struct blk_mq_hw_ctx *hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	__blk_mq_insert_request(hctx, ctx, rq, at_head);
+
+	if (run_queue)
+		blk_mq_run_hw_queue(hctx, false);
+}
+EXPORT_SYMBOL(blk_mq_insert_request);
+
+/*
+ * Requests only sit on a software queue until the hardware queue is run,
+ * which is deferred for async writes.  Try to append the bio to the last
+ * request staged there.
+ */
+static bool blk_mq_attempt_merge(struct request_queue *q,
+				 struct blk_mq_ctx *ctx, struct bio *bio)
+{
+	struct request *rq;
+	bool merged = false;
+
+	if (blk_queue_nomerges(q) || (bio->bi_rw & (REQ_FLUSH | REQ_FUA)))
+		return false;
+
+	spin_lock(&ctx->lock);
+	if (!list_empty(&ctx->rq_list)) {
+		rq = list_entry(ctx->rq_list.prev, struct request, queuelist);
+		if (elv_rq_merge_ok(rq, bio) &&
+		    blk_rq_pos(rq) + blk_rq_sectors(rq) == bio->bi_sector &&
+		    bio_attempt_back_merge(q, rq, bio)) {
+			ctx->rq_merged++;
+			merged = true;
+		}
+	}
+	spin_unlock(&ctx->lock);
+
+	return merged;
+}
+
+static int blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	const int is_sync = rw_is_sync(bio->bi_rw);
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	unsigned int rw_flags;
+
+	blk_queue_bounce(q, &bio);
+
+	ctx = blk_mq_get_ctx(q);
+	hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	if ((hctx->flags & BLK_MQ_F_SHOULD_MERGE) &&
+	    blk_mq_attempt_merge(q, ctx, bio))
+		return 0;
+
+	rw_flags = bio_data_dir(bio);
+	if (is_sync)
+		rw_flags |= REQ_SYNC;
+
+	trace_block_getrq(q, bio, bio_data_dir(bio));
+
+	/* may sleep for a tag, but can not fail */
+	rq = __blk_mq_alloc_request(hctx, ctx, rw_flags, GFP_NOIO, false);
+	init_request_from_bio(rq, bio);
+	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags))
+		rq->cpu = ctx->cpu;
+	drive_stat_acct(rq, 1);
+
+	__blk_mq_insert_request(hctx, ctx, rq, false);
+
+	/*
+	 * Sync requests are dispatched right away from the submitting
+	 * context, async ones from kblockd, leaving a window for merges.
+	 */
+	blk_mq_run_hw_queue(hctx, !is_sync);
+	return 0;
+}
+
+/*
+ * Spread the possible CPUs evenly over the hardware queues, keeping
+ * neighbouring CPU ids on the same queue.
+ */
+static unsigned int *blk_mq_make_queue_map(struct blk_mq_reg *reg)
+{
+	unsigned int *map;
+	unsigned int cpu;
+
+	map = kzalloc_node(sizeof(*map) * nr_cpu_ids, GFP_KERNEL,
+			   reg->numa_node);
+	if (!map)
+		return NULL;
+
+	for_each_possible_cpu(cpu)
+		map[cpu] = cpu * reg->nr_hw_queues / nr_cpu_ids;
+
+	return map;
+}
+
+static void blk_mq_free_rq_map(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	if (hctx->rqs) {
+		for (i = 0; i < hctx->queue_depth; i++)
+			kfree(hctx->rqs[i]);
+		kfree(hctx->rqs);
+	}
+	kfree(hctx->tag_map);
+}
+
+static int blk_mq_init_rq_map(struct blk_mq_hw_ctx *hctx,
+			      struct blk_mq_reg *reg)
+{
+	unsigned int i;
+
+	hctx->queue_depth = reg->queue_depth;
+	hctx->reserved_tags = reg->reserved_tags;
+	init_waitqueue_head(&hctx->tag_wait);
+
+	hctx->tag_map = kzalloc_node(BITS_TO_LONGS(hctx->queue_depth) *
+				     sizeof(unsigned long), GFP_KERNEL,
+				     hctx->numa_node);
+	hctx->rqs = kzalloc_node(hctx->queue_depth * sizeof(struct request *),
+				 GFP_KERNEL, hctx->numa_node);
+	if (!hctx->tag_map || !hctx->rqs)
+		goto fail;
+
+	for (i = 0; i < hctx->queue_depth; i++) {
+		hctx->rqs[i] = kzalloc_node(sizeof(struct request) +
+					    reg->cmd_size, GFP_KERNEL,
+					    hctx->numa_node);
+		if (!hctx->rqs[i])
+			goto fail;
+		hctx->rqs[i]->tag = i;
+	}
+
+	return 0;
+fail:
+	blk_mq_free_rq_map(hctx);
+	hctx->rqs = NULL;
+	hctx->tag_map = NULL;
+	return -ENOMEM;
+}
+
+static void blk_mq_free_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!hctx)
+			continue;
+		cancel_delayed_work_sync(&hctx->delayed_work);
+		if (q->mq_ops->exit_hctx && hctx->rqs)
+			q->mq_ops->exit_hctx(hctx, i);
+		blk_mq_free_rq_map(hctx);
+		kfree(hctx->ctx_map);
+		kfree(hctx->ctxs);
+		kfree(hctx);
+	}
+}
+
+static int blk_mq_init_hw_queues(struct request_queue *q,
+				 struct blk_mq_reg *reg, void *driver_data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, reg->numa_node);
+		if (!hctx)
+			return -ENOMEM;
+		q->queue_hw_ctx[i] = hctx;
+
+		spin_lock_init(&hctx->lock);
+		INIT_LIST_HEAD(&hctx->dispatch);
+		INIT_DELAYED_WORK(&hctx->delayed_work, blk_mq_work_fn);
+		hctx->queue = q;
+		hctx->queue_num = i;
+		hctx->flags = reg->flags;
+		hctx->numa_node = reg->numa_node;
+
+		hctx->ctxs = kzalloc_node(nr_cpu_ids * sizeof(void *),
+					  GFP_KERNEL, reg->numa_node);
+		hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(nr_cpu_ids) *
+					     sizeof(unsigned long), GFP_KERNEL,
+					     reg->numa_node);
+		if (!hctx->ctxs || !hctx->ctx_map)
+			return -ENOMEM;
+
+		if (blk_mq_init_rq_map(hctx, reg))
+			return -ENOMEM;
+
+		if (reg->ops->init_hctx &&
+		    reg->ops->init_hctx(hctx, driver_data, i)) {
+			/* don't call ->exit_hctx() for this one */
+			blk_mq_free_rq_map(hctx);
+			hctx->rqs = NULL;
+			hctx->tag_map = NULL;
+			return -ENODEV;
+		}
+	}
+
+	return 0;
+}
+
+static void blk_mq_init_cpu_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_mq_ctx *ctx = __blk_mq_get_ctx(q, cpu);
+
+		memset(ctx, 0, sizeof(*ctx));
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		hctx = q->mq_ops->map_queue(q, cpu);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+}
+
+/**
+ * blk_mq_init_queue - set up a multi-queue request queue
+ * @reg:	queue layout and driver operations
+ * @driver_data: passed to ->init_hctx()
+ *
+ * Description:
+ *     Allocates a request queue with @reg->nr_hw_queues hardware queues of
+ *     @reg->queue_depth preallocated requests each, every request followed
+ *     by @reg->cmd_size bytes of driver data.  The queue is released with
+ *     blk_cleanup_queue() like any other.
+ */
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct request_queue *q;
+
+	if (!reg->nr_hw_queues || !reg->ops->queue_rq ||
+	    !reg->ops->map_queue || !reg->queue_depth ||
+	    reg->queue_depth > BLK_MQ_MAX_DEPTH ||
+	    reg->reserved_tags >= reg->queue_depth)
+		return ERR_PTR(-EINVAL);
+
+	if (reg->nr_hw_queues > nr_cpu_ids)
+		reg->nr_hw_queues = nr_cpu_ids;
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return ERR_PTR(-ENOMEM);
+
+	q->mq_ops = reg->ops;
+	q->nr_queues = nr_cpu_ids;
+	q->nr_hw_queues = reg->nr_hw_queues;
+
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->queue_hw_ctx = kzalloc_node(reg->nr_hw_queues * sizeof(void *),
+				       GFP_KERNEL, reg->numa_node);
+	q->mq_map = blk_mq_make_queue_map(reg);
+	if (!q->queue_ctx || !q->queue_hw_ctx || !q->mq_map)
+		goto err;
+
+	if (blk_mq_init_hw_queues(q, reg, driver_data))
+		goto err;
+
+	blk_mq_init_cpu_queues(q);
+
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->softirq_done_fn = reg->ops->complete;
+	q->queue_flags |= QUEUE_FLAG_MQ_DEFAULT;
+	q->nr_requests = reg->queue_depth;
+
+	return q;
+err:
+	blk_cleanup_queue(q);
+	return ERR_PTR(-ENOMEM);
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
+
+/*
+ * Wait for all requests to be given back.  Called when the queue is being
+ * torn down, after the last bio has been submitted.
+ */
+void blk_mq_drain_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	bool busy;
+	int i;
+
+	if (!q->queue_hw_ctx)
+		return;
+
+	do {
+		busy = false;
+		queue_for_each_hw_ctx(q, hctx, i) {
+			if (hctx && hctx->tag_map && blk_mq_hctx_busy(hctx))
+				busy = true;
+		}
+		if (busy) {
+			blk_mq_run_queues(q, false);
+			msleep(10);
+		}
+	} while (busy);
+}
+
+/* Called from the release of the queue kobject */
+void blk_mq_free_queue(struct request_queue *q)
+{
+	if (q->queue_hw_ctx) {
+		blk_mq_free_hw_queues(q);
+		kfree(q->queue_hw_ctx);
+		q->queue_hw_ctx = NULL;
+	}
+	free_percpu(q->queue_ctx);
+	q->queue_ctx = NULL;
+	kfree(q->mq_map);
+	q->mq_map = NULL;
+}
@@ -99,6 +99,22 @@ void blk_queue_lld_busy(struct request_queue *q, lld_busy_fn *fn)
 }
 EXPORT_SYMBOL_GPL(blk_queue_lld_busy);
 
+/**
+ * blk_queue_poll - set the completion polling function of a queue
+ * @q:  queue
+ * @fn: polling function
+ *
+ * @fn reaps whatever completions the device has posted, without waiting
+ * for an interrupt, and returns how many it found.  Tasks waiting for
+ * synchronous I/O call it in a loop instead of sleeping once polling
+ * has been enabled in sysfs; see blk_poll().
+ */
+void blk_queue_poll(struct request_queue *q, poll_fn *fn)
+{
+	q->poll_fn = fn;
+}
+EXPORT_SYMBOL_GPL(blk_queue_poll);
+
 /**
  * blk_set_default_limits - reset limits to default values
  * @lim:  the queue_limits structure to reset
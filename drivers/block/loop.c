@@ -75,6 +75,9 @@
 #include <linux/kthread.h>
 #include <linux/splice.h>
 #include <linux/sysfs.h>
+#include <linux/vmalloc.h>
+#include <linux/mempool.h>
+#include <linux/fiemap.h>
 
 #include <asm/uaccess.h>
 
@@ -498,6 +501,181 @@ out:
 	return ret;
 }
 
+/*
+ * Direct I/O mode.
+ *
+ * The backing file is mapped once, with bmap(), into extents on the
+ * device holding its filesystem.  Reads and writes to the loop device are
+ * then remapped onto that device by the loop thread, which only submits
+ * them, so any number of them can be in flight and the page cache of the
+ * backing file is bypassed.  A bio may need many clones; they are not
+ * allocated from loop_make_request(), where generic_make_request() would
+ * hold them all back until it returns and could drain fs_bio_set.
+ *
+ * As for swap files, the file has to be fully allocated and written, and
+ * it is marked S_SWAPFILE while direct I/O is enabled, so that it can be
+ * neither truncated nor have holes punched or its blocks moved.
+ */
+struct loop_extent {
+	loff_t		pos;		/* byte offset in the backing file */
+	loff_t		len;
+	sector_t	sector;		/* start sector on map->bdev */
+};
+
+struct loop_dio_map {
+	struct block_device	*bdev;
+	struct inode		*pinned;	/* marked S_SWAPFILE by us */
+	mempool_t		*pool;		/* of struct loop_dio */
+	unsigned int		nr_extents;
+	unsigned int		max_extents;
+	struct loop_extent	extents[0];
+};
+
+/* a loop bio being served by one or more bios to map->bdev */
+struct loop_dio {
+	struct loop_device	*lo;
+	struct loop_dio_map	*map;
+	struct bio		*bio;
+	atomic_t		remaining;
+	int			error;
+};
+
+static struct loop_extent *loop_dio_find(struct loop_dio_map *map, loff_t pos)
+{
+	unsigned int first = 0, last = map->nr_extents;
+
+	while (first < last) {
+		unsigned int mid = (first + last) / 2;
+		struct loop_extent *ext = &map->extents[mid];
+
+		if (pos < ext->pos)
+			last = mid;
+		else if (pos >= ext->pos + ext->len)
+			first = mid + 1;
+		else
+			return ext;
+	}
+	return NULL;
+}
+
+static void loop_dio_put(struct loop_dio *dio)
+{
+	struct loop_device *lo = dio->lo;
+
+	if (!atomic_dec_and_test(&dio->remaining))
+		return;
+
+	bio_endio(dio->bio, dio->error);
+	mempool_free(dio, dio->map->pool);
+
+	if (atomic_dec_and_test(&lo->lo_dio_inflight))
+		wake_up(&lo->lo_dio_wait);
+}
+
+static void loop_dio_end_io(struct bio *clone, int error)
+{
+	struct loop_dio *dio = clone->bi_private;
+
+	if (error)
+		dio->error = error;
+	bio_put(clone);
+	loop_dio_put(dio);
+}
+
+static struct bio *loop_dio_alloc_clone(struct loop_dio *dio, sector_t sector,
+					unsigned long rw, int nr_vecs)
+{
+	struct bio *clone;
+
+	clone = bio_alloc(GFP_NOIO, min(nr_vecs, BIO_MAX_PAGES));
+	clone->bi_bdev = dio->map->bdev;
+	clone->bi_sector = sector;
+	clone->bi_rw = rw;
+	clone->bi_end_io = loop_dio_end_io;
+	clone->bi_private = dio;
+	return clone;
+}
+
+static void loop_dio_issue(struct loop_dio *dio, struct bio *clone)
+{
+	atomic_inc(&dio->remaining);
+	generic_make_request(clone);
+}
+
+/*
+ * Split @bio along the extents of the backing file and submit the pieces.
+ * Pages are not copied, the clones point at the pages of @bio.  Only the
+ * first clone carries a preflush, the FUA bit is set on all of them.
+ */
+static void loop_dio_submit(struct loop_device *lo, struct loop_dio_map *map,
+			    struct bio *bio)
+{
+	unsigned long rw = bio_data_dir(bio) |
+		(bio->bi_rw & (REQ_SYNC | REQ_META | REQ_NOIDLE |
+			       REQ_FLUSH | REQ_FUA));
+	loff_t pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
+	struct bio *clone = NULL;
+	struct bio_vec *bvec;
+	struct loop_dio *dio;
+	int i;
+
+	dio = mempool_alloc(map->pool, GFP_NOIO);
+	dio->lo = lo;
+	dio->map = map;
+	dio->bio = bio;
+	dio->error = 0;
+	atomic_set(&dio->remaining, 1);
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int off = bvec->bv_offset;
+		unsigned int len = bvec->bv_len;
+
+		while (len) {
+			struct loop_extent *ext = loop_dio_find(map, pos);
+			unsigned int chunk;
+			sector_t sector;
+
+			if (unlikely(!ext)) {
+				dio->error = -EIO;
+				goto out;
+			}
+			chunk = min_t(loff_t, len, ext->pos + ext->len - pos);
+			sector = ext->sector + ((pos - ext->pos) >> 9);
+
+			if (!clone ||
+			    clone->bi_sector + bio_sectors(clone) != sector ||
+			    bio_add_page(clone, bvec->bv_page, chunk, off) < chunk) {
+				if (clone)
+					loop_dio_issue(dio, clone);
+				clone = loop_dio_alloc_clone(dio, sector, rw,
+							     bio->bi_vcnt - i);
+				rw &= ~REQ_FLUSH;
+				if (bio_add_page(clone, bvec->bv_page, chunk,
+						 off) < chunk) {
+					dio->error = -EIO;
+					goto out;
+				}
+			}
+
+			pos += chunk;
+			off += chunk;
+			len -= chunk;
+		}
+	}
+
+	/* an empty flush is passed on as such */
+	if (!clone && !bio->bi_size)
+		clone = loop_dio_alloc_clone(dio, 0, rw | REQ_WRITE, 0);
+out:
+	if (clone) {
+		if (dio->error)
+			bio_put(clone);
+		else
+			loop_dio_issue(dio, clone);
+	}
+	loop_dio_put(dio);
+}
+
 /*
  * Add bio to back of pending list
  */
@@ -529,6 +707,21 @@ static int loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
+	/* bios without a bdev are loop_switch() requests for the thread */
+	if (lo->lo_dio_parking && old_bio->bi_bdev) {
+		bio_list_add(&lo->lo_dio_parked, old_bio);
+		spin_unlock_irq(&lo->lo_lock);
+		return 0;
+	}
+	if (lo->lo_dio_map && old_bio->bi_bdev) {
+		if (unlikely(old_bio->bi_rw & REQ_DISCARD)) {
+			/* punching holes would invalidate the extent map */
+			spin_unlock_irq(&lo->lo_lock);
+			bio_endio(old_bio, -EOPNOTSUPP);
+			return 0;
+		}
+		atomic_inc(&lo->lo_dio_inflight);
+	}
 	loop_add_bio(lo, old_bio);
 	wake_up(&lo->lo_event);
 	spin_unlock_irq(&lo->lo_lock);
@@ -552,6 +745,9 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 	if (unlikely(!bio->bi_bdev)) {
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
+	} else if (lo->lo_dio_map) {
+		/* stays set until the bios queued for it are completed */
+		loop_dio_submit(lo, lo->lo_dio_map, bio);
 	} else {
 		int ret = do_bio_filebacked(lo, bio);
 		bio_endio(bio, ret);
@@ -628,6 +824,294 @@ static int loop_flush(struct loop_device *lo)
 	return loop_switch(lo, NULL);
 }
 
+/*
+ * Pin the backing file the way swapon() does: S_SWAPFILE makes truncate,
+ * hole punching and online defragmentation refuse it, so that its blocks
+ * stay where the extent map says they are.
+ */
+static int loop_dio_pin(struct loop_dio_map *map, struct inode *inode)
+{
+	int err = 0;
+
+	mutex_lock(&inode->i_mutex);
+	if (IS_SWAPFILE(inode))
+		err = -EBUSY;
+	else
+		inode->i_flags |= S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+	if (!err)
+		map->pinned = inode;
+	return err;
+}
+
+static void loop_dio_free_map(struct loop_dio_map *map)
+{
+	struct inode *inode = map->pinned;
+
+	if (inode) {
+		mutex_lock(&inode->i_mutex);
+		inode->i_flags &= ~S_SWAPFILE;
+		mutex_unlock(&inode->i_mutex);
+	}
+	if (map->pool)
+		mempool_destroy(map->pool);
+	vfree(map);
+}
+
+/* extents whose blocks cannot be read and written through the map */
+#define LOOP_DIO_BAD_EXTENT	(FIEMAP_EXTENT_UNKNOWN |		\
+				 FIEMAP_EXTENT_DELALLOC |		\
+				 FIEMAP_EXTENT_ENCODED |		\
+				 FIEMAP_EXTENT_DATA_ENCRYPTED |		\
+				 FIEMAP_EXTENT_NOT_ALIGNED |		\
+				 FIEMAP_EXTENT_DATA_INLINE |		\
+				 FIEMAP_EXTENT_DATA_TAIL |		\
+				 FIEMAP_EXTENT_UNWRITTEN |		\
+				 FIEMAP_EXTENT_SHARED)
+
+#define LOOP_DIO_FIEMAP_BATCH	32
+
+/*
+ * bmap() cannot tell written blocks from ones that are only allocated:
+ * ext4 maps unwritten extents like any other, so reads through the map
+ * would return stale disk contents, and writes would skip the conversion
+ * of the extent.  Ask ->fiemap() about the whole file and refuse it if it
+ * has holes or any extent that is unwritten, delayed, shared, encoded or
+ * otherwise not plain data in place.  Dirty pages must have been written
+ * back, so that nothing is left in delayed allocation.
+ */
+static int loop_dio_check_extents(struct inode *inode)
+{
+	loff_t size = i_size_read(inode), pos = 0;
+	struct fiemap_extent *fe;
+	int i, nr, err = 0;
+
+	if (!inode->i_op->fiemap)
+		return -EINVAL;
+	fe = kmalloc(LOOP_DIO_FIEMAP_BATCH * sizeof(*fe), GFP_KERNEL);
+	if (!fe)
+		return -ENOMEM;
+
+	while (pos < size) {
+		nr = kernel_fiemap(inode, pos, size - pos, fe,
+				   LOOP_DIO_FIEMAP_BATCH);
+		if (nr < 0) {
+			err = nr;
+			break;
+		}
+
+		err = -EINVAL;
+		if (!nr)
+			break;		/* a hole up to the end */
+		for (i = 0; i < nr; i++) {
+			struct fiemap_extent *ext = &fe[i];
+
+			if (ext->fe_logical > pos ||
+			    (ext->fe_flags & LOOP_DIO_BAD_EXTENT) ||
+			    ext->fe_logical + ext->fe_length <= pos)
+				goto out;
+			pos = ext->fe_logical + ext->fe_length;
+		}
+		err = 0;
+		cond_resched();
+	}
+out:
+	kfree(fe);
+	return err;
+}
+
+static int loop_dio_add_extent(struct loop_dio_map **mapp, loff_t pos,
+			       loff_t len, sector_t sector)
+{
+	struct loop_dio_map *map = *mapp;
+	struct loop_extent *ext;
+
+	if (map->nr_extents) {
+		ext = &map->extents[map->nr_extents - 1];
+		if (ext->pos + ext->len == pos &&
+		    ext->sector + (ext->len >> 9) == sector) {
+			ext->len += len;
+			return 0;
+		}
+	}
+
+	if (map->nr_extents == map->max_extents) {
+		unsigned int max = map->max_extents * 2;
+		struct loop_dio_map *new;
+
+		new = vmalloc(sizeof(*new) + max * sizeof(*ext));
+		if (!new)
+			return -ENOMEM;
+		memcpy(new, map, sizeof(*map) +
+		       map->nr_extents * sizeof(*ext));
+		new->max_extents = max;
+		vfree(map);
+		*mapp = map = new;
+	}
+
+	ext = &map->extents[map->nr_extents++];
+	ext->pos = pos;
+	ext->len = len;
+	ext->sector = sector;
+	return 0;
+}
+
+/*
+ * Build the extent map of the backing file.  Holes, including blocks that
+ * are allocated but not yet written, cannot be written through the map,
+ * so a file containing any is refused.
+ */
+static struct loop_dio_map *loop_dio_map_file(struct loop_device *lo)
+{
+	struct file *file = lo->lo_backing_file;
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	struct loop_dio_map *map;
+	int err = -ENOMEM;
+
+	map = vmalloc(sizeof(*map) + 16 * sizeof(struct loop_extent));
+	if (!map)
+		return ERR_PTR(-ENOMEM);
+	memset(map, 0, sizeof(*map));
+	map->max_extents = 16;
+
+	if (S_ISBLK(inode->i_mode)) {
+		map->bdev = I_BDEV(inode);
+		err = loop_dio_add_extent(&map, 0, i_size_read(inode), 0);
+	} else {
+		unsigned blkbits = inode->i_blkbits;
+		sector_t block, nr_blocks;
+
+		/*
+		 * Like swapon(), require ->bmap(): filesystems that checksum
+		 * or copy on write, such as btrfs, do not provide it, since
+		 * writing to the blocks in place would bypass them.
+		 */
+		err = -EINVAL;
+		if (!mapping->a_ops->bmap || !inode->i_sb->s_bdev)
+			goto out_free;
+		map->bdev = inode->i_sb->s_bdev;
+
+		err = loop_dio_pin(map, inode);
+		if (err)
+			goto out_free;
+		err = loop_dio_check_extents(inode);
+		if (err)
+			goto out_free;
+
+		nr_blocks = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+		for (block = 0; block < nr_blocks; block++) {
+			sector_t phys = bmap(inode, block);
+
+			err = -EINVAL;
+			if (!phys)
+				goto out_free;
+			err = loop_dio_add_extent(&map, (loff_t) block << blkbits,
+						  1 << blkbits,
+						  phys << (blkbits - 9));
+			if (err)
+				goto out_free;
+			cond_resched();
+		}
+	}
+	if (err)
+		goto out_free;
+
+	/* loop devices have 512 byte sectors, so must the backing device */
+	err = -EINVAL;
+	if (bdev_logical_block_size(map->bdev) != 512 ||
+	    (lo->lo_offset & 511))
+		goto out_free;
+
+	err = -ENOMEM;
+	map->pool = mempool_create_kmalloc_pool(16, sizeof(struct loop_dio));
+	if (!map->pool)
+		goto out_free;
+	return map;
+
+out_free:
+	loop_dio_free_map(map);
+	return ERR_PTR(err);
+}
+
+static void loop_dio_unpark(struct loop_device *lo)
+{
+	struct bio_list parked;
+	struct bio *bio;
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_dio_parking = false;
+	parked = lo->lo_dio_parked;
+	bio_list_init(&lo->lo_dio_parked);
+	spin_unlock_irq(&lo->lo_lock);
+
+	while ((bio = bio_list_pop(&parked)))
+		loop_make_request(lo->lo_queue, bio);
+}
+
+/*
+ * Switch between buffered and direct I/O to the backing file.  Called with
+ * lo_ctl_mutex held.  While switching, new bios are parked, so that the
+ * two paths never run concurrently and the page cache of the backing file
+ * is written back and dropped in between.
+ */
+static int loop_set_direct_io(struct loop_device *lo, unsigned long arg)
+{
+	struct address_space *mapping;
+	struct loop_dio_map *map;
+	int err = 0;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+	if (!!arg == !!(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return 0;
+	/* the raw block mapping of the file is handed to the device */
+	if (arg && !capable(CAP_SYS_RAWIO))
+		return -EPERM;
+	/* data is transformed by the transfer function */
+	if (arg && lo->transfer != transfer_none)
+		return -EINVAL;
+
+	mapping = lo->lo_backing_file->f_mapping;
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_dio_parking = true;
+	spin_unlock_irq(&lo->lo_lock);
+
+	if (!arg) {
+		wait_event(lo->lo_dio_wait,
+			   !atomic_read(&lo->lo_dio_inflight));
+		spin_lock_irq(&lo->lo_lock);
+		map = lo->lo_dio_map;
+		lo->lo_dio_map = NULL;
+		spin_unlock_irq(&lo->lo_lock);
+		loop_dio_free_map(map);
+		lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+		/* drop cached pages that the direct writes made stale */
+		invalidate_inode_pages2(mapping);
+		goto out;
+	}
+
+	loop_flush(lo);
+	err = filemap_write_and_wait(mapping);
+	if (err)
+		goto out;
+	map = loop_dio_map_file(lo);
+	if (IS_ERR(map)) {
+		err = PTR_ERR(map);
+		goto out;
+	}
+	invalidate_inode_pages2(mapping);
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_dio_map = map;
+	spin_unlock_irq(&lo->lo_lock);
+	lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+out:
+	loop_dio_unpark(lo);
+	return err;
+}
+
 /*
  * Do the actual switch; called from the BIO completion routine
  */
@@ -677,6 +1161,11 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY))
 		goto out;
 
+	/* the extent map is that of the old file */
+	error = -EBUSY;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		goto out;
+
 	error = -EBADF;
 	file = fget(arg);
 	if (!file)
@@ -784,16 +1273,25 @@ static ssize_t loop_attr_autoclear_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", autoclear ? "1" : "0");
 }
 
+static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
+{
+	int dio = (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+
+	return sprintf(buf, "%s\n", dio ? "1" : "0");
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
+LOOP_ATTR_RO(dio);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
 	&loop_attr_offset.attr,
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
+	&loop_attr_dio.attr,
 	NULL,
 };
 
@@ -1005,6 +1503,13 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 	lo->lo_state = Lo_rundown;
 	spin_unlock_irq(&lo->lo_lock);
 
+	if (lo->lo_dio_map) {
+		wait_event(lo->lo_dio_wait,
+			   !atomic_read(&lo->lo_dio_inflight));
+		loop_dio_free_map(lo->lo_dio_map);
+		lo->lo_dio_map = NULL;
+	}
+
 	kthread_stop(lo->lo_thread);
 
 	lo->lo_backing_file = NULL;
@@ -1064,6 +1569,11 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
 
+	/* offset and transfer may change, go back to buffered I/O */
+	err = loop_set_direct_io(lo, 0);
+	if (err)
+		return err;
+
 	err = loop_release_xfer(lo);
 	if (err)
 		return err;
@@ -1265,6 +1775,10 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	err = -ENXIO;
 	if (unlikely(lo->lo_state != Lo_bound))
 		goto out;
+	/* blocks past the old end are not in the extent map */
+	err = -EBUSY;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		goto out;
 	err = figure_loop_size(lo);
 	if (unlikely(err))
 		goto out;
@@ -1319,6 +1833,11 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
 			err = loop_set_capacity(lo, bdev);
 		break;
+	case LOOP_SET_DIRECT_IO:
+		err = -EPERM;
+		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
+			err = loop_set_direct_io(lo, arg);
+		break;
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
@@ -1473,6 +1992,7 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DIRECT_IO:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -1604,6 +2124,8 @@ static struct loop_device *loop_alloc(int i)
 	lo->lo_number		= i;
 	lo->lo_thread		= NULL;
 	init_waitqueue_head(&lo->lo_event);
+	init_waitqueue_head(&lo->lo_dio_wait);
+	bio_list_init(&lo->lo_dio_parked);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
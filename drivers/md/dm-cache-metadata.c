@@ -0,0 +1,363 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#include "dm-cache-metadata.h"
+
+#include <linux/blkdev.h>
+#include <linux/dm-io.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache metadata"
+
+/*-----------------------------------------------------------------
+ * On disk layout
+ *
+ * The first 4k of the metadata device hold the superblock, the rest
+ * is an array with one entry per cache block.
+ *
+ * An entry occupies 16 bytes within a sector, so every change to it is
+ * written atomically.  Changing the origin block a cache block maps is
+ * made safe by the target: it removes the old mapping, and commits that,
+ * before overwriting the data, and only inserts the new mapping once the
+ * data has been copied and flushed.
+ *
+ * A zeroed device is formatted on first use.  All on disk structures
+ * are little-endian.
+ *---------------------------------------------------------------*/
+
+/* "dmCa" */
+#define CACHE_MAGIC 0x61436d64
+#define CACHE_METADATA_VERSION 1
+
+#define SUPERBLOCK_SECTORS 8
+#define MAPPINGS_PER_SECTOR ((1 << SECTOR_SHIFT) / sizeof(struct disk_mapping))
+
+/* superblock flags */
+#define CLEAN_SHUTDOWN (1 << 0)
+
+/* mapping flags */
+#define M_VALID (1 << 0)
+#define M_DIRTY (1 << 1)
+
+struct disk_superblock {
+	__le32 magic;
+	__le32 version;
+	__le32 flags;
+
+	/* In sectors */
+	__le32 data_block_size;
+	__le32 cache_blocks;
+} __packed;
+
+struct disk_mapping {
+	__le64 oblock;
+	__le64 flags;
+} __packed;
+
+struct dm_cache_metadata {
+	struct block_device *bdev;
+	struct dm_io_client *io_client;
+
+	sector_t data_block_size;
+	dm_cblock_t cache_size;
+	bool clean_when_opened;
+
+	/*
+	 * An in core copy of the whole device, indexed by sector, and the
+	 * sectors of it that have changed since the last commit.
+	 */
+	void *area;
+	sector_t nr_sectors;
+	unsigned long *pending;
+};
+
+static struct disk_superblock *superblock(struct dm_cache_metadata *cmd)
+{
+	return cmd->area;
+}
+
+static struct disk_mapping *mapping(struct dm_cache_metadata *cmd,
+				    dm_cblock_t cblock)
+{
+	return (struct disk_mapping *)
+		(cmd->area + (SUPERBLOCK_SECTORS << SECTOR_SHIFT)) + cblock;
+}
+
+static sector_t mapping_sector(dm_cblock_t cblock)
+{
+	return SUPERBLOCK_SECTORS + cblock / MAPPINGS_PER_SECTOR;
+}
+
+sector_t dm_cache_metadata_size(dm_cblock_t cache_size)
+{
+	return SUPERBLOCK_SECTORS + dm_div_up(cache_size, MAPPINGS_PER_SECTOR);
+}
+
+static int area_io(struct dm_cache_metadata *cmd, int rw,
+		   sector_t sector, sector_t count)
+{
+	struct dm_io_region where = {
+		.bdev = cmd->bdev,
+		.sector = sector,
+		.count = count,
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = rw,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = cmd->area + (sector << SECTOR_SHIFT),
+		.client = cmd->io_client,
+		.notify.fn = NULL,
+	};
+
+	return dm_io(&io_req, 1, &where, NULL);
+}
+
+static int write_superblock(struct dm_cache_metadata *cmd)
+{
+	return area_io(cmd, WRITE_FLUSH_FUA, 0, 1);
+}
+
+/*
+ * Write out the pending sectors, coalescing adjacent ones, and make
+ * them durable.
+ */
+static int write_pending(struct dm_cache_metadata *cmd)
+{
+	unsigned long start, end;
+	int r;
+
+	start = find_first_bit(cmd->pending, cmd->nr_sectors);
+	if (start >= cmd->nr_sectors)
+		return 0;
+
+	while (start < cmd->nr_sectors) {
+		end = find_next_zero_bit(cmd->pending, cmd->nr_sectors, start);
+
+		r = area_io(cmd, WRITE, start, end - start);
+		if (r)
+			return r;
+
+		bitmap_clear(cmd->pending, start, end - start);
+		start = find_next_bit(cmd->pending, cmd->nr_sectors, end);
+	}
+
+	return blkdev_issue_flush(cmd->bdev, GFP_NOIO, NULL);
+}
+
+static int format_metadata(struct dm_cache_metadata *cmd)
+{
+	struct disk_superblock *sb = superblock(cmd);
+	int r;
+
+	memset(cmd->area, 0, cmd->nr_sectors << SECTOR_SHIFT);
+
+	r = area_io(cmd, WRITE, SUPERBLOCK_SECTORS,
+		    cmd->nr_sectors - SUPERBLOCK_SECTORS);
+	if (r)
+		return r;
+
+	sb->magic = cpu_to_le32(CACHE_MAGIC);
+	sb->version = cpu_to_le32(CACHE_METADATA_VERSION);
+	sb->flags = cpu_to_le32(CLEAN_SHUTDOWN);
+	sb->data_block_size = cpu_to_le32(cmd->data_block_size);
+	sb->cache_blocks = cpu_to_le32(cmd->cache_size);
+	cmd->clean_when_opened = true;
+
+	return write_superblock(cmd);
+}
+
+static int read_metadata(struct dm_cache_metadata *cmd)
+{
+	struct disk_superblock *sb = superblock(cmd);
+	int r;
+
+	r = area_io(cmd, READ, 0, 1);
+	if (r)
+		return r;
+
+	if (!sb->magic)
+		return format_metadata(cmd);
+
+	if (le32_to_cpu(sb->magic) != CACHE_MAGIC) {
+		DMERR("bad magic");
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(sb->version) != CACHE_METADATA_VERSION) {
+		DMERR("unsupported metadata version %u",
+		      le32_to_cpu(sb->version));
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(sb->data_block_size) != cmd->data_block_size) {
+		DMERR("block size %u differs from the %llu in the table",
+		      le32_to_cpu(sb->data_block_size),
+		      (unsigned long long)cmd->data_block_size);
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(sb->cache_blocks) != cmd->cache_size) {
+		DMERR("cache of %u blocks cannot be resized to %u",
+		      le32_to_cpu(sb->cache_blocks), cmd->cache_size);
+		return -EINVAL;
+	}
+
+	cmd->clean_when_opened = le32_to_cpu(sb->flags) & CLEAN_SHUTDOWN;
+
+	return area_io(cmd, READ, SUPERBLOCK_SECTORS,
+		       cmd->nr_sectors - SUPERBLOCK_SECTORS);
+}
+
+struct dm_cache_metadata *dm_cache_metadata_open(struct block_device *bdev,
+						 sector_t data_block_size,
+						 dm_cblock_t cache_size)
+{
+	struct dm_cache_metadata *cmd;
+	int r = -ENOMEM;
+
+	cmd = kzalloc(sizeof(*cmd), GFP_KERNEL);
+	if (!cmd)
+		return ERR_PTR(-ENOMEM);
+
+	cmd->bdev = bdev;
+	cmd->data_block_size = data_block_size;
+	cmd->cache_size = cache_size;
+	cmd->nr_sectors = dm_cache_metadata_size(cache_size);
+
+	cmd->area = vmalloc(cmd->nr_sectors << SECTOR_SHIFT);
+	if (!cmd->area)
+		goto bad;
+
+	cmd->pending = vzalloc(BITS_TO_LONGS(cmd->nr_sectors) *
+			       sizeof(unsigned long));
+	if (!cmd->pending)
+		goto bad;
+
+	cmd->io_client = dm_io_client_create(1);
+	if (IS_ERR(cmd->io_client)) {
+		r = PTR_ERR(cmd->io_client);
+		cmd->io_client = NULL;
+		goto bad;
+	}
+
+	r = read_metadata(cmd);
+	if (r)
+		goto bad;
+
+	return cmd;
+
+bad:
+	dm_cache_metadata_close(cmd);
+	return ERR_PTR(r);
+}
+
+void dm_cache_metadata_close(struct dm_cache_metadata *cmd)
+{
+	if (cmd->io_client)
+		dm_io_client_destroy(cmd->io_client);
+	vfree(cmd->pending);
+	vfree(cmd->area);
+	kfree(cmd);
+}
+
+int dm_cache_load_mappings(struct dm_cache_metadata *cmd,
+			   load_mapping_fn fn, void *context)
+{
+	struct disk_mapping *m;
+	dm_cblock_t cblock;
+	u64 flags;
+	int r;
+
+	/*
+	 * A table being replaced may have used the metadata since it
+	 * was opened, so read it again.
+	 */
+	r = read_metadata(cmd);
+	if (r)
+		return r;
+
+	for (cblock = 0; cblock < cmd->cache_size; cblock++) {
+		m = mapping(cmd, cblock);
+		flags = le64_to_cpu(m->flags);
+		if (!(flags & M_VALID))
+			continue;
+
+		r = fn(context, le64_to_cpu(m->oblock), cblock,
+		       !cmd->clean_when_opened || (flags & M_DIRTY));
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+void dm_cache_insert_mapping(struct dm_cache_metadata *cmd,
+			     dm_cblock_t cblock, dm_oblock_t oblock)
+{
+	struct disk_mapping *m = mapping(cmd, cblock);
+
+	m->oblock = cpu_to_le64(oblock);
+	m->flags = cpu_to_le64(M_VALID);
+	set_bit(mapping_sector(cblock), cmd->pending);
+}
+
+void dm_cache_remove_mapping(struct dm_cache_metadata *cmd,
+			     dm_cblock_t cblock)
+{
+	struct disk_mapping *m = mapping(cmd, cblock);
+
+	m->oblock = 0;
+	m->flags = 0;
+	set_bit(mapping_sector(cblock), cmd->pending);
+}
+
+int dm_cache_commit(struct dm_cache_metadata *cmd)
+{
+	return write_pending(cmd);
+}
+
+int dm_cache_set_clean(struct dm_cache_metadata *cmd,
+		       unsigned long *dirty_bitset)
+{
+	struct disk_superblock *sb = superblock(cmd);
+	struct disk_mapping *m;
+	dm_cblock_t cblock;
+	u64 flags, new_flags;
+	int r;
+
+	for (cblock = 0; cblock < cmd->cache_size; cblock++) {
+		m = mapping(cmd, cblock);
+		flags = le64_to_cpu(m->flags);
+		if (!(flags & M_VALID))
+			continue;
+
+		new_flags = M_VALID;
+		if (test_bit(cblock, dirty_bitset))
+			new_flags |= M_DIRTY;
+
+		if (new_flags != flags) {
+			m->flags = cpu_to_le64(new_flags);
+			set_bit(mapping_sector(cblock), cmd->pending);
+		}
+	}
+
+	r = write_pending(cmd);
+	if (r)
+		return r;
+
+	sb->flags = cpu_to_le32(le32_to_cpu(sb->flags) | CLEAN_SHUTDOWN);
+	return write_superblock(cmd);
+}
+
+int dm_cache_set_unclean(struct dm_cache_metadata *cmd)
+{
+	struct disk_superblock *sb = superblock(cmd);
+
+	if (!(le32_to_cpu(sb->flags) & CLEAN_SHUTDOWN))
+		return 0;
+
+	sb->flags = cpu_to_le32(le32_to_cpu(sb->flags) & ~CLEAN_SHUTDOWN);
+	return write_superblock(cmd);
+}
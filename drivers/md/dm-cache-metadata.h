@@ -0,0 +1,53 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#ifndef DM_CACHE_METADATA_H
+#define DM_CACHE_METADATA_H
+
+#include "dm-cache-policy.h"
+
+/*
+ * The mapping of cache blocks to origin blocks, kept on the metadata
+ * device.
+ *
+ * Changes are made in core and written out by dm_cache_commit(); once
+ * it returns they survive a crash.  Dirty state is only written when the
+ * cache is shut down cleanly: after a crash every mapped block is
+ * reported as dirty.
+ */
+struct dm_cache_metadata;
+
+struct dm_cache_metadata *dm_cache_metadata_open(struct block_device *bdev,
+						 sector_t data_block_size,
+						 dm_cblock_t cache_size);
+void dm_cache_metadata_close(struct dm_cache_metadata *cmd);
+
+/* Number of sectors the metadata of a cache of this size needs. */
+sector_t dm_cache_metadata_size(dm_cblock_t cache_size);
+
+/*
+ * Reads the metadata back from disk and passes each mapping to fn.
+ */
+typedef int (*load_mapping_fn)(void *context, dm_oblock_t oblock,
+			       dm_cblock_t cblock, bool dirty);
+int dm_cache_load_mappings(struct dm_cache_metadata *cmd,
+			   load_mapping_fn fn, void *context);
+
+void dm_cache_insert_mapping(struct dm_cache_metadata *cmd,
+			     dm_cblock_t cblock, dm_oblock_t oblock);
+void dm_cache_remove_mapping(struct dm_cache_metadata *cmd,
+			     dm_cblock_t cblock);
+int dm_cache_commit(struct dm_cache_metadata *cmd);
+
+/*
+ * Record the dirty blocks and mark the metadata as cleanly shut down.
+ * The data of the clean blocks must already be on the origin.
+ */
+int dm_cache_set_clean(struct dm_cache_metadata *cmd,
+		       unsigned long *dirty_bitset);
+
+/* Must be called before the cache is used again after set_clean(). */
+int dm_cache_set_unclean(struct dm_cache_metadata *cmd);
+
+#endif	/* DM_CACHE_METADATA_H */
@@ -0,0 +1,528 @@
+/*
+ * This file is released under the GPL.
+ *
+ * Multiqueue cache policy.
+ *
+ * Every origin block the policy has seen recently gets an entry with a
+ * hit count.  Entries are kept on one of two multiqueues: "cache" for
+ * the blocks that are in the cache, "pre_cache" for those that are
+ * not.  A multiqueue is a set of LRU lists, one per power of two of the
+ * hit count, so that the least recently used of the least often hit
+ * blocks is always at the head of the lowest non-empty level.
+ *
+ * A block is promoted once it has been hit promote_threshold times and
+ * more often than the block it would replace, which is taken from the
+ * bottom of the cache multiqueue.  Until the cache is full, blocks are
+ * promoted on first use.  Long sequential streams are left on the
+ * origin.
+ *
+ * Hit counts are halved every AGE_PERIOD ticks, so that blocks that
+ * were hot a long time ago do not stay in the cache for ever.
+ */
+
+#include "dm-cache-policy.h"
+
+#include <linux/hash.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache-policy-mq"
+
+#define NR_QUEUE_LEVELS 16
+#define AGE_PERIOD 60			/* ticks */
+
+#define DEFAULT_SEQUENTIAL_THRESHOLD 512	/* blocks */
+#define DEFAULT_PROMOTE_THRESHOLD 4		/* hits */
+
+/*----------------------------------------------------------------*/
+
+struct queue {
+	struct list_head qs[NR_QUEUE_LEVELS];
+};
+
+static void queue_init(struct queue *q)
+{
+	unsigned i;
+
+	for (i = 0; i < NR_QUEUE_LEVELS; i++)
+		INIT_LIST_HEAD(q->qs + i);
+}
+
+static unsigned queue_level(unsigned hit_count)
+{
+	return hit_count ? min(ilog2(hit_count), NR_QUEUE_LEVELS - 1) : 0;
+}
+
+/* Insert as the most recently used entry of its level. */
+static void queue_push(struct queue *q, unsigned level, struct list_head *elt)
+{
+	list_add_tail(elt, q->qs + level);
+}
+
+/* The least recently used entry of the lowest level, or NULL. */
+static struct list_head *queue_peek(struct queue *q)
+{
+	unsigned i;
+
+	for (i = 0; i < NR_QUEUE_LEVELS; i++)
+		if (!list_empty(q->qs + i))
+			return q->qs[i].next;
+
+	return NULL;
+}
+
+/*
+ * Move every level down by one, to match entries having their hit
+ * counts halved.  The top of level 0 stays the most recently used.
+ */
+static void queue_age(struct queue *q)
+{
+	unsigned i;
+
+	for (i = 1; i < NR_QUEUE_LEVELS; i++)
+		list_splice_tail_init(q->qs + i, q->qs + i - 1);
+}
+
+/*----------------------------------------------------------------*/
+
+struct entry {
+	struct hlist_node hlist;
+	struct list_head list;
+	dm_oblock_t oblock;
+	dm_cblock_t cblock;
+	unsigned hit_count;
+	unsigned generation;
+	bool in_cache;
+};
+
+struct mq_policy {
+	struct dm_cache_policy policy;
+
+	struct queue pre_cache;
+	struct queue cache;
+
+	struct entry *entries;
+	struct list_head free;
+
+	unsigned hash_bits;
+	struct hlist_head *table;
+
+	dm_cblock_t cache_size;
+	dm_cblock_t nr_allocated;
+	dm_cblock_t alloc_hint;
+	unsigned long *allocation_bitset;
+
+	/* sequential stream detection */
+	dm_oblock_t last_oblock;
+	unsigned seq_len;
+
+	unsigned generation;
+	unsigned ticks;
+
+	unsigned sequential_threshold;
+	unsigned promote_threshold;
+};
+
+static struct mq_policy *to_mq_policy(struct dm_cache_policy *p)
+{
+	return container_of(p, struct mq_policy, policy);
+}
+
+/*----------------------------------------------------------------*/
+
+static struct hlist_head *hash_bucket(struct mq_policy *mq, dm_oblock_t oblock)
+{
+	return mq->table + hash_64((u64) oblock, mq->hash_bits);
+}
+
+static struct entry *hash_lookup(struct mq_policy *mq, dm_oblock_t oblock)
+{
+	struct hlist_node *tmp;
+	struct entry *e;
+
+	hlist_for_each_entry(e, tmp, hash_bucket(mq, oblock), hlist)
+		if (e->oblock == oblock)
+			return e;
+
+	return NULL;
+}
+
+/* Apply any ageing that happened since the entry was last looked at. */
+static void age_entry(struct mq_policy *mq, struct entry *e)
+{
+	unsigned delta = mq->generation - e->generation;
+
+	e->hit_count = delta < 32 ? e->hit_count >> delta : 0;
+	e->generation = mq->generation;
+}
+
+static struct queue *entry_queue(struct mq_policy *mq, struct entry *e)
+{
+	return e->in_cache ? &mq->cache : &mq->pre_cache;
+}
+
+static void requeue_entry(struct mq_policy *mq, struct entry *e)
+{
+	list_del(&e->list);
+	queue_push(entry_queue(mq, e), queue_level(e->hit_count), &e->list);
+}
+
+static void free_entry(struct mq_policy *mq, struct entry *e)
+{
+	hlist_del(&e->hlist);
+	list_move(&e->list, &mq->free);
+}
+
+/*
+ * Returns an unhashed, unqueued entry.  When none is free, the coldest
+ * pre_cache entry is forgotten.
+ */
+static struct entry *alloc_entry(struct mq_policy *mq)
+{
+	struct list_head *l;
+	struct entry *e;
+
+	if (list_empty(&mq->free)) {
+		l = queue_peek(&mq->pre_cache);
+		if (!l)
+			return NULL;
+
+		free_entry(mq, list_entry(l, struct entry, list));
+	}
+
+	e = list_first_entry(&mq->free, struct entry, list);
+	list_del_init(&e->list);
+	e->hit_count = 0;
+	e->generation = mq->generation;
+	e->in_cache = false;
+
+	return e;
+}
+
+static void insert_entry(struct mq_policy *mq, struct entry *e,
+			 dm_oblock_t oblock)
+{
+	e->oblock = oblock;
+	hlist_add_head(&e->hlist, hash_bucket(mq, oblock));
+	queue_push(entry_queue(mq, e), queue_level(e->hit_count), &e->list);
+}
+
+/*----------------------------------------------------------------*/
+
+static bool any_free_cblocks(struct mq_policy *mq)
+{
+	return mq->nr_allocated < mq->cache_size;
+}
+
+static dm_cblock_t alloc_cblock(struct mq_policy *mq)
+{
+	unsigned long b;
+
+	b = find_next_zero_bit(mq->allocation_bitset, mq->cache_size,
+			       mq->alloc_hint);
+	if (b >= mq->cache_size)
+		b = find_first_zero_bit(mq->allocation_bitset, mq->cache_size);
+
+	BUG_ON(b >= mq->cache_size);
+	set_bit(b, mq->allocation_bitset);
+	mq->nr_allocated++;
+	mq->alloc_hint = b + 1;
+
+	return b;
+}
+
+static void free_cblock(struct mq_policy *mq, dm_cblock_t cblock)
+{
+	BUG_ON(!test_bit(cblock, mq->allocation_bitset));
+	clear_bit(cblock, mq->allocation_bitset);
+	mq->nr_allocated--;
+}
+
+/*----------------------------------------------------------------*/
+
+static void update_sequential(struct mq_policy *mq, dm_oblock_t oblock)
+{
+	if (oblock == mq->last_oblock + 1)
+		mq->seq_len++;
+	else if (oblock != mq->last_oblock)
+		mq->seq_len = 0;
+
+	mq->last_oblock = oblock;
+}
+
+static bool should_promote(struct mq_policy *mq, struct entry *e)
+{
+	struct entry *victim;
+
+	if (any_free_cblocks(mq))
+		return true;
+
+	if (e->hit_count < mq->promote_threshold)
+		return false;
+
+	victim = list_entry(queue_peek(&mq->cache), struct entry, list);
+	age_entry(mq, victim);
+
+	return e->hit_count > victim->hit_count;
+}
+
+static void promote(struct mq_policy *mq, struct entry *e,
+		    struct policy_result *result)
+{
+	struct entry *victim;
+
+	list_del(&e->list);
+
+	if (any_free_cblocks(mq)) {
+		result->op = POLICY_NEW;
+		e->cblock = alloc_cblock(mq);
+	} else {
+		/* The victim stays around as a pre_cache entry. */
+		victim = list_entry(queue_peek(&mq->cache), struct entry, list);
+		victim->in_cache = false;
+		requeue_entry(mq, victim);
+
+		result->op = POLICY_REPLACE;
+		result->old_oblock = victim->oblock;
+		e->cblock = victim->cblock;
+	}
+
+	e->in_cache = true;
+	queue_push(&mq->cache, queue_level(e->hit_count), &e->list);
+	result->cblock = e->cblock;
+}
+
+static int mq_map(struct dm_cache_policy *p, dm_oblock_t oblock,
+		  bool can_migrate, bool data_dir_write,
+		  struct policy_result *result)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e;
+
+	update_sequential(mq, oblock);
+
+	e = hash_lookup(mq, oblock);
+	if (e)
+		age_entry(mq, e);
+
+	if (e && e->in_cache) {
+		e->hit_count++;
+		requeue_entry(mq, e);
+		result->op = POLICY_HIT;
+		result->cblock = e->cblock;
+		return 0;
+	}
+
+	result->op = POLICY_MISS;
+
+	/* Streams would only push useful blocks out of the cache. */
+	if (mq->seq_len >= mq->sequential_threshold)
+		return 0;
+
+	if (!e) {
+		e = alloc_entry(mq);
+		if (!e)
+			return 0;
+		insert_entry(mq, e, oblock);
+	}
+
+	e->hit_count++;
+	requeue_entry(mq, e);
+
+	if (!should_promote(mq, e))
+		return 0;
+
+	if (!can_migrate)
+		return -EWOULDBLOCK;
+
+	promote(mq, e, result);
+	return 0;
+}
+
+static int mq_load_mapping(struct dm_cache_policy *p, dm_oblock_t oblock,
+			   dm_cblock_t cblock)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e;
+
+	if (cblock >= mq->cache_size ||
+	    test_bit(cblock, mq->allocation_bitset))
+		return -EINVAL;
+
+	e = hash_lookup(mq, oblock);
+	if (e) {
+		if (e->in_cache)
+			return -EINVAL;
+		list_del(&e->list);
+	} else {
+		e = alloc_entry(mq);
+		if (!e)
+			return -ENOMEM;
+		e->hit_count = 1;
+		e->oblock = oblock;
+		hlist_add_head(&e->hlist, hash_bucket(mq, oblock));
+	}
+
+	set_bit(cblock, mq->allocation_bitset);
+	mq->nr_allocated++;
+
+	e->in_cache = true;
+	e->cblock = cblock;
+	queue_push(&mq->cache, queue_level(e->hit_count), &e->list);
+
+	return 0;
+}
+
+static void mq_remove_mapping(struct dm_cache_policy *p, dm_oblock_t oblock)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e = hash_lookup(mq, oblock);
+
+	BUG_ON(!e || !e->in_cache);
+
+	free_cblock(mq, e->cblock);
+	free_entry(mq, e);
+}
+
+static dm_cblock_t mq_residency(struct dm_cache_policy *p)
+{
+	return to_mq_policy(p)->nr_allocated;
+}
+
+static void mq_tick(struct dm_cache_policy *p)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+
+	if (++mq->ticks < AGE_PERIOD)
+		return;
+
+	mq->ticks = 0;
+	mq->generation++;
+	queue_age(&mq->pre_cache);
+	queue_age(&mq->cache);
+}
+
+static int mq_set_config_value(struct dm_cache_policy *p,
+			       const char *key, const char *value)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	unsigned long tmp;
+
+	if (strict_strtoul(value, 10, &tmp))
+		return -EINVAL;
+
+	if (!strcasecmp(key, "sequential_threshold"))
+		mq->sequential_threshold = tmp;
+	else if (!strcasecmp(key, "promote_threshold"))
+		mq->promote_threshold = tmp;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int mq_emit_config_values(struct dm_cache_policy *p, char *result,
+				 unsigned maxlen)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+
+	snprintf(result, maxlen, "4 sequential_threshold %u promote_threshold %u",
+		 mq->sequential_threshold, mq->promote_threshold);
+
+	return 0;
+}
+
+static void mq_destroy(struct dm_cache_policy *p)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+
+	vfree(mq->table);
+	vfree(mq->allocation_bitset);
+	vfree(mq->entries);
+	kfree(mq);
+}
+
+static struct dm_cache_policy *mq_create(dm_cblock_t cache_size,
+					 sector_t origin_size,
+					 sector_t block_size)
+{
+	struct mq_policy *mq;
+	unsigned long nr_entries, i;
+
+	mq = kzalloc(sizeof(*mq), GFP_KERNEL);
+	if (!mq)
+		return NULL;
+
+	mq->policy.map = mq_map;
+	mq->policy.load_mapping = mq_load_mapping;
+	mq->policy.remove_mapping = mq_remove_mapping;
+	mq->policy.residency = mq_residency;
+	mq->policy.tick = mq_tick;
+	mq->policy.set_config_value = mq_set_config_value;
+	mq->policy.emit_config_values = mq_emit_config_values;
+	mq->policy.destroy = mq_destroy;
+
+	mq->cache_size = cache_size;
+	mq->sequential_threshold = DEFAULT_SEQUENTIAL_THRESHOLD;
+	mq->promote_threshold = DEFAULT_PROMOTE_THRESHOLD;
+	mq->last_oblock = (dm_oblock_t) -1;
+	queue_init(&mq->pre_cache);
+	queue_init(&mq->cache);
+	INIT_LIST_HEAD(&mq->free);
+
+	/* Track as many blocks outside the cache as there are inside it. */
+	nr_entries = 2 * (unsigned long) cache_size;
+	mq->entries = vzalloc(nr_entries * sizeof(*mq->entries));
+	if (!mq->entries)
+		goto bad;
+	for (i = 0; i < nr_entries; i++)
+		list_add_tail(&mq->entries[i].list, &mq->free);
+
+	mq->hash_bits = ilog2(roundup_pow_of_two(max(nr_entries / 2, 16UL)));
+	mq->table = vzalloc(sizeof(*mq->table) << mq->hash_bits);
+	if (!mq->table)
+		goto bad;
+
+	mq->allocation_bitset = vzalloc(BITS_TO_LONGS(cache_size) *
+					sizeof(unsigned long));
+	if (!mq->allocation_bitset)
+		goto bad;
+
+	return &mq->policy;
+
+bad:
+	mq_destroy(&mq->policy);
+	return NULL;
+}
+
+/*----------------------------------------------------------------*/
+
+static struct dm_cache_policy_type mq_policy_type = {
+	.name = "mq",
+	.owner = THIS_MODULE,
+	.create = mq_create
+};
+
+static int __init mq_init(void)
+{
+	int r = dm_cache_policy_register(&mq_policy_type);
+
+	if (!r)
+		DMINFO("version 1.0.0 loaded");
+	else
+		DMERR("register failed %d", r);
+
+	return r;
+}
+
+static void __exit mq_exit(void)
+{
+	dm_cache_policy_unregister(&mq_policy_type);
+}
+
+module_init(mq_init);
+module_exit(mq_exit);
+
+MODULE_DESCRIPTION("mq cache policy");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,111 @@
+/*
+ * This file is released under the GPL.
+ *
+ * Cache policy registration.
+ */
+
+#ifndef DM_CACHE_POLICY_H
+#define DM_CACHE_POLICY_H
+
+#include <linux/device-mapper.h>
+
+/*
+ * An origin block is a block sized chunk of the origin device, a cache
+ * block a block sized chunk of the cache device.
+ */
+typedef sector_t dm_oblock_t;
+typedef uint32_t dm_cblock_t;
+
+/*
+ * The policy decides which origin blocks are held in the cache.  The
+ * target asks it what to do with each io, and carries out any migration
+ * (promotion of an origin block into the cache, demotion of one out of
+ * it) that the policy asks for.
+ *
+ * The policy's idea of the mapping changes as soon as it returns a
+ * migration; the target holds back io to the blocks involved until the
+ * migration has completed.  If a migration fails the target tells the
+ * policy, via remove_mapping() and load_mapping(), what the mapping
+ * really is.
+ *
+ * Calls into a policy object are serialised by the target and may be
+ * made with a spinlock held, so they must not block.
+ */
+enum policy_operation {
+	POLICY_HIT,		/* block is in the cache at result->cblock */
+	POLICY_MISS,		/* use the origin */
+	POLICY_NEW,		/* promote into the free result->cblock */
+	POLICY_REPLACE		/* demote old_oblock, promote into its cblock */
+};
+
+struct policy_result {
+	enum policy_operation op;
+	dm_oblock_t old_oblock;
+	dm_cblock_t cblock;
+};
+
+struct dm_cache_policy {
+	/*
+	 * Map an origin block.  If the policy would like to migrate but
+	 * can_migrate is false it returns -EWOULDBLOCK, and the target
+	 * calls it again from a context that can start the migration.
+	 */
+	int (*map)(struct dm_cache_policy *p, dm_oblock_t oblock,
+		   bool can_migrate, bool data_dir_write,
+		   struct policy_result *result);
+
+	/*
+	 * Tell the policy about a mapping that already exists, when the
+	 * metadata is loaded or a failed migration is undone.
+	 */
+	int (*load_mapping)(struct dm_cache_policy *p, dm_oblock_t oblock,
+			    dm_cblock_t cblock);
+
+	/* Forget oblock, freeing its cache block. */
+	void (*remove_mapping)(struct dm_cache_policy *p, dm_oblock_t oblock);
+
+	/* Number of cache blocks in use. */
+	dm_cblock_t (*residency)(struct dm_cache_policy *p);
+
+	/* Called about once a second, for ageing the statistics. */
+	void (*tick)(struct dm_cache_policy *p);
+
+	/* Tunables: "<key> <value>" pairs from the table or a message. */
+	int (*set_config_value)(struct dm_cache_policy *p,
+				const char *key, const char *value);
+	int (*emit_config_values)(struct dm_cache_policy *p, char *result,
+				  unsigned maxlen);
+
+	void (*destroy)(struct dm_cache_policy *p);
+
+	/* Owned by dm-cache-policy.c */
+	struct dm_cache_policy_type *type;
+};
+
+#define CACHE_POLICY_NAME_SIZE 16
+
+struct dm_cache_policy_type {
+	struct list_head list;
+	char name[CACHE_POLICY_NAME_SIZE];
+	struct module *owner;
+
+	struct dm_cache_policy *(*create)(dm_cblock_t cache_size,
+					  sector_t origin_size,
+					  sector_t block_size);
+};
+
+int dm_cache_policy_register(struct dm_cache_policy_type *type);
+void dm_cache_policy_unregister(struct dm_cache_policy_type *type);
+
+/*
+ * Find the named policy type, loading dm-cache-<name> if need be, and
+ * create an instance of it.  Returns an ERR_PTR on failure.
+ */
+struct dm_cache_policy *dm_cache_policy_create(const char *name,
+					       dm_cblock_t cache_size,
+					       sector_t origin_size,
+					       sector_t block_size);
+void dm_cache_policy_destroy(struct dm_cache_policy *p);
+const char *dm_cache_policy_get_name(struct dm_cache_policy *p);
+
+#endif	/* DM_CACHE_POLICY_H */
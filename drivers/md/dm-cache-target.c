@@ -0,0 +1,1494 @@
+/*
+ * This file is released under the GPL.
+ *
+ * A target that uses a fast device, such as an SSD, as a cache for a
+ * slower origin device.
+ *
+ * The origin is divided into fixed size blocks.  A policy module picks
+ * the origin blocks that are worth keeping on the cache device, and the
+ * target moves blocks in and out of the cache with kcopyd.  A moving
+ * block is a "migration"; io to the blocks involved is held back until
+ * it completes.  See Documentation/device-mapper/cache.txt.
+ */
+
+#include "dm-cache-metadata.h"
+#include "dm-cache-policy.h"
+
+#include <linux/blkdev.h>
+#include <linux/dm-io.h>
+#include <linux/dm-kcopyd.h>
+#include <linux/hash.h>
+#include <linux/init.h>
+#include <linux/mempool.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache"
+
+#define MIGRATION_POOL_SIZE 128
+#define CELL_POOL_SIZE 256
+#define CELL_HASH_BITS 10
+#define DEFERRED_SET_SIZE 64
+
+/* Migrations in flight: in total, and for writing back idle blocks. */
+#define MAX_MIGRATIONS 64
+#define MAX_IDLE_WRITEBACKS 8
+
+#define COPY_PAGES 256
+#define WAKER_PERIOD HZ
+
+/*-----------------------------------------------------------------
+ * Deferred set.
+ *
+ * Keeps track of the bios in flight, so that a migration can wait for
+ * all io issued before it started.  Bios are counted in the current
+ * entry of a ring; queueing work moves new bios on to the next entry,
+ * and the work is handed back once all older entries have drained.
+ *---------------------------------------------------------------*/
+struct deferred_set;
+
+struct ds_entry {
+	struct deferred_set *ds;
+	unsigned count;
+	struct list_head work_items;
+};
+
+struct deferred_set {
+	spinlock_t lock;
+	unsigned current_entry;
+	unsigned sweeper;
+	struct ds_entry entries[DEFERRED_SET_SIZE];
+};
+
+static void ds_init(struct deferred_set *ds)
+{
+	unsigned i;
+
+	spin_lock_init(&ds->lock);
+	ds->current_entry = 0;
+	ds->sweeper = 0;
+	for (i = 0; i < DEFERRED_SET_SIZE; i++) {
+		ds->entries[i].ds = ds;
+		ds->entries[i].count = 0;
+		INIT_LIST_HEAD(&ds->entries[i].work_items);
+	}
+}
+
+static unsigned ds_next(unsigned index)
+{
+	return (index + 1) % DEFERRED_SET_SIZE;
+}
+
+static struct ds_entry *ds_inc(struct deferred_set *ds)
+{
+	unsigned long flags;
+	struct ds_entry *entry;
+
+	spin_lock_irqsave(&ds->lock, flags);
+	entry = ds->entries + ds->current_entry;
+	entry->count++;
+	spin_unlock_irqrestore(&ds->lock, flags);
+
+	return entry;
+}
+
+static void __ds_sweep(struct deferred_set *ds, struct list_head *head)
+{
+	while ((ds->sweeper != ds->current_entry) &&
+	       !ds->entries[ds->sweeper].count) {
+		list_splice_init(&ds->entries[ds->sweeper].work_items, head);
+		ds->sweeper = ds_next(ds->sweeper);
+	}
+
+	if ((ds->sweeper == ds->current_entry) && !ds->entries[ds->sweeper].count)
+		list_splice_init(&ds->entries[ds->sweeper].work_items, head);
+}
+
+static void ds_dec(struct ds_entry *entry, struct list_head *head)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&entry->ds->lock, flags);
+	BUG_ON(!entry->count);
+	--entry->count;
+	__ds_sweep(entry->ds, head);
+	spin_unlock_irqrestore(&entry->ds->lock, flags);
+}
+
+/*
+ * Returns 1 if the work has to wait for bios in flight, 0 if it can be
+ * done straight away.
+ */
+static int ds_add_work(struct deferred_set *ds, struct list_head *work)
+{
+	int r = 1;
+	unsigned long flags;
+	unsigned next_entry;
+
+	spin_lock_irqsave(&ds->lock, flags);
+	if ((ds->sweeper == ds->current_entry) &&
+	    !ds->entries[ds->current_entry].count)
+		r = 0;
+	else {
+		list_add(work, &ds->entries[ds->current_entry].work_items);
+		next_entry = ds_next(ds->current_entry);
+		if (!ds->entries[next_entry].count)
+			ds->current_entry = next_entry;
+	}
+	spin_unlock_irqrestore(&ds->lock, flags);
+
+	return r;
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Bios to an origin block that is being migrated are held in its cell.
+ */
+struct cell {
+	struct hlist_node list;
+	dm_oblock_t oblock;
+	struct bio_list bios;
+};
+
+enum migration_step {
+	MG_QUIESCE,	/* waiting for io to the blocks to drain */
+	MG_WRITEBACK,	/* copying dirty data back to the origin */
+	MG_REMOVE,	/* committing the removal of the old mapping */
+	MG_PROMOTE,	/* copying the new block into the cache */
+	MG_INSERT,	/* committing the new mapping */
+};
+
+struct dm_cache_migration {
+	struct list_head list;
+	struct cache *cache;
+
+	enum migration_step step;
+	bool writeback;
+	bool demote;
+	bool promote;
+	bool err;
+
+	dm_oblock_t old_oblock;
+	dm_oblock_t new_oblock;
+	dm_cblock_t cblock;
+
+	struct cell *old_cell;
+	struct cell *new_cell;
+};
+
+struct cache {
+	struct dm_target *ti;
+
+	struct dm_dev *metadata_dev;
+	struct dm_dev *origin_dev;
+	struct dm_dev *cache_dev;
+
+	sector_t origin_sectors;
+	dm_oblock_t origin_blocks;
+	dm_cblock_t cache_size;
+	sector_t sectors_per_block;
+	unsigned sectors_per_block_shift;
+
+	bool writethrough;
+
+	struct dm_cache_policy *policy;
+	struct dm_cache_metadata *cmd;
+
+	struct dm_kcopyd_client *copier;
+	struct dm_io_client *io_client;
+	struct workqueue_struct *wq;
+	struct work_struct worker;
+	struct delayed_work waker;
+
+	/*
+	 * Protects the policy, the cells, the dirty bits and the lists
+	 * below.
+	 */
+	spinlock_t lock;
+	struct bio_list deferred_bios;
+	struct list_head quiesced_migrations;
+	struct list_head completed_migrations;
+	struct hlist_head cells[1 << CELL_HASH_BITS];
+
+	struct deferred_set all_io_ds;
+
+	mempool_t *migration_pool;
+	mempool_t *cell_pool;
+
+	atomic_t nr_migrations;
+	wait_queue_head_t migration_wait;
+
+	/* Per cache block */
+	unsigned long *dirty_bitset;
+	dm_oblock_t *oblocks;
+	atomic_t nr_dirty;
+
+	bool loaded;
+	bool quiescing;
+
+	/* Idle detection for background writeback */
+	atomic_t nr_io;
+	bool idle;
+	dm_cblock_t writeback_cursor;
+
+	atomic_t read_hit;
+	atomic_t read_miss;
+	atomic_t write_hit;
+	atomic_t write_miss;
+	atomic_t demotion;
+	atomic_t promotion;
+	atomic_t writeback_count;
+};
+
+static struct kmem_cache *_migration_cache;
+static struct kmem_cache *_cell_cache;
+
+static void wake_worker(struct cache *cache)
+{
+	queue_work(cache->wq, &cache->worker);
+}
+
+/*----------------------------------------------------------------*/
+
+static struct hlist_head *cell_bucket(struct cache *cache, dm_oblock_t oblock)
+{
+	return cache->cells + hash_64((u64) oblock, CELL_HASH_BITS);
+}
+
+static struct cell *__cell_find(struct cache *cache, dm_oblock_t oblock)
+{
+	struct hlist_node *tmp;
+	struct cell *cell;
+
+	hlist_for_each_entry(cell, tmp, cell_bucket(cache, oblock), list)
+		if (cell->oblock == oblock)
+			return cell;
+
+	return NULL;
+}
+
+static void __cell_insert(struct cache *cache, struct cell *cell,
+			  dm_oblock_t oblock)
+{
+	cell->oblock = oblock;
+	bio_list_init(&cell->bios);
+	hlist_add_head(&cell->list, cell_bucket(cache, oblock));
+}
+
+/* Queues the held bios to be mapped again. */
+static void __cell_release(struct cache *cache, struct cell *cell)
+{
+	hlist_del(&cell->list);
+	bio_list_merge(&cache->deferred_bios, &cell->bios);
+}
+
+/*----------------------------------------------------------------*/
+
+static dm_oblock_t get_bio_block(struct cache *cache, struct bio *bio)
+{
+	return dm_target_offset(cache->ti, bio->bi_sector) >>
+		cache->sectors_per_block_shift;
+}
+
+static void remap_to_origin(struct cache *cache, struct bio *bio)
+{
+	bio->bi_bdev = cache->origin_dev->bdev;
+	bio->bi_sector = dm_target_offset(cache->ti, bio->bi_sector);
+}
+
+static void remap_to_cache(struct cache *cache, struct bio *bio,
+			   dm_cblock_t cblock)
+{
+	sector_t offset = dm_target_offset(cache->ti, bio->bi_sector);
+
+	bio->bi_bdev = cache->cache_dev->bdev;
+	bio->bi_sector = ((sector_t) cblock << cache->sectors_per_block_shift) |
+		(offset & (cache->sectors_per_block - 1));
+}
+
+static void __set_dirty(struct cache *cache, dm_cblock_t cblock)
+{
+	if (!test_and_set_bit(cblock, cache->dirty_bitset))
+		atomic_inc(&cache->nr_dirty);
+}
+
+static void __clear_dirty(struct cache *cache, dm_cblock_t cblock)
+{
+	if (test_and_clear_bit(cblock, cache->dirty_bitset))
+		atomic_dec(&cache->nr_dirty);
+}
+
+static void inc_hit_counter(struct cache *cache, struct bio *bio)
+{
+	atomic_inc(bio_data_dir(bio) == READ ?
+		   &cache->read_hit : &cache->write_hit);
+}
+
+static void inc_miss_counter(struct cache *cache, struct bio *bio)
+{
+	atomic_inc(bio_data_dir(bio) == READ ?
+		   &cache->read_miss : &cache->write_miss);
+}
+
+/*-----------------------------------------------------------------
+ * Writethrough: a write to a cached block goes to both devices.
+ *---------------------------------------------------------------*/
+static void writethrough_endio(unsigned long error, void *context)
+{
+	bio_endio(context, error ? -EIO : 0);
+}
+
+static void issue_writethrough(struct cache *cache, struct bio *bio,
+			       dm_cblock_t cblock)
+{
+	struct dm_io_region where[2];
+	struct dm_io_request io_req = {
+		.bi_rw = WRITE | (bio->bi_rw & REQ_FUA),
+		.mem.type = DM_IO_BVEC,
+		.mem.ptr.bvec = bio->bi_io_vec + bio->bi_idx,
+		.notify.fn = writethrough_endio,
+		.notify.context = bio,
+		.client = cache->io_client,
+	};
+
+	where[0].bdev = cache->origin_dev->bdev;
+	where[0].sector = dm_target_offset(cache->ti, bio->bi_sector);
+	where[0].count = bio_sectors(bio);
+
+	where[1].bdev = cache->cache_dev->bdev;
+	where[1].sector = ((sector_t) cblock << cache->sectors_per_block_shift) |
+		(where[0].sector & (cache->sectors_per_block - 1));
+	where[1].count = bio_sectors(bio);
+
+	BUG_ON(dm_io(&io_req, 2, where, NULL));
+}
+
+/*-----------------------------------------------------------------
+ * Migrations
+ *---------------------------------------------------------------*/
+struct commit_batch {
+	struct list_head migrations;
+	bool flush_origin;
+	bool flush_cache;
+};
+
+static void free_migration(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+
+	mempool_free(mg, cache->migration_pool);
+	if (atomic_dec_and_test(&cache->nr_migrations))
+		wake_up(&cache->migration_wait);
+}
+
+static void release_cells(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (mg->old_cell)
+		__cell_release(cache, mg->old_cell);
+	if (mg->new_cell)
+		__cell_release(cache, mg->new_cell);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (mg->old_cell)
+		mempool_free(mg->old_cell, cache->cell_pool);
+	if (mg->new_cell)
+		mempool_free(mg->new_cell, cache->cell_pool);
+
+	wake_worker(cache);
+}
+
+static void migration_success(struct dm_cache_migration *mg)
+{
+	release_cells(mg);
+	free_migration(mg);
+}
+
+/*
+ * Put things back the way they were before the migration, as far as
+ * the steps that completed allow.
+ */
+static void migration_failure(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	DMERR_LIMIT("migration of cache block %u failed at step %d",
+		    mg->cblock, mg->step);
+
+	switch (mg->step) {
+	case MG_REMOVE:
+		dm_cache_insert_mapping(cache->cmd, mg->cblock, mg->old_oblock);
+		/* fall through */
+	case MG_QUIESCE:
+	case MG_WRITEBACK:
+		if (mg->promote) {
+			spin_lock_irqsave(&cache->lock, flags);
+			cache->policy->remove_mapping(cache->policy,
+						      mg->new_oblock);
+			if (mg->demote)
+				cache->policy->load_mapping(cache->policy,
+							    mg->old_oblock,
+							    mg->cblock);
+			spin_unlock_irqrestore(&cache->lock, flags);
+		}
+		break;
+
+	case MG_INSERT:
+		dm_cache_remove_mapping(cache->cmd, mg->cblock);
+		/* fall through */
+	case MG_PROMOTE:
+		spin_lock_irqsave(&cache->lock, flags);
+		cache->policy->remove_mapping(cache->policy, mg->new_oblock);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		break;
+	}
+
+	release_cells(mg);
+	free_migration(mg);
+}
+
+static void copy_complete(int read_err, unsigned long write_err, void *context)
+{
+	struct dm_cache_migration *mg = context;
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	if (read_err || write_err)
+		mg->err = true;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_add_tail(&mg->list, &cache->completed_migrations);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+static void issue_copy(struct dm_cache_migration *mg, dm_oblock_t oblock,
+		       bool to_origin)
+{
+	struct cache *cache = mg->cache;
+	struct dm_io_region o_region, c_region;
+	sector_t sector = oblock << cache->sectors_per_block_shift;
+	int r;
+
+	o_region.bdev = cache->origin_dev->bdev;
+	o_region.sector = sector;
+	o_region.count = min(cache->sectors_per_block,
+			     cache->origin_sectors - sector);
+
+	c_region.bdev = cache->cache_dev->bdev;
+	c_region.sector = (sector_t) mg->cblock << cache->sectors_per_block_shift;
+	c_region.count = o_region.count;
+
+	if (to_origin)
+		r = dm_kcopyd_copy(cache->copier, &c_region, 1, &o_region, 0,
+				   copy_complete, mg);
+	else
+		r = dm_kcopyd_copy(cache->copier, &o_region, 1, &c_region, 0,
+				   copy_complete, mg);
+	if (r < 0)
+		copy_complete(1, 0, mg);
+}
+
+static void queue_commit(struct dm_cache_migration *mg,
+			 struct commit_batch *batch)
+{
+	list_add_tail(&mg->list, &batch->migrations);
+}
+
+static void migration_step_done(struct dm_cache_migration *mg,
+				struct commit_batch *batch)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	if (mg->err) {
+		migration_failure(mg);
+		return;
+	}
+
+	switch (mg->step) {
+	case MG_QUIESCE:
+		if (mg->writeback) {
+			mg->step = MG_WRITEBACK;
+			issue_copy(mg, mg->old_oblock, true);
+			return;
+		}
+		/* fall through */
+
+	case MG_WRITEBACK:
+		if (mg->demote) {
+			/*
+			 * The old mapping must be gone for good before the
+			 * cache block is overwritten, and written back data
+			 * must be on the origin before it goes.
+			 */
+			mg->step = MG_REMOVE;
+			dm_cache_remove_mapping(cache->cmd, mg->cblock);
+			batch->flush_origin |= mg->writeback;
+			queue_commit(mg, batch);
+			return;
+		}
+
+		if (mg->promote) {
+			mg->step = MG_PROMOTE;
+			issue_copy(mg, mg->new_oblock, false);
+			return;
+		}
+
+		/* Just cleaning the block. */
+		spin_lock_irqsave(&cache->lock, flags);
+		__clear_dirty(cache, mg->cblock);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		atomic_inc(&cache->writeback_count);
+		migration_success(mg);
+		return;
+
+	case MG_REMOVE:
+		spin_lock_irqsave(&cache->lock, flags);
+		__clear_dirty(cache, mg->cblock);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		atomic_inc(&cache->demotion);
+
+		mg->step = MG_PROMOTE;
+		issue_copy(mg, mg->new_oblock, false);
+		return;
+
+	case MG_PROMOTE:
+		/* The data must be on the cache before the mapping is. */
+		mg->step = MG_INSERT;
+		dm_cache_insert_mapping(cache->cmd, mg->cblock, mg->new_oblock);
+		batch->flush_cache = true;
+		queue_commit(mg, batch);
+		return;
+
+	case MG_INSERT:
+		cache->oblocks[mg->cblock] = mg->new_oblock;
+		atomic_inc(&cache->promotion);
+		migration_success(mg);
+		return;
+	}
+}
+
+static int commit(struct cache *cache, struct commit_batch *batch)
+{
+	int r;
+
+	if (batch->flush_origin) {
+		r = blkdev_issue_flush(cache->origin_dev->bdev, GFP_NOIO, NULL);
+		if (r)
+			return r;
+	}
+
+	if (batch->flush_cache) {
+		r = blkdev_issue_flush(cache->cache_dev->bdev, GFP_NOIO, NULL);
+		if (r)
+			return r;
+	}
+
+	return dm_cache_commit(cache->cmd);
+}
+
+static void process_migrations(struct cache *cache)
+{
+	unsigned long flags;
+	struct list_head list;
+	struct commit_batch batch;
+	struct dm_cache_migration *mg, *tmp;
+	int r;
+
+	INIT_LIST_HEAD(&list);
+	INIT_LIST_HEAD(&batch.migrations);
+	batch.flush_origin = false;
+	batch.flush_cache = false;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_splice_init(&cache->quiesced_migrations, &list);
+	list_splice_tail_init(&cache->completed_migrations, &list);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	list_for_each_entry_safe(mg, tmp, &list, list) {
+		list_del(&mg->list);
+		migration_step_done(mg, &batch);
+	}
+
+	if (list_empty(&batch.migrations))
+		return;
+
+	/* One flush and metadata write for all of them. */
+	r = commit(cache, &batch);
+	if (r)
+		DMERR_LIMIT("metadata commit failed %d", r);
+
+	list_for_each_entry_safe(mg, tmp, &batch.migrations, list) {
+		list_del(&mg->list);
+		if (r)
+			mg->err = true;
+		migration_step_done(mg, &batch);
+	}
+	BUG_ON(!list_empty(&batch.migrations));
+}
+
+/*
+ * The migration can start once all io issued before its cells were in
+ * place has completed.
+ */
+static void quiesce_migration(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	if (!ds_add_work(&cache->all_io_ds, &mg->list)) {
+		spin_lock_irqsave(&cache->lock, flags);
+		list_add_tail(&mg->list, &cache->quiesced_migrations);
+		spin_unlock_irqrestore(&cache->lock, flags);
+	}
+}
+
+/*-----------------------------------------------------------------
+ * Bio processing
+ *---------------------------------------------------------------*/
+struct prealloc {
+	struct dm_cache_migration *mg;
+	struct cell *cell1;
+	struct cell *cell2;
+};
+
+static void prealloc_fill(struct cache *cache, struct prealloc *p)
+{
+	if (!p->mg)
+		p->mg = mempool_alloc(cache->migration_pool, GFP_NOIO);
+	if (!p->cell1)
+		p->cell1 = mempool_alloc(cache->cell_pool, GFP_NOIO);
+	if (!p->cell2)
+		p->cell2 = mempool_alloc(cache->cell_pool, GFP_NOIO);
+}
+
+static void prealloc_free(struct cache *cache, struct prealloc *p)
+{
+	if (p->mg)
+		mempool_free(p->mg, cache->migration_pool);
+	if (p->cell1)
+		mempool_free(p->cell1, cache->cell_pool);
+	if (p->cell2)
+		mempool_free(p->cell2, cache->cell_pool);
+}
+
+static struct cell *prealloc_get_cell(struct prealloc *p)
+{
+	struct cell *cell = p->cell1;
+
+	if (cell)
+		p->cell1 = NULL;
+	else {
+		cell = p->cell2;
+		p->cell2 = NULL;
+	}
+
+	return cell;
+}
+
+static struct dm_cache_migration *prealloc_get_migration(struct cache *cache,
+							 struct prealloc *p)
+{
+	struct dm_cache_migration *mg = p->mg;
+
+	p->mg = NULL;
+	memset(mg, 0, sizeof(*mg));
+	mg->cache = cache;
+	mg->step = MG_QUIESCE;
+	atomic_inc(&cache->nr_migrations);
+
+	return mg;
+}
+
+static void __track_bio(struct cache *cache, struct bio *bio)
+{
+	dm_get_mapinfo(bio)->ptr = ds_inc(&cache->all_io_ds);
+}
+
+static void process_bio(struct cache *cache, struct prealloc *structs,
+			struct bio *bio)
+{
+	unsigned long flags;
+	dm_oblock_t oblock = get_bio_block(cache, bio);
+	struct policy_result lookup;
+	struct dm_cache_migration *mg;
+	struct cell *cell;
+	bool can_migrate;
+	int r;
+
+	spin_lock_irqsave(&cache->lock, flags);
+
+	cell = __cell_find(cache, oblock);
+	if (cell) {
+		bio_list_add(&cell->bios, bio);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		return;
+	}
+
+	can_migrate = !cache->quiescing &&
+		atomic_read(&cache->nr_migrations) < MAX_MIGRATIONS;
+	r = cache->policy->map(cache->policy, oblock, can_migrate,
+			       bio_data_dir(bio) == WRITE, &lookup);
+	if (r)
+		lookup.op = POLICY_MISS;
+
+	/*
+	 * The victim may be in the middle of being cleaned; leave this
+	 * one on the origin rather than wait.
+	 */
+	if (lookup.op == POLICY_REPLACE && __cell_find(cache, lookup.old_oblock)) {
+		cache->policy->remove_mapping(cache->policy, oblock);
+		cache->policy->load_mapping(cache->policy, lookup.old_oblock,
+					    lookup.cblock);
+		lookup.op = POLICY_MISS;
+	}
+
+	switch (lookup.op) {
+	case POLICY_HIT:
+		inc_hit_counter(cache, bio);
+		__track_bio(cache, bio);
+		if (bio_data_dir(bio) == WRITE && cache->writethrough) {
+			spin_unlock_irqrestore(&cache->lock, flags);
+			issue_writethrough(cache, bio, lookup.cblock);
+			return;
+		}
+		if (bio_data_dir(bio) == WRITE)
+			__set_dirty(cache, lookup.cblock);
+		remap_to_cache(cache, bio, lookup.cblock);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		generic_make_request(bio);
+		return;
+
+	case POLICY_MISS:
+		inc_miss_counter(cache, bio);
+		__track_bio(cache, bio);
+		remap_to_origin(cache, bio);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		generic_make_request(bio);
+		return;
+
+	case POLICY_NEW:
+	case POLICY_REPLACE:
+		inc_miss_counter(cache, bio);
+		mg = prealloc_get_migration(cache, structs);
+		mg->promote = true;
+		mg->new_oblock = oblock;
+		mg->cblock = lookup.cblock;
+		mg->new_cell = prealloc_get_cell(structs);
+		__cell_insert(cache, mg->new_cell, oblock);
+		bio_list_add(&mg->new_cell->bios, bio);
+
+		if (lookup.op == POLICY_REPLACE) {
+			mg->demote = true;
+			mg->writeback = test_bit(lookup.cblock,
+						 cache->dirty_bitset);
+			mg->old_oblock = lookup.old_oblock;
+			mg->old_cell = prealloc_get_cell(structs);
+			__cell_insert(cache, mg->old_cell, lookup.old_oblock);
+		}
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		quiesce_migration(mg);
+		return;
+	}
+}
+
+static void process_deferred_bios(struct cache *cache)
+{
+	unsigned long flags;
+	struct bio_list bios;
+	struct bio *bio;
+	struct prealloc structs;
+
+	memset(&structs, 0, sizeof(structs));
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&bios, &cache->deferred_bios);
+	bio_list_init(&cache->deferred_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	while ((bio = bio_list_pop(&bios))) {
+		/*
+		 * Take what a migration needs before the lock, as it
+		 * may have to wait for memory.
+		 */
+		prealloc_fill(cache, &structs);
+		process_bio(cache, &structs, bio);
+	}
+
+	prealloc_free(cache, &structs);
+}
+
+/*
+ * When no io has arrived for a while, write some dirty blocks back to
+ * the origin.
+ */
+static void writeback_some_dirty_blocks(struct cache *cache)
+{
+	unsigned long flags;
+	struct prealloc structs;
+	struct dm_cache_migration *mg;
+	dm_cblock_t cblock;
+	dm_oblock_t oblock;
+
+	if (!cache->idle)
+		return;
+
+	memset(&structs, 0, sizeof(structs));
+
+	while (atomic_read(&cache->nr_dirty) &&
+	       atomic_read(&cache->nr_migrations) < MAX_IDLE_WRITEBACKS) {
+		prealloc_fill(cache, &structs);
+
+		spin_lock_irqsave(&cache->lock, flags);
+		if (cache->quiescing) {
+			spin_unlock_irqrestore(&cache->lock, flags);
+			break;
+		}
+
+		cblock = find_next_bit(cache->dirty_bitset, cache->cache_size,
+				       cache->writeback_cursor);
+		if (cblock >= cache->cache_size)
+			cblock = find_first_bit(cache->dirty_bitset,
+						cache->cache_size);
+		if (cblock >= cache->cache_size) {
+			spin_unlock_irqrestore(&cache->lock, flags);
+			break;
+		}
+
+		oblock = cache->oblocks[cblock];
+		if (__cell_find(cache, oblock)) {
+			spin_unlock_irqrestore(&cache->lock, flags);
+			break;
+		}
+
+		mg = prealloc_get_migration(cache, &structs);
+		mg->writeback = true;
+		mg->old_oblock = oblock;
+		mg->cblock = cblock;
+		mg->old_cell = prealloc_get_cell(&structs);
+		__cell_insert(cache, mg->old_cell, oblock);
+		cache->writeback_cursor = cblock + 1;
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		quiesce_migration(mg);
+	}
+
+	prealloc_free(cache, &structs);
+}
+
+static void do_worker(struct work_struct *ws)
+{
+	struct cache *cache = container_of(ws, struct cache, worker);
+
+	process_deferred_bios(cache);
+	writeback_some_dirty_blocks(cache);
+	process_migrations(cache);
+}
+
+static void do_waker(struct work_struct *ws)
+{
+	struct cache *cache = container_of(to_delayed_work(ws), struct cache,
+					   waker);
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->policy->tick(cache->policy);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	cache->idle = !atomic_xchg(&cache->nr_io, 0);
+	if (cache->idle && atomic_read(&cache->nr_dirty))
+		wake_worker(cache);
+
+	queue_delayed_work(cache->wq, &cache->waker, WAKER_PERIOD);
+}
+
+/*-----------------------------------------------------------------
+ * Target methods
+ *---------------------------------------------------------------*/
+static void destroy(struct cache *cache)
+{
+	if (cache->wq)
+		destroy_workqueue(cache->wq);
+	if (cache->copier)
+		dm_kcopyd_client_destroy(cache->copier);
+	if (cache->io_client)
+		dm_io_client_destroy(cache->io_client);
+	if (cache->cell_pool)
+		mempool_destroy(cache->cell_pool);
+	if (cache->migration_pool)
+		mempool_destroy(cache->migration_pool);
+	if (cache->cmd)
+		dm_cache_metadata_close(cache->cmd);
+	if (cache->policy)
+		dm_cache_policy_destroy(cache->policy);
+	vfree(cache->oblocks);
+	vfree(cache->dirty_bitset);
+
+	if (cache->metadata_dev)
+		dm_put_device(cache->ti, cache->metadata_dev);
+	if (cache->origin_dev)
+		dm_put_device(cache->ti, cache->origin_dev);
+	if (cache->cache_dev)
+		dm_put_device(cache->ti, cache->cache_dev);
+
+	kfree(cache);
+}
+
+static void cache_dtr(struct dm_target *ti)
+{
+	destroy(ti->private);
+}
+
+static sector_t get_dev_size(struct dm_dev *dev)
+{
+	return i_size_read(dev->bdev->bd_inode) >> SECTOR_SHIFT;
+}
+
+static int parse_features(struct cache *cache, unsigned *argc, char ***argv)
+{
+	struct dm_target *ti = cache->ti;
+	unsigned long nr;
+	char *arg;
+
+	cache->writethrough = false;
+
+	if (!*argc || strict_strtoul((*argv)[0], 10, &nr) || nr > *argc - 1) {
+		ti->error = "Invalid number of feature arguments";
+		return -EINVAL;
+	}
+	(*argc)--;
+	(*argv)++;
+
+	while (nr--) {
+		arg = (*argv)[0];
+		(*argc)--;
+		(*argv)++;
+
+		if (!strcasecmp(arg, "writeback"))
+			cache->writethrough = false;
+		else if (!strcasecmp(arg, "writethrough"))
+			cache->writethrough = true;
+		else {
+			ti->error = "Unrecognised cache feature requested";
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int create_policy(struct cache *cache, unsigned argc, char **argv)
+{
+	struct dm_target *ti = cache->ti;
+	unsigned long nr;
+	int r;
+
+	if (argc < 2 || strict_strtoul(argv[1], 10, &nr) ||
+	    nr != argc - 2 || nr % 2) {
+		ti->error = "Invalid policy arguments";
+		return -EINVAL;
+	}
+
+	cache->policy = dm_cache_policy_create(argv[0], cache->cache_size,
+					       cache->origin_sectors,
+					       cache->sectors_per_block);
+	if (IS_ERR(cache->policy)) {
+		r = PTR_ERR(cache->policy);
+		cache->policy = NULL;
+		ti->error = "Error creating cache's policy";
+		return r;
+	}
+
+	for (argv += 2; nr; nr -= 2, argv += 2) {
+		r = cache->policy->set_config_value(cache->policy,
+						    argv[0], argv[1]);
+		if (r) {
+			ti->error = "Invalid policy argument";
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Construct a cache device mapping:
+ *
+ * cache <metadata dev> <cache dev> <origin dev> <block size>
+ *       <#feature args> [<feature arg>]*
+ *       <policy> <#policy args> [<policy arg>]*
+ *
+ * The block size is in sectors, a power of two of at least a page.
+ * Feature args: writeback (the default) or writethrough.
+ */
+static int cache_ctr(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct cache *cache;
+	fmode_t mode = dm_table_get_mode(ti->table);
+	unsigned long block_size;
+	sector_t cache_blocks;
+	unsigned i;
+	int r = -EINVAL;
+
+	if (argc < 7) {
+		ti->error = "Insufficient arguments";
+		return -EINVAL;
+	}
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache) {
+		ti->error = "Cannot allocate cache context";
+		return -ENOMEM;
+	}
+	cache->ti = ti;
+	ti->private = cache;
+
+	if (dm_get_device(ti, argv[0], mode, &cache->metadata_dev)) {
+		ti->error = "Error opening metadata device";
+		goto bad;
+	}
+
+	if (dm_get_device(ti, argv[1], mode, &cache->cache_dev)) {
+		ti->error = "Error opening cache device";
+		goto bad;
+	}
+
+	if (dm_get_device(ti, argv[2], mode, &cache->origin_dev)) {
+		ti->error = "Error opening origin device";
+		goto bad;
+	}
+
+	cache->origin_sectors = ti->len;
+	if (get_dev_size(cache->origin_dev) < ti->len) {
+		ti->error = "Device lookup failed: origin device too small";
+		goto bad;
+	}
+
+	if (strict_strtoul(argv[3], 10, &block_size) ||
+	    block_size < (PAGE_SIZE >> SECTOR_SHIFT) ||
+	    !is_power_of_2(block_size)) {
+		ti->error = "Invalid data block size";
+		goto bad;
+	}
+	cache->sectors_per_block = block_size;
+	cache->sectors_per_block_shift = __ffs(block_size);
+	cache->origin_blocks = dm_div_up(ti->len, block_size);
+
+	cache_blocks = get_dev_size(cache->cache_dev) >>
+		cache->sectors_per_block_shift;
+	if (!cache_blocks || cache_blocks > (dm_cblock_t) -1) {
+		ti->error = "Invalid cache device size";
+		goto bad;
+	}
+	cache->cache_size = cache_blocks;
+
+	if (get_dev_size(cache->metadata_dev) <
+	    dm_cache_metadata_size(cache->cache_size)) {
+		ti->error = "Metadata device too small";
+		goto bad;
+	}
+
+	argc -= 4;
+	argv += 4;
+	r = parse_features(cache, &argc, &argv);
+	if (r)
+		goto bad;
+
+	r = create_policy(cache, argc, argv);
+	if (r)
+		goto bad;
+
+	r = -ENOMEM;
+	cache->dirty_bitset = vzalloc(BITS_TO_LONGS(cache->cache_size) *
+				      sizeof(unsigned long));
+	cache->oblocks = vmalloc(cache->cache_size * sizeof(*cache->oblocks));
+	if (!cache->dirty_bitset || !cache->oblocks) {
+		ti->error = "Cannot allocate per block state";
+		goto bad;
+	}
+
+	cache->cmd = dm_cache_metadata_open(cache->metadata_dev->bdev,
+					    cache->sectors_per_block,
+					    cache->cache_size);
+	if (IS_ERR(cache->cmd)) {
+		r = PTR_ERR(cache->cmd);
+		cache->cmd = NULL;
+		ti->error = "Error opening metadata";
+		goto bad;
+	}
+
+	cache->migration_pool = mempool_create_slab_pool(MIGRATION_POOL_SIZE,
+							 _migration_cache);
+	cache->cell_pool = mempool_create_slab_pool(CELL_POOL_SIZE,
+						    _cell_cache);
+	if (!cache->migration_pool || !cache->cell_pool) {
+		ti->error = "Cannot allocate mempools";
+		goto bad;
+	}
+
+	cache->io_client = dm_io_client_create(1);
+	if (IS_ERR(cache->io_client)) {
+		r = PTR_ERR(cache->io_client);
+		cache->io_client = NULL;
+		ti->error = "Cannot allocate io client";
+		goto bad;
+	}
+
+	r = dm_kcopyd_client_create(COPY_PAGES, &cache->copier);
+	if (r) {
+		cache->copier = NULL;
+		ti->error = "Cannot allocate kcopyd client";
+		goto bad;
+	}
+
+	r = -ENOMEM;
+	cache->wq = alloc_ordered_workqueue("dm-" DM_MSG_PREFIX,
+					    WQ_MEM_RECLAIM);
+	if (!cache->wq) {
+		ti->error = "Cannot allocate workqueue";
+		goto bad;
+	}
+	INIT_WORK(&cache->worker, do_worker);
+	INIT_DELAYED_WORK(&cache->waker, do_waker);
+
+	spin_lock_init(&cache->lock);
+	bio_list_init(&cache->deferred_bios);
+	INIT_LIST_HEAD(&cache->quiesced_migrations);
+	INIT_LIST_HEAD(&cache->completed_migrations);
+	for (i = 0; i < ARRAY_SIZE(cache->cells); i++)
+		INIT_HLIST_HEAD(cache->cells + i);
+	ds_init(&cache->all_io_ds);
+	atomic_set(&cache->nr_migrations, 0);
+	init_waitqueue_head(&cache->migration_wait);
+	atomic_set(&cache->nr_dirty, 0);
+	cache->quiescing = true;
+
+	ti->split_io = cache->sectors_per_block;
+	ti->num_flush_requests = 2;
+
+	return 0;
+
+bad:
+	destroy(cache);
+	return r;
+}
+
+static int cache_map(struct dm_target *ti, struct bio *bio,
+		     union map_info *map_context)
+{
+	struct cache *cache = ti->private;
+	unsigned long flags;
+	dm_oblock_t oblock;
+	struct policy_result lookup;
+	int r;
+
+	if (bio->bi_rw & REQ_FLUSH) {
+		BUG_ON(bio->bi_size);
+		if (!map_context->target_request_nr)
+			bio->bi_bdev = cache->origin_dev->bdev;
+		else
+			bio->bi_bdev = cache->cache_dev->bdev;
+		map_context->ptr = NULL;
+		return DM_MAPIO_REMAPPED;
+	}
+
+	map_context->ptr = NULL;
+	oblock = get_bio_block(cache, bio);
+	atomic_inc(&cache->nr_io);
+
+	spin_lock_irqsave(&cache->lock, flags);
+
+	if (__cell_find(cache, oblock))
+		goto defer;
+
+	r = cache->policy->map(cache->policy, oblock, false,
+			       bio_data_dir(bio) == WRITE, &lookup);
+	if (r == -EWOULDBLOCK)
+		goto defer;
+
+	if (lookup.op == POLICY_HIT) {
+		if (bio_data_dir(bio) == WRITE) {
+			if (cache->writethrough)
+				goto defer;
+			__set_dirty(cache, lookup.cblock);
+		}
+		inc_hit_counter(cache, bio);
+		remap_to_cache(cache, bio, lookup.cblock);
+	} else {
+		inc_miss_counter(cache, bio);
+		remap_to_origin(cache, bio);
+	}
+
+	map_context->ptr = ds_inc(&cache->all_io_ds);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	return DM_MAPIO_REMAPPED;
+
+defer:
+	bio_list_add(&cache->deferred_bios, bio);
+	spin_unlock_irqrestore(&cache->lock, flags);
+	wake_worker(cache);
+
+	return DM_MAPIO_SUBMITTED;
+}
+
+static int cache_end_io(struct dm_target *ti, struct bio *bio,
+			int error, union map_info *map_context)
+{
+	struct cache *cache = ti->private;
+	struct ds_entry *entry = map_context->ptr;
+	unsigned long flags;
+	LIST_HEAD(work);
+
+	if (!entry)
+		return error;
+
+	ds_dec(entry, &work);
+	if (!list_empty(&work)) {
+		spin_lock_irqsave(&cache->lock, flags);
+		list_splice_tail(&work, &cache->quiesced_migrations);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		wake_worker(cache);
+	}
+
+	return error;
+}
+
+static void cache_presuspend(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+	unsigned long flags;
+
+	/* Only io already in the cells gets migrated from now on. */
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->quiescing = true;
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	cancel_delayed_work_sync(&cache->waker);
+}
+
+static void cache_postsuspend(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+	int r;
+
+	wait_event(cache->migration_wait, !atomic_read(&cache->nr_migrations));
+	flush_workqueue(cache->wq);
+
+	if (!cache->loaded)
+		return;
+
+	/* Everything written back so far must be on the origin. */
+	r = blkdev_issue_flush(cache->origin_dev->bdev, GFP_NOIO, NULL);
+	if (!r)
+		r = blkdev_issue_flush(cache->cache_dev->bdev, GFP_NOIO, NULL);
+	if (!r)
+		r = dm_cache_set_clean(cache->cmd, cache->dirty_bitset);
+	if (r)
+		DMERR("could not write clean shutdown metadata: %d", r);
+}
+
+static int load_mapping(void *context, dm_oblock_t oblock,
+			dm_cblock_t cblock, bool dirty)
+{
+	struct cache *cache = context;
+	int r;
+
+	if (oblock >= cache->origin_blocks) {
+		DMERR("mapping of cache block %u beyond the end of the origin",
+		      cblock);
+		return -EINVAL;
+	}
+
+	r = cache->policy->load_mapping(cache->policy, oblock, cblock);
+	if (r)
+		return r;
+
+	cache->oblocks[cblock] = oblock;
+	if (dirty)
+		__set_dirty(cache, cblock);
+
+	return 0;
+}
+
+static int cache_preresume(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+	int r;
+
+	if (!cache->loaded) {
+		r = dm_cache_load_mappings(cache->cmd, load_mapping, cache);
+		if (r) {
+			DMERR("could not load cache mappings: %d", r);
+			return r;
+		}
+		cache->loaded = true;
+	}
+
+	r = dm_cache_set_unclean(cache->cmd);
+	if (r)
+		DMERR("could not mark metadata in use: %d", r);
+
+	return r;
+}
+
+static void cache_resume(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->quiescing = false;
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	queue_delayed_work(cache->wq, &cache->waker, WAKER_PERIOD);
+}
+
+static int cache_status(struct dm_target *ti, status_type_t type,
+			char *result, unsigned maxlen)
+{
+	struct cache *cache = ti->private;
+	unsigned long flags;
+	dm_cblock_t residency;
+	unsigned sz = 0;
+	char buf[BDEVNAME_SIZE];
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		spin_lock_irqsave(&cache->lock, flags);
+		residency = cache->policy->residency(cache->policy);
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		DMEMIT("%u/%u %u %u %u %u %u %u %u %u",
+		       residency, cache->cache_size,
+		       atomic_read(&cache->read_hit),
+		       atomic_read(&cache->read_miss),
+		       atomic_read(&cache->write_hit),
+		       atomic_read(&cache->write_miss),
+		       atomic_read(&cache->demotion),
+		       atomic_read(&cache->promotion),
+		       atomic_read(&cache->writeback_count),
+		       atomic_read(&cache->nr_dirty));
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s ", format_dev_t(buf, cache->metadata_dev->bdev->bd_dev));
+		DMEMIT("%s ", format_dev_t(buf, cache->cache_dev->bdev->bd_dev));
+		DMEMIT("%s ", format_dev_t(buf, cache->origin_dev->bdev->bd_dev));
+		DMEMIT("%llu 1 %s %s ",
+		       (unsigned long long) cache->sectors_per_block,
+		       cache->writethrough ? "writethrough" : "writeback",
+		       dm_cache_policy_get_name(cache->policy));
+
+		spin_lock_irqsave(&cache->lock, flags);
+		cache->policy->emit_config_values(cache->policy, result + sz,
+						  maxlen - sz);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Policy tunables can be changed on a live device:
+ *   dmsetup message <device> 0 <key> <value>
+ */
+static int cache_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct cache *cache = ti->private;
+	unsigned long flags;
+	int r;
+
+	if (argc != 2)
+		return -EINVAL;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	r = cache->policy->set_config_value(cache->policy, argv[0], argv[1]);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	return r;
+}
+
+static int cache_iterate_devices(struct dm_target *ti,
+				 iterate_devices_callout_fn fn, void *data)
+{
+	struct cache *cache = ti->private;
+	int r;
+
+	r = fn(ti, cache->cache_dev, 0, get_dev_size(cache->cache_dev), data);
+	if (!r)
+		r = fn(ti, cache->origin_dev, 0, ti->len, data);
+
+	return r;
+}
+
+static struct target_type cache_target = {
+	.name = "cache",
+	.version = {1, 0, 0},
+	.module = THIS_MODULE,
+	.ctr = cache_ctr,
+	.dtr = cache_dtr,
+	.map = cache_map,
+	.end_io = cache_end_io,
+	.presuspend = cache_presuspend,
+	.postsuspend = cache_postsuspend,
+	.preresume = cache_preresume,
+	.resume = cache_resume,
+	.status = cache_status,
+	.message = cache_message,
+	.iterate_devices = cache_iterate_devices,
+};
+
+static int __init dm_cache_init(void)
+{
+	int r;
+
+	_migration_cache = KMEM_CACHE(dm_cache_migration, 0);
+	if (!_migration_cache)
+		return -ENOMEM;
+
+	_cell_cache = kmem_cache_create("dm_cache_cell", sizeof(struct cell),
+					__alignof__(struct cell), 0, NULL);
+	if (!_cell_cache) {
+		r = -ENOMEM;
+		goto bad_cell_cache;
+	}
+
+	r = dm_register_target(&cache_target);
+	if (r) {
+		DMERR("cache target registration failed: %d", r);
+		goto bad_register;
+	}
+
+	return 0;
+
+bad_register:
+	kmem_cache_destroy(_cell_cache);
+bad_cell_cache:
+	kmem_cache_destroy(_migration_cache);
+	return r;
+}
+
+static void __exit dm_cache_exit(void)
+{
+	dm_unregister_target(&cache_target);
+	kmem_cache_destroy(_cell_cache);
+	kmem_cache_destroy(_migration_cache);
+}
+
+module_init(dm_cache_init);
+module_exit(dm_cache_exit);
+
+MODULE_DESCRIPTION(DM_NAME " cache target");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,1252 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#include "dm-thin-metadata.h"
+
+#include <linux/blkdev.h>
+#include <linux/dm-io.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "thin metadata"
+
+/*-----------------------------------------------------------------
+ * On disk layout
+ *
+ * The metadata device is divided into 4k blocks.  Block 0 holds the
+ * superblock, which points at a block listing the thin devices and the
+ * root of each one's mapping tree.
+ *
+ * A mapping tree is a fixed depth radix tree: every node is an array
+ * of 512 little-endian 64-bit entries, indexed by 9 bits of the virtual
+ * block number.  Entries of interior nodes hold the metadata block of a
+ * child node, leaf entries the data block plus one.  Zero means nothing
+ * is mapped there.
+ *
+ * Nodes are never changed in place once they have been committed.  A
+ * change copies ("shadows") the path from the root to the leaf, and the
+ * new copies are written out before the superblock that makes them
+ * live.  A node that is shared with a snapshot has a reference count
+ * greater than one; shadowing it takes a reference on each of its
+ * children, which is what lets snapshots share subtrees.
+ *
+ * Reference counts are not stored.  They are rebuilt by walking the
+ * trees when the metadata is opened, which makes a commit no more than
+ * the new nodes and one sector of superblock.
+ *---------------------------------------------------------------*/
+
+/* "dmTp" */
+#define THIN_MAGIC 0x70546d64
+#define THIN_METADATA_VERSION 1
+
+#define SUPERBLOCK_LOCATION 0
+
+#define NODE_SHIFT 9
+#define ENTRIES_PER_NODE (1 << NODE_SHIFT)
+#define TREE_LEVELS 4
+
+/* device flags */
+#define DEVICE_VALID (1 << 0)
+
+/* Enough new nodes for one insertion. */
+#define NR_SPARE_BLOCKS TREE_LEVELS
+
+struct thin_disk_superblock {
+	__le32 magic;
+	__le32 version;
+	__le64 transaction_id;
+
+	/* In sectors */
+	__le32 data_block_size;
+	__le32 padding;
+
+	__le64 nr_data_blocks;
+	__le64 dev_table;
+} __packed;
+
+struct thin_disk_device {
+	__le64 root;
+	__le64 mapped_blocks;
+	__le32 dev_id;
+	__le32 flags;
+} __packed;
+
+/*
+ * Reference counts for the blocks of a device.
+ */
+struct space_map {
+	dm_block_t nr_blocks;
+	dm_block_t nr_free;
+	dm_block_t hint;
+	uint32_t *refs;
+
+	/*
+	 * Blocks freed since the last commit.  The committed metadata may
+	 * still use them, so they are not handed out again yet.
+	 */
+	unsigned long *freed;
+
+	/*
+	 * Blocks that can not be allocated, because they are referenced
+	 * or in freed, so that allocation searches a word at a time.
+	 */
+	unsigned long *used;
+};
+
+struct dm_thin_device {
+	struct list_head list;
+	struct dm_pool_metadata *pmd;
+
+	dm_thin_id id;
+	int open_count;
+	dm_block_t root;
+	dm_block_t mapped_blocks;
+};
+
+struct dm_pool_metadata {
+	struct block_device *bdev;
+	struct dm_io_client *io_client;
+
+	/*
+	 * lock serialises changes and commits.  tree_lock is also taken
+	 * for the changes, so that lookups can run alongside them without
+	 * sleeping.
+	 */
+	struct mutex lock;
+	rwlock_t tree_lock;
+
+	bool fail_io;
+	bool changed;
+
+	sector_t data_block_size;
+	uint64_t transaction_id;
+	dm_block_t dev_table;
+
+	/*
+	 * The in core copy of each metadata block in use, and those of
+	 * them created since the last commit, which may be changed in
+	 * place and must be written by the next one.
+	 */
+	void **blocks;
+	unsigned long *shadowed;
+
+	void *spare[NR_SPARE_BLOCKS];
+	unsigned nr_spare;
+
+	struct space_map metadata_sm;
+	struct space_map data_sm;
+
+	struct list_head thin_devices;
+	unsigned nr_thin_devices;
+};
+
+/*----------------------------------------------------------------*/
+
+static unsigned long *alloc_bitset(dm_block_t nr_bits)
+{
+	return vzalloc(BITS_TO_LONGS(nr_bits) * sizeof(unsigned long));
+}
+
+static int sm_init(struct space_map *sm, dm_block_t nr_blocks)
+{
+	sm->nr_blocks = nr_blocks;
+	sm->nr_free = nr_blocks;
+	sm->hint = 0;
+	sm->refs = vzalloc(nr_blocks * sizeof(*sm->refs));
+	sm->freed = alloc_bitset(nr_blocks);
+	sm->used = alloc_bitset(nr_blocks);
+
+	return (sm->refs && sm->freed && sm->used) ? 0 : -ENOMEM;
+}
+
+static void sm_destroy(struct space_map *sm)
+{
+	vfree(sm->used);
+	vfree(sm->freed);
+	vfree(sm->refs);
+}
+
+/*
+ * Hands out the first usable block at or after the hint, so that
+ * consecutive allocations are contiguous on the device.
+ */
+static int sm_alloc(struct space_map *sm, dm_block_t *result)
+{
+	unsigned long b;
+
+	if (!sm->nr_free)
+		return -ENOSPC;
+
+	b = find_next_zero_bit(sm->used, sm->nr_blocks, sm->hint);
+	if (b >= sm->nr_blocks)
+		b = find_first_zero_bit(sm->used, sm->nr_blocks);
+	if (b >= sm->nr_blocks)
+		return -ENOSPC;	/* all the free blocks are in freed */
+
+	sm->refs[b] = 1;
+	sm->nr_free--;
+	set_bit(b, sm->used);
+	sm->hint = b + 1;
+	*result = b;
+
+	return 0;
+}
+
+static void sm_inc(struct space_map *sm, dm_block_t b)
+{
+	if (!sm->refs[b]++) {
+		sm->nr_free--;
+		set_bit(b, sm->used);
+	}
+}
+
+/* Returns true if the block is now free. */
+static bool sm_dec(struct space_map *sm, dm_block_t b)
+{
+	BUG_ON(!sm->refs[b]);
+	if (--sm->refs[b])
+		return false;
+
+	sm->nr_free++;
+	set_bit(b, sm->freed);
+	return true;
+}
+
+static void sm_commit(struct space_map *sm)
+{
+	unsigned long b;
+
+	for (b = find_first_bit(sm->freed, sm->nr_blocks); b < sm->nr_blocks;
+	     b = find_next_bit(sm->freed, sm->nr_blocks, b + 1))
+		if (!sm->refs[b])
+			clear_bit(b, sm->used);
+
+	bitmap_zero(sm->freed, sm->nr_blocks);
+}
+
+/*-----------------------------------------------------------------
+ * Block io
+ *---------------------------------------------------------------*/
+static int block_io(struct dm_pool_metadata *pmd, int rw, dm_block_t b,
+		    void *data, sector_t count)
+{
+	struct dm_io_region where = {
+		.bdev = pmd->bdev,
+		.sector = b * THIN_METADATA_BLOCK_SECTORS,
+		.count = count,
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = rw,
+		.mem.type = DM_IO_KMEM,
+		.mem.ptr.addr = data,
+		.client = pmd->io_client,
+		.notify.fn = NULL,
+	};
+
+	return dm_io(&io_req, 1, &where, NULL);
+}
+
+static int read_block(struct dm_pool_metadata *pmd, dm_block_t b)
+{
+	int r;
+
+	pmd->blocks[b] = kmalloc(THIN_METADATA_BLOCK_SIZE, GFP_KERNEL);
+	if (!pmd->blocks[b])
+		return -ENOMEM;
+
+	r = block_io(pmd, READ, b, pmd->blocks[b], THIN_METADATA_BLOCK_SECTORS);
+	if (r) {
+		kfree(pmd->blocks[b]);
+		pmd->blocks[b] = NULL;
+	}
+
+	return r;
+}
+
+struct write_batch {
+	atomic_t count;
+	int error;
+	struct completion done;
+};
+
+static void write_batch_dec(struct write_batch *wb)
+{
+	if (atomic_dec_and_test(&wb->count))
+		complete(&wb->done);
+}
+
+static void block_written(unsigned long error, void *context)
+{
+	struct write_batch *wb = context;
+
+	if (error)
+		wb->error = -EIO;
+	write_batch_dec(wb);
+}
+
+/* Write all the blocks created since the last commit. */
+static int write_shadowed_blocks(struct dm_pool_metadata *pmd)
+{
+	struct write_batch wb;
+	struct dm_io_region where;
+	struct dm_io_request io_req = {
+		.bi_rw = WRITE,
+		.mem.type = DM_IO_KMEM,
+		.notify.fn = block_written,
+		.notify.context = &wb,
+		.client = pmd->io_client,
+	};
+	dm_block_t nr_blocks = pmd->metadata_sm.nr_blocks;
+	unsigned long b;
+	int r;
+
+	atomic_set(&wb.count, 1);
+	wb.error = 0;
+	init_completion(&wb.done);
+
+	where.bdev = pmd->bdev;
+	where.count = THIN_METADATA_BLOCK_SECTORS;
+
+	for (b = find_first_bit(pmd->shadowed, nr_blocks); b < nr_blocks;
+	     b = find_next_bit(pmd->shadowed, nr_blocks, b + 1)) {
+		where.sector = (sector_t) b * THIN_METADATA_BLOCK_SECTORS;
+		io_req.mem.ptr.addr = pmd->blocks[b];
+
+		atomic_inc(&wb.count);
+		r = dm_io(&io_req, 1, &where, NULL);
+		if (r) {
+			wb.error = r;
+			write_batch_dec(&wb);
+			break;
+		}
+	}
+
+	write_batch_dec(&wb);
+	wait_for_completion(&wb.done);
+
+	return wb.error;
+}
+
+/*-----------------------------------------------------------------
+ * Metadata blocks
+ *---------------------------------------------------------------*/
+static __le64 *node(struct dm_pool_metadata *pmd, dm_block_t b)
+{
+	return pmd->blocks[b];
+}
+
+static struct thin_disk_superblock *superblock(struct dm_pool_metadata *pmd)
+{
+	return pmd->blocks[SUPERBLOCK_LOCATION];
+}
+
+/*
+ * New blocks are taken from the spares, so that changes can be made
+ * under tree_lock.
+ */
+static int prepare_spares(struct dm_pool_metadata *pmd)
+{
+	while (pmd->nr_spare < NR_SPARE_BLOCKS) {
+		void *data = kmalloc(THIN_METADATA_BLOCK_SIZE, GFP_NOIO);
+
+		if (!data)
+			return -ENOMEM;
+		pmd->spare[pmd->nr_spare++] = data;
+	}
+
+	return 0;
+}
+
+static int new_block(struct dm_pool_metadata *pmd, bool zero,
+		     dm_block_t *result)
+{
+	int r;
+
+	BUG_ON(!pmd->nr_spare);
+
+	r = sm_alloc(&pmd->metadata_sm, result);
+	if (r) {
+		DMERR_LIMIT("metadata device is full");
+		return r;
+	}
+
+	pmd->blocks[*result] = pmd->spare[--pmd->nr_spare];
+	if (zero)
+		memset(pmd->blocks[*result], 0, THIN_METADATA_BLOCK_SIZE);
+	set_bit(*result, pmd->shadowed);
+
+	return 0;
+}
+
+static void free_block(struct dm_pool_metadata *pmd, dm_block_t b)
+{
+	kfree(pmd->blocks[b]);
+	pmd->blocks[b] = NULL;
+	clear_bit(b, pmd->shadowed);
+}
+
+static bool is_leaf(unsigned level)
+{
+	return level == TREE_LEVELS - 1;
+}
+
+static unsigned node_index(dm_block_t block, unsigned level)
+{
+	return (block >> (NODE_SHIFT * (TREE_LEVELS - 1 - level))) &
+		(ENTRIES_PER_NODE - 1);
+}
+
+static void inc_children(struct dm_pool_metadata *pmd, dm_block_t b,
+			 unsigned level)
+{
+	__le64 *n = node(pmd, b);
+	uint64_t e;
+	unsigned i;
+
+	for (i = 0; i < ENTRIES_PER_NODE; i++) {
+		e = le64_to_cpu(n[i]);
+		if (!e)
+			continue;
+
+		if (is_leaf(level))
+			sm_inc(&pmd->data_sm, e - 1);
+		else
+			sm_inc(&pmd->metadata_sm, e);
+	}
+}
+
+/* Drop a reference to a node, and to its children if it is freed. */
+static void dec_node(struct dm_pool_metadata *pmd, dm_block_t b,
+		     unsigned level)
+{
+	__le64 *n = node(pmd, b);
+	uint64_t e;
+	unsigned i;
+
+	if (!sm_dec(&pmd->metadata_sm, b))
+		return;
+
+	for (i = 0; i < ENTRIES_PER_NODE; i++) {
+		e = le64_to_cpu(n[i]);
+		if (!e)
+			continue;
+
+		if (is_leaf(level))
+			sm_dec(&pmd->data_sm, e - 1);
+		else
+			dec_node(pmd, e, level + 1);
+	}
+
+	free_block(pmd, b);
+}
+
+/*
+ * Returns a copy of node b that may be changed.  The caller replaces
+ * its reference to b with one to the copy.
+ */
+static int shadow_node(struct dm_pool_metadata *pmd, dm_block_t b,
+		       unsigned level, dm_block_t *result)
+{
+	int r;
+
+	if (test_bit(b, pmd->shadowed) && pmd->metadata_sm.refs[b] == 1) {
+		*result = b;
+		return 0;
+	}
+
+	r = new_block(pmd, false, result);
+	if (r)
+		return r;
+	memcpy(node(pmd, *result), node(pmd, b), THIN_METADATA_BLOCK_SIZE);
+
+	if (sm_dec(&pmd->metadata_sm, b))
+		/* The copy inherits the only reference to the children. */
+		free_block(pmd, b);
+	else
+		inc_children(pmd, *result, level);
+
+	return 0;
+}
+
+/*
+ * Take references on everything reachable from node b, reading in
+ * each node the first time it is reached.
+ */
+static int load_tree(struct dm_pool_metadata *pmd, dm_block_t b,
+		     unsigned level)
+{
+	__le64 *n;
+	uint64_t e;
+	unsigned i;
+	int r;
+
+	if (b == SUPERBLOCK_LOCATION || b >= pmd->metadata_sm.nr_blocks) {
+		DMERR("node %llu out of range", (unsigned long long) b);
+		return -EINVAL;
+	}
+
+	sm_inc(&pmd->metadata_sm, b);
+	if (pmd->metadata_sm.refs[b] > 1)
+		return 0;
+
+	r = read_block(pmd, b);
+	if (r)
+		return r;
+
+	n = node(pmd, b);
+	for (i = 0; i < ENTRIES_PER_NODE; i++) {
+		e = le64_to_cpu(n[i]);
+		if (!e)
+			continue;
+
+		if (!is_leaf(level)) {
+			r = load_tree(pmd, e, level + 1);
+			if (r)
+				return r;
+
+		} else if (e - 1 < pmd->data_sm.nr_blocks)
+			sm_inc(&pmd->data_sm, e - 1);
+
+		else {
+			DMERR("data block %llu out of range",
+			      (unsigned long long) e - 1);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Thin devices
+ *---------------------------------------------------------------*/
+static struct dm_thin_device *__find_device(struct dm_pool_metadata *pmd,
+					    dm_thin_id dev)
+{
+	struct dm_thin_device *td;
+
+	list_for_each_entry(td, &pmd->thin_devices, list)
+		if (td->id == dev)
+			return td;
+
+	return NULL;
+}
+
+static int __add_device(struct dm_pool_metadata *pmd, dm_thin_id dev,
+			dm_block_t root, dm_block_t mapped_blocks,
+			struct dm_thin_device **result)
+{
+	struct dm_thin_device *td;
+
+	if (pmd->nr_thin_devices >= THIN_MAX_DEVICES)
+		return -ENOSPC;
+
+	td = kzalloc(sizeof(*td), GFP_NOIO);
+	if (!td)
+		return -ENOMEM;
+
+	td->pmd = pmd;
+	td->id = dev;
+	td->root = root;
+	td->mapped_blocks = mapped_blocks;
+	list_add_tail(&td->list, &pmd->thin_devices);
+	pmd->nr_thin_devices++;
+
+	if (result)
+		*result = td;
+
+	return 0;
+}
+
+static void __remove_device(struct dm_pool_metadata *pmd,
+			    struct dm_thin_device *td)
+{
+	list_del(&td->list);
+	pmd->nr_thin_devices--;
+	kfree(td);
+}
+
+static int load_devices(struct dm_pool_metadata *pmd)
+{
+	struct thin_disk_device *disk;
+	unsigned i;
+	int r;
+
+	if (pmd->dev_table == SUPERBLOCK_LOCATION ||
+	    pmd->dev_table >= pmd->metadata_sm.nr_blocks) {
+		DMERR("device table out of range");
+		return -EINVAL;
+	}
+
+	sm_inc(&pmd->metadata_sm, pmd->dev_table);
+	r = read_block(pmd, pmd->dev_table);
+	if (r)
+		return r;
+
+	disk = pmd->blocks[pmd->dev_table];
+	for (i = 0; i < THIN_MAX_DEVICES; i++, disk++) {
+		dm_block_t root = le64_to_cpu(disk->root);
+
+		if (!(le32_to_cpu(disk->flags) & DEVICE_VALID))
+			continue;
+
+		if (root) {
+			r = load_tree(pmd, root, 0);
+			if (r)
+				return r;
+		}
+
+		r = __add_device(pmd, le32_to_cpu(disk->dev_id), root,
+				 le64_to_cpu(disk->mapped_blocks), NULL);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+/*
+ * The device table is written to a new block on each commit, like any
+ * other committed block it must not be overwritten.
+ */
+static int __write_dev_table(struct dm_pool_metadata *pmd)
+{
+	struct thin_disk_device *disk;
+	struct dm_thin_device *td;
+	dm_block_t b;
+	int r;
+
+	r = new_block(pmd, true, &b);
+	if (r)
+		return r;
+
+	disk = pmd->blocks[b];
+	list_for_each_entry(td, &pmd->thin_devices, list) {
+		disk->root = cpu_to_le64(td->root);
+		disk->mapped_blocks = cpu_to_le64(td->mapped_blocks);
+		disk->dev_id = cpu_to_le32(td->id);
+		disk->flags = cpu_to_le32(DEVICE_VALID);
+		disk++;
+	}
+
+	if (pmd->dev_table && sm_dec(&pmd->metadata_sm, pmd->dev_table))
+		free_block(pmd, pmd->dev_table);
+	pmd->dev_table = b;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Superblock
+ *---------------------------------------------------------------*/
+static int write_superblock(struct dm_pool_metadata *pmd)
+{
+	struct thin_disk_superblock *sb = superblock(pmd);
+
+	sb->transaction_id = cpu_to_le64(pmd->transaction_id);
+	sb->nr_data_blocks = cpu_to_le64(pmd->data_sm.nr_blocks);
+	sb->dev_table = cpu_to_le64(pmd->dev_table);
+
+	return block_io(pmd, WRITE_FLUSH_FUA, SUPERBLOCK_LOCATION, sb, 1);
+}
+
+static int __commit(struct dm_pool_metadata *pmd)
+{
+	unsigned long flags;
+	int r;
+
+	r = prepare_spares(pmd);
+	if (r)
+		return r;
+
+	write_lock_irqsave(&pmd->tree_lock, flags);
+	r = __write_dev_table(pmd);
+	write_unlock_irqrestore(&pmd->tree_lock, flags);
+	if (r)
+		return r;
+
+	r = write_shadowed_blocks(pmd);
+	if (!r)
+		r = blkdev_issue_flush(pmd->bdev, GFP_NOIO, NULL);
+	if (!r)
+		r = write_superblock(pmd);
+	if (r) {
+		/* What is on disk no longer matches what is in core. */
+		DMERR("metadata commit failed: %d", r);
+		pmd->fail_io = true;
+		return r;
+	}
+
+	bitmap_zero(pmd->shadowed, pmd->metadata_sm.nr_blocks);
+	sm_commit(&pmd->metadata_sm);
+	sm_commit(&pmd->data_sm);
+	pmd->changed = false;
+
+	return 0;
+}
+
+static int format_metadata(struct dm_pool_metadata *pmd,
+			   dm_block_t nr_data_blocks)
+{
+	struct thin_disk_superblock *sb = superblock(pmd);
+	int r;
+
+	memset(sb, 0, THIN_METADATA_BLOCK_SIZE);
+	sb->magic = cpu_to_le32(THIN_MAGIC);
+	sb->version = cpu_to_le32(THIN_METADATA_VERSION);
+	sb->data_block_size = cpu_to_le32(pmd->data_block_size);
+
+	r = sm_init(&pmd->data_sm, nr_data_blocks);
+	if (r)
+		return r;
+
+	/* The commit writes the first device table. */
+	pmd->changed = true;
+	return __commit(pmd);
+}
+
+static int open_metadata(struct dm_pool_metadata *pmd,
+			 dm_block_t nr_data_blocks)
+{
+	struct thin_disk_superblock *sb;
+	int r;
+
+	r = read_block(pmd, SUPERBLOCK_LOCATION);
+	if (r)
+		return r;
+	sm_inc(&pmd->metadata_sm, SUPERBLOCK_LOCATION);
+
+	sb = superblock(pmd);
+	if (!sb->magic)
+		return format_metadata(pmd, nr_data_blocks);
+
+	if (le32_to_cpu(sb->magic) != THIN_MAGIC) {
+		DMERR("bad magic");
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(sb->version) != THIN_METADATA_VERSION) {
+		DMERR("unsupported metadata version %u",
+		      le32_to_cpu(sb->version));
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(sb->data_block_size) != pmd->data_block_size) {
+		DMERR("data block size %u differs from the %llu in the table",
+		      le32_to_cpu(sb->data_block_size),
+		      (unsigned long long) pmd->data_block_size);
+		return -EINVAL;
+	}
+
+	pmd->transaction_id = le64_to_cpu(sb->transaction_id);
+	pmd->dev_table = le64_to_cpu(sb->dev_table);
+
+	if (le64_to_cpu(sb->nr_data_blocks) > THIN_MAX_DATA_BLOCKS) {
+		DMERR("pool has %llu data blocks, more than the %u supported",
+		      (unsigned long long) le64_to_cpu(sb->nr_data_blocks),
+		      THIN_MAX_DATA_BLOCKS);
+		return -EINVAL;
+	}
+
+	r = sm_init(&pmd->data_sm, le64_to_cpu(sb->nr_data_blocks));
+	if (r)
+		return r;
+
+	return load_devices(pmd);
+}
+
+struct dm_pool_metadata *dm_pool_metadata_open(struct block_device *bdev,
+					       sector_t data_block_size,
+					       dm_block_t nr_data_blocks)
+{
+	struct dm_pool_metadata *pmd;
+	dm_block_t nr_blocks;
+	int r = -ENOMEM;
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> (SECTOR_SHIFT + 3);
+	if (nr_blocks > THIN_METADATA_MAX_BLOCKS) {
+		DMWARN("metadata device larger than %u blocks, the rest is unused",
+		       THIN_METADATA_MAX_BLOCKS);
+		nr_blocks = THIN_METADATA_MAX_BLOCKS;
+	}
+
+	if (nr_blocks < 2) {
+		DMERR("metadata device too small");
+		return ERR_PTR(-EINVAL);
+	}
+
+	pmd = kzalloc(sizeof(*pmd), GFP_KERNEL);
+	if (!pmd)
+		return ERR_PTR(-ENOMEM);
+
+	pmd->bdev = bdev;
+	pmd->data_block_size = data_block_size;
+	mutex_init(&pmd->lock);
+	rwlock_init(&pmd->tree_lock);
+	INIT_LIST_HEAD(&pmd->thin_devices);
+
+	pmd->blocks = vzalloc(nr_blocks * sizeof(*pmd->blocks));
+	pmd->shadowed = alloc_bitset(nr_blocks);
+	if (!pmd->blocks || !pmd->shadowed)
+		goto bad;
+
+	r = sm_init(&pmd->metadata_sm, nr_blocks);
+	if (r)
+		goto bad;
+
+	pmd->io_client = dm_io_client_create(1);
+	if (IS_ERR(pmd->io_client)) {
+		r = PTR_ERR(pmd->io_client);
+		pmd->io_client = NULL;
+		goto bad;
+	}
+
+	r = open_metadata(pmd, nr_data_blocks);
+	if (r)
+		goto bad;
+
+	return pmd;
+
+bad:
+	dm_pool_metadata_close(pmd);
+	return ERR_PTR(r);
+}
+
+void dm_pool_metadata_close(struct dm_pool_metadata *pmd)
+{
+	struct dm_thin_device *td, *tmp;
+	dm_block_t b;
+
+	list_for_each_entry_safe(td, tmp, &pmd->thin_devices, list) {
+		if (td->open_count)
+			DMERR("closing metadata with thin device %u still open",
+			      td->id);
+		__remove_device(pmd, td);
+	}
+
+	while (pmd->nr_spare)
+		kfree(pmd->spare[--pmd->nr_spare]);
+
+	if (pmd->blocks)
+		for (b = 0; b < pmd->metadata_sm.nr_blocks; b++)
+			kfree(pmd->blocks[b]);
+
+	if (pmd->io_client)
+		dm_io_client_destroy(pmd->io_client);
+	sm_destroy(&pmd->data_sm);
+	sm_destroy(&pmd->metadata_sm);
+	vfree(pmd->shadowed);
+	vfree(pmd->blocks);
+	kfree(pmd);
+}
+
+/*-----------------------------------------------------------------
+ * Pool interface
+ *---------------------------------------------------------------*/
+int dm_pool_create_thin(struct dm_pool_metadata *pmd, dm_thin_id dev)
+{
+	int r = -EIO;
+
+	mutex_lock(&pmd->lock);
+	if (pmd->fail_io)
+		goto out;
+
+	r = -EEXIST;
+	if (__find_device(pmd, dev))
+		goto out;
+
+	r = __add_device(pmd, dev, 0, 0, NULL);
+	if (!r)
+		pmd->changed = true;
+out:
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+int dm_pool_create_snap(struct dm_pool_metadata *pmd, dm_thin_id dev,
+			dm_thin_id origin)
+{
+	struct dm_thin_device *origin_td, *td;
+	unsigned long flags;
+	int r = -EIO;
+
+	mutex_lock(&pmd->lock);
+	if (pmd->fail_io)
+		goto out;
+
+	r = -EEXIST;
+	if (__find_device(pmd, dev))
+		goto out;
+
+	r = -ENODEV;
+	origin_td = __find_device(pmd, origin);
+	if (!origin_td)
+		goto out;
+
+	r = __add_device(pmd, dev, 0, 0, &td);
+	if (r)
+		goto out;
+
+	/* Sharing the whole tree takes just a reference on its root. */
+	write_lock_irqsave(&pmd->tree_lock, flags);
+	td->root = origin_td->root;
+	td->mapped_blocks = origin_td->mapped_blocks;
+	if (td->root)
+		sm_inc(&pmd->metadata_sm, td->root);
+	write_unlock_irqrestore(&pmd->tree_lock, flags);
+
+	pmd->changed = true;
+out:
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+int dm_pool_delete_thin_device(struct dm_pool_metadata *pmd, dm_thin_id dev)
+{
+	struct dm_thin_device *td;
+	unsigned long flags;
+	int r = -EIO;
+
+	mutex_lock(&pmd->lock);
+	if (pmd->fail_io)
+		goto out;
+
+	r = -ENODEV;
+	td = __find_device(pmd, dev);
+	if (!td)
+		goto out;
+
+	r = -EBUSY;
+	if (td->open_count)
+		goto out;
+
+	write_lock_irqsave(&pmd->tree_lock, flags);
+	if (td->root)
+		dec_node(pmd, td->root, 0);
+	write_unlock_irqrestore(&pmd->tree_lock, flags);
+
+	__remove_device(pmd, td);
+	pmd->changed = true;
+	r = 0;
+out:
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+bool dm_pool_changed_this_transaction(struct dm_pool_metadata *pmd)
+{
+	bool r;
+
+	mutex_lock(&pmd->lock);
+	r = pmd->changed;
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+int dm_pool_commit_metadata(struct dm_pool_metadata *pmd)
+{
+	int r = -EIO;
+
+	mutex_lock(&pmd->lock);
+	if (!pmd->fail_io)
+		r = pmd->changed ? __commit(pmd) : 0;
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+int dm_pool_set_metadata_transaction_id(struct dm_pool_metadata *pmd,
+					uint64_t current_id, uint64_t new_id)
+{
+	int r = -EIO;
+
+	mutex_lock(&pmd->lock);
+	if (pmd->fail_io)
+		goto out;
+
+	r = -EINVAL;
+	if (pmd->transaction_id != current_id)
+		goto out;
+
+	pmd->transaction_id = new_id;
+	pmd->changed = true;
+	r = 0;
+out:
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+uint64_t dm_pool_get_metadata_transaction_id(struct dm_pool_metadata *pmd)
+{
+	uint64_t r;
+
+	mutex_lock(&pmd->lock);
+	r = pmd->transaction_id;
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+dm_block_t dm_pool_get_free_block_count(struct dm_pool_metadata *pmd)
+{
+	dm_block_t r;
+
+	mutex_lock(&pmd->lock);
+	r = pmd->data_sm.nr_free;
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+dm_block_t dm_pool_get_data_dev_size(struct dm_pool_metadata *pmd)
+{
+	dm_block_t r;
+
+	mutex_lock(&pmd->lock);
+	r = pmd->data_sm.nr_blocks;
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+dm_block_t dm_pool_get_free_metadata_block_count(struct dm_pool_metadata *pmd)
+{
+	dm_block_t r;
+
+	mutex_lock(&pmd->lock);
+	r = pmd->metadata_sm.nr_free;
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+dm_block_t dm_pool_get_metadata_dev_size(struct dm_pool_metadata *pmd)
+{
+	return pmd->metadata_sm.nr_blocks;
+}
+
+int dm_pool_resize_data_dev(struct dm_pool_metadata *pmd, dm_block_t new_size)
+{
+	struct space_map *sm = &pmd->data_sm;
+	uint32_t *refs, *old_refs;
+	unsigned long *freed, *old_freed, *used, *old_used;
+	unsigned long flags;
+	int r = -EIO;
+
+	mutex_lock(&pmd->lock);
+	if (pmd->fail_io)
+		goto out;
+
+	r = -EINVAL;
+	if (new_size < sm->nr_blocks || new_size > THIN_MAX_DATA_BLOCKS)
+		goto out;
+
+	r = 0;
+	if (new_size == sm->nr_blocks)
+		goto out;
+
+	r = -ENOMEM;
+	refs = vzalloc(new_size * sizeof(*refs));
+	freed = alloc_bitset(new_size);
+	used = alloc_bitset(new_size);
+	if (!refs || !freed || !used) {
+		vfree(refs);
+		vfree(freed);
+		vfree(used);
+		goto out;
+	}
+
+	write_lock_irqsave(&pmd->tree_lock, flags);
+	memcpy(refs, sm->refs, sm->nr_blocks * sizeof(*refs));
+	bitmap_copy(freed, sm->freed, sm->nr_blocks);
+	bitmap_copy(used, sm->used, sm->nr_blocks);
+	old_refs = sm->refs;
+	old_freed = sm->freed;
+	old_used = sm->used;
+	sm->refs = refs;
+	sm->freed = freed;
+	sm->used = used;
+	sm->nr_free += new_size - sm->nr_blocks;
+	sm->nr_blocks = new_size;
+	write_unlock_irqrestore(&pmd->tree_lock, flags);
+
+	vfree(old_refs);
+	vfree(old_freed);
+	vfree(old_used);
+	pmd->changed = true;
+	r = 0;
+out:
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+int dm_pool_alloc_data_block(struct dm_pool_metadata *pmd, dm_block_t *result)
+{
+	unsigned long flags;
+	int r = -EIO;
+
+	mutex_lock(&pmd->lock);
+	if (!pmd->fail_io) {
+		write_lock_irqsave(&pmd->tree_lock, flags);
+		r = sm_alloc(&pmd->data_sm, result);
+		write_unlock_irqrestore(&pmd->tree_lock, flags);
+	}
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+void dm_pool_release_data_block(struct dm_pool_metadata *pmd, dm_block_t b)
+{
+	unsigned long flags;
+
+	mutex_lock(&pmd->lock);
+	write_lock_irqsave(&pmd->tree_lock, flags);
+	sm_dec(&pmd->data_sm, b);
+	write_unlock_irqrestore(&pmd->tree_lock, flags);
+	mutex_unlock(&pmd->lock);
+}
+
+/*-----------------------------------------------------------------
+ * Thin device interface
+ *---------------------------------------------------------------*/
+int dm_pool_open_thin_device(struct dm_pool_metadata *pmd, dm_thin_id dev,
+			     struct dm_thin_device **td)
+{
+	int r = 0;
+
+	mutex_lock(&pmd->lock);
+	*td = __find_device(pmd, dev);
+	if (*td)
+		(*td)->open_count++;
+	else
+		r = -ENODEV;
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+void dm_pool_close_thin_device(struct dm_thin_device *td)
+{
+	mutex_lock(&td->pmd->lock);
+	td->open_count--;
+	mutex_unlock(&td->pmd->lock);
+}
+
+dm_thin_id dm_thin_dev_id(struct dm_thin_device *td)
+{
+	return td->id;
+}
+
+int dm_thin_find_block(struct dm_thin_device *td, dm_block_t block,
+		       struct dm_thin_lookup_result *result)
+{
+	struct dm_pool_metadata *pmd = td->pmd;
+	unsigned long flags;
+	dm_block_t b;
+	unsigned level;
+	int r = -ENODATA;
+
+	read_lock_irqsave(&pmd->tree_lock, flags);
+	b = td->root;
+	result->shared = false;
+	for (level = 0; b; level++) {
+		/* Everything below a shared node is shared too. */
+		if (pmd->metadata_sm.refs[b] > 1)
+			result->shared = true;
+
+		b = le64_to_cpu(node(pmd, b)[node_index(block, level)]);
+		if (b && is_leaf(level)) {
+			result->block = b - 1;
+			if (pmd->data_sm.refs[result->block] > 1)
+				result->shared = true;
+			r = 0;
+			break;
+		}
+	}
+	read_unlock_irqrestore(&pmd->tree_lock, flags);
+
+	return r;
+}
+
+int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
+			 dm_block_t data_block)
+{
+	struct dm_pool_metadata *pmd = td->pmd;
+	unsigned long flags;
+	dm_block_t b, child;
+	unsigned level, i;
+	uint64_t old;
+	__le64 *n;
+	int r = -EIO;
+
+	mutex_lock(&pmd->lock);
+	if (pmd->fail_io)
+		goto out;
+
+	r = prepare_spares(pmd);
+	if (r)
+		goto out;
+
+	write_lock_irqsave(&pmd->tree_lock, flags);
+
+	if (td->root)
+		r = shadow_node(pmd, td->root, 0, &b);
+	else
+		r = new_block(pmd, true, &b);
+	if (r)
+		goto out_unlock;
+	td->root = b;
+	pmd->changed = true;
+
+	for (level = 0; !is_leaf(level); level++) {
+		n = node(pmd, b);
+		i = node_index(block, level);
+
+		child = le64_to_cpu(n[i]);
+		if (child)
+			r = shadow_node(pmd, child, level + 1, &child);
+		else
+			r = new_block(pmd, true, &child);
+		if (r)
+			goto out_unlock;
+
+		n[i] = cpu_to_le64(child);
+		b = child;
+	}
+
+	n = node(pmd, b);
+	i = node_index(block, level);
+	old = le64_to_cpu(n[i]);
+	n[i] = cpu_to_le64(data_block + 1);
+	if (old)
+		sm_dec(&pmd->data_sm, old - 1);
+	else
+		td->mapped_blocks++;
+
+out_unlock:
+	write_unlock_irqrestore(&pmd->tree_lock, flags);
+out:
+	mutex_unlock(&pmd->lock);
+
+	return r;
+}
+
+dm_block_t dm_thin_get_mapped_count(struct dm_thin_device *td)
+{
+	unsigned long flags;
+	dm_block_t r;
+
+	read_lock_irqsave(&td->pmd->tree_lock, flags);
+	r = td->mapped_blocks;
+	read_unlock_irqrestore(&td->pmd->tree_lock, flags);
+
+	return r;
+}
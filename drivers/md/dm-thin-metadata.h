@@ -0,0 +1,122 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#ifndef DM_THIN_METADATA_H
+#define DM_THIN_METADATA_H
+
+#include <linux/device-mapper.h>
+
+#define THIN_METADATA_BLOCK_SIZE 4096
+#define THIN_METADATA_BLOCK_SECTORS (THIN_METADATA_BLOCK_SIZE >> SECTOR_SHIFT)
+
+/* Larger metadata devices are only used up to this size. */
+#define THIN_METADATA_MAX_BLOCKS (1 << 20)
+
+/*
+ * The reference counts of the data blocks are kept in core, four bytes
+ * and two bits each, so the size of a pool is limited to this many data
+ * blocks: 64M of memory, and 1T of data with the smallest block size.
+ */
+#define THIN_MAX_DATA_BLOCKS (1 << 24)
+
+/* The highest virtual block a thin device can map, plus one. */
+#define THIN_MAX_VIRTUAL_BLOCKS (1ULL << 36)
+
+#define THIN_MAX_DEVICES 170
+
+typedef uint64_t dm_block_t;
+typedef uint32_t dm_thin_id;
+
+/*
+ * The metadata of a pool: the thin devices in it, a copy-on-write tree
+ * per device that maps its virtual blocks to blocks of the data device,
+ * and reference counts for the blocks of both devices.
+ *
+ * A snapshot starts off sharing the whole tree of its origin.  Nodes
+ * and data blocks are only copied when a device that shares them writes
+ * to them, so the cost of a write does not depend on the number of
+ * snapshots.
+ *
+ * Changes are made in core and written out by dm_pool_commit_metadata();
+ * a crash rolls the pool back to the last commit.
+ */
+struct dm_pool_metadata;
+struct dm_thin_device;
+
+/*
+ * nr_data_blocks is only used when a blank metadata device is
+ * formatted; after that the data device is sized with
+ * dm_pool_resize_data_dev().
+ */
+struct dm_pool_metadata *dm_pool_metadata_open(struct block_device *bdev,
+					       sector_t data_block_size,
+					       dm_block_t nr_data_blocks);
+void dm_pool_metadata_close(struct dm_pool_metadata *pmd);
+
+/*
+ * Device ids are chosen by userland.  A snapshot's origin must be
+ * suspended while the snapshot is taken.
+ */
+int dm_pool_create_thin(struct dm_pool_metadata *pmd, dm_thin_id dev);
+int dm_pool_create_snap(struct dm_pool_metadata *pmd, dm_thin_id dev,
+			dm_thin_id origin);
+int dm_pool_delete_thin_device(struct dm_pool_metadata *pmd, dm_thin_id dev);
+
+/* Returns true if there is anything for a commit to write. */
+bool dm_pool_changed_this_transaction(struct dm_pool_metadata *pmd);
+int dm_pool_commit_metadata(struct dm_pool_metadata *pmd);
+
+/*
+ * A number for userland to keep its own records in step with the
+ * pool's.  Changing it needs the current value.
+ */
+int dm_pool_set_metadata_transaction_id(struct dm_pool_metadata *pmd,
+					uint64_t current_id, uint64_t new_id);
+uint64_t dm_pool_get_metadata_transaction_id(struct dm_pool_metadata *pmd);
+
+dm_block_t dm_pool_get_free_block_count(struct dm_pool_metadata *pmd);
+dm_block_t dm_pool_get_data_dev_size(struct dm_pool_metadata *pmd);
+dm_block_t dm_pool_get_free_metadata_block_count(struct dm_pool_metadata *pmd);
+dm_block_t dm_pool_get_metadata_dev_size(struct dm_pool_metadata *pmd);
+
+/* The data device can only grow. */
+int dm_pool_resize_data_dev(struct dm_pool_metadata *pmd, dm_block_t new_size);
+
+/*
+ * A data block is allocated with a reference that dm_thin_insert_block()
+ * hands on to the mapping; dm_pool_release_data_block() drops it if the
+ * block is not used after all.  Blocks freed since the last commit are
+ * not reused until the next one.
+ */
+int dm_pool_alloc_data_block(struct dm_pool_metadata *pmd, dm_block_t *result);
+void dm_pool_release_data_block(struct dm_pool_metadata *pmd, dm_block_t b);
+
+/*----------------------------------------------------------------*/
+
+/* An open device can not be deleted. */
+int dm_pool_open_thin_device(struct dm_pool_metadata *pmd, dm_thin_id dev,
+			     struct dm_thin_device **td);
+void dm_pool_close_thin_device(struct dm_thin_device *td);
+
+dm_thin_id dm_thin_dev_id(struct dm_thin_device *td);
+
+struct dm_thin_lookup_result {
+	dm_block_t block;
+	bool shared;	/* also mapped by another device */
+};
+
+/*
+ * Returns -ENODATA if the block is not mapped.  Never blocks, so it can
+ * be called from the map function.
+ */
+int dm_thin_find_block(struct dm_thin_device *td, dm_block_t block,
+		       struct dm_thin_lookup_result *result);
+
+/* Map block to data_block, replacing any existing mapping. */
+int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
+			 dm_block_t data_block);
+
+dm_block_t dm_thin_get_mapped_count(struct dm_thin_device *td);
+
+#endif	/* DM_THIN_METADATA_H */
@@ -0,0 +1,1424 @@
+/*
+ * This file is released under the GPL.
+ *
+ * Thin provisioning.  A "thin-pool" target manages a data device that
+ * is shared out, a block at a time and only when first written, between
+ * any number of "thin" devices.  Snapshots of thin devices share blocks
+ * with their origin until either side writes to them.
+ * See Documentation/device-mapper/thin-provisioning.txt.
+ */
+
+#include "dm-thin-metadata.h"
+
+#include <linux/blkdev.h>
+#include <linux/dm-io.h>
+#include <linux/dm-kcopyd.h>
+#include <linux/hash.h>
+#include <linux/init.h>
+#include <linux/list.h>
+#include <linux/mempool.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#define DM_MSG_PREFIX "thin"
+
+#define ENDIO_HOOK_POOL_SIZE 1024
+#define MAPPING_POOL_SIZE 128
+#define MAPPING_HASH_BITS 10
+#define COPY_PAGES 256
+#define COMMIT_PERIOD HZ
+
+/* 64k to 1G */
+#define DATA_DEV_BLOCK_SIZE_MIN_SECTORS (64 * 1024 >> SECTOR_SHIFT)
+#define DATA_DEV_BLOCK_SIZE_MAX_SECTORS (1024 * 1024 * 1024 >> SECTOR_SHIFT)
+
+/*-----------------------------------------------------------------
+ * A pool is shared by the pool target and the thin targets that use
+ * it, and outlives table reloads of any of them.  Pools are found by
+ * the mapped device of the pool target, or by their metadata device.
+ *---------------------------------------------------------------*/
+struct pool {
+	struct list_head list;
+	struct mapped_device *pool_md;
+	struct block_device *md_dev;
+	struct dm_pool_metadata *pmd;
+	unsigned ref_count;
+
+	/* Set from the pool target when it is resumed. */
+	struct dm_target *ti;
+	struct block_device *data_dev;
+	dm_block_t low_water_blocks;
+	bool low_water_triggered;
+
+	sector_t sectors_per_block;
+	unsigned block_shift;
+
+	struct dm_kcopyd_client *copier;
+	struct dm_io_client *io_client;
+	struct workqueue_struct *wq;
+	struct work_struct worker;
+	struct delayed_work waker;
+
+	spinlock_t lock;
+	struct bio_list deferred_bios;
+	struct bio_list deferred_flush_bios;
+	struct list_head prepared_mappings;
+
+	/* Mappings in progress; only used by the worker. */
+	struct hlist_head mappings[1 << MAPPING_HASH_BITS];
+
+	mempool_t *mapping_pool;
+	mempool_t *endio_hook_pool;
+};
+
+struct pool_c {
+	struct dm_target *ti;
+	struct pool *pool;
+	struct dm_dev *metadata_dev;
+	struct dm_dev *data_dev;
+	dm_block_t low_water_blocks;
+};
+
+struct thin_c {
+	struct dm_target *ti;
+	struct dm_dev *pool_dev;
+	struct pool *pool;
+	dm_thin_id dev_id;
+	struct dm_thin_device *td;
+};
+
+/*
+ * A data block being prepared for a virtual block: zeroed, or copied
+ * from the block it is replacing, or written in full by bio.  Other
+ * bios to the virtual block wait in bios until it is mapped.
+ */
+struct new_mapping {
+	struct list_head list;
+	struct hlist_node hash;
+	struct thin_c *tc;
+
+	dm_block_t virt_block;
+	dm_block_t data_block;
+	int err;
+
+	struct bio *bio;
+	struct bio_list bios;
+};
+
+/* Every bio the worker handles has one of these in its map_info. */
+struct endio_hook {
+	struct thin_c *tc;
+	struct new_mapping *overwrite_mapping;
+};
+
+static struct kmem_cache *_new_mapping_cache;
+static struct kmem_cache *_endio_hook_cache;
+
+/* The zero page, over and over, for zeroing new blocks with dm-io. */
+static struct page_list _zero_page_list;
+
+static struct dm_thin_pool_table {
+	struct mutex mutex;
+	struct list_head pools;
+} dm_thin_pool_table;
+
+static void pool_table_init(void)
+{
+	mutex_init(&dm_thin_pool_table.mutex);
+	INIT_LIST_HEAD(&dm_thin_pool_table.pools);
+}
+
+static void __pool_table_insert(struct pool *pool)
+{
+	BUG_ON(!mutex_is_locked(&dm_thin_pool_table.mutex));
+	list_add(&pool->list, &dm_thin_pool_table.pools);
+}
+
+static void __pool_table_remove(struct pool *pool)
+{
+	BUG_ON(!mutex_is_locked(&dm_thin_pool_table.mutex));
+	list_del(&pool->list);
+}
+
+static struct pool *__pool_table_lookup(struct mapped_device *md)
+{
+	struct pool *pool;
+
+	BUG_ON(!mutex_is_locked(&dm_thin_pool_table.mutex));
+
+	list_for_each_entry(pool, &dm_thin_pool_table.pools, list)
+		if (pool->pool_md == md)
+			return pool;
+
+	return NULL;
+}
+
+static struct pool *__pool_table_lookup_metadata_dev(struct block_device *md_dev)
+{
+	struct pool *pool;
+
+	BUG_ON(!mutex_is_locked(&dm_thin_pool_table.mutex));
+
+	list_for_each_entry(pool, &dm_thin_pool_table.pools, list)
+		if (pool->md_dev == md_dev)
+			return pool;
+
+	return NULL;
+}
+
+/*----------------------------------------------------------------*/
+
+static void wake_worker(struct pool *pool)
+{
+	queue_work(pool->wq, &pool->worker);
+}
+
+static dm_block_t get_bio_block(struct thin_c *tc, struct bio *bio)
+{
+	return dm_target_offset(tc->ti, bio->bi_sector) >> tc->pool->block_shift;
+}
+
+static void remap(struct thin_c *tc, struct bio *bio, dm_block_t block)
+{
+	struct pool *pool = tc->pool;
+
+	bio->bi_bdev = pool->data_dev;
+	bio->bi_sector = (block << pool->block_shift) |
+		(dm_target_offset(tc->ti, bio->bi_sector) &
+		 (pool->sectors_per_block - 1));
+}
+
+static int commit(struct pool *pool)
+{
+	int r;
+
+	if (!dm_pool_changed_this_transaction(pool->pmd))
+		return 0;
+
+	/* The data that new mappings point at must be on disk first. */
+	r = pool->data_dev ?
+		blkdev_issue_flush(pool->data_dev, GFP_NOIO, NULL) : 0;
+	if (!r)
+		r = dm_pool_commit_metadata(pool->pmd);
+	if (r)
+		DMERR_LIMIT("%s: commit failed: error = %d",
+			    dm_device_name(pool->pool_md), r);
+
+	return r;
+}
+
+static void check_low_water_mark(struct pool *pool)
+{
+	dm_block_t nr_free = dm_pool_get_free_block_count(pool->pmd);
+
+	if (nr_free > pool->low_water_blocks || pool->low_water_triggered)
+		return;
+
+	pool->low_water_triggered = true;
+	DMWARN("%s: reached low water mark, sending event.",
+	       dm_device_name(pool->pool_md));
+	if (pool->ti)
+		dm_table_event(pool->ti->table);
+}
+
+static int alloc_data_block(struct pool *pool, dm_block_t *result)
+{
+	int r;
+
+	r = dm_pool_alloc_data_block(pool->pmd, result);
+	if (r == -ENOSPC && dm_pool_changed_this_transaction(pool->pmd)) {
+		/* Blocks freed since the last commit can be used after it. */
+		r = commit(pool);
+		if (!r)
+			r = dm_pool_alloc_data_block(pool->pmd, result);
+	}
+
+	if (r == -ENOSPC)
+		DMERR_LIMIT("%s: no free space in the pool",
+			    dm_device_name(pool->pool_md));
+	else if (!r)
+		check_low_water_mark(pool);
+
+	return r;
+}
+
+/*-----------------------------------------------------------------
+ * Preparing new blocks
+ *---------------------------------------------------------------*/
+static struct hlist_head *mapping_bucket(struct pool *pool, dm_thin_id dev,
+					 dm_block_t block)
+{
+	return pool->mappings +
+		hash_64(block + ((u64) dev << 36), MAPPING_HASH_BITS);
+}
+
+static struct new_mapping *find_mapping(struct pool *pool, dm_thin_id dev,
+					dm_block_t block)
+{
+	struct hlist_node *tmp;
+	struct new_mapping *m;
+
+	hlist_for_each_entry(m, tmp, mapping_bucket(pool, dev, block), hash)
+		if (m->tc->dev_id == dev && m->virt_block == block)
+			return m;
+
+	return NULL;
+}
+
+static void mapping_prepared(struct new_mapping *m)
+{
+	struct pool *pool = m->tc->pool;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	list_add_tail(&m->list, &pool->prepared_mappings);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	wake_worker(pool);
+}
+
+static void copy_complete(int read_err, unsigned long write_err, void *context)
+{
+	struct new_mapping *m = context;
+
+	m->err = (read_err || write_err) ? -EIO : 0;
+	mapping_prepared(m);
+}
+
+static void zero_complete(unsigned long error, void *context)
+{
+	struct new_mapping *m = context;
+
+	m->err = error ? -EIO : 0;
+	mapping_prepared(m);
+}
+
+static void copy_block(struct new_mapping *m, dm_block_t from)
+{
+	struct pool *pool = m->tc->pool;
+	struct dm_io_region src, dest;
+	int r;
+
+	src.bdev = pool->data_dev;
+	src.sector = from << pool->block_shift;
+	src.count = pool->sectors_per_block;
+
+	dest.bdev = pool->data_dev;
+	dest.sector = m->data_block << pool->block_shift;
+	dest.count = pool->sectors_per_block;
+
+	r = dm_kcopyd_copy(pool->copier, &src, 1, &dest, 0, copy_complete, m);
+	if (r < 0) {
+		DMERR_LIMIT("dm_kcopyd_copy() failed");
+		copy_complete(1, 0, m);
+	}
+}
+
+static void zero_block(struct new_mapping *m)
+{
+	struct pool *pool = m->tc->pool;
+	struct dm_io_region where;
+	struct dm_io_request io_req = {
+		.bi_rw = WRITE,
+		.mem.type = DM_IO_PAGE_LIST,
+		.mem.ptr.pl = &_zero_page_list,
+		.mem.offset = 0,
+		.notify.fn = zero_complete,
+		.notify.context = m,
+		.client = pool->io_client,
+	};
+
+	where.bdev = pool->data_dev;
+	where.sector = m->data_block << pool->block_shift;
+	where.count = pool->sectors_per_block;
+
+	if (dm_io(&io_req, 1, &where, NULL)) {
+		DMERR_LIMIT("dm_io() failed zeroing block");
+		zero_complete(1, m);
+	}
+}
+
+static bool io_overwrites_block(struct pool *pool, struct bio *bio)
+{
+	return bio_data_dir(bio) == WRITE &&
+		!(bio->bi_rw & (REQ_FLUSH | REQ_FUA)) &&
+		bio->bi_size == (pool->sectors_per_block << SECTOR_SHIFT);
+}
+
+/*
+ * Give the virtual block a data block of its own.  If the block is
+ * currently shared, origin says where its data is.
+ */
+static void schedule_mapping(struct thin_c *tc, struct bio *bio,
+			     dm_block_t block,
+			     struct dm_thin_lookup_result *origin)
+{
+	struct pool *pool = tc->pool;
+	struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+	struct new_mapping *m;
+	dm_block_t data_block;
+	int r;
+
+	r = alloc_data_block(pool, &data_block);
+	if (r) {
+		bio_endio(bio, r);
+		return;
+	}
+
+	m = mempool_alloc(pool->mapping_pool, GFP_NOIO);
+	memset(m, 0, sizeof(*m));
+	m->tc = tc;
+	m->virt_block = block;
+	m->data_block = data_block;
+	bio_list_init(&m->bios);
+	hlist_add_head(&m->hash, mapping_bucket(pool, tc->dev_id, block));
+
+	/*
+	 * A write of the whole block leaves nothing to zero or copy; it
+	 * goes straight to the new block, which is mapped once the write
+	 * completes.
+	 */
+	if (io_overwrites_block(pool, bio)) {
+		m->bio = bio;
+		h->overwrite_mapping = m;
+		remap(tc, bio, data_block);
+		generic_make_request(bio);
+		return;
+	}
+
+	bio_list_add(&m->bios, bio);
+	if (origin)
+		copy_block(m, origin->block);
+	else
+		zero_block(m);
+}
+
+static void process_prepared_mapping(struct new_mapping *m)
+{
+	struct thin_c *tc = m->tc;
+	struct pool *pool = tc->pool;
+	struct endio_hook *h;
+	unsigned long flags;
+	struct bio *bio;
+	int r = m->err;
+
+	if (!r) {
+		r = dm_thin_insert_block(tc->td, m->virt_block, m->data_block);
+		if (r)
+			DMERR_LIMIT("dm_thin_insert_block() failed");
+	}
+
+	if (r)
+		dm_pool_release_data_block(pool->pmd, m->data_block);
+
+	hlist_del(&m->hash);
+
+	if (m->bio) {
+		h = dm_get_mapinfo(m->bio)->ptr;
+		h->overwrite_mapping = NULL;
+		bio_endio(m->bio, r);
+	}
+
+	if (r) {
+		while ((bio = bio_list_pop(&m->bios)))
+			bio_endio(bio, r);
+	} else {
+		/* Send the waiting bios through the new mapping. */
+		spin_lock_irqsave(&pool->lock, flags);
+		bio_list_merge(&pool->deferred_bios, &m->bios);
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+
+	mempool_free(m, pool->mapping_pool);
+}
+
+static void process_prepared_mappings(struct pool *pool)
+{
+	unsigned long flags;
+	struct list_head maps;
+	struct new_mapping *m, *tmp;
+
+	INIT_LIST_HEAD(&maps);
+	spin_lock_irqsave(&pool->lock, flags);
+	list_splice_init(&pool->prepared_mappings, &maps);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	list_for_each_entry_safe(m, tmp, &maps, list)
+		process_prepared_mapping(m);
+}
+
+/*-----------------------------------------------------------------
+ * Bio processing
+ *---------------------------------------------------------------*/
+
+/*
+ * Flushes and FUA writes are only issued once the mappings they depend
+ * on have been committed.
+ */
+static void remap_and_issue(struct thin_c *tc, struct bio *bio,
+			    dm_block_t block)
+{
+	struct pool *pool = tc->pool;
+	unsigned long flags;
+
+	remap(tc, bio, block);
+
+	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
+		spin_lock_irqsave(&pool->lock, flags);
+		bio_list_add(&pool->deferred_flush_bios, bio);
+		spin_unlock_irqrestore(&pool->lock, flags);
+	} else
+		generic_make_request(bio);
+}
+
+static void process_bio(struct thin_c *tc, struct bio *bio)
+{
+	struct pool *pool = tc->pool;
+	dm_block_t block = get_bio_block(tc, bio);
+	struct dm_thin_lookup_result lookup;
+	struct new_mapping *m;
+	int r;
+
+	if (!bio->bi_size) {
+		/* An empty flush */
+		remap_and_issue(tc, bio, 0);
+		return;
+	}
+
+	m = find_mapping(pool, tc->dev_id, block);
+	if (m) {
+		bio_list_add(&m->bios, bio);
+		return;
+	}
+
+	r = dm_thin_find_block(tc->td, block, &lookup);
+	switch (r) {
+	case 0:
+		if (bio_data_dir(bio) == WRITE && lookup.shared)
+			schedule_mapping(tc, bio, block, &lookup);
+		else
+			remap_and_issue(tc, bio, lookup.block);
+		break;
+
+	case -ENODATA:
+		if (bio_data_dir(bio) == READ) {
+			zero_fill_bio(bio);
+			bio_endio(bio, 0);
+		} else
+			schedule_mapping(tc, bio, block, NULL);
+		break;
+
+	default:
+		DMERR_LIMIT("dm_thin_find_block() failed, error = %d", r);
+		bio_io_error(bio);
+		break;
+	}
+}
+
+static void process_deferred_bios(struct pool *pool)
+{
+	unsigned long flags;
+	struct bio_list bios;
+	struct bio *bio;
+	struct endio_hook *h;
+	int r;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	bio_list_merge(&bios, &pool->deferred_bios);
+	bio_list_init(&pool->deferred_bios);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	while ((bio = bio_list_pop(&bios))) {
+		h = dm_get_mapinfo(bio)->ptr;
+		process_bio(h->tc, bio);
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	bio_list_merge(&bios, &pool->deferred_flush_bios);
+	bio_list_init(&pool->deferred_flush_bios);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (bio_list_empty(&bios))
+		return;
+
+	r = commit(pool);
+	while ((bio = bio_list_pop(&bios))) {
+		if (r)
+			bio_io_error(bio);
+		else
+			generic_make_request(bio);
+	}
+}
+
+static void do_worker(struct work_struct *ws)
+{
+	struct pool *pool = container_of(ws, struct pool, worker);
+
+	process_prepared_mappings(pool);
+	process_deferred_bios(pool);
+}
+
+/* Commit periodically, so a crash loses at most a second of mappings. */
+static void do_waker(struct work_struct *ws)
+{
+	struct pool *pool = container_of(to_delayed_work(ws), struct pool,
+					 waker);
+
+	commit(pool);
+	queue_delayed_work(pool->wq, &pool->waker, COMMIT_PERIOD);
+}
+
+/*-----------------------------------------------------------------
+ * Pool creation
+ *---------------------------------------------------------------*/
+static void __pool_destroy(struct pool *pool)
+{
+	__pool_table_remove(pool);
+
+	if (pool->wq)
+		destroy_workqueue(pool->wq);
+	if (pool->copier)
+		dm_kcopyd_client_destroy(pool->copier);
+	if (pool->io_client)
+		dm_io_client_destroy(pool->io_client);
+	if (pool->endio_hook_pool)
+		mempool_destroy(pool->endio_hook_pool);
+	if (pool->mapping_pool)
+		mempool_destroy(pool->mapping_pool);
+	if (pool->pmd)
+		dm_pool_metadata_close(pool->pmd);
+
+	kfree(pool);
+}
+
+static struct pool *pool_create(struct mapped_device *pool_md,
+				struct block_device *metadata_dev,
+				unsigned long block_size,
+				dm_block_t nr_data_blocks, char **error)
+{
+	struct pool *pool;
+	unsigned i;
+	int r;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool) {
+		*error = "Error allocating memory for pool";
+		return ERR_PTR(-ENOMEM);
+	}
+
+	pool->pool_md = pool_md;
+	pool->md_dev = metadata_dev;
+	pool->ref_count = 1;
+	pool->sectors_per_block = block_size;
+	pool->block_shift = __ffs(block_size);
+	spin_lock_init(&pool->lock);
+	bio_list_init(&pool->deferred_bios);
+	bio_list_init(&pool->deferred_flush_bios);
+	INIT_LIST_HEAD(&pool->prepared_mappings);
+	for (i = 0; i < ARRAY_SIZE(pool->mappings); i++)
+		INIT_HLIST_HEAD(pool->mappings + i);
+	__pool_table_insert(pool);
+
+	pool->pmd = dm_pool_metadata_open(metadata_dev, block_size,
+					  nr_data_blocks);
+	if (IS_ERR(pool->pmd)) {
+		r = PTR_ERR(pool->pmd);
+		pool->pmd = NULL;
+		*error = "Error creating metadata object";
+		goto bad;
+	}
+
+	r = -ENOMEM;
+	pool->mapping_pool = mempool_create_slab_pool(MAPPING_POOL_SIZE,
+						      _new_mapping_cache);
+	pool->endio_hook_pool = mempool_create_slab_pool(ENDIO_HOOK_POOL_SIZE,
+							 _endio_hook_cache);
+	if (!pool->mapping_pool || !pool->endio_hook_pool) {
+		*error = "Error creating pool's mempools";
+		goto bad;
+	}
+
+	pool->io_client = dm_io_client_create(1);
+	if (IS_ERR(pool->io_client)) {
+		r = PTR_ERR(pool->io_client);
+		pool->io_client = NULL;
+		*error = "Error creating pool's io client";
+		goto bad;
+	}
+
+	r = dm_kcopyd_client_create(COPY_PAGES, &pool->copier);
+	if (r) {
+		pool->copier = NULL;
+		*error = "Error creating pool's kcopyd client";
+		goto bad;
+	}
+
+	r = -ENOMEM;
+	pool->wq = alloc_ordered_workqueue("dm-" DM_MSG_PREFIX, WQ_MEM_RECLAIM);
+	if (!pool->wq) {
+		*error = "Error creating pool's workqueue";
+		goto bad;
+	}
+	INIT_WORK(&pool->worker, do_worker);
+	INIT_DELAYED_WORK(&pool->waker, do_waker);
+
+	return pool;
+
+bad:
+	__pool_destroy(pool);
+	return ERR_PTR(r);
+}
+
+static void __pool_inc(struct pool *pool)
+{
+	BUG_ON(!mutex_is_locked(&dm_thin_pool_table.mutex));
+	pool->ref_count++;
+}
+
+static void __pool_dec(struct pool *pool)
+{
+	BUG_ON(!mutex_is_locked(&dm_thin_pool_table.mutex));
+	BUG_ON(!pool->ref_count);
+	if (!--pool->ref_count)
+		__pool_destroy(pool);
+}
+
+static struct pool *__pool_find(struct mapped_device *pool_md,
+				struct block_device *metadata_dev,
+				unsigned long block_size,
+				dm_block_t nr_data_blocks, char **error)
+{
+	struct pool *pool;
+
+	pool = __pool_table_lookup_metadata_dev(metadata_dev);
+	if (pool) {
+		if (pool->pool_md != pool_md) {
+			*error = "metadata device already in use by a pool";
+			return ERR_PTR(-EBUSY);
+		}
+	} else {
+		pool = __pool_table_lookup(pool_md);
+		if (!pool)
+			return pool_create(pool_md, metadata_dev, block_size,
+					   nr_data_blocks, error);
+
+		if (pool->md_dev != metadata_dev) {
+			*error = "different pool cannot replace a pool";
+			return ERR_PTR(-EINVAL);
+		}
+	}
+
+	if (pool->sectors_per_block != block_size) {
+		*error = "data block size cannot be changed";
+		return ERR_PTR(-EINVAL);
+	}
+
+	__pool_inc(pool);
+	return pool;
+}
+
+/*-----------------------------------------------------------------
+ * Pool target methods
+ *---------------------------------------------------------------*/
+static void pool_dtr(struct dm_target *ti)
+{
+	struct pool_c *pt = ti->private;
+
+	mutex_lock(&dm_thin_pool_table.mutex);
+
+	if (pt->pool->ti == ti)
+		pt->pool->ti = NULL;
+	__pool_dec(pt->pool);
+	dm_put_device(ti, pt->metadata_dev);
+	dm_put_device(ti, pt->data_dev);
+	kfree(pt);
+
+	mutex_unlock(&dm_thin_pool_table.mutex);
+}
+
+/*
+ * thin-pool <metadata dev> <data dev>
+ *	     <data block size (sectors)>
+ *	     <low water mark (blocks)>
+ */
+static int pool_ctr(struct dm_target *ti, unsigned argc, char **argv)
+{
+	int r;
+	struct pool_c *pt;
+	struct pool *pool;
+	struct dm_dev *metadata_dev, *data_dev;
+	unsigned long block_size;
+	unsigned long long low_water;
+
+	if (argc != 4) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	mutex_lock(&dm_thin_pool_table.mutex);
+
+	r = dm_get_device(ti, argv[0], FMODE_READ | FMODE_WRITE, &metadata_dev);
+	if (r) {
+		ti->error = "Error opening metadata block device";
+		goto out_unlock;
+	}
+
+	r = dm_get_device(ti, argv[1], FMODE_READ | FMODE_WRITE, &data_dev);
+	if (r) {
+		ti->error = "Error getting data device";
+		goto out_metadata;
+	}
+
+	if (strict_strtoul(argv[2], 10, &block_size) ||
+	    block_size < DATA_DEV_BLOCK_SIZE_MIN_SECTORS ||
+	    block_size > DATA_DEV_BLOCK_SIZE_MAX_SECTORS ||
+	    !is_power_of_2(block_size)) {
+		ti->error = "Invalid block size";
+		r = -EINVAL;
+		goto out;
+	}
+
+	/* the reference counts of all the data blocks are held in core */
+	if (ti->len >> __ffs(block_size) > THIN_MAX_DATA_BLOCKS) {
+		ti->error = "Pool too large for its data block size";
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (strict_strtoull(argv[3], 10, &low_water)) {
+		ti->error = "Invalid low water mark";
+		r = -EINVAL;
+		goto out;
+	}
+
+	pt = kzalloc(sizeof(*pt), GFP_KERNEL);
+	if (!pt) {
+		ti->error = "Error allocating pool context";
+		r = -ENOMEM;
+		goto out;
+	}
+
+	pool = __pool_find(dm_table_get_md(ti->table), metadata_dev->bdev,
+			   block_size, ti->len >> __ffs(block_size),
+			   &ti->error);
+	if (IS_ERR(pool)) {
+		r = PTR_ERR(pool);
+		goto out_free_pt;
+	}
+
+	pt->ti = ti;
+	pt->pool = pool;
+	pt->metadata_dev = metadata_dev;
+	pt->data_dev = data_dev;
+	pt->low_water_blocks = low_water;
+	ti->private = pt;
+
+	/* Flushes go through to the data device. */
+	ti->num_flush_requests = 1;
+
+	mutex_unlock(&dm_thin_pool_table.mutex);
+
+	return 0;
+
+out_free_pt:
+	kfree(pt);
+out:
+	dm_put_device(ti, data_dev);
+out_metadata:
+	dm_put_device(ti, metadata_dev);
+out_unlock:
+	mutex_unlock(&dm_thin_pool_table.mutex);
+
+	return r;
+}
+
+static int pool_map(struct dm_target *ti, struct bio *bio,
+		    union map_info *map_context)
+{
+	struct pool_c *pt = ti->private;
+
+	/* The pool device itself is just the data device. */
+	bio->bi_bdev = pt->data_dev->bdev;
+
+	return DM_MAPIO_REMAPPED;
+}
+
+/*
+ * The length of the pool target is the size of the data device;
+ * loading a longer table grows the pool.
+ */
+static int pool_preresume(struct dm_target *ti)
+{
+	struct pool_c *pt = ti->private;
+	struct pool *pool = pt->pool;
+	dm_block_t data_size, sb_data_size;
+	int r;
+
+	pool->ti = ti;
+	pool->data_dev = pt->data_dev->bdev;
+	pool->low_water_blocks = pt->low_water_blocks;
+
+	data_size = ti->len >> pool->block_shift;
+	sb_data_size = dm_pool_get_data_dev_size(pool->pmd);
+
+	if (data_size < sb_data_size) {
+		DMERR("pool target too small, is %llu blocks (expected %llu)",
+		      (unsigned long long) data_size,
+		      (unsigned long long) sb_data_size);
+		return -EINVAL;
+	}
+
+	if (data_size > sb_data_size) {
+		r = dm_pool_resize_data_dev(pool->pmd, data_size);
+		if (r) {
+			DMERR("failed to resize data device");
+			return r;
+		}
+
+		r = commit(pool);
+		if (r)
+			return r;
+	}
+
+	pool->low_water_triggered = false;
+
+	return 0;
+}
+
+static void pool_resume(struct dm_target *ti)
+{
+	struct pool_c *pt = ti->private;
+	struct pool *pool = pt->pool;
+
+	queue_delayed_work(pool->wq, &pool->waker, COMMIT_PERIOD);
+	wake_worker(pool);
+}
+
+static void pool_postsuspend(struct dm_target *ti)
+{
+	struct pool_c *pt = ti->private;
+	struct pool *pool = pt->pool;
+
+	cancel_delayed_work_sync(&pool->waker);
+	flush_workqueue(pool->wq);
+	commit(pool);
+}
+
+static int check_arg_count(unsigned argc, unsigned args_required)
+{
+	if (argc != args_required) {
+		DMWARN("Message received with %u arguments instead of %u.",
+		       argc, args_required);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int read_dev_id(char *arg, dm_thin_id *dev_id, int warning)
+{
+	unsigned long tmp;
+
+	if (!strict_strtoul(arg, 10, &tmp) && tmp <= (dm_thin_id) -1) {
+		*dev_id = tmp;
+		return 0;
+	}
+
+	if (warning)
+		DMWARN("Message received with invalid device id: %s", arg);
+
+	return -EINVAL;
+}
+
+static int process_create_thin_mesg(unsigned argc, char **argv,
+				    struct pool *pool)
+{
+	dm_thin_id dev_id;
+	int r;
+
+	r = check_arg_count(argc, 2);
+	if (r)
+		return r;
+
+	r = read_dev_id(argv[1], &dev_id, 1);
+	if (r)
+		return r;
+
+	r = dm_pool_create_thin(pool->pmd, dev_id);
+	if (r)
+		DMWARN("Creation of new thinly-provisioned device with id %s failed.",
+		       argv[1]);
+
+	return r;
+}
+
+static int process_create_snap_mesg(unsigned argc, char **argv,
+				    struct pool *pool)
+{
+	dm_thin_id dev_id, origin_dev_id;
+	int r;
+
+	r = check_arg_count(argc, 3);
+	if (r)
+		return r;
+
+	r = read_dev_id(argv[1], &dev_id, 1);
+	if (r)
+		return r;
+
+	r = read_dev_id(argv[2], &origin_dev_id, 1);
+	if (r)
+		return r;
+
+	r = dm_pool_create_snap(pool->pmd, dev_id, origin_dev_id);
+	if (r)
+		DMWARN("Creation of new snapshot %s of device %s failed.",
+		       argv[1], argv[2]);
+
+	return r;
+}
+
+static int process_delete_mesg(unsigned argc, char **argv, struct pool *pool)
+{
+	dm_thin_id dev_id;
+	int r;
+
+	r = check_arg_count(argc, 2);
+	if (r)
+		return r;
+
+	r = read_dev_id(argv[1], &dev_id, 1);
+	if (r)
+		return r;
+
+	r = dm_pool_delete_thin_device(pool->pmd, dev_id);
+	if (r)
+		DMWARN("Deletion of thin device %s failed.", argv[1]);
+
+	return r;
+}
+
+static int process_set_transaction_id_mesg(unsigned argc, char **argv,
+					   struct pool *pool)
+{
+	unsigned long long old_id, new_id;
+	int r;
+
+	r = check_arg_count(argc, 3);
+	if (r)
+		return r;
+
+	if (strict_strtoull(argv[1], 10, &old_id)) {
+		DMWARN("set_transaction_id message: Unrecognised id %s.",
+		       argv[1]);
+		return -EINVAL;
+	}
+
+	if (strict_strtoull(argv[2], 10, &new_id)) {
+		DMWARN("set_transaction_id message: Unrecognised new id %s.",
+		       argv[2]);
+		return -EINVAL;
+	}
+
+	r = dm_pool_set_metadata_transaction_id(pool->pmd, old_id, new_id);
+	if (r)
+		DMWARN("Failed to change transaction id from %s to %s.",
+		       argv[1], argv[2]);
+
+	return r;
+}
+
+/*
+ * Messages supported:
+ *   create_thin	<dev_id>
+ *   create_snap	<dev_id> <origin_id>
+ *   delete		<dev_id>
+ *   set_transaction_id <current_trans_id> <new_trans_id>
+ */
+static int pool_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct pool_c *pt = ti->private;
+	struct pool *pool = pt->pool;
+	int r = -EINVAL;
+
+	if (!argc)
+		return r;
+
+	if (!strcasecmp(argv[0], "create_thin"))
+		r = process_create_thin_mesg(argc, argv, pool);
+
+	else if (!strcasecmp(argv[0], "create_snap"))
+		r = process_create_snap_mesg(argc, argv, pool);
+
+	else if (!strcasecmp(argv[0], "delete"))
+		r = process_delete_mesg(argc, argv, pool);
+
+	else if (!strcasecmp(argv[0], "set_transaction_id"))
+		r = process_set_transaction_id_mesg(argc, argv, pool);
+
+	else
+		DMWARN("Unrecognised thin pool target message received: %s",
+		       argv[0]);
+
+	if (!r)
+		r = commit(pool);
+
+	return r;
+}
+
+/*
+ * Status line is:
+ *    <transaction id> <used metadata blocks>/<total metadata blocks>
+ *    <used data blocks>/<total data blocks>
+ */
+static int pool_status(struct dm_target *ti, status_type_t type,
+		       char *result, unsigned maxlen)
+{
+	struct pool_c *pt = ti->private;
+	struct pool *pool = pt->pool;
+	struct dm_pool_metadata *pmd = pool->pmd;
+	dm_block_t nr_metadata, nr_data;
+	unsigned sz = 0;
+	char buf[BDEVNAME_SIZE];
+	char buf2[BDEVNAME_SIZE];
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		nr_metadata = dm_pool_get_metadata_dev_size(pmd);
+		nr_data = dm_pool_get_data_dev_size(pmd);
+
+		DMEMIT("%llu %llu/%llu %llu/%llu",
+		       (unsigned long long) dm_pool_get_metadata_transaction_id(pmd),
+		       (unsigned long long) (nr_metadata -
+				dm_pool_get_free_metadata_block_count(pmd)),
+		       (unsigned long long) nr_metadata,
+		       (unsigned long long) (nr_data -
+				dm_pool_get_free_block_count(pmd)),
+		       (unsigned long long) nr_data);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s %s %lu %llu",
+		       format_dev_t(buf, pt->metadata_dev->bdev->bd_dev),
+		       format_dev_t(buf2, pt->data_dev->bdev->bd_dev),
+		       (unsigned long) pool->sectors_per_block,
+		       (unsigned long long) pt->low_water_blocks);
+		break;
+	}
+
+	return 0;
+}
+
+static int pool_iterate_devices(struct dm_target *ti,
+				iterate_devices_callout_fn fn, void *data)
+{
+	struct pool_c *pt = ti->private;
+
+	return fn(ti, pt->data_dev, 0, ti->len, data);
+}
+
+static struct target_type pool_target = {
+	.name = "thin-pool",
+	.version = {1, 0, 0},
+	.module = THIS_MODULE,
+	.ctr = pool_ctr,
+	.dtr = pool_dtr,
+	.map = pool_map,
+	.postsuspend = pool_postsuspend,
+	.preresume = pool_preresume,
+	.resume = pool_resume,
+	.message = pool_message,
+	.status = pool_status,
+	.iterate_devices = pool_iterate_devices,
+};
+
+/*-----------------------------------------------------------------
+ * Thin target methods
+ *---------------------------------------------------------------*/
+static void thin_dtr(struct dm_target *ti)
+{
+	struct thin_c *tc = ti->private;
+
+	mutex_lock(&dm_thin_pool_table.mutex);
+
+	dm_pool_close_thin_device(tc->td);
+	__pool_dec(tc->pool);
+	dm_put_device(ti, tc->pool_dev);
+	kfree(tc);
+
+	mutex_unlock(&dm_thin_pool_table.mutex);
+}
+
+/*
+ * Thin target parameters:
+ *
+ * <pool_dev> <dev_id>
+ *
+ * pool_dev: the path to the pool (eg, /dev/mapper/my_pool)
+ * dev_id: the internal device identifier
+ */
+static int thin_ctr(struct dm_target *ti, unsigned argc, char **argv)
+{
+	int r;
+	struct thin_c *tc;
+	struct mapped_device *pool_md;
+
+	if (argc != 2) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	mutex_lock(&dm_thin_pool_table.mutex);
+
+	tc = ti->private = kzalloc(sizeof(*tc), GFP_KERNEL);
+	if (!tc) {
+		ti->error = "Out of memory";
+		r = -ENOMEM;
+		goto out_unlock;
+	}
+	tc->ti = ti;
+
+	r = dm_get_device(ti, argv[0], dm_table_get_mode(ti->table),
+			  &tc->pool_dev);
+	if (r) {
+		ti->error = "Error opening pool device";
+		goto bad_pool_c;
+	}
+
+	r = read_dev_id(argv[1], &tc->dev_id, 0);
+	if (r) {
+		ti->error = "Invalid device id";
+		goto bad_common;
+	}
+
+	pool_md = dm_get_md(tc->pool_dev->bdev->bd_dev);
+	if (!pool_md) {
+		ti->error = "Couldn't get pool mapped device";
+		r = -EINVAL;
+		goto bad_common;
+	}
+
+	tc->pool = __pool_table_lookup(pool_md);
+	dm_put(pool_md);
+	if (!tc->pool) {
+		ti->error = "Couldn't find pool object";
+		r = -EINVAL;
+		goto bad_common;
+	}
+
+	if (!tc->pool->data_dev) {
+		ti->error = "Pool is not active";
+		r = -EINVAL;
+		goto bad_common;
+	}
+	__pool_inc(tc->pool);
+
+	r = dm_pool_open_thin_device(tc->pool->pmd, tc->dev_id, &tc->td);
+	if (r) {
+		ti->error = "Couldn't open thin internal device";
+		goto bad_thin_open;
+	}
+
+	if (ti->len >> tc->pool->block_shift >= THIN_MAX_VIRTUAL_BLOCKS) {
+		ti->error = "Thin device too large";
+		r = -EINVAL;
+		goto bad_size;
+	}
+
+	ti->split_io = tc->pool->sectors_per_block;
+	ti->num_flush_requests = 1;
+
+	mutex_unlock(&dm_thin_pool_table.mutex);
+
+	return 0;
+
+bad_size:
+	dm_pool_close_thin_device(tc->td);
+bad_thin_open:
+	__pool_dec(tc->pool);
+bad_common:
+	dm_put_device(ti, tc->pool_dev);
+bad_pool_c:
+	kfree(tc);
+out_unlock:
+	mutex_unlock(&dm_thin_pool_table.mutex);
+
+	return r;
+}
+
+static void thin_defer_bio(struct thin_c *tc, struct bio *bio,
+			   union map_info *map_context)
+{
+	struct pool *pool = tc->pool;
+	struct endio_hook *h;
+	unsigned long flags;
+
+	h = mempool_alloc(pool->endio_hook_pool, GFP_NOIO);
+	h->tc = tc;
+	h->overwrite_mapping = NULL;
+	map_context->ptr = h;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	bio_list_add(&pool->deferred_bios, bio);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	wake_worker(pool);
+}
+
+/*
+ * Bios to blocks that are mapped and not shared are remapped here.  The
+ * rest need the worker: to provision a block, to break sharing, or to
+ * commit before a flush.
+ */
+static int thin_map(struct dm_target *ti, struct bio *bio,
+		    union map_info *map_context)
+{
+	struct thin_c *tc = ti->private;
+	struct dm_thin_lookup_result result;
+	int r;
+
+	map_context->ptr = NULL;
+
+	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
+		thin_defer_bio(tc, bio, map_context);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	r = dm_thin_find_block(tc->td, get_bio_block(tc, bio), &result);
+	if (!r && !(result.shared && bio_data_dir(bio) == WRITE)) {
+		remap(tc, bio, result.block);
+		return DM_MAPIO_REMAPPED;
+	}
+
+	thin_defer_bio(tc, bio, map_context);
+	return DM_MAPIO_SUBMITTED;
+}
+
+static int thin_endio(struct dm_target *ti, struct bio *bio, int err,
+		      union map_info *map_context)
+{
+	struct thin_c *tc = ti->private;
+	struct endio_hook *h = map_context->ptr;
+	struct new_mapping *m;
+
+	if (!h)
+		return err;
+
+	m = h->overwrite_mapping;
+	if (m) {
+		/* Completed by the worker once the block is mapped. */
+		m->err = err;
+		mapping_prepared(m);
+		return DM_ENDIO_INCOMPLETE;
+	}
+
+	mempool_free(h, tc->pool->endio_hook_pool);
+	return err;
+}
+
+/*
+ * Status line is:
+ *    <nr mapped sectors>
+ */
+static int thin_status(struct dm_target *ti, status_type_t type,
+		       char *result, unsigned maxlen)
+{
+	struct thin_c *tc = ti->private;
+	unsigned sz = 0;
+	char buf[BDEVNAME_SIZE];
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		DMEMIT("%llu", (unsigned long long)
+		       (dm_thin_get_mapped_count(tc->td) *
+			tc->pool->sectors_per_block));
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s %lu",
+		       format_dev_t(buf, tc->pool_dev->bdev->bd_dev),
+		       (unsigned long) tc->dev_id);
+		break;
+	}
+
+	return 0;
+}
+
+static int thin_iterate_devices(struct dm_target *ti,
+				iterate_devices_callout_fn fn, void *data)
+{
+	struct thin_c *tc = ti->private;
+	struct pool *pool = tc->pool;
+	dm_block_t blocks = dm_pool_get_data_dev_size(pool->pmd);
+
+	return fn(ti, tc->pool_dev, 0, blocks * pool->sectors_per_block, data);
+}
+
+static struct target_type thin_target = {
+	.name = "thin",
+	.version = {1, 0, 0},
+	.module	= THIS_MODULE,
+	.ctr = thin_ctr,
+	.dtr = thin_dtr,
+	.map = thin_map,
+	.end_io = thin_endio,
+	.status = thin_status,
+	.iterate_devices = thin_iterate_devices,
+};
+
+/*----------------------------------------------------------------*/
+
+static int __init dm_thin_init(void)
+{
+	int r;
+
+	pool_table_init();
+
+	_zero_page_list.next = &_zero_page_list;
+	_zero_page_list.page = ZERO_PAGE(0);
+
+	_new_mapping_cache = KMEM_CACHE(new_mapping, 0);
+	if (!_new_mapping_cache)
+		return -ENOMEM;
+
+	_endio_hook_cache = KMEM_CACHE(endio_hook, 0);
+	if (!_endio_hook_cache) {
+		r = -ENOMEM;
+		goto bad_endio_hook_cache;
+	}
+
+	r = dm_register_target(&thin_target);
+	if (r)
+		goto bad_thin_target;
+
+	r = dm_register_target(&pool_target);
+	if (r)
+		goto bad_pool_target;
+
+	return 0;
+
+bad_pool_target:
+	dm_unregister_target(&thin_target);
+bad_thin_target:
+	kmem_cache_destroy(_endio_hook_cache);
+bad_endio_hook_cache:
+	kmem_cache_destroy(_new_mapping_cache);
+
+	return r;
+}
+
+static void __exit dm_thin_exit(void)
+{
+	dm_unregister_target(&thin_target);
+	dm_unregister_target(&pool_target);
+	kmem_cache_destroy(_endio_hook_cache);
+	kmem_cache_destroy(_new_mapping_cache);
+}
+
+module_init(dm_thin_init);
+module_exit(dm_thin_exit);
+
+MODULE_DESCRIPTION(DM_NAME " thin provisioning target");
+MODULE_LICENSE("GPL");
@@ -210,6 +210,9 @@ struct stripe_head {
 	unsigned long		state;		/* state flags */
 	atomic_t		count;	      /* nr of active thread/requests */
 	spinlock_t		lock;
+	int			cpu;		/* CPU whose worker group
+						 * handles the stripe */
+	struct r5worker_group	*group;		/* on group->handle_list */
 	int			bm_seq;	/* sequence number for bitmap flushes */
 	int			disks;		/* disks in stripe */
 	enum check_states	check_state;
@@ -344,6 +347,25 @@ struct disk_info {
 	mdk_rdev_t	*rdev;
 };
 
+/*
+ * Stripe handling can be spread over groups of worker threads, one group
+ * per NUMA node.  A stripe that needs handling is queued to the group of
+ * the CPU that last initialized it, and the workers of that group run
+ * handle_stripe() on different stripes in parallel.
+ */
+struct r5worker {
+	struct work_struct	work;
+	struct r5worker_group	*group;
+	bool			working;	/* queued or running */
+};
+
+struct r5worker_group {
+	struct list_head	handle_list;
+	struct raid5_private_data *conf;
+	struct r5worker		*workers;
+	int			stripes_cnt;	/* length of handle_list */
+};
+
 struct raid5_private_data {
 	struct hlist_head	*stripe_hashtbl;
 	mddev_t			*mddev;
@@ -372,6 +394,9 @@ struct raid5_private_data {
 						     * metadata */
 
 	struct list_head	handle_list; /* stripes needing handling */
+	struct r5worker_group	*worker_groups;
+	int			group_cnt;
+	int			worker_cnt_per_group; /* 0: raid5d only */
 	struct list_head	hold_list; /* preread ready stripes */
 	struct list_head	delayed_list; /* stripes that have plugged requests */
 	struct list_head	bitmap_list; /* stripes delaying awaiting bitmap update */
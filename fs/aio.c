@@ -35,6 +35,7 @@
 #include <linux/eventfd.h>
 #include <linux/blkdev.h>
 #include <linux/compat.h>
+#include <linux/percpu.h>
 
 #include <asm/kmap_types.h>
 #include <asm/uaccess.h>
@@ -54,6 +55,17 @@ unsigned long aio_max_nr = 0x10000; /* system wide maximum number of aio request
 static struct kmem_cache	*kiocb_cachep;
 static struct kmem_cache	*kioctx_cachep;
 
+/*
+ * The contexts of an mm, indexed by kioctx->id.  The id is also stored in
+ * the ring header, so a context id can be turned into its kioctx without
+ * searching.  The table only ever grows and is replaced under RCU.
+ */
+struct kioctx_table {
+	struct rcu_head		rcu;
+	unsigned		nr;
+	struct kioctx __rcu	*table[];
+};
+
 static struct workqueue_struct *aio_wq;
 
 /* Used for rare fput completion. */
@@ -112,6 +124,14 @@ static int aio_setup_ring(struct kioctx *ctx)
 	unsigned long size;
 	int nr_pages;
 
+	/*
+	 * Up to half of the free slots may be cached by other cpus (see
+	 * get_reqs_available()), so double the ring to make sure the
+	 * caller can have max_reqs requests in flight.  Each cpu takes
+	 * slots in batches, which must not be empty.
+	 */
+	nr_events = max(nr_events, num_possible_cpus() * 4) * 2;
+
 	/* Compensate for the ring buffer's head/tail overlap entry */
 	nr_events += 2;	/* 1 is required, 2 for good luck */
 
@@ -162,7 +182,7 @@ static int aio_setup_ring(struct kioctx *ctx)
 
 	ring = kmap_atomic(info->ring_pages[0], KM_USER0);
 	ring->nr = nr_events;	/* user copy */
-	ring->id = ctx->user_id;
+	ring->id = ~0U;		/* set by ioctx_add_table() */
 	ring->head = ring->tail = 0;
 	ring->magic = AIO_RING_MAGIC;
 	ring->compat_features = AIO_RING_COMPAT_FEATURES;
@@ -201,6 +221,7 @@ static void ctx_rcu_free(struct rcu_head *head)
 	struct kioctx *ctx = container_of(head, struct kioctx, rcu_head);
 	unsigned nr_events = ctx->max_reqs;
 
+	free_percpu(ctx->cpu);
 	kmem_cache_free(kioctx_cachep, ctx);
 
 	if (nr_events) {
@@ -215,9 +236,19 @@ static void ctx_rcu_free(struct rcu_head *head)
  *	Called when the last user of an aio context has gone away,
  *	and the struct needs to be freed.
  */
+static int aio_reqs_active(struct kioctx *ctx)
+{
+	int cpu, active = 0;
+
+	for_each_possible_cpu(cpu)
+		active += per_cpu_ptr(ctx->cpu, cpu)->reqs_active;
+
+	return active;
+}
+
 static void __put_ioctx(struct kioctx *ctx)
 {
-	BUG_ON(ctx->reqs_active);
+	BUG_ON(aio_reqs_active(ctx));
 
 	cancel_delayed_work(&ctx->wq);
 	cancel_work_sync(&ctx->wq.work);
@@ -246,6 +277,79 @@ static inline void put_ioctx(struct kioctx *kioctx)
 		__put_ioctx(kioctx);
 }
 
+static void ioctx_table_rcu_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct kioctx_table, rcu));
+}
+
+/* ioctx_add_table
+ *	Gives ctx a free slot in the mm's table, growing the table if it
+ *	is full, and records the slot in the ring header for lookup_ioctx().
+ */
+static int ioctx_add_table(struct kioctx *ctx, struct mm_struct *mm)
+{
+	struct kioctx_table *table, *old;
+	struct aio_ring *ring;
+	unsigned i, nr;
+
+	spin_lock(&mm->ioctx_lock);
+	while (1) {
+		table = rcu_dereference_protected(mm->ioctx_table,
+					lockdep_is_held(&mm->ioctx_lock));
+		if (table) {
+			for (i = 0; i < table->nr; i++)
+				if (!rcu_dereference_protected(table->table[i],
+					lockdep_is_held(&mm->ioctx_lock)))
+					goto found;
+		}
+
+		nr = table ? table->nr * 4 : 4;
+		spin_unlock(&mm->ioctx_lock);
+
+		table = kzalloc(sizeof(*table) + sizeof(table->table[0]) * nr,
+				GFP_KERNEL);
+		if (!table)
+			return -ENOMEM;
+		table->nr = nr;
+
+		spin_lock(&mm->ioctx_lock);
+		old = rcu_dereference_protected(mm->ioctx_table,
+					lockdep_is_held(&mm->ioctx_lock));
+		if (old && old->nr >= nr) {
+			/* someone else grew it while we were allocating */
+			kfree(table);
+			continue;
+		}
+		if (old)
+			memcpy(table->table, old->table,
+			       sizeof(table->table[0]) * old->nr);
+		rcu_assign_pointer(mm->ioctx_table, table);
+		if (old)
+			call_rcu(&old->rcu, ioctx_table_rcu_free);
+	}
+
+found:
+	ctx->id = i;
+	ring = kmap_atomic(ctx->ring_info.ring_pages[0], KM_USER0);
+	ring->id = i;
+	kunmap_atomic(ring, KM_USER0);
+	rcu_assign_pointer(table->table[i], ctx);
+	spin_unlock(&mm->ioctx_lock);
+	return 0;
+}
+
+/* Called with mm->ioctx_lock held. */
+static void ioctx_remove_table(struct kioctx *ctx, struct mm_struct *mm)
+{
+	struct kioctx_table *table;
+
+	table = rcu_dereference_protected(mm->ioctx_table,
+				lockdep_is_held(&mm->ioctx_lock));
+	WARN_ON(rcu_dereference_protected(table->table[ctx->id],
+				lockdep_is_held(&mm->ioctx_lock)) != ctx);
+	rcu_assign_pointer(table->table[ctx->id], NULL);
+}
+
 /* ioctx_alloc
  *	Allocates and initializes an ioctx.  Returns an ERR_PTR if it failed.
  */
@@ -269,6 +373,12 @@ static struct kioctx *ioctx_alloc(unsigned nr_events)
 	if (!ctx)
 		return ERR_PTR(-ENOMEM);
 
+	ctx->cpu = alloc_percpu(struct kioctx_cpu);
+	if (!ctx->cpu) {
+		kmem_cache_free(kioctx_cachep, ctx);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	ctx->max_reqs = nr_events;
 	mm = ctx->mm = current->mm;
 	atomic_inc(&mm->mm_count);
@@ -285,6 +395,11 @@ static struct kioctx *ioctx_alloc(unsigned nr_events)
 	if (aio_setup_ring(ctx) < 0)
 		goto out_freectx;
 
+	atomic_set(&ctx->reqs_available, ctx->ring_info.nr - 1);
+	ctx->req_batch = (ctx->ring_info.nr - 1) / (num_possible_cpus() * 4);
+	if (ctx->req_batch < 1)
+		ctx->req_batch = 1;
+
 	/* limit the number of system wide aios */
 	do {
 		spin_lock_bh(&aio_nr_lock);
@@ -306,10 +421,8 @@ static struct kioctx *ioctx_alloc(unsigned nr_events)
 	if (ctx->max_reqs == 0)
 		goto out_cleanup;
 
-	/* now link into global list. */
-	spin_lock(&mm->ioctx_lock);
-	hlist_add_head_rcu(&ctx->list, &mm->ioctx_list);
-	spin_unlock(&mm->ioctx_lock);
+	if (ioctx_add_table(ctx, mm) < 0)
+		goto out_cleanup_nomem;
 
 	dprintk("aio: allocated ioctx %p[%ld]: mm=%p mask=0x%x\n",
 		ctx, ctx->user_id, current->mm, ctx->ring_info.nr);
@@ -319,8 +432,13 @@ out_cleanup:
 	__put_ioctx(ctx);
 	return ERR_PTR(-EAGAIN);
 
+out_cleanup_nomem:
+	__put_ioctx(ctx);
+	return ERR_PTR(-ENOMEM);
+
 out_freectx:
 	mmdrop(mm);
+	free_percpu(ctx->cpu);
 	kmem_cache_free(kioctx_cachep, ctx);
 	ctx = ERR_PTR(-ENOMEM);
 
@@ -361,12 +479,12 @@ static void wait_for_all_aios(struct kioctx *ctx)
 	DECLARE_WAITQUEUE(wait, tsk);
 
 	spin_lock_irq(&ctx->ctx_lock);
-	if (!ctx->reqs_active)
+	if (!aio_reqs_active(ctx))
 		goto out;
 
 	add_wait_queue(&ctx->wait, &wait);
 	set_task_state(tsk, TASK_UNINTERRUPTIBLE);
-	while (ctx->reqs_active) {
+	while (aio_reqs_active(ctx)) {
 		spin_unlock_irq(&ctx->ctx_lock);
 		io_schedule();
 		set_task_state(tsk, TASK_UNINTERRUPTIBLE);
@@ -404,11 +522,20 @@ EXPORT_SYMBOL(wait_on_sync_kiocb);
  */
 void exit_aio(struct mm_struct *mm)
 {
+	struct kioctx_table *table;
 	struct kioctx *ctx;
+	unsigned i;
+
+	/* Nothing can look the contexts up any more, so no locking. */
+	table = rcu_dereference_raw(mm->ioctx_table);
+	if (!table)
+		return;
 
-	while (!hlist_empty(&mm->ioctx_list)) {
-		ctx = hlist_entry(mm->ioctx_list.first, struct kioctx, list);
-		hlist_del_rcu(&ctx->list);
+	for (i = 0; i < table->nr; i++) {
+		ctx = rcu_dereference_raw(table->table[i]);
+		if (!ctx)
+			continue;
+		RCU_INIT_POINTER(table->table[i], NULL);
 
 		aio_cancel_all(ctx);
 
@@ -422,9 +549,117 @@ void exit_aio(struct mm_struct *mm)
 			printk(KERN_DEBUG
 				"exit_aio:ioctx still alive: %d %d %d\n",
 				atomic_read(&ctx->users), ctx->dead,
-				ctx->reqs_active);
+				aio_reqs_active(ctx));
 		put_ioctx(ctx);
 	}
+
+	RCU_INIT_POINTER(mm->ioctx_table, NULL);
+	kfree(table);
+}
+
+static void put_reqs_available(struct kioctx *ctx, unsigned nr)
+{
+	struct kioctx_cpu *kcpu;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	kcpu = this_cpu_ptr(ctx->cpu);
+	kcpu->reqs_available += nr;
+
+	while (kcpu->reqs_available >= ctx->req_batch * 2) {
+		kcpu->reqs_available -= ctx->req_batch;
+		atomic_add(ctx->req_batch, &ctx->reqs_available);
+	}
+	local_irq_restore(flags);
+}
+
+static bool __get_reqs_available(struct kioctx *ctx)
+{
+	struct kioctx_cpu *kcpu;
+	bool ret = false;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	kcpu = this_cpu_ptr(ctx->cpu);
+	if (!kcpu->reqs_available) {
+		int old, avail = atomic_read(&ctx->reqs_available);
+
+		do {
+			if (avail < ctx->req_batch)
+				goto out;
+
+			old = avail;
+			avail = atomic_cmpxchg(&ctx->reqs_available,
+					       avail, avail - ctx->req_batch);
+		} while (avail != old);
+
+		kcpu->reqs_available += ctx->req_batch;
+	}
+
+	ret = true;
+	kcpu->reqs_available--;
+out:
+	local_irq_restore(flags);
+	return ret;
+}
+
+/* refill_reqs_available
+ *	Gives back the slots of events that have been reaped, by the kernel
+ *	or by userspace, since the last call.  head comes from the ring and
+ *	so can not be trusted; the worst userspace can do by lying about it
+ *	is to overwrite its own events.  Called with ctx_lock held.
+ */
+static void refill_reqs_available(struct kioctx *ctx, unsigned head,
+				  unsigned tail)
+{
+	unsigned events_in_ring, completed;
+
+	head %= ctx->ring_info.nr;
+	if (head <= tail)
+		events_in_ring = tail - head;
+	else
+		events_in_ring = ctx->ring_info.nr - (head - tail);
+
+	completed = ctx->completed_events;
+	if (events_in_ring < completed)
+		completed -= events_in_ring;
+	else
+		completed = 0;
+
+	if (!completed)
+		return;
+
+	ctx->completed_events -= completed;
+	put_reqs_available(ctx, completed);
+}
+
+/* user_refill_reqs_available
+ *	Called when there are no free slots left, in case userspace has
+ *	reaped events from the ring without a syscall since the last
+ *	completion.
+ */
+static void user_refill_reqs_available(struct kioctx *ctx)
+{
+	struct aio_ring *ring;
+	unsigned head;
+
+	spin_lock_irq(&ctx->ctx_lock);
+	if (ctx->completed_events) {
+		ring = kmap_atomic(ctx->ring_info.ring_pages[0], KM_USER0);
+		head = ring->head;
+		kunmap_atomic(ring, KM_USER0);
+
+		refill_reqs_available(ctx, head, ctx->ring_info.tail);
+	}
+	spin_unlock_irq(&ctx->ctx_lock);
+}
+
+static bool get_reqs_available(struct kioctx *ctx)
+{
+	if (__get_reqs_available(ctx))
+		return true;
+	user_refill_reqs_available(ctx);
+	return __get_reqs_available(ctx);
 }
 
 /* aio_get_req
@@ -440,12 +675,16 @@ void exit_aio(struct mm_struct *mm)
 static struct kiocb *__aio_get_req(struct kioctx *ctx)
 {
 	struct kiocb *req = NULL;
-	struct aio_ring *ring;
-	int okay = 0;
+
+	/* Make sure the completion ring will have room for our event. */
+	if (!get_reqs_available(ctx))
+		return NULL;
 
 	req = kmem_cache_alloc(kiocb_cachep, GFP_KERNEL);
-	if (unlikely(!req))
+	if (unlikely(!req)) {
+		put_reqs_available(ctx, 1);
 		return NULL;
+	}
 
 	req->ki_flags = 0;
 	req->ki_users = 2;
@@ -457,25 +696,14 @@ static struct kiocb *__aio_get_req(struct kioctx *ctx)
 	req->private = NULL;
 	req->ki_iovec = NULL;
 	INIT_LIST_HEAD(&req->ki_run_list);
+	INIT_LIST_HEAD(&req->ki_list);
 	req->ki_eventfd = NULL;
 
-	/* Check if the completion queue has enough free space to
-	 * accept an event from this io.
+	/*
+	 * io_submit_one() checks ctx->dead under ctx_lock after this, which
+	 * orders the increment against wait_for_all_aios().
 	 */
-	spin_lock_irq(&ctx->ctx_lock);
-	ring = kmap_atomic(ctx->ring_info.ring_pages[0], KM_USER0);
-	if (ctx->reqs_active < aio_ring_avail(&ctx->ring_info, ring)) {
-		list_add(&req->ki_list, &ctx->active_reqs);
-		ctx->reqs_active++;
-		okay = 1;
-	}
-	kunmap_atomic(ring, KM_USER0);
-	spin_unlock_irq(&ctx->ctx_lock);
-
-	if (!okay) {
-		kmem_cache_free(kiocb_cachep, req);
-		req = NULL;
-	}
+	irqsafe_cpu_inc(ctx->cpu->reqs_active);
 
 	return req;
 }
@@ -506,9 +734,9 @@ static inline void really_put_req(struct kioctx *ctx, struct kiocb *req)
 	if (req->ki_iovec != &req->ki_inline_vec)
 		kfree(req->ki_iovec);
 	kmem_cache_free(kiocb_cachep, req);
-	ctx->reqs_active--;
+	__this_cpu_dec(ctx->cpu->reqs_active);
 
-	if (unlikely(!ctx->reqs_active && ctx->dead))
+	if (unlikely(ctx->dead && !aio_reqs_active(ctx)))
 		wake_up_all(&ctx->wait);
 }
 
@@ -589,31 +817,68 @@ int aio_put_req(struct kiocb *req)
 }
 EXPORT_SYMBOL(aio_put_req);
 
+/* lookup_ioctx
+ *	The context id is the address of the ring, whose header holds the
+ *	index of the context in the mm's table.  Userspace can scribble on
+ *	the header, so the id found there is only trusted once the context
+ *	in that slot turns out to have the same ring.
+ */
 static struct kioctx *lookup_ioctx(unsigned long ctx_id)
 {
+	struct aio_ring __user *ring = (void __user *)ctx_id;
 	struct mm_struct *mm = current->mm;
 	struct kioctx *ctx, *ret = NULL;
-	struct hlist_node *n;
+	struct kioctx_table *table;
+	unsigned id;
+
+	if (get_user(id, &ring->id))
+		return NULL;
 
 	rcu_read_lock();
 
-	hlist_for_each_entry_rcu(ctx, n, &mm->ioctx_list, list) {
-		/*
-		 * RCU protects us against accessing freed memory but
-		 * we have to be careful not to get a reference when the
-		 * reference count already dropped to 0 (ctx->dead test
-		 * is unreliable because of races).
-		 */
-		if (ctx->user_id == ctx_id && !ctx->dead && try_get_ioctx(ctx)){
-			ret = ctx;
-			break;
-		}
-	}
+	table = rcu_dereference(mm->ioctx_table);
+	if (!table || id >= table->nr)
+		goto out;
 
+	ctx = rcu_dereference(table->table[id]);
+	/*
+	 * RCU protects us against accessing freed memory but
+	 * we have to be careful not to get a reference when the
+	 * reference count already dropped to 0 (ctx->dead test
+	 * is unreliable because of races).
+	 */
+	if (ctx && ctx->user_id == ctx_id && !ctx->dead && try_get_ioctx(ctx))
+		ret = ctx;
+out:
 	rcu_read_unlock();
 	return ret;
 }
 
+/* kiocb_set_cancel_fn
+ *	Makes a request cancellable by io_cancel() and when its context is
+ *	destroyed.  Only requests that have a cancel method are kept on the
+ *	context's active_reqs list, so that submission does not need to take
+ *	ctx_lock.
+ */
+void kiocb_set_cancel_fn(struct kiocb *req,
+			 int (*cancel)(struct kiocb *, struct io_event *))
+{
+	struct kioctx *ctx = req->ki_ctx;
+	unsigned long flags;
+
+	if (is_sync_kiocb(req)) {
+		req->ki_cancel = cancel;
+		return;
+	}
+
+	spin_lock_irqsave(&ctx->ctx_lock, flags);
+	if (list_empty(&req->ki_list))
+		list_add(&req->ki_list, &ctx->active_reqs);
+	req->ki_cancel = cancel;
+	spin_unlock_irqrestore(&ctx->ctx_lock, flags);
+}
+EXPORT_SYMBOL(kiocb_set_cancel_fn);
+
 /*
  * Queue up a kiocb to be retried. Assumes that the kiocb
  * has already been marked as kicked, and places it on
@@ -787,17 +1052,13 @@ static int __aio_run_iocbs(struct kioctx *ctx)
 
 static void aio_queue_work(struct kioctx * ctx)
 {
-	unsigned long timeout;
 	/*
-	 * if someone is waiting, get the work started right
-	 * away, otherwise, use a longer delay
+	 * Start the retries right away even if nobody is waiting in
+	 * io_getevents(): the process may be waiting on an eventfd, or
+	 * reaping the ring itself, and a kicked iocb usually has its data
+	 * ready.
 	 */
-	smp_mb();
-	if (waitqueue_active(&ctx->wait))
-		timeout = 1;
-	else
-		timeout = HZ/10;
-	queue_delayed_work(aio_wq, &ctx->wq, timeout);
+	queue_delayed_work(aio_wq, &ctx->wq, 0);
 }
 
 /*
@@ -936,8 +1197,10 @@ int aio_complete(struct kiocb *iocb, long res, long res2)
 	 * cancelled requests don't get events, userland was given one
 	 * when the event got cancelled.
 	 */
-	if (kiocbIsCancelled(iocb))
+	if (kiocbIsCancelled(iocb)) {
+		put_reqs_available(ctx, 1);
 		goto put_rq;
+	}
 
 	ring = kmap_atomic(info->ring_pages[0], KM_IRQ1);
 
@@ -963,6 +1226,15 @@ int aio_complete(struct kiocb *iocb, long res, long res2)
 	info->tail = tail;
 	ring->tail = tail;
 
+	/*
+	 * The slot of the event only becomes free again once the event has
+	 * been reaped, which userspace may do behind our back.  Work out
+	 * from head how many have been reaped since the last completion.
+	 */
+	ctx->completed_events++;
+	if (ctx->completed_events > 1)
+		refill_reqs_available(ctx, ring->head, tail);
+
 	put_aio_ring_event(event, KM_IRQ0);
 	kunmap_atomic(ring, KM_IRQ1);
 
@@ -999,8 +1271,9 @@ EXPORT_SYMBOL(aio_complete);
 /* aio_read_evt
  *	Pull an event off of the ioctx's event ring.  Returns the number of 
  *	events fetched (0 or 1 ;-)
- *	FIXME: make this use cmpxchg.
- *	TODO: make the ringbuffer user mmap()able (requires FIXME).
+ *	The slot is given back to reqs_available by the next completion, or
+ *	by the next submission that finds none free, just as for events
+ *	reaped by userspace from the mmap()ed ring.
  */
 static int aio_read_evt(struct kioctx *ioctx, struct io_event *ent)
 {
@@ -1156,7 +1429,7 @@ retry:
 				break;
 			/* Try to only show up in io wait if there are ops
 			 *  in flight */
-			if (ctx->reqs_active)
+			if (aio_reqs_active(ctx))
 				io_schedule();
 			else
 				schedule();
@@ -1203,7 +1476,8 @@ static void io_destroy(struct kioctx *ioctx)
 	spin_lock(&mm->ioctx_lock);
 	was_dead = ioctx->dead;
 	ioctx->dead = 1;
-	hlist_del_rcu(&ioctx->list);
+	if (likely(!was_dead))
+		ioctx_remove_table(ioctx, mm);
 	spin_unlock(&mm->ioctx_lock);
 
 	dprintk("aio_release(%p)\n", ioctx);
@@ -1589,7 +1863,7 @@ static int io_submit_one(struct kioctx *ctx, struct iocb __user *user_iocb,
 	 * check here is reliable: io_destroy() sets ctx->dead before waiting
 	 * for outstanding IO and the barrier between these two is realized by
 	 * unlock of mm->ioctx_lock and lock of ctx->ctx_lock.  Analogously we
-	 * increment ctx->reqs_active before checking for ctx->dead and the
+	 * count the request as active before checking for ctx->dead and the
 	 * barrier is realized by unlock and lock of ctx->ctx_lock. Thus if we
 	 * don't see ctx->dead set here, io_destroy() waits for our IO to
 	 * finish.
@@ -1611,6 +1885,7 @@ static int io_submit_one(struct kioctx *ctx, struct iocb __user *user_iocb,
 	return 0;
 
 out_put_req:
+	put_reqs_available(ctx, 1);	/* no event will be added */
 	aio_put_req(req);	/* drop extra ref to req */
 	aio_put_req(req);	/* drop i/o ref to req */
 	return ret;
@@ -35,6 +35,7 @@
 #include <linux/hardirq.h>
 #include <linux/bit_spinlock.h>
 #include <linux/rculist_bl.h>
+#include <linux/percpu_counter.h>
 #include "internal.h"
 
 /*
@@ -45,8 +46,8 @@
  *   - the dcache hash table
  * s_anon bl list spinlock protects:
  *   - the s_anon list (see __d_drop)
- * dcache_lru_lock protects:
- *   - the dcache lru lists and counters
+ * the per node locks of sb->s_dentry_lru protect:
+ *   - the dcache lru lists, and the lists the shrinkers isolate dentries to
  * d_lock protects:
  *   - d_flags
  *   - d_name
@@ -60,7 +61,7 @@
  * Ordering:
  * dentry->d_inode->i_lock
  *   dentry->d_lock
- *     dcache_lru_lock
+ *     sb->s_dentry_lru node lock
  *     dcache_hash_bucket lock
  *     s_anon lock
  *
@@ -78,7 +79,6 @@
 int sysctl_vfs_cache_pressure __read_mostly = 100;
 EXPORT_SYMBOL_GPL(sysctl_vfs_cache_pressure);
 
-static __cacheline_aligned_in_smp DEFINE_SPINLOCK(dcache_lru_lock);
 __cacheline_aligned_in_smp DEFINE_SEQLOCK(rename_lock);
 
 EXPORT_SYMBOL(rename_lock);
@@ -116,6 +116,18 @@ struct dentry_stat_t dentry_stat = {
 
 static DEFINE_PER_CPU(unsigned int, nr_dentry);
 
+/*
+ * Unused dentries of all superblocks, per node of their memory, so that
+ * the shrinker of a node can size its work without walking superblocks.
+ */
+static struct percpu_counter *nr_dentry_unused;
+
+static inline struct percpu_counter *
+dentry_unused_counter(struct dentry *dentry)
+{
+	return &nr_dentry_unused[page_to_nid(virt_to_page(dentry))];
+}
+
 #if defined(CONFIG_SYSCTL) && defined(CONFIG_PROC_FS)
 static int get_nr_dentry(void)
 {
@@ -126,10 +138,20 @@ static int get_nr_dentry(void)
 	return sum < 0 ? 0 : sum;
 }
 
+static int get_nr_dentry_unused(void)
+{
+	int nid;
+	s64 sum = 0;
+	for_each_node(nid)
+		sum += percpu_counter_sum_positive(&nr_dentry_unused[nid]);
+	return min_t(s64, sum, INT_MAX);
+}
+
 int proc_nr_dentry(ctl_table *table, int write, void __user *buffer,
 		   size_t *lenp, loff_t *ppos)
 {
 	dentry_stat.nr_dentry = get_nr_dentry();
+	dentry_stat.nr_unused = get_nr_dentry_unused();
 	return proc_dointvec(table, write, buffer, lenp, ppos);
 }
 #endif
@@ -224,46 +246,31 @@ static void dentry_unlink_inode(struct dentry * dentry)
 }
 
 /*
- * dentry_lru_(add|del|move_tail) must be called with d_lock held.
+ * dentry_lru_(add|del|expire) must be called with d_lock held.
+ *
+ * A dentry that a shrinker has isolated to its private list stays
+ * counted as unused, and is taken off that list by dentry_lru_del()
+ * like off the lru: the list holds the dentries of one node only, and
+ * is serialized by the same node lock.
  */
 static void dentry_lru_add(struct dentry *dentry)
 {
-	if (list_empty(&dentry->d_lru)) {
-		spin_lock(&dcache_lru_lock);
-		list_add(&dentry->d_lru, &dentry->d_sb->s_dentry_lru);
-		dentry->d_sb->s_nr_dentry_unused++;
-		dentry_stat.nr_unused++;
-		spin_unlock(&dcache_lru_lock);
-	}
-}
-
-static void __dentry_lru_del(struct dentry *dentry)
-{
-	list_del_init(&dentry->d_lru);
-	dentry->d_sb->s_nr_dentry_unused--;
-	dentry_stat.nr_unused--;
+	if (list_empty(&dentry->d_lru) &&
+	    list_lru_add(&dentry->d_sb->s_dentry_lru, &dentry->d_lru))
+		percpu_counter_inc(dentry_unused_counter(dentry));
 }
 
 static void dentry_lru_del(struct dentry *dentry)
 {
-	if (!list_empty(&dentry->d_lru)) {
-		spin_lock(&dcache_lru_lock);
-		__dentry_lru_del(dentry);
-		spin_unlock(&dcache_lru_lock);
-	}
+	if (!list_empty(&dentry->d_lru) &&
+	    list_lru_del(&dentry->d_sb->s_dentry_lru, &dentry->d_lru))
+		percpu_counter_dec(dentry_unused_counter(dentry));
 }
 
-static void dentry_lru_move_tail(struct dentry *dentry)
+static void dentry_lru_expire(struct dentry *dentry)
 {
-	spin_lock(&dcache_lru_lock);
-	if (list_empty(&dentry->d_lru)) {
-		list_add_tail(&dentry->d_lru, &dentry->d_sb->s_dentry_lru);
-		dentry->d_sb->s_nr_dentry_unused++;
-		dentry_stat.nr_unused++;
-	} else {
-		list_move_tail(&dentry->d_lru, &dentry->d_sb->s_dentry_lru);
-	}
-	spin_unlock(&dcache_lru_lock);
+	if (list_lru_expire(&dentry->d_sb->s_dentry_lru, &dentry->d_lru))
+		percpu_counter_inc(dentry_unused_counter(dentry));
 }
 
 /**
@@ -711,76 +718,91 @@ static void shrink_dentry_list(struct list_head *list)
 	rcu_read_unlock();
 }
 
+struct dentry_lru_walk {
+	struct list_head	*dispose;
+	int			flags;
+};
+
+static enum lru_status dentry_lru_isolate(struct list_head *item,
+					  spinlock_t *lru_lock, void *arg)
+{
+	struct dentry_lru_walk *walk = arg;
+	struct dentry *dentry = list_entry(item, struct dentry, d_lru);
+
+	/*
+	 * The lru lock nests inside d_lock, so only try it, and leave
+	 * the dentry to the next walk if someone else has it.
+	 */
+	if (!spin_trylock(&dentry->d_lock))
+		return LRU_SKIP;
+
+	/*
+	 * If we are honouring the DCACHE_REFERENCED flag and the
+	 * dentry has this flag set, don't free it.  Clear the flag
+	 * and put it back on the LRU.
+	 */
+	if (walk->flags & DCACHE_REFERENCED &&
+			dentry->d_flags & DCACHE_REFERENCED) {
+		dentry->d_flags &= ~DCACHE_REFERENCED;
+		spin_unlock(&dentry->d_lock);
+		return LRU_ROTATE;
+	}
+
+	list_move_tail(&dentry->d_lru, walk->dispose);
+	spin_unlock(&dentry->d_lock);
+	return LRU_ISOLATED;
+}
+
 /**
  * __shrink_dcache_sb - shrink the dentry LRU on a given superblock
  * @sb:		superblock to shrink dentry LRU.
- * @count:	number of entries to prune
+ * @nid:	node whose dentries to shrink
+ * @count:	number of entries to look at
  * @flags:	flags to control the dentry processing
  *
  * If flags contains DCACHE_REFERENCED reference dentries will not be pruned.
+ * Returns the number of dentries taken off the LRU to be pruned.
  */
-static void __shrink_dcache_sb(struct super_block *sb, int *count, int flags)
+static int __shrink_dcache_sb(struct super_block *sb, int nid, int count,
+			      int flags)
 {
 	/* called from prune_dcache() and shrink_dcache_parent() */
-	struct dentry *dentry;
-	LIST_HEAD(referenced);
-	LIST_HEAD(tmp);
-	int cnt = *count;
-
-relock:
-	spin_lock(&dcache_lru_lock);
-	while (!list_empty(&sb->s_dentry_lru)) {
-		dentry = list_entry(sb->s_dentry_lru.prev,
-				struct dentry, d_lru);
-		BUG_ON(dentry->d_sb != sb);
-
-		if (!spin_trylock(&dentry->d_lock)) {
-			spin_unlock(&dcache_lru_lock);
-			cpu_relax();
-			goto relock;
-		}
+	unsigned long nr_to_walk = count;
+	LIST_HEAD(dispose);
+	struct dentry_lru_walk walk = {
+		.dispose = &dispose,
+		.flags = flags,
+	};
+	int isolated;
 
-		/*
-		 * If we are honouring the DCACHE_REFERENCED flag and the
-		 * dentry has this flag set, don't free it.  Clear the flag
-		 * and put it back on the LRU.
-		 */
-		if (flags & DCACHE_REFERENCED &&
-				dentry->d_flags & DCACHE_REFERENCED) {
-			dentry->d_flags &= ~DCACHE_REFERENCED;
-			list_move(&dentry->d_lru, &referenced);
-			spin_unlock(&dentry->d_lock);
-		} else {
-			list_move_tail(&dentry->d_lru, &tmp);
-			spin_unlock(&dentry->d_lock);
-			if (!--cnt)
-				break;
-		}
-		cond_resched_lock(&dcache_lru_lock);
-	}
-	if (!list_empty(&referenced))
-		list_splice(&referenced, &sb->s_dentry_lru);
-	spin_unlock(&dcache_lru_lock);
+	isolated = list_lru_walk_node(&sb->s_dentry_lru, nid,
+				      dentry_lru_isolate, &walk, &nr_to_walk);
+	shrink_dentry_list(&dispose);
+	return isolated;
+}
 
-	shrink_dentry_list(&tmp);
+/* The unused dentries of all superblocks on a node, roughly */
+static int nr_dentry_unused_node(int nid)
+{
+	s64 unused = percpu_counter_read_positive(&nr_dentry_unused[nid]);
 
-	*count = cnt;
+	return min_t(s64, unused, INT_MAX);
 }
 
 /**
  * prune_dcache - shrink the dcache
  * @count: number of entries to try to free
+ * @nid: node to free them on
  *
- * Shrink the dcache. This is done when we need more memory, or simply when we
- * need to unmount something (at which point we need to unuse all dentries).
+ * Shrink the dcache on a node. This is done when the node needs more memory.
  *
  * This function may fail to free any resources if all the dentries are in use.
  */
-static void prune_dcache(int count)
+static void prune_dcache(int count, int nid)
 {
 	struct super_block *sb, *p = NULL;
 	int w_count;
-	int unused = dentry_stat.nr_unused;
+	int unused = nr_dentry_unused_node(nid);
 	int prune_ratio;
 	int pruned;
 
@@ -792,9 +814,12 @@ static void prune_dcache(int count)
 		prune_ratio = unused / count;
 	spin_lock(&sb_lock);
 	list_for_each_entry(sb, &super_blocks, s_list) {
+		int sb_unused;
+
 		if (list_empty(&sb->s_instances))
 			continue;
-		if (sb->s_nr_dentry_unused == 0)
+		sb_unused = list_lru_count_node(&sb->s_dentry_lru, nid);
+		if (sb_unused == 0)
 			continue;
 		sb->s_count++;
 		/* Now, we reclaim unused dentrins with fairness.
@@ -808,9 +833,9 @@ static void prune_dcache(int count)
 		 */
 		spin_unlock(&sb_lock);
 		if (prune_ratio != 1)
-			w_count = (sb->s_nr_dentry_unused / prune_ratio) + 1;
+			w_count = (sb_unused / prune_ratio) + 1;
 		else
-			w_count = sb->s_nr_dentry_unused;
+			w_count = sb_unused;
 		pruned = w_count;
 		/*
 		 * We need to be sure this filesystem isn't being unmounted,
@@ -820,12 +845,9 @@ static void prune_dcache(int count)
 		 * s_root isn't NULL.
 		 */
 		if (down_read_trylock(&sb->s_umount)) {
-			if ((sb->s_root != NULL) &&
-			    (!list_empty(&sb->s_dentry_lru))) {
-				__shrink_dcache_sb(sb, &w_count,
+			if (sb->s_root != NULL)
+				pruned = __shrink_dcache_sb(sb, nid, w_count,
 						DCACHE_REFERENCED);
-				pruned -= w_count;
-			}
 			up_read(&sb->s_umount);
 		}
 		spin_lock(&sb_lock);
@@ -842,6 +864,15 @@ static void prune_dcache(int count)
 	spin_unlock(&sb_lock);
 }
 
+static enum lru_status dentry_lru_isolate_all(struct list_head *item,
+					      spinlock_t *lru_lock, void *arg)
+{
+	struct list_head *dispose = arg;
+
+	list_move_tail(item, dispose);
+	return LRU_ISOLATED;
+}
+
 /**
  * shrink_dcache_sb - shrink dcache for a superblock
  * @sb: superblock
@@ -851,16 +882,22 @@ static void prune_dcache(int count)
  */
 void shrink_dcache_sb(struct super_block *sb)
 {
-	LIST_HEAD(tmp);
+	int nid;
+
+	for_each_node_mask(nid, sb->s_dentry_lru.active_nodes) {
+		for (;;) {
+			/* in batches, not to hold the lru lock for long */
+			unsigned long nr_to_walk = 1024;
+			LIST_HEAD(dispose);
 
-	spin_lock(&dcache_lru_lock);
-	while (!list_empty(&sb->s_dentry_lru)) {
-		list_splice_init(&sb->s_dentry_lru, &tmp);
-		spin_unlock(&dcache_lru_lock);
-		shrink_dentry_list(&tmp);
-		spin_lock(&dcache_lru_lock);
+			if (!list_lru_walk_node(&sb->s_dentry_lru, nid,
+						dentry_lru_isolate_all,
+						&dispose, &nr_to_walk))
+				break;
+			shrink_dentry_list(&dispose);
+			cond_resched();
+		}
 	}
-	spin_unlock(&dcache_lru_lock);
 }
 EXPORT_SYMBOL(shrink_dcache_sb);
 
@@ -1106,10 +1143,10 @@ EXPORT_SYMBOL(have_submounts);
 
 /*
  * Search the dentry child list for the specified parent,
- * and move any unused dentries to the end of the unused
- * list for prune_dcache(). We descend to the next level
- * whenever the d_subdirs list is non-empty and continue
- * searching.
+ * and move any unused dentries to where the next walk of
+ * their node's unused list starts, noting the nodes in
+ * @nodes. We descend to the next level whenever the
+ * d_subdirs list is non-empty and continue searching.
  *
  * It returns zero iff there are no unused children,
  * otherwise  it returns the number of children moved to
@@ -1118,7 +1155,7 @@ EXPORT_SYMBOL(have_submounts);
  * drop the lock and return early due to latency
  * constraints.
  */
-static int select_parent(struct dentry * parent)
+static int select_parent(struct dentry * parent, nodemask_t *nodes)
 {
 	struct dentry *this_parent;
 	struct list_head *next;
@@ -1145,7 +1182,8 @@ resume:
 		 * of the unused list for prune_dcache
 		 */
 		if (!dentry->d_count) {
-			dentry_lru_move_tail(dentry);
+			dentry_lru_expire(dentry);
+			node_set(page_to_nid(virt_to_page(dentry)), *nodes);
 			found++;
 		} else {
 			dentry_lru_del(dentry);
@@ -1211,10 +1249,19 @@ rename_retry:
 void shrink_dcache_parent(struct dentry * parent)
 {
 	struct super_block *sb = parent->d_sb;
-	int found;
+	nodemask_t nodes = NODE_MASK_NONE;
+	int found, nid;
 
-	while ((found = select_parent(parent)) != 0)
-		__shrink_dcache_sb(sb, &found, 0);
+	/*
+	 * The children found on a node are the first dentries of its
+	 * list, but as only their total is known, each node gets that
+	 * many looked at.
+	 */
+	while ((found = select_parent(parent, &nodes)) != 0) {
+		for_each_node_mask(nid, nodes)
+			__shrink_dcache_sb(sb, nid, found, 0);
+		nodes_clear(nodes);
+	}
 }
 EXPORT_SYMBOL(shrink_dcache_parent);
 
@@ -1230,19 +1277,21 @@ EXPORT_SYMBOL(shrink_dcache_parent);
  *
  * In this case we return -1 to tell the caller that we baled.
  */
-static int shrink_dcache_memory(struct shrinker *shrink, int nr, gfp_t gfp_mask)
+static int shrink_dcache_memory(struct shrinker *shrink,
+				struct shrink_control *sc)
 {
-	if (nr) {
-		if (!(gfp_mask & __GFP_FS))
+	if (sc->nr_to_scan) {
+		if (!(sc->gfp_mask & __GFP_FS))
 			return -1;
-		prune_dcache(nr);
+		prune_dcache(sc->nr_to_scan, sc->nid);
 	}
 
-	return (dentry_stat.nr_unused / 100) * sysctl_vfs_cache_pressure;
+	return (nr_dentry_unused_node(sc->nid) / 100) *
+		sysctl_vfs_cache_pressure;
 }
 
 static struct shrinker dcache_shrinker = {
-	.shrink = shrink_dcache_memory,
+	.shrink_node = shrink_dcache_memory,
 	.seeks = DEFAULT_SEEKS,
 };
 
@@ -3025,7 +3074,15 @@ static void __init dcache_init(void)
 	 */
 	dentry_cache = KMEM_CACHE(dentry,
 		SLAB_RECLAIM_ACCOUNT|SLAB_PANIC|SLAB_MEM_SPREAD);
-	
+
+	nr_dentry_unused = kcalloc(nr_node_ids, sizeof(*nr_dentry_unused),
+				   GFP_KERNEL);
+	if (!nr_dentry_unused)
+		panic("Failed to allocate the dentry counters\n");
+	for (loop = 0; loop < nr_node_ids; loop++)
+		if (percpu_counter_init(&nr_dentry_unused[loop], 0))
+			panic("Failed to allocate the dentry counters\n");
+
 	register_shrinker(&dcache_shrinker);
 
 	/* Hash may have been set up in dcache_init_early */
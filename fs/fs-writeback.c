@@ -724,6 +724,9 @@ static long wb_writeback(struct bdi_writeback *wb,
 			writeback_inodes_wb(wb, &wbc);
 		trace_wbc_writeback_written(&wbc, wb->bdi);
 
+		/* balance_dirty_pages() paces dirtiers by this */
+		bdi_update_bandwidth(wb->bdi, 0, 0, 0, 0, 0);
+
 		work->nr_pages -= write_chunk - wbc.nr_to_write;
 		wrote += write_chunk - wbc.nr_to_write;
 
@@ -73,8 +73,9 @@ static int ioctl_fibmap(struct file *filp, int __user *p)
  * @flags:	FIEMAP_EXTENT flags that describe this extent
  *
  * Called from file system ->fiemap callback. Will populate extent
- * info as passed in via arguments and copy to user memory. On
- * success, extent count on fieinfo is incremented.
+ * info as passed in via arguments and copy to user memory, or to the
+ * buffer of kernel_fiemap(). On success, extent count on fieinfo is
+ * incremented.
  *
  * Returns 0 on success, -errno on error, 1 if this was the last
  * extent that will fit in user array.
@@ -110,8 +111,10 @@ int fiemap_fill_next_extent(struct fiemap_extent_info *fieinfo, u64 logical,
 	extent.fe_length = len;
 	extent.fe_flags = flags;
 
-	dest += fieinfo->fi_extents_mapped;
-	if (copy_to_user(dest, &extent, sizeof(extent)))
+	if (fieinfo->fi_extents_kernel)
+		fieinfo->fi_extents_kernel[fieinfo->fi_extents_mapped] = extent;
+	else if (copy_to_user(dest + fieinfo->fi_extents_mapped, &extent,
+			      sizeof(extent)))
 		return -EFAULT;
 
 	fieinfo->fi_extents_mapped++;
@@ -215,6 +218,41 @@ static int ioctl_fiemap(struct file *filp, unsigned long arg)
 	return error;
 }
 
+/**
+ * kernel_fiemap - get the extents of a file into a kernel buffer
+ * @inode:	the file
+ * @start:	first byte to map
+ * @len:	number of bytes to map
+ * @extents:	buffer for the extents
+ * @max_extents: size of @extents
+ *
+ * Like FS_IOC_FIEMAP without flags, for use inside the kernel.  The
+ * caller must not hold i_mutex, which some ->fiemap take.  Returns the
+ * number of extents stored, or -errno.
+ */
+int kernel_fiemap(struct inode *inode, u64 start, u64 len,
+		  struct fiemap_extent *extents, unsigned int max_extents)
+{
+	struct fiemap_extent_info fieinfo = {
+		.fi_extents_max = max_extents,
+		.fi_extents_kernel = extents,
+	};
+	int error;
+
+	if (!inode->i_op->fiemap)
+		return -EOPNOTSUPP;
+	if (!max_extents)
+		return -EINVAL;
+
+	error = fiemap_check_ranges(inode->i_sb, start, len, &len);
+	if (error)
+		return error;
+
+	error = inode->i_op->fiemap(inode, &fieinfo, start, len);
+	return error ? error : fieinfo.fi_extents_mapped;
+}
+EXPORT_SYMBOL(kernel_fiemap);
+
 #ifdef CONFIG_BLOCK
 
 static inline sector_t logical_to_blk(struct inode *inode, loff_t offset)
@@ -241,6 +241,14 @@ int do_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 	if (IS_IMMUTABLE(inode))
 		return -EPERM;
 
+	/*
+	 * Swap files, and the backing files of loop devices doing direct
+	 * I/O, are accessed through a map of their blocks: punching a hole
+	 * would free blocks still in use, as truncate would.
+	 */
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && IS_SWAPFILE(inode))
+		return -ETXTBSY;
+
 	/*
 	 * Revalidate the write permissions, in case security policy has
 	 * changed since the files were opened.
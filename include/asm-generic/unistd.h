@@ -24,6 +24,14 @@
 #define __SC_3264(_nr, _32, _64) __SYSCALL(_nr, _64)
 #endif
 
+#ifndef __SC_COMP
+#ifdef __SYSCALL_COMPAT
+#define __SC_COMP(_nr, _sys, _comp) __SYSCALL(_nr, _comp)
+#else
+#define __SC_COMP(_nr, _sys, _comp) __SYSCALL(_nr, _sys)
+#endif
+#endif
+
 #define __NR_io_setup 0
 __SYSCALL(__NR_io_setup, sys_io_setup)
 #define __NR_io_destroy 1
@@ -654,9 +662,16 @@ __SYSCALL(__NR_open_by_handle_at, sys_open_by_handle_at)
 __SYSCALL(__NR_clock_adjtime, sys_clock_adjtime)
 #define __NR_syncfs 267
 __SYSCALL(__NR_syncfs, sys_syncfs)
+/* 268 and 269 are setns and sendmmsg, not implemented here */
+#define __NR_process_vm_readv 270
+__SC_COMP(__NR_process_vm_readv, sys_process_vm_readv, \
+	  compat_sys_process_vm_readv)
+#define __NR_process_vm_writev 271
+__SC_COMP(__NR_process_vm_writev, sys_process_vm_writev, \
+	  compat_sys_process_vm_writev)
 
 #undef __NR_syscalls
-#define __NR_syscalls 268
+#define __NR_syscalls 272
 
 /*
  * All syscalls below here should go away really,
@@ -2,6 +2,7 @@
 #define __LINUX__AIO_H
 
 #include <linux/list.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 #include <linux/aio_abi.h>
 #include <linux/uio.h>
@@ -77,10 +78,10 @@ struct kioctx;
  *
  * If ki_retry returns -EIOCBRETRY it has made a promise that kick_iocb()
  * will be called on the kiocb pointer in the future.  This may happen
- * through generic helpers that associate kiocb->ki_wait with a wait
- * queue head that ki_retry uses via current->io_wait.  It can also happen
- * with custom tracking and manual calls to kick_iocb(), though that is
- * discouraged.  In either case, kick_iocb() must be called once and only
+ * through generic helpers that queue kiocb->ki_wait on a wait queue, as
+ * generic_file_aio_read() does to wait for a page to be read in.  It can
+ * also happen with custom tracking and manual calls to kick_iocb(), though
+ * that is discouraged.  In either case, kick_iocb() must be called once and only
  * once.  ki_retry must ensure forward progress, the AIO core will wait
  * indefinitely for kick_iocb() to be called.
  */
@@ -118,6 +119,9 @@ struct kiocb {
 	struct list_head	ki_list;	/* the aio core uses this
 						 * for cancellation */
 
+	/* queued on a page's wait queue to kick a buffered read */
+	struct wait_bit_queue	ki_wait;
+
 	/*
 	 * If the aio_resfd field of the userspace iocb is not zero,
 	 * this is the underlying eventfd context to deliver events to.
@@ -141,11 +145,20 @@ struct kiocb {
 		(x)->ki_user_data = 0;                  \
 	} while (0)
 
+/*
+ * The completion ring is mapped at the address io_setup() returns as the
+ * context id, so userspace can reap events without calling io_getevents():
+ * the kernel writes an event and then advances tail, and userspace reads
+ * the events between head and tail and then advances head itself.  head
+ * is only ever read by the kernel to work out how many slots are free;
+ * a process that reaps from the ring and calls io_getevents() from more
+ * than one thread at a time must serialize them itself.
+ */
 #define AIO_RING_MAGIC			0xa10a10a1
 #define AIO_RING_COMPAT_FEATURES	1
 #define AIO_RING_INCOMPAT_FEATURES	0
 struct aio_ring {
-	unsigned	id;	/* kernel internal index number */
+	unsigned	id;	/* index into the mm's kioctx table */
 	unsigned	nr;	/* number of io_events */
 	unsigned	head;
 	unsigned	tail;
@@ -159,8 +172,6 @@ struct aio_ring {
 	struct io_event		io_events[0];
 }; /* 128 bytes + ring size */
 
-#define aio_ring_avail(info, ring)	(((ring)->head + (info)->nr - 1 - (ring)->tail) % (info)->nr)
-
 #define AIO_RING_PAGES	8
 struct aio_ring_info {
 	unsigned long		mmap_base;
@@ -175,21 +186,41 @@ struct aio_ring_info {
 	struct page		*internal_pages[AIO_RING_PAGES];
 };
 
+struct kioctx_cpu {
+	unsigned		reqs_available;
+	int			reqs_active;
+};
+
 struct kioctx {
 	atomic_t		users;
 	int			dead;
 	struct mm_struct	*mm;
 
-	/* This needs improving */
 	unsigned long		user_id;
-	struct hlist_node	list;
+	unsigned		id;		/* index in mm->ioctx_table */
 
 	wait_queue_head_t	wait;
 
 	spinlock_t		ctx_lock;
 
-	int			reqs_active;
-	struct list_head	active_reqs;	/* used for cancellation */
+	/*
+	 * Ring slots that are neither reserved by a request in flight nor
+	 * hold an event that has not been reaped.  Each CPU takes them
+	 * req_batch at a time into its kioctx_cpu, so that submission does
+	 * not touch a shared cacheline.  The number of requests in flight
+	 * is kept per cpu as well; only the sum over all cpus is meaningful.
+	 */
+	struct kioctx_cpu __percpu *cpu;
+	atomic_t		reqs_available;
+	unsigned		req_batch;
+
+	/*
+	 * Events added to the ring whose slots have not been given back to
+	 * reqs_available yet.  Protected by ctx_lock.
+	 */
+	unsigned		completed_events;
+
+	struct list_head	active_reqs;	/* cancellable reqs */
 	struct list_head	run_list;	/* used for kicked reqs */
 
 	/* sys_io_setup currently limits this to an unsigned int */
@@ -210,6 +241,8 @@ extern ssize_t wait_on_sync_kiocb(struct kiocb *iocb);
 extern int aio_put_req(struct kiocb *iocb);
 extern void kick_iocb(struct kiocb *iocb);
 extern int aio_complete(struct kiocb *iocb, long res, long res2);
+extern void kiocb_set_cancel_fn(struct kiocb *iocb,
+		int (*cancel)(struct kiocb *, struct io_event *));
 struct mm_struct;
 extern void exit_aio(struct mm_struct *mm);
 extern long do_io_submit(aio_context_t ctx_id, long nr,
@@ -219,6 +252,8 @@ static inline ssize_t wait_on_sync_kiocb(struct kiocb *iocb) { return 0; }
 static inline int aio_put_req(struct kiocb *iocb) { return 0; }
 static inline void kick_iocb(struct kiocb *iocb) { }
 static inline int aio_complete(struct kiocb *iocb, long res, long res2) { return 0; }
+static inline void kiocb_set_cancel_fn(struct kiocb *iocb,
+		int (*cancel)(struct kiocb *, struct io_event *)) { }
 struct mm_struct;
 static inline void exit_aio(struct mm_struct *mm) { }
 static inline long do_io_submit(aio_context_t ctx_id, long nr,
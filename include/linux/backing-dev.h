@@ -40,6 +40,8 @@ typedef int (congested_fn)(void *, int);
 enum bdi_stat_item {
 	BDI_RECLAIMABLE,
 	BDI_WRITEBACK,
+	BDI_DIRTIED,
+	BDI_WRITTEN,
 	NR_BDI_STAT_ITEMS
 };
 
@@ -74,6 +76,17 @@ struct backing_dev_info {
 	struct prop_local_percpu completions;
 	int dirty_exceeded;
 
+	/*
+	 * Estimated in balance_dirty_pages() and by the flusher, in pages
+	 * per second; see bdi_update_bandwidth().
+	 */
+	unsigned long bw_time_stamp;	/* last time they were updated */
+	unsigned long dirtied_stamp;	/* BDI_DIRTIED at bw_time_stamp */
+	unsigned long written_stamp;	/* BDI_WRITTEN at bw_time_stamp */
+	unsigned long write_bandwidth;	/* rate pages are written out at */
+	unsigned long avg_write_bandwidth; /* smoothed further */
+	unsigned long dirty_ratelimit;	/* fair share of it per dirtier */
+
 	unsigned int min_ratio;
 	unsigned int max_ratio, max_prop_frac;
 
@@ -92,12 +92,13 @@ extern void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd);
 #define wait_split_huge_page(__anon_vma, __pmd)				\
 	do {								\
 		pmd_t *____pmd = (__pmd);				\
-		spin_unlock_wait(&(__anon_vma)->root->lock);		\
 		/*							\
-		 * spin_unlock_wait() is just a loop in C and so the	\
-		 * CPU can reorder anything around it.			\
+		 * split_huge_page() holds the lock for writing, so	\
+		 * taking it for reading waits for the split to end,	\
+		 * without queueing behind the rmap walkers.		\
 		 */							\
-		smp_mb();						\
+		read_lock(&(__anon_vma)->root->lock);			\
+		read_unlock(&(__anon_vma)->root->lock);			\
 		BUG_ON(pmd_trans_splitting(*____pmd) ||			\
 		       pmd_trans_huge(*____pmd));			\
 	} while (0)
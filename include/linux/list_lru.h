@@ -0,0 +1,75 @@
+/*
+ * List of objects in least recently used order, kept per NUMA node so
+ * that a cache can be shrunk on the node that is short of memory, and
+ * so that the nodes do not share a lock.
+ *
+ * Objects go on the list of the node their memory is on.
+ */
+#ifndef _LINUX_LIST_LRU_H
+#define _LINUX_LIST_LRU_H
+
+#include <linux/list.h>
+#include <linux/nodemask.h>
+#include <linux/spinlock.h>
+
+/* What a list_lru_walk_node() callback did with an item */
+enum lru_status {
+	LRU_REMOVED,		/* taken off the list and no longer counted */
+	LRU_ISOLATED,		/* moved to a list of the caller's, see below */
+	LRU_ROTATE,		/* referenced, give it another round */
+	LRU_SKIP,		/* cannot be looked at now, leave it */
+	LRU_RETRY,		/* the lock was dropped, restart the walk */
+};
+
+struct list_lru_node {
+	spinlock_t		lock;
+	struct list_head	list;
+	long			nr_items;
+} ____cacheline_aligned_in_smp;
+
+struct list_lru {
+	struct list_lru_node	*node;
+	nodemask_t		active_nodes;	/* nodes with nr_items */
+};
+
+int list_lru_init(struct list_lru *lru);
+void list_lru_destroy(struct list_lru *lru);
+
+/*
+ * list_lru_add: add @item as the most recently used object of its node.
+ * Returns true if it was added, false if it was on a list already.
+ *
+ * list_lru_del: take @item off the list it is on.  Returns true if it
+ * was on one, false if it was not.
+ *
+ * list_lru_expire: make @item the first object the next walk of its node
+ * looks at, adding it if it was not on the list.  Returns true if it was
+ * added.
+ *
+ * All three serialize against the walks of the item's node only.
+ */
+bool list_lru_add(struct list_lru *lru, struct list_head *item);
+bool list_lru_del(struct list_lru *lru, struct list_head *item);
+bool list_lru_expire(struct list_lru *lru, struct list_head *item);
+
+unsigned long list_lru_count_node(struct list_lru *lru, int nid);
+unsigned long list_lru_count(struct list_lru *lru);
+
+/*
+ * The callback is called with the node's lock held, which it may drop
+ * only if it returns LRU_RETRY with the lock taken again.
+ *
+ * An item that the callback returns LRU_ISOLATED for has been moved to a
+ * private list, but is still counted on its node, and the node's lock
+ * still serializes it: it must eventually be removed with list_lru_del(),
+ * and the private list must only hold items of that one node.  This lets
+ * other paths take the item off while it waits on the private list.
+ */
+typedef enum lru_status (*list_lru_walk_cb)(struct list_head *item,
+					    spinlock_t *lock, void *cb_arg);
+
+unsigned long list_lru_walk_node(struct list_lru *lru, int nid,
+				 list_lru_walk_cb isolate, void *cb_arg,
+				 unsigned long *nr_to_walk);
+
+#endif /* _LINUX_LIST_LRU_H */
@@ -28,6 +28,8 @@ enum {
 
 struct loop_func_table;
 
+struct loop_dio_map;
+
 struct loop_device {
 	int		lo_number;
 	int		lo_refcnt;
@@ -62,6 +64,13 @@ struct loop_device {
 	struct task_struct	*lo_thread;
 	wait_queue_head_t	lo_event;
 
+	/* direct I/O to the blocks of the backing file, see loop.c */
+	struct loop_dio_map	*lo_dio_map;
+	atomic_t		lo_dio_inflight;
+	wait_queue_head_t	lo_dio_wait;
+	bool			lo_dio_parking;
+	struct bio_list		lo_dio_parked;
+
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
 	struct list_head	lo_list;
@@ -76,6 +85,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_USE_AOPS	= 2,
 	LO_FLAGS_AUTOCLEAR	= 4,
+	LO_FLAGS_DIRECT_IO	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
@@ -160,5 +170,6 @@ int loop_unregister_transfer(int number);
 #define LOOP_GET_STATUS64	0x4C05
 #define LOOP_CHANGE_FD		0x4C06
 #define LOOP_SET_CAPACITY	0x4C07
+#define LOOP_SET_DIRECT_IO	0x4C08
 
 #endif
@@ -65,4 +65,14 @@ static inline int migrate_huge_page_move_mapping(struct address_space *mapping,
 #define fail_migrate_page NULL
 
 #endif /* CONFIG_MIGRATION */
+
+#ifdef CONFIG_NUMA_BALANCING
+extern bool migrate_misplaced_page(struct page *page, int node);
+#else
+static inline bool migrate_misplaced_page(struct page *page, int node)
+{
+	put_page(page);
+	return false;
+}
+#endif /* CONFIG_NUMA_BALANCING */
 #endif /* _LINUX_MIGRATE_H */
@@ -305,6 +305,7 @@ enum {
 	TCA_HTB_INIT,
 	TCA_HTB_CTAB,
 	TCA_HTB_RTAB,
+	TCA_HTB_SHARED,
 	__TCA_HTB_MAX,
 };
 
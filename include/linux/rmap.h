@@ -26,7 +26,7 @@
  */
 struct anon_vma {
 	struct anon_vma *root;	/* Root of this anon_vma tree */
-	spinlock_t lock;	/* Serialize access to vma list */
+	rwlock_t lock;		/* Serialize access to vma list */
 	/*
 	 * The refcount is taken on an anon_vma when there is no
 	 * guarantee that the vma of page tables will exist for
@@ -37,10 +37,22 @@ struct anon_vma {
 	atomic_t refcount;
 
 	/*
+	 * The lock is taken for reading by rmap walkers, which only
+	 * look at the vma list, so that reclaim, migration and KSM can
+	 * walk it concurrently; anything that changes the list takes it
+	 * for writing.
+	 *
+	 * rwlock_t lets new readers in while a writer waits, so while
+	 * walkers keep overlapping on a hot tree (steady reclaim or KSM
+	 * scanning of a large pre-forked tree), fork, exit and
+	 * anon_vma_prepare() can be held off for as long as that lasts.
+	 * Nothing that only needs the walkers out of the way may take
+	 * the lock for writing for that reason alone.
+	 *
 	 * NOTE: the LSB of the head.next is set by
-	 * mm_take_all_locks() _after_ taking the above lock. So the
-	 * head must only be read/written after taking the above lock
-	 * to be sure to see a valid next pointer. The LSB bit itself
+	 * mm_take_all_locks() _after_ taking the above lock for writing.
+	 * So the head must only be read/written after taking the above
+	 * lock to be sure to see a valid next pointer. The LSB bit itself
 	 * is serialized by a system wide lock only visible to
 	 * mm_take_all_locks() (mm_all_locks_mutex).
 	 */
@@ -64,7 +76,7 @@ struct anon_vma_chain {
 	struct vm_area_struct *vma;
 	struct anon_vma *anon_vma;
 	struct list_head same_vma;   /* locked by mmap_sem & page_table_lock */
-	struct list_head same_anon_vma;	/* locked by anon_vma->lock */
+	struct list_head same_anon_vma;	/* locked by anon_vma->lock (write) */
 };
 
 #ifdef CONFIG_MMU
@@ -93,24 +105,34 @@ static inline void vma_lock_anon_vma(struct vm_area_struct *vma)
 {
 	struct anon_vma *anon_vma = vma->anon_vma;
 	if (anon_vma)
-		spin_lock(&anon_vma->root->lock);
+		write_lock(&anon_vma->root->lock);
 }
 
 static inline void vma_unlock_anon_vma(struct vm_area_struct *vma)
 {
 	struct anon_vma *anon_vma = vma->anon_vma;
 	if (anon_vma)
-		spin_unlock(&anon_vma->root->lock);
+		write_unlock(&anon_vma->root->lock);
 }
 
-static inline void anon_vma_lock(struct anon_vma *anon_vma)
+static inline void anon_vma_lock_write(struct anon_vma *anon_vma)
 {
-	spin_lock(&anon_vma->root->lock);
+	write_lock(&anon_vma->root->lock);
 }
 
-static inline void anon_vma_unlock(struct anon_vma *anon_vma)
+static inline void anon_vma_unlock_write(struct anon_vma *anon_vma)
 {
-	spin_unlock(&anon_vma->root->lock);
+	write_unlock(&anon_vma->root->lock);
+}
+
+static inline void anon_vma_lock_read(struct anon_vma *anon_vma)
+{
+	read_lock(&anon_vma->root->lock);
+}
+
+static inline void anon_vma_unlock_read(struct anon_vma *anon_vma)
+{
+	read_unlock(&anon_vma->root->lock);
 }
 
 /*
@@ -216,15 +238,28 @@ int page_mkclean(struct page *);
 int try_to_munlock(struct page *);
 
 /*
- * Called by memory-failure.c to kill processes.
+ * Called by memory-failure.c to kill processes, and by migration and
+ * split_huge_page(), which takes the lock for writing.
  */
-struct anon_vma *__page_lock_anon_vma(struct page *page);
+struct anon_vma *__page_lock_anon_vma(struct page *page, int write);
+
+static inline struct anon_vma *page_lock_anon_vma_read(struct page *page)
+{
+	struct anon_vma *anon_vma;
+
+	__cond_lock(RCU, anon_vma = __page_lock_anon_vma(page, 0));
+
+	/* (void) is needed to make gcc happy */
+	(void) __cond_lock(&anon_vma->root->lock, anon_vma);
+
+	return anon_vma;
+}
 
-static inline struct anon_vma *page_lock_anon_vma(struct page *page)
+static inline struct anon_vma *page_lock_anon_vma_write(struct page *page)
 {
 	struct anon_vma *anon_vma;
 
-	__cond_lock(RCU, anon_vma = __page_lock_anon_vma(page));
+	__cond_lock(RCU, anon_vma = __page_lock_anon_vma(page, 1));
 
 	/* (void) is needed to make gcc happy */
 	(void) __cond_lock(&anon_vma->root->lock, anon_vma);
@@ -232,7 +267,8 @@ static inline struct anon_vma *page_lock_anon_vma(struct page *page)
 	return anon_vma;
 }
 
-void page_unlock_anon_vma(struct anon_vma *anon_vma);
+void page_unlock_anon_vma_read(struct anon_vma *anon_vma);
+void page_unlock_anon_vma_write(struct anon_vma *anon_vma);
 int page_mapped_in_vma(struct page *page, struct vm_area_struct *vma);
 
 /*
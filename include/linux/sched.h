@@ -1481,6 +1481,14 @@ struct task_struct {
 	struct mempolicy *mempolicy;	/* Protected by alloc_lock */
 	short il_next;
 	short pref_node_fork;
+#endif
+#ifdef CONFIG_NUMA_BALANCING
+	int numa_scan_seq;		/* mm->numa_scan_seq last seen */
+	unsigned int numa_scan_period;	/* ms between scans */
+	int numa_preferred_nid;		/* node with most faults, or -1 */
+	int numa_work;			/* task_numa_work() pending */
+	u64 node_stamp;			/* runtime at the last scan */
+	unsigned long *numa_faults;	/* hinting faults per node */
 #endif
 	atomic_t fs_excl;	/* holding fs exclusive resources */
 	struct rcu_head rcu;
@@ -1495,7 +1503,12 @@ struct task_struct {
 #ifdef CONFIG_FAULT_INJECTION
 	int make_it_fail;
 #endif
-	struct prop_local_single dirties;
+	/*
+	 * Pages dirtied since the last balance_dirty_pages(), and how many
+	 * may be before the next.
+	 */
+	int nr_dirtied;
+	int nr_dirtied_pause;
 #ifdef CONFIG_LATENCYTOP
 	int latency_record_count;
 	struct latency_record latency_record[LT_SAVECOUNT];
@@ -1956,6 +1969,36 @@ int sched_rt_handler(struct ctl_table *table, int write,
 		void __user *buffer, size_t *lenp,
 		loff_t *ppos);
 
+#ifdef CONFIG_NUMA_BALANCING
+extern unsigned int sysctl_numa_balancing;
+extern unsigned int sysctl_numa_balancing_scan_delay;
+extern unsigned int sysctl_numa_balancing_scan_period_min;
+extern unsigned int sysctl_numa_balancing_scan_period_max;
+extern unsigned int sysctl_numa_balancing_scan_size;
+
+extern void task_numa_fault(int node, int pages, bool migrated);
+extern void task_numa_free(struct task_struct *p);
+extern void __task_numa_work(void);
+
+static inline void task_numa_work(void)
+{
+	if (unlikely(current->numa_work))
+		__task_numa_work();
+}
+#else
+static inline void task_numa_fault(int node, int pages, bool migrated)
+{
+}
+
+static inline void task_numa_free(struct task_struct *p)
+{
+}
+
+static inline void task_numa_work(void)
+{
+}
+#endif
+
 #ifdef CONFIG_SCHED_AUTOGROUP
 extern unsigned int sysctl_sched_autogroup_enabled;
 
@@ -8,6 +8,7 @@
 #include <linux/memcontrol.h>
 #include <linux/sched.h>
 #include <linux/node.h>
+#include <linux/workqueue.h>
 
 #include <asm/atomic.h>
 #include <asm/page.h>
@@ -144,7 +145,6 @@ enum {
 	SWP_USED	= (1 << 0),	/* is slot in swap_info[] used? */
 	SWP_WRITEOK	= (1 << 1),	/* ok to write to this swap?	*/
 	SWP_DISCARDABLE = (1 << 2),	/* swapon+blkdev support discard */
-	SWP_DISCARDING	= (1 << 3),	/* now discarding a free cluster */
 	SWP_SOLIDSTATE	= (1 << 4),	/* blkdev seeks are cheap */
 	SWP_CONTINUED	= (1 << 5),	/* swap_map has count continuation */
 	SWP_BLKDEV	= (1 << 6),	/* its a block device */
@@ -171,6 +171,22 @@ enum {
 #define COUNT_CONTINUED	0x80	/* See swap_map continuation for full count */
 #define SWAP_MAP_SHMEM	0xbf	/* Owned by shmem/tmpfs, in first swap_map */
 
+/*
+ * Swap on a solid state device is handed out in aligned clusters of
+ * SWAPFILE_CLUSTER slots, each cpu allocating from a cluster of its own.
+ * Clusters with no slot in use are kept on a free list.
+ */
+struct swap_cluster_info {
+	struct list_head list;		/* on free or discard list when unused */
+	unsigned int count;		/* slots in use, bad or beyond the end */
+};
+
+/* The cluster a cpu is allocating from */
+struct percpu_cluster {
+	unsigned int index;		/* cluster, or CLUSTER_NONE */
+	unsigned int next;		/* likely next free slot in it */
+};
+
 /*
  * The in-memory structure used to track swap areas.
  */
@@ -187,8 +203,11 @@ struct swap_info_struct {
 	unsigned int inuse_pages;	/* number of those currently in use */
 	unsigned int cluster_next;	/* likely index for next allocation */
 	unsigned int cluster_nr;	/* countdown to next cluster search */
-	unsigned int lowest_alloc;	/* while preparing discard cluster */
-	unsigned int highest_alloc;	/* while preparing discard cluster */
+	struct swap_cluster_info *cluster_info; /* vmalloc'ed, SSD only */
+	struct percpu_cluster __percpu *percpu_cluster; /* SSD only */
+	struct list_head free_clusters;	/* clusters with no slot in use */
+	struct list_head discard_clusters; /* freed clusters to discard */
+	struct work_struct discard_work; /* discards discard_clusters */
 	struct swap_extent *curr_swap_extent;
 	struct swap_extent first_swap_extent;
 	struct block_device *bdev;	/* swap device or bdev of swap file */
@@ -204,6 +223,15 @@ struct swap_list_t {
 /* Swap 50% full? Release swapcache more aggressively.. */
 #define vm_swap_full() (nr_swap_pages*2 < total_swap_pages)
 
+/* linux/mm/workingset.c */
+extern void *workingset_eviction(struct page *page);
+extern bool workingset_refault(void *shadow);
+extern void workingset_activation(struct page *page);
+extern void workingset_shadow_added(struct address_space *mapping);
+extern void workingset_shadow_removed(struct address_space *mapping);
+extern void clear_shadow_entries(struct address_space *mapping,
+				 pgoff_t start, pgoff_t end);
+
 /* linux/mm/page_alloc.c */
 extern unsigned long totalram_pages;
 extern unsigned long totalreserve_pages;
@@ -9,7 +9,11 @@
 extern void unix_inflight(struct file *fp);
 extern void unix_notinflight(struct file *fp);
 extern void unix_gc(void);
+extern void unix_schedule_gc(void);
+extern void unix_flush_gc(void);
 extern void wait_for_unix_gc(void);
+extern void unix_gc_queue_skb(struct sock *sk, struct sk_buff *skb);
+extern void unix_gc_unqueue_skb(struct sk_buff *skb);
 extern struct sock *unix_get_socket(struct file *filp);
 
 #define UNIX_HASH_SIZE	256
@@ -27,6 +31,8 @@ struct unix_skb_parms {
 	struct pid		*pid;		/* Skb credentials	*/
 	const struct cred	*cred;
 	struct scm_fp_list	*fp;		/* Passed files		*/
+	struct unix_sock	*gc_owner;	/* Queue holding passed sockets */
+	bool			gc_embryo;	/* Queued on an embryo	*/
 #ifdef CONFIG_SECURITY_NETWORK
 	u32			secid;		/* Security ID		*/
 #endif
@@ -54,6 +60,7 @@ struct unix_sock {
 	struct sock		*other;
 	struct list_head	link;
 	atomic_long_t		inflight;
+	unsigned long		gc_edges;	/* queued skbs passing sockets */
 	spinlock_t		lock;
 	unsigned int		gc_candidate : 1;
 	unsigned int		gc_maybe_cycle : 1;
@@ -110,20 +110,27 @@ struct listen_sock {
  * @rskq_accept_head - FIFO head of established children
  * @rskq_accept_tail - FIFO tail of established children
  * @rskq_defer_accept - User waits for some data after accept()
+ * @rskq_lock - protects the accept FIFO
  * @syn_wait_lock - serializer
  *
- * %syn_wait_lock is necessary only to avoid proc interface having to grab the main
- * lock sock while browsing the listening hash (otherwise it's deadlock prone).
+ * The accept FIFO has its own lock, so that established children can be
+ * queued and dequeued without holding the listener's socket lock.
+ *
+ * %syn_wait_lock is necessary to avoid proc interface having to grab the
+ * main lock sock while browsing the listening hash (otherwise it's deadlock
+ * prone), and lets tcp_v4_rcv() answer SYNs on a full SYN queue without the
+ * main lock.
  *
  * This lock is acquired in read mode only from listening_get_next() seq_file
- * op and it's acquired in write mode _only_ from code that is actively
- * changing rskq_accept_head. All readers that are holding the master sock lock
- * don't need to grab this lock in read mode too as rskq_accept_head. writes
- * are always protected from the main sock lock.
+ * op and the lockless SYN path, and it's acquired in write mode _only_ from
+ * code that is actively changing rskq_accept_head. All readers that are
+ * holding the master sock lock don't need to grab this lock in read mode too
+ * as rskq_accept_head. writes are always protected from the main sock lock.
  */
 struct request_sock_queue {
 	struct request_sock	*rskq_accept_head;
 	struct request_sock	*rskq_accept_tail;
+	spinlock_t		rskq_lock;
 	rwlock_t		syn_wait_lock;
 	u8			rskq_defer_accept;
 	/* 3 bytes hole, try to pack */
@@ -139,9 +146,13 @@ extern void reqsk_queue_destroy(struct request_sock_queue *queue);
 static inline struct request_sock *
 	reqsk_queue_yank_acceptq(struct request_sock_queue *queue)
 {
-	struct request_sock *req = queue->rskq_accept_head;
+	struct request_sock *req;
 
+	spin_lock_bh(&queue->rskq_lock);
+	req = queue->rskq_accept_head;
 	queue->rskq_accept_head = NULL;
+	queue->rskq_accept_tail = NULL;
+	spin_unlock_bh(&queue->rskq_lock);
 	return req;
 }
 
@@ -165,6 +176,9 @@ static inline void reqsk_queue_add(struct request_sock_queue *queue,
 				   struct sock *child)
 {
 	req->sk = child;
+	req->dl_next = NULL;
+
+	spin_lock(&queue->rskq_lock);
 	sk_acceptq_added(parent);
 
 	if (queue->rskq_accept_head == NULL)
@@ -173,9 +187,10 @@ static inline void reqsk_queue_add(struct request_sock_queue *queue,
 		queue->rskq_accept_tail->dl_next = req;
 
 	queue->rskq_accept_tail = req;
-	req->dl_next = NULL;
+	spin_unlock(&queue->rskq_lock);
 }
 
+/* Must be called with rskq_lock held */
 static inline struct request_sock *reqsk_queue_remove(struct request_sock_queue *queue)
 {
 	struct request_sock *req = queue->rskq_accept_head;
@@ -192,12 +207,17 @@ static inline struct request_sock *reqsk_queue_remove(struct request_sock_queue
 static inline struct sock *reqsk_queue_get_child(struct request_sock_queue *queue,
 						 struct sock *parent)
 {
-	struct request_sock *req = reqsk_queue_remove(queue);
-	struct sock *child = req->sk;
+	struct request_sock *req;
+	struct sock *child;
+
+	spin_lock_bh(&queue->rskq_lock);
+	req = reqsk_queue_remove(queue);
+	sk_acceptq_removed(parent);
+	spin_unlock_bh(&queue->rskq_lock);
 
+	child = req->sk;
 	WARN_ON(child == NULL);
 
-	sk_acceptq_removed(parent);
 	__reqsk_free(req);
 	return child;
 }
@@ -23,6 +23,7 @@
 #include <linux/latencytop.h>
 #include <linux/sched.h>
 #include <linux/cpumask.h>
+#include <linux/mempolicy.h>
 
 /*
  * Targeted preemption latency for CPU-bound tasks:
@@ -659,6 +660,236 @@ update_stats_curr_start(struct cfs_rq *cfs_rq, struct sched_entity *se)
 	se->exec_start = rq_of(cfs_rq)->clock_task;
 }
 
+/**************************************************
+ * Automatic NUMA balancing:
+ */
+
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * The address space of a task that has run long enough is scanned a few
+ * hundred megabytes at a time, and the ptes found made to take a NUMA
+ * hinting fault on the next access, see change_prot_numa().  The faults
+ * move the pages to the node of the cpu touching them, and tell which
+ * node the task uses the most memory on.
+ */
+unsigned int sysctl_numa_balancing __read_mostly = 1;
+
+/* Time after an address space is created before it is first scanned */
+unsigned int sysctl_numa_balancing_scan_delay = 1000;
+
+/*
+ * Time between scans: a task whose pages are all where it runs backs off
+ * towards the maximum, and goes back to the minimum when it moves.
+ */
+unsigned int sysctl_numa_balancing_scan_period_min = 1000;
+unsigned int sysctl_numa_balancing_scan_period_max = 60000;
+
+/* Megabytes of address space scanned at a time */
+unsigned int sysctl_numa_balancing_scan_size = 256;
+
+/*
+ * Once per pass over the address space, make the node the task faulted
+ * on the most its preferred one, and halve the counts, so that the
+ * recent passes count the most.
+ */
+static void task_numa_placement(struct task_struct *p)
+{
+	int seq = ACCESS_ONCE(p->mm->numa_scan_seq);
+	unsigned long faults, max_faults = 0;
+	int nid, max_nid = -1;
+
+	if (p->numa_scan_seq == seq)
+		return;
+	p->numa_scan_seq = seq;
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		faults = p->numa_faults[nid];
+		p->numa_faults[nid] = faults >> 1;
+		if (faults > max_faults) {
+			max_faults = faults;
+			max_nid = nid;
+		}
+	}
+
+	if (max_nid != -1 && max_nid != p->numa_preferred_nid) {
+		p->numa_preferred_nid = max_nid;
+		p->numa_scan_period = sysctl_numa_balancing_scan_period_min;
+	}
+}
+
+/*
+ * Got a NUMA hinting fault on @pages pages that are now on @node, after
+ * being moved there if @migrated.
+ */
+void task_numa_fault(int node, int pages, bool migrated)
+{
+	struct task_struct *p = current;
+
+	if (!sysctl_numa_balancing || !p->mm)
+		return;
+
+	if (unlikely(!p->numa_faults)) {
+		p->numa_faults = kzalloc(nr_node_ids * sizeof(*p->numa_faults),
+					 GFP_KERNEL | __GFP_NOWARN);
+		if (!p->numa_faults)
+			return;
+	}
+
+	/* Memory that did not need moving does not need scanning as often */
+	if (!migrated)
+		p->numa_scan_period = min(sysctl_numa_balancing_scan_period_max,
+					  p->numa_scan_period + 10);
+
+	task_numa_placement(p);
+	p->numa_faults[node] += pages;
+}
+
+void task_numa_free(struct task_struct *p)
+{
+	kfree(p->numa_faults);
+}
+
+static void reset_ptenuma_scan(struct mm_struct *mm)
+{
+	ACCESS_ONCE(mm->numa_scan_seq)++;
+	mm->numa_scan_offset = 0;
+}
+
+/*
+ * Called on the way back to user space after task_tick_numa() found the
+ * task due a scan.  Only one of the threads sharing the address space
+ * does the scan, each time it is due.
+ */
+void __task_numa_work(void)
+{
+	unsigned long migrate, next_scan, now = jiffies;
+	struct task_struct *p = current;
+	struct mm_struct *mm = p->mm;
+	struct vm_area_struct *vma;
+	unsigned long start, end;
+	long pages;
+
+	p->numa_work = 0;
+	if (!mm || (p->flags & PF_EXITING))
+		return;
+
+	migrate = mm->numa_next_scan;
+	if (time_before(now, migrate))
+		return;
+
+	next_scan = now + msecs_to_jiffies(p->numa_scan_period);
+	if (cmpxchg(&mm->numa_next_scan, migrate, next_scan) != migrate)
+		return;
+
+	pages = (long)sysctl_numa_balancing_scan_size << (20 - PAGE_SHIFT);
+
+	down_read(&mm->mmap_sem);
+	start = mm->numa_scan_offset;
+	vma = find_vma(mm, start);
+	if (!vma) {
+		reset_ptenuma_scan(mm);
+		start = 0;
+		vma = mm->mmap;
+	}
+	for (; vma; vma = vma->vm_next) {
+		if (!vma_migratable(vma))
+			continue;
+
+		/* PROT_NONE ptes cannot be told from hinting ones */
+		if (!(vma->vm_flags & (VM_READ | VM_WRITE | VM_EXEC)))
+			continue;
+
+		do {
+			start = max(start, vma->vm_start);
+			end = ALIGN(start + (pages << PAGE_SHIFT), PMD_SIZE);
+			end = min(end, vma->vm_end);
+			pages -= (end - start) >> PAGE_SHIFT;
+			change_prot_numa(vma, start, end);
+
+			start = end;
+			if (pages <= 0)
+				goto out;
+		} while (end != vma->vm_end);
+	}
+
+out:
+	/*
+	 * The vma we stopped in may be gone by the next scan, but
+	 * find_vma() then finds the one after it, which is where the scan
+	 * would have gone on anyway.
+	 */
+	if (vma)
+		mm->numa_scan_offset = start;
+	else
+		reset_ptenuma_scan(mm);
+	up_read(&mm->mmap_sem);
+}
+
+/*
+ * Check, once the task has run for its scan period, whether its address
+ * space is due a scan, and have the scan done on the way back to user
+ * space, where it can sleep on the mmap_sem.
+ */
+static void task_tick_numa(struct rq *rq, struct task_struct *curr)
+{
+	u64 period, now;
+
+	if (!sysctl_numa_balancing || !curr->mm || curr->numa_work ||
+	    (curr->flags & (PF_EXITING | PF_KTHREAD)))
+		return;
+
+	now = curr->se.sum_exec_runtime;
+	period = (u64)curr->numa_scan_period * NSEC_PER_MSEC;
+
+	if (now - curr->node_stamp > period) {
+		curr->node_stamp = now;
+
+		if (!time_before(jiffies, curr->mm->numa_next_scan)) {
+			curr->numa_work = 1;
+			set_tsk_thread_flag(curr, TIF_NOTIFY_RESUME);
+		}
+	}
+}
+
+#ifdef CONFIG_SMP
+/*
+ * Bias the load balancer towards the node the task faults on the most:
+ * a move there makes a cache hot task movable, a move off it makes a
+ * cache cold one stay.  Balancing that keeps failing still moves it.
+ */
+static int task_numa_hot(struct task_struct *p, int src_cpu, int dst_cpu,
+			 int hot)
+{
+	int nid = p->numa_preferred_nid;
+	int src_nid, dst_nid;
+
+	if (!sched_feat(NUMA_LOCALITY) || !sysctl_numa_balancing || nid == -1)
+		return hot;
+
+	src_nid = cpu_to_node(src_cpu);
+	dst_nid = cpu_to_node(dst_cpu);
+	if (src_nid == dst_nid)
+		return hot;
+
+	if (dst_nid == nid)
+		return 0;
+	if (src_nid == nid)
+		return 1;
+	return hot;
+}
+#endif /* CONFIG_SMP */
+#else
+static void task_tick_numa(struct rq *rq, struct task_struct *curr)
+{
+}
+
+static inline int task_numa_hot(struct task_struct *p, int src_cpu,
+				int dst_cpu, int hot)
+{
+	return hot;
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /**************************************************
  * Scheduling class queueing methods:
  */
@@ -2044,6 +2275,7 @@ int can_migrate_task(struct task_struct *p, struct rq *rq, int this_cpu,
 	 */
 
 	tsk_cache_hot = task_hot(p, rq->clock_task, sd);
+	tsk_cache_hot = task_numa_hot(p, cpu_of(rq), this_cpu, tsk_cache_hot);
 	if (!tsk_cache_hot ||
 		sd->nr_balance_failed > sd->cache_nice_tries) {
 #ifdef CONFIG_SCHEDSTATS
@@ -4069,6 +4301,8 @@ static void task_tick_fair(struct rq *rq, struct task_struct *curr, int queued)
 		cfs_rq = cfs_rq_of(se);
 		entity_tick(cfs_rq, se, queued);
 	}
+
+	task_tick_numa(rq, curr);
 }
 
 /*
@@ -64,3 +64,9 @@ SCHED_FEAT(OWNER_SPIN, 1)
  * Decrement CPU power based on irq activity
  */
 SCHED_FEAT(NONIRQ_POWER, 1)
+
+/*
+ * With automatic NUMA balancing, prefer to move tasks to the node they
+ * take the most NUMA hinting faults on, see task_numa_hot()
+ */
+SCHED_FEAT(NUMA_LOCALITY, 1)
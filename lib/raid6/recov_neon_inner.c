@@ -0,0 +1,108 @@
+/*
+ * linux/lib/raid6/recov_neon_inner.c - NEON inner loops of RAID6 recovery
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <arm_neon.h>
+
+/*
+ * Look up each byte of idx (all below 16) in the 16 byte table tbl.  ARMv7
+ * only has the 64-bit wide vtbl.8, so do it as two lookups in a pair of
+ * d registers.
+ */
+static inline uint8x16_t vtbl16_u8(uint8x16_t tbl, uint8x16_t idx)
+{
+	union {
+		uint8x16_t	val;
+		uint8x8x2_t	pair;
+	} t = { tbl };
+
+	return vcombine_u8(vtbl2_u8(t.pair, vget_low_u8(idx)),
+			   vtbl2_u8(t.pair, vget_high_u8(idx)));
+}
+
+/*
+ * Multiply every byte of x by the constant whose raid6_vgfmul row has
+ * been loaded into lo (products of the low nibble) and hi (products of
+ * the high nibble).
+ */
+static inline uint8x16_t gfmul16(uint8x16_t x, uint8x16_t lo, uint8x16_t hi)
+{
+	const uint8x16_t x0f = vdupq_n_u8(0x0f);
+	uint8x16_t vx, vy;
+
+	vy = vshrq_n_u8(x, 4);
+	vx = vtbl16_u8(lo, vandq_u8(x, x0f));
+	vy = vtbl16_u8(hi, vy);
+	return veorq_u8(vx, vy);
+}
+
+void __raid6_2data_recov_neon(int bytes, uint8_t *p, uint8_t *q, uint8_t *dp,
+			      uint8_t *dq, const uint8_t *pbmul,
+			      const uint8_t *qmul)
+{
+	uint8x16_t pm0 = vld1q_u8(pbmul);
+	uint8x16_t pm1 = vld1q_u8(pbmul + 16);
+	uint8x16_t qm0 = vld1q_u8(qmul);
+	uint8x16_t qm1 = vld1q_u8(qmul + 16);
+
+	/*
+	 * while ( bytes-- ) {
+	 *	uint8_t px, qx, db;
+	 *
+	 *	px    = *p ^ *dp;
+	 *	qx    = qmul[*q ^ *dq];
+	 *	*dq++ = db = pbmul[px] ^ qx;
+	 *	*dp++ = db ^ px;
+	 *	p++; q++;
+	 * }
+	 */
+
+	while (bytes) {
+		uint8x16_t px, qx, db;
+
+		px = veorq_u8(vld1q_u8(p), vld1q_u8(dp));
+		qx = gfmul16(veorq_u8(vld1q_u8(q), vld1q_u8(dq)), qm0, qm1);
+		db = veorq_u8(gfmul16(px, pm0, pm1), qx);
+
+		vst1q_u8(dq, db);
+		vst1q_u8(dp, veorq_u8(db, px));
+
+		bytes -= 16;
+		p += 16;
+		q += 16;
+		dp += 16;
+		dq += 16;
+	}
+}
+
+void __raid6_datap_recov_neon(int bytes, uint8_t *p, uint8_t *q, uint8_t *dq,
+			      const uint8_t *qmul)
+{
+	uint8x16_t qm0 = vld1q_u8(qmul);
+	uint8x16_t qm1 = vld1q_u8(qmul + 16);
+
+	/*
+	 * while (bytes--) {
+	 *	*p++ ^= *dq = qmul[*q ^ *dq];
+	 *	q++; dq++;
+	 * }
+	 */
+
+	while (bytes) {
+		uint8x16_t vx;
+
+		vx = gfmul16(veorq_u8(vld1q_u8(q), vld1q_u8(dq)), qm0, qm1);
+
+		vst1q_u8(dq, vx);
+		vst1q_u8(p, veorq_u8(vx, vld1q_u8(p)));
+
+		bytes -= 16;
+		p += 16;
+		q += 16;
+		dq += 16;
+	}
+}
@@ -22,17 +22,18 @@
 #define NDISKS		16	/* Including P and Q */
 
 const char raid6_empty_zero_page[PAGE_SIZE] __attribute__((aligned(256)));
-struct raid6_calls raid6_call;
+const char *raid6_recov_name;
 
 char *dataptrs[NDISKS];
 char data[NDISKS][PAGE_SIZE];
 char recovi[PAGE_SIZE], recovj[PAGE_SIZE];
+char refp[PAGE_SIZE], refq[PAGE_SIZE];
 
-static void makedata(void)
+static void makedata(int start, int stop)
 {
 	int i, j;
 
-	for (i = 0; i < NDISKS; i++) {
+	for (i = start; i <= stop; i++) {
 		for (j = 0; j < PAGE_SIZE; j++)
 			data[i][j] = rand();
 
@@ -72,8 +73,8 @@ static int test_disks(int i, int j)
 		   equivalent to a RAID-5 failure (XOR, then recompute Q) */
 		erra = errb = 0;
 	} else {
-		printf("algo=%-8s  faila=%3d(%c)  failb=%3d(%c)  %s\n",
-		       raid6_call.name,
+		printf("algo=%-8s/%-8s  faila=%3d(%c)  failb=%3d(%c)  %s\n",
+		       raid6_call.name, raid6_recov_name,
 		       i, disk_type(i),
 		       j, disk_type(j),
 		       (!erra && !errb) ? "OK" :
@@ -87,16 +88,74 @@ static int test_disks(int i, int j)
 	return erra || errb;
 }
 
+/*
+ * Rewrite data disks start..stop the way a read-modify-write does: fold
+ * the old contents out of P/Q, write the new data, fold it back in, and
+ * compare with a syndrome generated from scratch.
+ */
+static int test_rmw(int start, int stop)
+{
+	int err;
+
+	raid6_call.xor_syndrome(NDISKS, start, stop, PAGE_SIZE,
+				(void **)&dataptrs);
+	makedata(start, stop);
+	raid6_call.xor_syndrome(NDISKS, start, stop, PAGE_SIZE,
+				(void **)&dataptrs);
+
+	memcpy(refp, data[NDISKS-2], PAGE_SIZE);
+	memcpy(refq, data[NDISKS-1], PAGE_SIZE);
+	raid6_call.gen_syndrome(NDISKS, PAGE_SIZE, (void **)&dataptrs);
+
+	err = memcmp(refp, data[NDISKS-2], PAGE_SIZE) ||
+	      memcmp(refq, data[NDISKS-1], PAGE_SIZE);
+	if (err)
+		printf("algo=%-8s  rmw start=%3d stop=%3d  ERR\n",
+		       raid6_call.name, start, stop);
+
+	return err;
+}
+
+/* Recovery throughput of the current routines, in MB/s */
+static unsigned long bench_recov(void)
+{
+	unsigned long n = 0;
+	uint32_t j0;
+
+	j0 = raid6_jiffies();
+	while (raid6_jiffies() - j0 < 1000) {
+		dataptrs[0] = recovi;
+		dataptrs[1] = recovj;
+		raid6_2data_recov(NDISKS, PAGE_SIZE, 0, 1, (void **)&dataptrs);
+		n++;
+	}
+	dataptrs[0] = data[0];
+	dataptrs[1] = data[1];
+
+	return (n * PAGE_SIZE) >> 20;
+}
+
 int main(int argc, char *argv[])
 {
 	const struct raid6_calls *const *algo;
-	int i, j;
-	int err = 0;
+	const struct raid6_recov_calls *const *ra;
+	int i, j, start, stop;
+	int err = 0, rmw_err;
+
+	makedata(0, NDISKS-1);
+
+	for (ra = raid6_recov_algos; *ra; ra++) {
+		if ((*ra)->valid && !(*ra)->valid())
+			continue;
 
-	makedata();
+		raid6_2data_recov = (*ra)->data2;
+		raid6_datap_recov = (*ra)->datap;
+		raid6_recov_name = (*ra)->name;
+
+		for (algo = raid6_algos; *algo; algo++) {
+			if ((*algo)->valid && !(*algo)->valid())
+				continue;
 
-	for (algo = raid6_algos; *algo; algo++) {
-		if (!(*algo)->valid || (*algo)->valid()) {
 			raid6_call = **algo;
 
 			/* Nuke syndromes */
@@ -109,6 +168,17 @@ int main(int argc, char *argv[])
 			for (i = 0; i < NDISKS-1; i++)
 				for (j = i+1; j < NDISKS; j++)
 					err += test_disks(i, j);
+
+			if (!raid6_call.xor_syndrome)
+				continue;
+
+			rmw_err = 0;
+			for (start = 0; start < NDISKS-2; start++)
+				for (stop = start; stop < NDISKS-2; stop++)
+					rmw_err += test_rmw(start, stop);
+			printf("algo=%-8s  rmw %s\n", raid6_call.name,
+			       rmw_err ? "ERRORS" : "OK");
+			err += rmw_err;
 		}
 		printf("\n");
 	}
@@ -117,6 +187,15 @@ int main(int argc, char *argv[])
 	/* Pick the best algorithm test */
 	raid6_select_algo();
 
+	for (ra = raid6_recov_algos; *ra; ra++) {
+		if ((*ra)->valid && !(*ra)->valid())
+			continue;
+
+		raid6_2data_recov = (*ra)->data2;
+		printf("raid6: recovery %-8s %5ld MB/s\n", (*ra)->name,
+		       bench_recov());
+	}
+
 	if (err)
 		printf("\n*** ERRORS FOUND ***\n");
 
@@ -109,16 +109,45 @@
  *    ->i_mmap_lock
  */
 
+static void page_cache_tree_delete(struct address_space *mapping,
+				   struct page *page, void *shadow)
+{
+	void **slot;
+	int tag;
+
+	if (!shadow) {
+		radix_tree_delete(&mapping->page_tree, page->index);
+		return;
+	}
+
+	/* The shadow entry must not inherit the page's tags */
+	for (tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++)
+		if (radix_tree_tagged(&mapping->page_tree, tag))
+			radix_tree_tag_clear(&mapping->page_tree,
+					     page->index, tag);
+
+	slot = radix_tree_lookup_slot(&mapping->page_tree, page->index);
+	radix_tree_replace_slot(slot, shadow);
+	workingset_shadow_added(mapping);
+	/*
+	 * Make the nrshadows update visible before the nrpages one, so that
+	 * a truncation racing with reclaim does not see both at zero and
+	 * miss the shadow entry.
+	 */
+	smp_wmb();
+}
+
 /*
  * Delete a page from the page cache and free it. Caller has to make
  * sure the page is locked and that nobody else uses it - or that usage
- * is safe.  The caller must hold the mapping's tree_lock.
+ * is safe.  The caller must hold the mapping's tree_lock.  If @shadow is
+ * not NULL, it is left in the page's slot: see mm/workingset.c.
  */
-void __delete_from_page_cache(struct page *page)
+void __delete_from_page_cache(struct page *page, void *shadow)
 {
 	struct address_space *mapping = page->mapping;
 
-	radix_tree_delete(&mapping->page_tree, page->index);
+	page_cache_tree_delete(mapping, page, shadow);
 	page->mapping = NULL;
 	mapping->nrpages--;
 	__dec_zone_page_state(page, NR_FILE_PAGES);
@@ -156,7 +185,7 @@ void delete_from_page_cache(struct page *page)
 
 	freepage = mapping->a_ops->freepage;
 	spin_lock_irq(&mapping->tree_lock);
-	__delete_from_page_cache(page);
+	__delete_from_page_cache(page, NULL);
 	spin_unlock_irq(&mapping->tree_lock);
 	mem_cgroup_uncharge_cache_page(page);
 
@@ -416,7 +445,7 @@ int replace_page_cache_page(struct page *old, struct page *new, gfp_t gfp_mask)
 		new->index = offset;
 
 		spin_lock_irq(&mapping->tree_lock);
-		__delete_from_page_cache(old);
+		__delete_from_page_cache(old, NULL);
 		error = radix_tree_insert(&mapping->page_tree, offset, new);
 		BUG_ON(error);
 		mapping->nrpages++;
@@ -438,17 +467,42 @@ int replace_page_cache_page(struct page *old, struct page *new, gfp_t gfp_mask)
 EXPORT_SYMBOL_GPL(replace_page_cache_page);
 
 /**
- * add_to_page_cache_locked - add a locked page to the pagecache
- * @page:	page to add
- * @mapping:	the page's address_space
- * @offset:	page index
- * @gfp_mask:	page allocation mode
+ * page_cache_tree_insert - insert a page into the radix tree of a mapping
+ * @mapping: the mapping, whose tree_lock the caller holds
+ * @index: where to insert the page
+ * @page: the page
+ * @shadowp: returns the shadow entry replaced, if not NULL
  *
- * This function is used to add a page to the pagecache. It must be locked.
- * This function does not add the page to the LRU.  The caller must do that.
+ * Takes the place of the shadow entry of an evicted page if there is one,
+ * so code that inserts pages into a page cache by itself must use this
+ * instead of radix_tree_insert().  The caller has done radix_tree_preload()
+ * and does all other accounting.  Returns -EEXIST if there is a page.
  */
-int add_to_page_cache_locked(struct page *page, struct address_space *mapping,
-		pgoff_t offset, gfp_t gfp_mask)
+int page_cache_tree_insert(struct address_space *mapping, pgoff_t index,
+			   struct page *page, void **shadowp)
+{
+	void **slot;
+	void *p;
+
+	slot = radix_tree_lookup_slot(&mapping->page_tree, index);
+	if (!slot)
+		return radix_tree_insert(&mapping->page_tree, index, page);
+
+	p = radix_tree_deref_slot_protected(slot, &mapping->tree_lock);
+	if (!radix_tree_exceptional_entry(p))
+		return -EEXIST;
+	radix_tree_replace_slot(slot, page);
+	workingset_shadow_removed(mapping);
+	if (shadowp)
+		*shadowp = p;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(page_cache_tree_insert);
+
+static int __add_to_page_cache_locked(struct page *page,
+				      struct address_space *mapping,
+				      pgoff_t offset, gfp_t gfp_mask,
+				      void **shadowp)
 {
 	int error;
 
@@ -466,7 +520,7 @@ int add_to_page_cache_locked(struct page *page, struct address_space *mapping,
 		page->index = offset;
 
 		spin_lock_irq(&mapping->tree_lock);
-		error = radix_tree_insert(&mapping->page_tree, offset, page);
+		error = page_cache_tree_insert(mapping, offset, page, shadowp);
 		if (likely(!error)) {
 			mapping->nrpages++;
 			__inc_zone_page_state(page, NR_FILE_PAGES);
@@ -485,11 +539,29 @@ int add_to_page_cache_locked(struct page *page, struct address_space *mapping,
 out:
 	return error;
 }
+
+/**
+ * add_to_page_cache_locked - add a locked page to the pagecache
+ * @page:	page to add
+ * @mapping:	the page's address_space
+ * @offset:	page index
+ * @gfp_mask:	page allocation mode
+ *
+ * This function is used to add a page to the pagecache. It must be locked.
+ * This function does not add the page to the LRU.  The caller must do that.
+ */
+int add_to_page_cache_locked(struct page *page, struct address_space *mapping,
+		pgoff_t offset, gfp_t gfp_mask)
+{
+	return __add_to_page_cache_locked(page, mapping, offset,
+					  gfp_mask, NULL);
+}
 EXPORT_SYMBOL(add_to_page_cache_locked);
 
 int add_to_page_cache_lru(struct page *page, struct address_space *mapping,
 				pgoff_t offset, gfp_t gfp_mask)
 {
+	void *shadow = NULL;
 	int ret;
 
 	/*
@@ -501,14 +573,21 @@ int add_to_page_cache_lru(struct page *page, struct address_space *mapping,
 	if (mapping_cap_swap_backed(mapping))
 		SetPageSwapBacked(page);
 
-	ret = add_to_page_cache(page, mapping, offset, gfp_mask);
-	if (ret == 0) {
-		if (page_is_file_cache(page))
-			lru_cache_add_file(page);
-		else
-			lru_cache_add_anon(page);
+	__set_page_locked(page);
+	ret = __add_to_page_cache_locked(page, mapping, offset,
+					 gfp_mask, &shadow);
+	if (unlikely(ret)) {
+		__clear_page_locked(page);
+		return ret;
 	}
-	return ret;
+
+	if (!page_is_file_cache(page))
+		lru_cache_add_anon(page);
+	else if (shadow && workingset_refault(shadow))
+		lru_cache_add_lru(page, LRU_ACTIVE_FILE);
+	else
+		lru_cache_add_file(page);
+	return 0;
 }
 EXPORT_SYMBOL_GPL(add_to_page_cache_lru);
 
@@ -580,6 +659,64 @@ void add_page_wait_queue(struct page *page, wait_queue_t *waiter)
 }
 EXPORT_SYMBOL_GPL(add_page_wait_queue);
 
+static int kiocb_wake_page_function(wait_queue_t *wait, unsigned mode,
+				    int sync, void *arg)
+{
+	struct wait_bit_key *key = arg;
+	struct wait_bit_queue *wait_bit
+		= container_of(wait, struct wait_bit_queue, wait);
+
+	if (wait_bit->key.flags != key->flags ||
+			wait_bit->key.bit_nr != key->bit_nr ||
+			test_bit(key->bit_nr, key->flags))
+		return 0;
+
+	list_del_init(&wait->task_list);
+	kick_iocb(wait->private);
+	return 1;
+}
+
+/*
+ * kiocb_wait_on_page_locked - have the aio core retry an iocb once a page
+ * is unlocked
+ * @iocb: the async iocb to kick
+ * @page: the page to wait for
+ *
+ * Returns -EIOCBRETRY once the wait is queued, or 0 if the page turned
+ * out to be unlocked already, in which case the caller can go on at once.
+ */
+static int kiocb_wait_on_page_locked(struct kiocb *iocb, struct page *page)
+{
+	wait_queue_head_t *q = page_waitqueue(page);
+	struct wait_bit_queue *wait = &iocb->ki_wait;
+	unsigned long flags;
+	int queued = 1;
+
+	wait->key.flags = &page->flags;
+	wait->key.bit_nr = PG_locked;
+	init_waitqueue_func_entry(&wait->wait, kiocb_wake_page_function);
+	wait->wait.private = iocb;
+
+	spin_lock_irqsave(&q->lock, flags);
+	__add_wait_queue(q, &wait->wait);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	/* Pairs with the barrier in unlock_page(), as in prepare_to_wait(). */
+	smp_mb();
+	if (PageLocked(page))
+		return -EIOCBRETRY;
+
+	/* Unless the wakeup got to it first, take the wait back off. */
+	spin_lock_irqsave(&q->lock, flags);
+	if (!list_empty(&wait->wait.task_list)) {
+		list_del_init(&wait->wait.task_list);
+		queued = 0;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	return queued ? -EIOCBRETRY : 0;
+}
+
 /**
  * unlock_page - unlock a locked page
  * @page: the page
@@ -655,6 +792,64 @@ int __lock_page_or_retry(struct page *page, struct mm_struct *mm,
 	}
 }
 
+/**
+ * page_cache_next_hole - find the next hole (not-present entry)
+ * @mapping: mapping
+ * @index: index
+ * @max_scan: maximum range to search
+ *
+ * Like radix_tree_next_hole() on the page cache of @mapping, except that
+ * the shadow entries of evicted pages count as holes.
+ */
+pgoff_t page_cache_next_hole(struct address_space *mapping,
+			     pgoff_t index, unsigned long max_scan)
+{
+	unsigned long i;
+
+	for (i = 0; i < max_scan; i++) {
+		struct page *page;
+
+		page = radix_tree_lookup(&mapping->page_tree, index);
+		if (!page || radix_tree_exceptional_entry(page))
+			break;
+		index++;
+		if (index == 0)
+			break;
+	}
+
+	return index;
+}
+EXPORT_SYMBOL(page_cache_next_hole);
+
+/**
+ * page_cache_prev_hole - find the prev hole (not-present entry)
+ * @mapping: mapping
+ * @index: index
+ * @max_scan: maximum range to search
+ *
+ * Like radix_tree_prev_hole() on the page cache of @mapping, except that
+ * the shadow entries of evicted pages count as holes.
+ */
+pgoff_t page_cache_prev_hole(struct address_space *mapping,
+			     pgoff_t index, unsigned long max_scan)
+{
+	unsigned long i;
+
+	for (i = 0; i < max_scan; i++) {
+		struct page *page;
+
+		page = radix_tree_lookup(&mapping->page_tree, index);
+		if (!page || radix_tree_exceptional_entry(page))
+			break;
+		index--;
+		if (index == ULONG_MAX)
+			break;
+	}
+
+	return index;
+}
+EXPORT_SYMBOL(page_cache_prev_hole);
+
 /**
  * find_get_page - find and get a page reference
  * @mapping: the address_space to search
@@ -678,6 +873,11 @@ repeat:
 			goto out;
 		if (radix_tree_deref_retry(page))
 			goto repeat;
+		/* A shadow entry of an evicted page */
+		if (radix_tree_exceptional_entry(page)) {
+			page = NULL;
+			goto out;
+		}
 
 		if (!page_cache_get_speculative(page))
 			goto repeat;
@@ -777,68 +977,94 @@ repeat:
 EXPORT_SYMBOL(find_or_create_page);
 
 /**
- * find_get_pages - gang pagecache lookup
+ * find_get_pages_range - gang pagecache lookup
  * @mapping:	The address_space to search
  * @start:	The starting page index
+ * @end:	The final page index (inclusive)
  * @nr_pages:	The maximum number of pages
  * @pages:	Where the resulting pages are placed
  *
- * find_get_pages() will search for and return a group of up to
- * @nr_pages pages in the mapping.  The pages are placed at @pages.
- * find_get_pages() takes a reference against the returned pages.
+ * find_get_pages_range() will search for and return a group of up to
+ * @nr_pages pages in the mapping, at indexes no higher than @end.  The
+ * pages are placed at @pages.  find_get_pages_range() takes a reference
+ * against the returned pages.
  *
  * The search returns a group of mapping-contiguous pages with ascending
  * indexes.  There may be holes in the indices due to not-present pages.
  *
- * find_get_pages() returns the number of pages which were found.
+ * find_get_pages_range() returns the number of pages which were found.
  */
-unsigned find_get_pages(struct address_space *mapping, pgoff_t start,
-			    unsigned int nr_pages, struct page **pages)
+unsigned find_get_pages_range(struct address_space *mapping, pgoff_t start,
+			      pgoff_t end, unsigned int nr_pages,
+			      struct page **pages)
 {
+	unsigned long indices[PAGEVEC_SIZE];
+	void **slots[PAGEVEC_SIZE];
 	unsigned int i;
-	unsigned int ret;
+	unsigned int ret = 0;
 	unsigned int nr_found;
 
+	/*
+	 * Shadow entries are skipped, and there may be any number of them
+	 * in a row: look up in batches, and carry on after a batch that
+	 * gave no pages, because callers stop trying once 0 is returned.
+	 * Never look beyond @end, however many of them there are.
+	 */
 	rcu_read_lock();
+	while (ret < nr_pages && start <= end) {
+		unsigned int nr = min_t(unsigned int, nr_pages - ret,
+					PAGEVEC_SIZE);
+
+		if (end - start < nr)
+			nr = end - start + 1;
 restart:
-	nr_found = radix_tree_gang_lookup_slot(&mapping->page_tree,
-				(void ***)pages, start, nr_pages);
-	ret = 0;
-	for (i = 0; i < nr_found; i++) {
-		struct page *page;
+		nr_found = radix_tree_gang_lookup_slot(&mapping->page_tree,
+				slots, indices, start, nr);
+		if (!nr_found)
+			break;
+
+		for (i = 0; i < nr_found; i++) {
+			struct page *page;
+
+			if (indices[i] > end)
+				goto out;
 repeat:
-		page = radix_tree_deref_slot((void **)pages[i]);
-		if (unlikely(!page))
-			continue;
+			page = radix_tree_deref_slot(slots[i]);
+			if (unlikely(!page))
+				continue;
 
-		/*
-		 * This can only trigger when the entry at index 0 moves out
-		 * of or back to the root: none yet gotten, safe to restart.
-		 */
-		if (radix_tree_deref_retry(page)) {
-			WARN_ON(start | i);
-			goto restart;
-		}
+			/*
+			 * This can only trigger when the entry at index 0
+			 * moves out of or back to the root: none yet gotten,
+			 * safe to restart.
+			 */
+			if (radix_tree_deref_retry(page)) {
+				WARN_ON(start | i);
+				goto restart;
+			}
 
-		if (!page_cache_get_speculative(page))
-			goto repeat;
+			/* A shadow entry of an evicted page */
+			if (radix_tree_exceptional_entry(page))
+				continue;
 
-		/* Has the page moved? */
-		if (unlikely(page != *((void **)pages[i]))) {
-			page_cache_release(page);
-			goto repeat;
+			if (!page_cache_get_speculative(page))
+				goto repeat;
+
+			/* Has the page moved? */
+			if (unlikely(page != *slots[i])) {
+				page_cache_release(page);
+				goto repeat;
+			}
+
+			pages[ret] = page;
+			ret++;
 		}
 
-		pages[ret] = page;
-		ret++;
+		start = indices[nr_found - 1] + 1;
+		if (!start)
+			break;
 	}
-
-	/*
-	 * If all entries were removed before we could secure them,
-	 * try again, because callers stop trying once 0 is returned.
-	 */
-	if (unlikely(!ret && nr_found))
-		goto restart;
+out:
 	rcu_read_unlock();
 	return ret;
 }
@@ -865,7 +1091,7 @@ unsigned find_get_pages_contig(struct address_space *mapping, pgoff_t index,
 	rcu_read_lock();
 restart:
 	nr_found = radix_tree_gang_lookup_slot(&mapping->page_tree,
-				(void ***)pages, index, nr_pages);
+				(void ***)pages, NULL, index, nr_pages);
 	ret = 0;
 	for (i = 0; i < nr_found; i++) {
 		struct page *page;
@@ -881,6 +1107,10 @@ repeat:
 		if (radix_tree_deref_retry(page))
 			goto restart;
 
+		/* A shadow entry of an evicted page is a hole */
+		if (radix_tree_exceptional_entry(page))
+			break;
+
 		if (!page_cache_get_speculative(page))
 			goto repeat;
 
@@ -946,6 +1176,10 @@ repeat:
 		if (radix_tree_deref_retry(page))
 			goto restart;
 
+		/* The page was evicted since the lookup */
+		if (radix_tree_exceptional_entry(page))
+			continue;
+
 		if (!page_cache_get_speculative(page))
 			goto repeat;
 
@@ -1034,15 +1268,22 @@ static void shrink_readahead_size_eio(struct file *filp,
  * @ppos:	current file position
  * @desc:	read_descriptor
  * @actor:	read method
+ * @busy:	where to return a page that is being read in, or NULL to
+ *		wait for it
  *
  * This is a generic file read routine, and uses the
  * mapping->a_ops->readpage() function for the actual low-level stuff.
  *
+ * If @busy is not NULL, the read does not wait for pages to come in from
+ * the disk.  It stops at the first page that is locked for io, sets
+ * desc->error to -EIOCBRETRY and returns the page, with a reference held,
+ * in *@busy.
+ *
  * This is really ugly. But the goto's actually try to clarify some
  * of the logic when it comes to error handling etc.
  */
 static void do_generic_file_read(struct file *filp, loff_t *ppos,
-		read_descriptor_t *desc, read_actor_t actor)
+		read_descriptor_t *desc, read_actor_t actor, struct page **busy)
 {
 	struct address_space *mapping = filp->f_mapping;
 	struct inode *inode = mapping->host;
@@ -1162,9 +1403,14 @@ page_ok:
 
 page_not_up_to_date:
 		/* Get exclusive access to the page ... */
-		error = lock_page_killable(page);
-		if (unlikely(error))
-			goto readpage_error;
+		if (busy) {
+			if (!trylock_page(page))
+				goto page_busy;
+		} else {
+			error = lock_page_killable(page);
+			if (unlikely(error))
+				goto readpage_error;
+		}
 
 page_not_up_to_date_locked:
 		/* Did it get truncated before we got the lock? */
@@ -1180,6 +1426,16 @@ page_not_up_to_date_locked:
 			goto page_ok;
 		}
 
+		/*
+		 * Without waiting we can not tell a read that failed from
+		 * one we have not waited for yet, so do not try again.
+		 */
+		if (busy && PageError(page)) {
+			unlock_page(page);
+			error = -EIO;
+			goto readpage_error;
+		}
+
 readpage:
 		/*
 		 * A previous I/O error may have been due to temporary
@@ -1199,6 +1455,8 @@ readpage:
 		}
 
 		if (!PageUptodate(page)) {
+			if (busy)
+				goto page_busy;
 			error = lock_page_killable(page);
 			if (unlikely(error))
 				goto readpage_error;
@@ -1227,6 +1485,12 @@ readpage_error:
 		page_cache_release(page);
 		goto out;
 
+page_busy:
+		/* The caller will wait for it to be unlocked */
+		desc->error = -EIOCBRETRY;
+		*busy = page;
+		goto out;
+
 no_cached_page:
 		/*
 		 * Ok, it wasn't cached, so we need to create a new
@@ -1355,6 +1619,14 @@ generic_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
 	size_t count;
 	loff_t *ppos = &iocb->ki_pos;
 	struct blk_plug plug;
+	struct page *page, **busy = NULL;
+
+	/*
+	 * Async reads do not wait for pages to be read in; the aio core
+	 * retries them once the page they need has been unlocked.
+	 */
+	if (!is_sync_kiocb(iocb))
+		busy = &page;
 
 	count = 0;
 	retval = generic_segment_checks(iov, &nr_segs, &count, VERIFY_WRITE);
@@ -1425,7 +1697,21 @@ generic_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
 		if (desc.count == 0)
 			continue;
 		desc.error = 0;
-		do_generic_file_read(filp, ppos, &desc, file_read_actor);
+		do {
+			do_generic_file_read(filp, ppos, &desc,
+					     file_read_actor, busy);
+			if (likely(desc.error != -EIOCBRETRY))
+				break;
+			/*
+			 * Hand back what we have read so far, if anything;
+			 * the next call will queue the wait.
+			 */
+			desc.error = 0;
+			if (!retval && !desc.written)
+				desc.error = kiocb_wait_on_page_locked(iocb,
+								       page);
+			page_cache_release(page);
+		} while (!desc.error && !retval && !desc.written);
 		retval += desc.written;
 		if (desc.error) {
 			retval = retval ?: desc.error;
@@ -1713,8 +1999,84 @@ page_not_uptodate:
 }
 EXPORT_SYMBOL(filemap_fault);
 
+/**
+ * filemap_map_pages - map the cached pages around a read fault
+ * @vma:	vma in which the fault was taken
+ * @vmf:	range to map, see struct vm_fault
+ *
+ * Maps the pages from vmf->pgoff to vmf->max_pgoff that are uptodate in
+ * the page cache and not mapped yet, so that a task reading through a
+ * cached file takes one fault for several pages.  Pages that are locked,
+ * not uptodate or have readahead pending are left to filemap_fault().
+ * Called with the page table lock held, so nothing here may block.
+ */
+void filemap_map_pages(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct file *file = vma->vm_file;
+	struct address_space *mapping = file->f_mapping;
+	unsigned long address = (unsigned long)vmf->virtual_address;
+	struct page *pages[PAGEVEC_SIZE];
+	pgoff_t index = vmf->pgoff;
+	pgoff_t last = vmf->max_pgoff;
+	unsigned int i, nr;
+	loff_t size;
+
+	size = i_size_read(mapping->host);
+	if (!size)
+		return;
+	last = min_t(pgoff_t, last, (size - 1) >> PAGE_CACHE_SHIFT);
+
+	while (index <= last) {
+		nr = find_get_pages_range(mapping, index, last,
+					  PAGEVEC_SIZE, pages);
+		if (!nr)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			struct page *page = pages[i];
+			pte_t *pte;
+
+			index = page->index + 1;
+			if (!PageUptodate(page) || PageReadahead(page) ||
+			    PageHWPoison(page))
+				goto skip;
+			if (!trylock_page(page))
+				goto skip;
+
+			/* Truncated, or invalidated and not read back yet? */
+			if (page->mapping != mapping || !PageUptodate(page))
+				goto unlock;
+
+			/* Truncated since i_size was sampled above? */
+			size = i_size_read(mapping->host);
+			if (page->index >= (size + PAGE_CACHE_SIZE - 1) >>
+					   PAGE_CACHE_SHIFT)
+				goto unlock;
+
+			pte = vmf->pte + page->index - vmf->pgoff;
+			if (!pte_none(*pte))
+				goto unlock;
+
+			if (file->f_ra.mmap_miss > 0)
+				file->f_ra.mmap_miss--;
+			/* The mapping keeps the reference the lookup took */
+			do_set_pte(vma, address +
+				   ((page->index - vmf->pgoff) << PAGE_SHIFT),
+				   page, pte, false, false);
+			unlock_page(page);
+			continue;
+unlock:
+			unlock_page(page);
+skip:
+			page_cache_release(page);
+		}
+	}
+}
+EXPORT_SYMBOL(filemap_map_pages);
+
 const struct vm_operations_struct generic_file_vm_ops = {
 	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
 };
 
 /* This is used for a general mmap of a disk file */
@@ -0,0 +1,178 @@
+/*
+ *  linux/mm/list_lru.c
+ *
+ *  Per node lists of reclaimable objects, in least recently used order.
+ *
+ *  Each node has its own list and lock, and objects go on the list of
+ *  the node their memory is on, so that a shrinker asked to free memory
+ *  on one node only looks at the objects there, and so that adding and
+ *  removing objects on different nodes does not contend on one lock.
+ *
+ *  Objects are added at the tail of the list and walks start at the
+ *  head, where the objects that have been unused for the longest are.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/list_lru.h>
+
+static inline struct list_lru_node *item_node(struct list_lru *lru,
+					      struct list_head *item, int *nid)
+{
+	*nid = page_to_nid(virt_to_page(item));
+	return &lru->node[*nid];
+}
+
+bool list_lru_add(struct list_lru *lru, struct list_head *item)
+{
+	struct list_lru_node *nlru;
+	int nid;
+
+	nlru = item_node(lru, item, &nid);
+	spin_lock(&nlru->lock);
+	if (list_empty(item)) {
+		list_add_tail(item, &nlru->list);
+		if (nlru->nr_items++ == 0)
+			node_set(nid, lru->active_nodes);
+		spin_unlock(&nlru->lock);
+		return true;
+	}
+	spin_unlock(&nlru->lock);
+	return false;
+}
+EXPORT_SYMBOL_GPL(list_lru_add);
+
+bool list_lru_del(struct list_lru *lru, struct list_head *item)
+{
+	struct list_lru_node *nlru;
+	int nid;
+
+	nlru = item_node(lru, item, &nid);
+	spin_lock(&nlru->lock);
+	if (!list_empty(item)) {
+		list_del_init(item);
+		if (--nlru->nr_items == 0)
+			node_clear(nid, lru->active_nodes);
+		spin_unlock(&nlru->lock);
+		return true;
+	}
+	spin_unlock(&nlru->lock);
+	return false;
+}
+EXPORT_SYMBOL_GPL(list_lru_del);
+
+bool list_lru_expire(struct list_lru *lru, struct list_head *item)
+{
+	struct list_lru_node *nlru;
+	bool added = false;
+	int nid;
+
+	nlru = item_node(lru, item, &nid);
+	spin_lock(&nlru->lock);
+	if (list_empty(item)) {
+		if (nlru->nr_items++ == 0)
+			node_set(nid, lru->active_nodes);
+		added = true;
+	} else
+		list_del(item);
+	list_add(item, &nlru->list);
+	spin_unlock(&nlru->lock);
+	return added;
+}
+EXPORT_SYMBOL_GPL(list_lru_expire);
+
+unsigned long list_lru_count_node(struct list_lru *lru, int nid)
+{
+	long count = ACCESS_ONCE(lru->node[nid].nr_items);
+
+	return count > 0 ? count : 0;
+}
+EXPORT_SYMBOL_GPL(list_lru_count_node);
+
+unsigned long list_lru_count(struct list_lru *lru)
+{
+	unsigned long count = 0;
+	int nid;
+
+	for_each_node_mask(nid, lru->active_nodes)
+		count += list_lru_count_node(lru, nid);
+	return count;
+}
+EXPORT_SYMBOL_GPL(list_lru_count);
+
+/**
+ * list_lru_walk_node - walk the objects of one node, oldest first
+ * @lru: the lru to walk
+ * @nid: the node whose list to walk
+ * @isolate: called for each object, see enum lru_status
+ * @cb_arg: passed on to @isolate
+ * @nr_to_walk: how many objects to look at, decremented for each
+ *
+ * Returns the number of objects @isolate removed or isolated.
+ */
+unsigned long list_lru_walk_node(struct list_lru *lru, int nid,
+				 list_lru_walk_cb isolate, void *cb_arg,
+				 unsigned long *nr_to_walk)
+{
+	struct list_lru_node *nlru = &lru->node[nid];
+	struct list_head *item, *n;
+	unsigned long isolated = 0;
+
+	spin_lock(&nlru->lock);
+restart:
+	list_for_each_safe(item, n, &nlru->list) {
+		if (!*nr_to_walk)
+			break;
+		--*nr_to_walk;
+
+		switch (isolate(item, &nlru->lock, cb_arg)) {
+		case LRU_REMOVED:
+			if (--nlru->nr_items == 0)
+				node_clear(nid, lru->active_nodes);
+			/* fall through */
+		case LRU_ISOLATED:
+			isolated++;
+			break;
+		case LRU_ROTATE:
+			list_move_tail(item, &nlru->list);
+			break;
+		case LRU_SKIP:
+			break;
+		case LRU_RETRY:
+			/* The list may have changed while it was unlocked */
+			goto restart;
+		default:
+			BUG();
+		}
+	}
+	spin_unlock(&nlru->lock);
+	return isolated;
+}
+EXPORT_SYMBOL_GPL(list_lru_walk_node);
+
+int list_lru_init(struct list_lru *lru)
+{
+	int i;
+
+	lru->node = kcalloc(nr_node_ids, sizeof(*lru->node), GFP_KERNEL);
+	if (!lru->node)
+		return -ENOMEM;
+
+	nodes_clear(lru->active_nodes);
+	for (i = 0; i < nr_node_ids; i++) {
+		spin_lock_init(&lru->node[i].lock);
+		INIT_LIST_HEAD(&lru->node[i].list);
+		lru->node[i].nr_items = 0;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(list_lru_init);
+
+void list_lru_destroy(struct list_lru *lru)
+{
+	kfree(lru->node);
+	lru->node = NULL;
+}
+EXPORT_SYMBOL_GPL(list_lru_destroy);
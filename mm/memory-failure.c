@@ -237,9 +237,10 @@ void shake_page(struct page *p, int access)
 	 * access is not potentially fatal.
 	 */
 	if (access) {
+		nodemask_t nodes = nodemask_of_node(page_to_nid(p));
 		int nr;
 		do {
-			nr = shrink_slab(1000, GFP_KERNEL, 1000);
+			nr = shrink_slab(1000, GFP_KERNEL, 1000, &nodes);
 			if (page_count(p) == 1)
 				break;
 		} while (nr > 10);
@@ -387,7 +388,7 @@ static void collect_procs_anon(struct page *page, struct list_head *to_kill,
 	struct anon_vma *av;
 
 	read_lock(&tasklist_lock);
-	av = page_lock_anon_vma(page);
+	av = page_lock_anon_vma_read(page);
 	if (av == NULL)	/* Not actually mapped anymore */
 		goto out;
 	for_each_process (tsk) {
@@ -403,7 +404,7 @@ static void collect_procs_anon(struct page *page, struct list_head *to_kill,
 				add_to_kill(tsk, page, vma, to_kill, tkc);
 		}
 	}
-	page_unlock_anon_vma(av);
+	page_unlock_anon_vma_read(av);
 out:
 	read_unlock(&tasklist_lock);
 }
@@ -1607,6 +1607,37 @@ unsigned slab_node(struct mempolicy *policy)
 	}
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+/**
+ * mpol_misplaced - check whether a page is on the node its policy wants
+ * @page: page that took a NUMA hinting fault
+ * @vma: vm area where the page is mapped
+ * @addr: virtual address where the page is mapped
+ *
+ * Only pages under the default, local allocation, policy are moved, to the
+ * node of the cpu that faulted on them: pages under an explicit policy
+ * were put where the task asked for them.
+ *
+ * Returns the node the page should be moved to, or -1 if it should stay.
+ * Called with the mmap_sem held for read.
+ */
+int mpol_misplaced(struct page *page, struct vm_area_struct *vma,
+		   unsigned long addr)
+{
+	struct mempolicy *pol = get_vma_policy(current, vma, addr);
+	int thisnid = numa_node_id();
+	int ret = -1;
+
+	if (pol->mode == MPOL_PREFERRED && (pol->flags & MPOL_F_LOCAL) &&
+	    page_to_nid(page) != thisnid &&
+	    node_isset(thisnid, cpuset_current_mems_allowed))
+		ret = thisnid;
+
+	mpol_cond_put(pol);
+	return ret;
+}
+#endif
+
 /* Do static interleaving for a VMA with known offset. */
 static unsigned offset_il_node(struct mempolicy *pol,
 		struct vm_area_struct *vma, unsigned long off)
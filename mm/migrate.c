@@ -718,10 +718,10 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 	 */
 	if (PageAnon(page)) {
 		/*
-		 * Only page_lock_anon_vma() understands the subtleties of
+		 * Only page_lock_anon_vma_read() understands the subtleties of
 		 * getting a hold on an anon_vma from outside one of its mms.
 		 */
-		anon_vma = page_lock_anon_vma(page);
+		anon_vma = page_lock_anon_vma_read(page);
 		if (anon_vma) {
 			/*
 			 * Take a reference count on the anon_vma if the
@@ -729,7 +729,7 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 			 * exist when the page is remapped later
 			 */
 			get_anon_vma(anon_vma);
-			page_unlock_anon_vma(anon_vma);
+			page_unlock_anon_vma_read(anon_vma);
 		} else if (PageSwapCache(page)) {
 			/*
 			 * We cannot be sure that the anon_vma of an unmapped
@@ -858,10 +858,10 @@ static int unmap_and_move_huge_page(new_page_t get_new_page,
 	}
 
 	if (PageAnon(hpage)) {
-		anon_vma = page_lock_anon_vma(hpage);
+		anon_vma = page_lock_anon_vma_read(hpage);
 		if (anon_vma) {
 			get_anon_vma(anon_vma);
-			page_unlock_anon_vma(anon_vma);
+			page_unlock_anon_vma_read(anon_vma);
 		}
 	}
 
@@ -1370,4 +1370,88 @@ int migrate_vmas(struct mm_struct *mm, const nodemask_t *to,
  	}
  	return err;
 }
+
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Do not move more than 128MB per 100ms to one node for hinting faults,
+ * so that a task that just landed on a new node does not saturate the
+ * interconnect moving its whole working set at once.
+ */
+static unsigned int migrate_interval_millisecs __read_mostly = 100;
+static unsigned int ratelimit_pages __read_mostly = 128 << (20 - PAGE_SHIFT);
+
+static bool numamigrate_update_ratelimit(pg_data_t *pgdat)
+{
+	bool rate_limited = false;
+
+	spin_lock(&pgdat->numabalancing_migrate_lock);
+	if (time_after(jiffies, pgdat->numabalancing_migrate_next_window)) {
+		pgdat->numabalancing_migrate_nr_pages = 0;
+		pgdat->numabalancing_migrate_next_window = jiffies +
+			msecs_to_jiffies(migrate_interval_millisecs);
+	}
+	if (pgdat->numabalancing_migrate_nr_pages >= ratelimit_pages)
+		rate_limited = true;
+	else
+		pgdat->numabalancing_migrate_nr_pages++;
+	spin_unlock(&pgdat->numabalancing_migrate_lock);
+
+	return rate_limited;
+}
+
+static struct page *alloc_misplaced_dst_page(struct page *page,
+					     unsigned long data, int **result)
+{
+	int nid = (int) data;
+
+	/* Only move the page if there is free memory on the node for it */
+	return alloc_pages_exact_node(nid, GFP_HIGHUSER_MOVABLE |
+				      __GFP_THISNODE | __GFP_NOMEMALLOC |
+				      __GFP_NORETRY | __GFP_NOWARN, 0);
+}
+
+/**
+ * migrate_misplaced_page - move a page to the node that faulted on it
+ * @page: page that took a NUMA hinting fault, see mpol_misplaced()
+ * @node: node to move it to
+ *
+ * Only pages mapped by a single process are moved: which node is best
+ * for a shared page cannot be told from one fault.  The reference the
+ * caller holds on @page is dropped.
+ *
+ * Returns true if the page was moved.
+ */
+bool migrate_misplaced_page(struct page *page, int node)
+{
+	pg_data_t *pgdat = NODE_DATA(node);
+	LIST_HEAD(migratepages);
+	int isolated = 0;
+	int nr_remaining;
+
+	if (page_mapcount(page) != 1 || PageCompound(page))
+		goto out;
+	if (numamigrate_update_ratelimit(pgdat))
+		goto out;
+	if (isolate_lru_page(page))
+		goto out;
+
+	isolated = 1;
+	inc_zone_page_state(page, NR_ISOLATED_ANON + page_is_file_cache(page));
+	list_add(&page->lru, &migratepages);
+out:
+	/* Migration expects the isolation reference to be the only one */
+	put_page(page);
+	if (!isolated)
+		return false;
+
+	nr_remaining = migrate_pages(&migratepages, alloc_misplaced_dst_page,
+				     node, false, true);
+	if (nr_remaining) {
+		putback_lru_pages(&migratepages);
+		return false;
+	}
+	count_vm_event(NUMA_PAGE_MIGRATE);
+	return true;
+}
+#endif /* CONFIG_NUMA_BALANCING */
 #endif
@@ -141,6 +141,116 @@ static void change_protection(struct vm_area_struct *vma,
 	flush_tlb_range(vma, start, end);
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+static unsigned long change_pte_range_numa(struct vm_area_struct *vma,
+		pmd_t *pmd, unsigned long addr, unsigned long end)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long pages = 0;
+	pte_t *pte;
+	spinlock_t *ptl;
+
+	pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	arch_enter_lazy_mmu_mode();
+	do {
+		pte_t ptent = *pte;
+
+		if (!pte_present(ptent) || pte_numa(ptent))
+			continue;
+		if (!vm_normal_page(vma, addr, ptent))
+			continue;
+
+		ptent = ptep_modify_prot_start(mm, addr, pte);
+		ptep_modify_prot_commit(mm, addr, pte, pte_mknuma(ptent));
+		pages++;
+	} while (pte++, addr += PAGE_SIZE, addr != end);
+	arch_leave_lazy_mmu_mode();
+	pte_unmap_unlock(pte - 1, ptl);
+
+	return pages;
+}
+
+static unsigned long change_pmd_range_numa(struct vm_area_struct *vma,
+		pud_t *pud, unsigned long addr, unsigned long end)
+{
+	unsigned long next, pages = 0;
+	pmd_t *pmd, pmdval;
+
+	pmd = pmd_offset(pud, addr);
+	do {
+		next = pmd_addr_end(addr, end);
+		/*
+		 * A fault can install a huge pmd with only the read side of
+		 * the mmap_sem, so look at the pmd once.  A pte table stays
+		 * one: collapsing it takes the mmap_sem for writing.
+		 */
+		pmdval = *pmd;
+		barrier();
+		if (pmd_none(pmdval) || pmd_trans_huge(pmdval))
+			continue;
+		if (unlikely(pmd_bad(pmdval))) {
+			pmd_clear_bad(pmd);
+			continue;
+		}
+		pages += change_pte_range_numa(vma, pmd, addr, next);
+	} while (pmd++, addr = next, addr != end);
+
+	return pages;
+}
+
+static unsigned long change_pud_range_numa(struct vm_area_struct *vma,
+		pgd_t *pgd, unsigned long addr, unsigned long end)
+{
+	unsigned long next, pages = 0;
+	pud_t *pud;
+
+	pud = pud_offset(pgd, addr);
+	do {
+		next = pud_addr_end(addr, end);
+		if (pud_none_or_clear_bad(pud))
+			continue;
+		pages += change_pmd_range_numa(vma, pud, addr, next);
+	} while (pud++, addr = next, addr != end);
+
+	return pages;
+}
+
+/**
+ * change_prot_numa - make the ptes of a range take NUMA hinting faults
+ * @vma: vm area the range is in
+ * @addr: start of the range
+ * @end: end of the range
+ *
+ * The pages mapped in the range stay mapped, but the next access to each
+ * of them faults, see do_numa_page().  Transparent huge pages are left
+ * alone.  Called with the mmap_sem held for read.
+ *
+ * Returns the number of ptes changed.
+ */
+unsigned long change_prot_numa(struct vm_area_struct *vma,
+			       unsigned long addr, unsigned long end)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long start = addr, next, pages = 0;
+	pgd_t *pgd;
+
+	BUG_ON(addr >= end);
+	pgd = pgd_offset(mm, addr);
+	do {
+		next = pgd_addr_end(addr, end);
+		if (pgd_none_or_clear_bad(pgd))
+			continue;
+		pages += change_pud_range_numa(vma, pgd, addr, next);
+	} while (pgd++, addr = next, addr != end);
+
+	if (pages) {
+		flush_tlb_range(vma, start, end);
+		count_vm_events(NUMA_PTE_UPDATES, pages);
+	}
+	return pages;
+}
+#endif
+
 int
 mprotect_fixup(struct vm_area_struct *vma, struct vm_area_struct **pprev,
 	unsigned long start, unsigned long end, unsigned long newflags)
@@ -0,0 +1,371 @@
+/*
+ *  linux/mm/process_vm_access.c
+ *
+ *  process_vm_readv() and process_vm_writev(): copy data between the
+ *  address space of the caller and that of another process in one go,
+ *  without going through a pipe or shared memory.
+ *
+ *  The pages of the other process are pinned with get_user_pages() a
+ *  batch at a time, and copied to or from the iovecs of the caller with
+ *  copy_to_user() and copy_from_user().  The caller needs the permission
+ *  ptrace would need to attach to the process.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version
+ *  2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/sched.h>
+#include <linux/highmem.h>
+#include <linux/ptrace.h>
+#include <linux/slab.h>
+#include <linux/syscalls.h>
+
+#ifdef CONFIG_COMPAT
+#include <linux/compat.h>
+#endif
+
+/* Pages pinned at a time: up to this many on the stack... */
+#define PVM_MAX_PP_ARRAY_COUNT	16
+/* ...and kmalloc()ed up to this many bytes of page pointers beyond */
+#define PVM_MAX_KMALLOC_PAGES	(PAGE_SIZE * 2)
+
+/* Where in the iovecs of the caller the copy has got to */
+struct pvm_local {
+	const struct iovec *iov;
+	unsigned long nr_segs;
+	unsigned long seg;
+	size_t offset;
+};
+
+/*
+ * Copy @len bytes, starting @offset bytes into the first of @pages, to or
+ * from the caller.  Stops early when the caller's iovecs are full.
+ *
+ * Returns 0, or -EFAULT if a local address could not be accessed.
+ */
+static int process_vm_rw_pages(struct page **pages, unsigned long offset,
+			       unsigned long len, struct pvm_local *local,
+			       int vm_write, ssize_t *bytes_copied)
+{
+	while (len && local->seg < local->nr_segs) {
+		const struct iovec *iov = &local->iov[local->seg];
+		void __user *buf = iov->iov_base + local->offset;
+		size_t copy, left;
+		void *kaddr;
+
+		if (local->offset == iov->iov_len) {
+			local->seg++;
+			local->offset = 0;
+			continue;
+		}
+
+		copy = min3((size_t)(PAGE_SIZE - offset), (size_t)len,
+			    iov->iov_len - local->offset);
+		kaddr = kmap(*pages);
+		if (vm_write) {
+			left = copy_from_user(kaddr + offset, buf, copy);
+			set_page_dirty_lock(*pages);
+		} else {
+			left = copy_to_user(buf, kaddr + offset, copy);
+		}
+		kunmap(*pages);
+
+		*bytes_copied += copy - left;
+		if (left)
+			return -EFAULT;
+
+		len -= copy;
+		local->offset += copy;
+		offset += copy;
+		if (offset == PAGE_SIZE) {
+			pages++;
+			offset = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Copy one iovec of the other process, @addr and @len in @mm, pinning at
+ * most @nr_pp pages at a time in @process_pages.
+ *
+ * Returns 0, or -EFAULT if an address of either process could not be
+ * accessed.
+ */
+static int process_vm_rw_single_vec(unsigned long addr, unsigned long len,
+				    struct pvm_local *local,
+				    struct page **process_pages,
+				    unsigned long nr_pp,
+				    struct task_struct *task,
+				    struct mm_struct *mm, int vm_write,
+				    ssize_t *bytes_copied)
+{
+	unsigned long pa = addr & PAGE_MASK;
+	unsigned long start_offset = addr - pa;
+	unsigned long nr_pages;
+	int rc = 0;
+
+	if (!len)
+		return 0;
+	nr_pages = (addr + len - 1) / PAGE_SIZE - addr / PAGE_SIZE + 1;
+
+	while (nr_pages && local->seg < local->nr_segs) {
+		unsigned long bytes;
+		int pages, i;
+
+		/*
+		 * The mmap_sem is not held over the copy, which may fault
+		 * on the caller's mm, and that may be @mm.
+		 */
+		down_read(&mm->mmap_sem);
+		pages = get_user_pages(task, mm, pa, min(nr_pages, nr_pp),
+				       vm_write, 0, process_pages, NULL);
+		up_read(&mm->mmap_sem);
+		if (pages <= 0)
+			return -EFAULT;
+
+		bytes = pages * PAGE_SIZE - start_offset;
+		if (bytes > len)
+			bytes = len;
+
+		rc = process_vm_rw_pages(process_pages, start_offset, bytes,
+					 local, vm_write, bytes_copied);
+		for (i = 0; i < pages; i++)
+			put_page(process_pages[i]);
+		if (rc)
+			return rc;
+
+		len -= bytes;
+		start_offset = 0;
+		nr_pages -= pages;
+		pa += pages * PAGE_SIZE;
+	}
+	return 0;
+}
+
+/*
+ * Copy between the already checked iovecs @lvec of the caller and @rvec
+ * of process @pid.
+ *
+ * Returns the number of bytes copied, or an error if none were.
+ */
+static ssize_t process_vm_rw_core(pid_t pid, const struct iovec *lvec,
+				  unsigned long liovcnt,
+				  const struct iovec *rvec,
+				  unsigned long riovcnt,
+				  unsigned long flags, int vm_write)
+{
+	struct page *pp_stack[PVM_MAX_PP_ARRAY_COUNT];
+	struct page **process_pages = pp_stack;
+	unsigned long nr_pages = 0, nr_pp = PVM_MAX_PP_ARRAY_COUNT;
+	struct pvm_local local = {
+		.iov = lvec,
+		.nr_segs = liovcnt,
+	};
+	struct task_struct *task;
+	struct mm_struct *mm;
+	ssize_t bytes_copied = 0;
+	ssize_t rc = 0;
+	unsigned long i;
+
+	/* The most pages one remote iovec spans, to size the batches */
+	for (i = 0; i < riovcnt; i++) {
+		unsigned long start = (unsigned long)rvec[i].iov_base;
+		unsigned long len = rvec[i].iov_len;
+
+		if (len)
+			nr_pages = max(nr_pages, (start + len - 1) / PAGE_SIZE -
+					start / PAGE_SIZE + 1);
+	}
+	if (!nr_pages)
+		return 0;
+
+	if (nr_pages > PVM_MAX_PP_ARRAY_COUNT) {
+		nr_pp = min_t(unsigned long, nr_pages,
+			      PVM_MAX_KMALLOC_PAGES / sizeof(struct page *));
+		process_pages = kmalloc(nr_pp * sizeof(struct page *),
+					GFP_KERNEL);
+		if (!process_pages)
+			return -ENOMEM;
+	}
+
+	rcu_read_lock();
+	task = find_task_by_vpid(pid);
+	if (task)
+		get_task_struct(task);
+	rcu_read_unlock();
+	if (!task) {
+		rc = -ESRCH;
+		goto free_proc_pages;
+	}
+
+	task_lock(task);
+	if (__ptrace_may_access(task, PTRACE_MODE_ATTACH)) {
+		task_unlock(task);
+		rc = -EPERM;
+		goto put_task_struct;
+	}
+	mm = task->mm;
+	if (!mm || (task->flags & PF_KTHREAD)) {
+		task_unlock(task);
+		rc = -EINVAL;
+		goto put_task_struct;
+	}
+	atomic_inc(&mm->mm_users);
+	task_unlock(task);
+
+	for (i = 0; i < riovcnt && local.seg < liovcnt; i++) {
+		rc = process_vm_rw_single_vec(
+			(unsigned long)rvec[i].iov_base, rvec[i].iov_len,
+			&local, process_pages, nr_pp, task, mm, vm_write,
+			&bytes_copied);
+		if (rc)
+			break;
+	}
+
+	/* Like readv() and writev(), report a partial copy as a success */
+	if (bytes_copied)
+		rc = bytes_copied;
+
+	mmput(mm);
+
+put_task_struct:
+	put_task_struct(task);
+
+free_proc_pages:
+	if (process_pages != pp_stack)
+		kfree(process_pages);
+	return rc;
+}
+
+static ssize_t process_vm_rw(pid_t pid,
+			     const struct iovec __user *lvec,
+			     unsigned long liovcnt,
+			     const struct iovec __user *rvec,
+			     unsigned long riovcnt,
+			     unsigned long flags, int vm_write)
+{
+	struct iovec iovstack_l[UIO_FASTIOV];
+	struct iovec iovstack_r[UIO_FASTIOV];
+	struct iovec *iov_l = iovstack_l;
+	struct iovec *iov_r = iovstack_r;
+	ssize_t rc;
+
+	if (flags != 0)
+		return -EINVAL;
+
+	/* Reading from the other process writes to our memory */
+	rc = rw_copy_check_uvector(vm_write ? WRITE : READ, lvec, liovcnt,
+				   UIO_FASTIOV, iovstack_l, &iov_l);
+	if (rc <= 0)
+		goto free_iovecs;
+
+	rc = rw_copy_check_uvector(CHECK_IOVEC_ONLY, rvec, riovcnt,
+				   UIO_FASTIOV, iovstack_r, &iov_r);
+	if (rc <= 0)
+		goto free_iovecs;
+
+	rc = process_vm_rw_core(pid, iov_l, liovcnt, iov_r, riovcnt, flags,
+				vm_write);
+
+free_iovecs:
+	if (iov_r != iovstack_r)
+		kfree(iov_r);
+	if (iov_l != iovstack_l)
+		kfree(iov_l);
+
+	return rc;
+}
+
+SYSCALL_DEFINE6(process_vm_readv, pid_t, pid, const struct iovec __user *, lvec,
+		unsigned long, liovcnt, const struct iovec __user *, rvec,
+		unsigned long, riovcnt,	unsigned long, flags)
+{
+	return process_vm_rw(pid, lvec, liovcnt, rvec, riovcnt, flags, 0);
+}
+
+SYSCALL_DEFINE6(process_vm_writev, pid_t, pid,
+		const struct iovec __user *, lvec,
+		unsigned long, liovcnt, const struct iovec __user *, rvec,
+		unsigned long, riovcnt,	unsigned long, flags)
+{
+	return process_vm_rw(pid, lvec, liovcnt, rvec, riovcnt, flags, 1);
+}
+
+#ifdef CONFIG_COMPAT
+
+static ssize_t
+compat_process_vm_rw(compat_pid_t pid,
+		     const struct compat_iovec __user *lvec,
+		     unsigned long liovcnt,
+		     const struct compat_iovec __user *rvec,
+		     unsigned long riovcnt,
+		     unsigned long flags, int vm_write)
+{
+	struct iovec iovstack_l[UIO_FASTIOV];
+	struct iovec iovstack_r[UIO_FASTIOV];
+	struct iovec *iov_l = iovstack_l;
+	struct iovec *iov_r = iovstack_r;
+	ssize_t rc = -EFAULT;
+
+	if (flags != 0)
+		return -EINVAL;
+
+	if (!access_ok(VERIFY_READ, lvec, liovcnt * sizeof(*lvec)))
+		goto out;
+	if (!access_ok(VERIFY_READ, rvec, riovcnt * sizeof(*rvec)))
+		goto out;
+
+	rc = compat_rw_copy_check_uvector(vm_write ? WRITE : READ, lvec,
+					  liovcnt, UIO_FASTIOV, iovstack_l,
+					  &iov_l);
+	if (rc <= 0)
+		goto free_iovecs;
+
+	rc = compat_rw_copy_check_uvector(CHECK_IOVEC_ONLY, rvec, riovcnt,
+					  UIO_FASTIOV, iovstack_r, &iov_r);
+	if (rc <= 0)
+		goto free_iovecs;
+
+	rc = process_vm_rw_core(pid, iov_l, liovcnt, iov_r, riovcnt, flags,
+				vm_write);
+
+free_iovecs:
+	if (iov_r != iovstack_r)
+		kfree(iov_r);
+	if (iov_l != iovstack_l)
+		kfree(iov_l);
+
+out:
+	return rc;
+}
+
+asmlinkage ssize_t
+compat_sys_process_vm_readv(compat_pid_t pid,
+			    const struct compat_iovec __user *lvec,
+			    unsigned long liovcnt,
+			    const struct compat_iovec __user *rvec,
+			    unsigned long riovcnt,
+			    unsigned long flags)
+{
+	return compat_process_vm_rw(pid, lvec, liovcnt, rvec,
+				    riovcnt, flags, 0);
+}
+
+asmlinkage ssize_t
+compat_sys_process_vm_writev(compat_pid_t pid,
+			     const struct compat_iovec __user *lvec,
+			     unsigned long liovcnt,
+			     const struct compat_iovec __user *rvec,
+			     unsigned long riovcnt,
+			     unsigned long flags)
+{
+	return compat_process_vm_rw(pid, lvec, liovcnt, rvec,
+				    riovcnt, flags, 1);
+}
+
+#endif
@@ -31,6 +31,7 @@
 #include <linux/syscalls.h>
 #include <linux/memcontrol.h>
 #include <linux/poll.h>
+#include <linux/cpu.h>
 
 #include <asm/pgtable.h>
 #include <asm/tlbflush.h>
@@ -170,14 +171,129 @@ static void discard_swap_cluster(struct swap_info_struct *si,
 	}
 }
 
-static int wait_for_discard(void *word)
+#define SWAPFILE_CLUSTER	256
+#define LATENCY_LIMIT		256
+#define CLUSTER_NONE		UINT_MAX
+
+/*
+ * Discard the clusters waiting on the discard list, dropping swap_lock
+ * around each, and put them back on the free list.
+ */
+static void swap_do_scheduled_discard(struct swap_info_struct *si)
 {
-	schedule();
-	return 0;
+	struct swap_cluster_info *ci;
+	unsigned long offset;
+
+	while (!list_empty(&si->discard_clusters)) {
+		ci = list_first_entry(&si->discard_clusters,
+				      struct swap_cluster_info, list);
+		list_del_init(&ci->list);
+		offset = (ci - si->cluster_info) * SWAPFILE_CLUSTER;
+		spin_unlock(&swap_lock);
+
+		discard_swap_cluster(si, offset, SWAPFILE_CLUSTER);
+
+		spin_lock(&swap_lock);
+		memset(si->swap_map + offset, 0, SWAPFILE_CLUSTER);
+		list_add_tail(&ci->list, &si->free_clusters);
+	}
 }
 
-#define SWAPFILE_CLUSTER	256
-#define LATENCY_LIMIT		256
+static void swap_discard_work(struct work_struct *work)
+{
+	struct swap_info_struct *si;
+
+	si = container_of(work, struct swap_info_struct, discard_work);
+	spin_lock(&swap_lock);
+	swap_do_scheduled_discard(si);
+	spin_unlock(&swap_lock);
+}
+
+static void inc_cluster_info_page(struct swap_info_struct *si,
+				  unsigned long offset)
+{
+	struct swap_cluster_info *ci;
+
+	if (!si->cluster_info)
+		return;
+	ci = &si->cluster_info[offset / SWAPFILE_CLUSTER];
+	if (!ci->count++)
+		list_del_init(&ci->list);
+}
+
+static void dec_cluster_info_page(struct swap_info_struct *si,
+				  unsigned long offset)
+{
+	struct swap_cluster_info *ci;
+
+	if (!si->cluster_info)
+		return;
+	ci = &si->cluster_info[offset / SWAPFILE_CLUSTER];
+	VM_BUG_ON(!ci->count);
+	if (--ci->count)
+		return;
+
+	/*
+	 * To optimize wear-levelling, discard the old data of a cluster
+	 * before it is used again.  Its slots are marked bad meanwhile,
+	 * so that scan_swap_map() does not hand any of them out.
+	 */
+	if (si->flags & SWP_DISCARDABLE) {
+		memset(si->swap_map + offset - offset % SWAPFILE_CLUSTER,
+		       SWAP_MAP_BAD, SWAPFILE_CLUSTER);
+		list_add_tail(&ci->list, &si->discard_clusters);
+		schedule_work(&si->discard_work);
+		return;
+	}
+	list_add_tail(&ci->list, &si->free_clusters);
+}
+
+/*
+ * Find a free slot in the cluster this cpu is allocating from, moving on
+ * to the first free cluster when it is used up.  A cluster only leaves
+ * the free list when its first slot is allocated, so cpus racing for a
+ * new cluster may share one until then.  Leaves *offset alone when no
+ * cluster is free, for the caller to scan the whole swap map.
+ */
+static void scan_swap_map_try_ssd_cluster(struct swap_info_struct *si,
+					  unsigned long *offset)
+{
+	struct percpu_cluster *cluster;
+	struct swap_cluster_info *ci;
+	unsigned long tmp, max;
+
+new_cluster:
+	cluster = this_cpu_ptr(si->percpu_cluster);
+	if (cluster->index == CLUSTER_NONE) {
+		if (!list_empty(&si->free_clusters)) {
+			ci = list_first_entry(&si->free_clusters,
+					      struct swap_cluster_info, list);
+			cluster->index = ci - si->cluster_info;
+			cluster->next = cluster->index * SWAPFILE_CLUSTER;
+		} else if (!list_empty(&si->discard_clusters)) {
+			/*
+			 * Rather than scanning for stray free slots, wait
+			 * for the discards to finish and use their clusters.
+			 */
+			swap_do_scheduled_discard(si);
+			goto new_cluster;
+		} else
+			return;
+	}
+
+	/* Other cpus may have allocated from this cluster meanwhile */
+	tmp = cluster->next;
+	max = min_t(unsigned long, si->max,
+		    (cluster->index + 1) * SWAPFILE_CLUSTER);
+	while (tmp < max && si->swap_map[tmp])
+		tmp++;
+	if (tmp >= max) {
+		cluster->index = CLUSTER_NONE;
+		goto new_cluster;
+	}
+	cluster->next = tmp + 1;
+	*offset = tmp;
+}
 
 static unsigned long scan_swap_map(struct swap_info_struct *si,
 				   unsigned char usage)
@@ -186,7 +302,6 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 	unsigned long scan_base;
 	unsigned long last_in_cluster = 0;
 	int latency_ration = LATENCY_LIMIT;
-	int found_free_cluster = 0;
 
 	/*
 	 * We try to cluster swap pages by allocating them sequentially
@@ -197,29 +312,22 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 	 * overall disk seek times between swap pages.  -- sct
 	 * But we do now try to find an empty cluster.  -Andrea
 	 * And we let swap pages go all over an SSD partition.  Hugh
+	 * On an SSD, each cpu now allocates from a cluster of its own.
 	 */
 
 	si->flags += SWP_SCANNING;
 	scan_base = offset = si->cluster_next;
 
+	if (si->cluster_info) {
+		scan_swap_map_try_ssd_cluster(si, &offset);
+		goto checks;
+	}
+
 	if (unlikely(!si->cluster_nr--)) {
 		if (si->pages - si->inuse_pages < SWAPFILE_CLUSTER) {
 			si->cluster_nr = SWAPFILE_CLUSTER - 1;
 			goto checks;
 		}
-		if (si->flags & SWP_DISCARDABLE) {
-			/*
-			 * Start range check on racing allocations, in case
-			 * they overlap the cluster we eventually decide on
-			 * (we scan without swap_lock to allow preemption).
-			 * It's hardly conceivable that cluster_nr could be
-			 * wrapped during our scan, but don't depend on it.
-			 */
-			if (si->lowest_alloc)
-				goto checks;
-			si->lowest_alloc = si->max;
-			si->highest_alloc = 0;
-		}
 		spin_unlock(&swap_lock);
 
 		/*
@@ -243,7 +351,6 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 				offset -= SWAPFILE_CLUSTER - 1;
 				si->cluster_next = offset;
 				si->cluster_nr = SWAPFILE_CLUSTER - 1;
-				found_free_cluster = 1;
 				goto checks;
 			}
 			if (unlikely(--latency_ration < 0)) {
@@ -264,7 +371,6 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 				offset -= SWAPFILE_CLUSTER - 1;
 				si->cluster_next = offset;
 				si->cluster_nr = SWAPFILE_CLUSTER - 1;
-				found_free_cluster = 1;
 				goto checks;
 			}
 			if (unlikely(--latency_ration < 0)) {
@@ -276,7 +382,6 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 		offset = scan_base;
 		spin_lock(&swap_lock);
 		si->cluster_nr = SWAPFILE_CLUSTER - 1;
-		si->lowest_alloc = 0;
 	}
 
 checks:
@@ -312,62 +417,9 @@ checks:
 		si->highest_bit = 0;
 	}
 	si->swap_map[offset] = usage;
+	inc_cluster_info_page(si, offset);
 	si->cluster_next = offset + 1;
 	si->flags -= SWP_SCANNING;
-
-	if (si->lowest_alloc) {
-		/*
-		 * Only set when SWP_DISCARDABLE, and there's a scan
-		 * for a free cluster in progress or just completed.
-		 */
-		if (found_free_cluster) {
-			/*
-			 * To optimize wear-levelling, discard the
-			 * old data of the cluster, taking care not to
-			 * discard any of its pages that have already
-			 * been allocated by racing tasks (offset has
-			 * already stepped over any at the beginning).
-			 */
-			if (offset < si->highest_alloc &&
-			    si->lowest_alloc <= last_in_cluster)
-				last_in_cluster = si->lowest_alloc - 1;
-			si->flags |= SWP_DISCARDING;
-			spin_unlock(&swap_lock);
-
-			if (offset < last_in_cluster)
-				discard_swap_cluster(si, offset,
-					last_in_cluster - offset + 1);
-
-			spin_lock(&swap_lock);
-			si->lowest_alloc = 0;
-			si->flags &= ~SWP_DISCARDING;
-
-			smp_mb();	/* wake_up_bit advises this */
-			wake_up_bit(&si->flags, ilog2(SWP_DISCARDING));
-
-		} else if (si->flags & SWP_DISCARDING) {
-			/*
-			 * Delay using pages allocated by racing tasks
-			 * until the whole discard has been issued. We
-			 * could defer that delay until swap_writepage,
-			 * but it's easier to keep this self-contained.
-			 */
-			spin_unlock(&swap_lock);
-			wait_on_bit(&si->flags, ilog2(SWP_DISCARDING),
-				wait_for_discard, TASK_UNINTERRUPTIBLE);
-			spin_lock(&swap_lock);
-		} else {
-			/*
-			 * Note pages allocated by racing tasks while
-			 * scan for a free cluster is in progress, so
-			 * that its final discard can exclude them.
-			 */
-			if (offset < si->lowest_alloc)
-				si->lowest_alloc = offset;
-			if (offset > si->highest_alloc)
-				si->highest_alloc = offset;
-		}
-	}
 	return offset;
 
 scan:
@@ -408,17 +460,23 @@ no_page:
 	return 0;
 }
 
-swp_entry_t get_swap_page(void)
+/*
+ * Allocate up to n swap slots for the swap cache, all under one hold of
+ * swap_lock.  Returns the number allocated.
+ */
+static int get_swap_pages(int n, swp_entry_t entries[])
 {
 	struct swap_info_struct *si;
 	pgoff_t offset;
 	int type, next;
 	int wrapped = 0;
+	int nr = 0;
 
 	spin_lock(&swap_lock);
 	if (nr_swap_pages <= 0)
 		goto noswap;
-	nr_swap_pages--;
+	n = min_t(long, n, nr_swap_pages);
+	nr_swap_pages -= n;
 
 	for (type = swap_list.next; type >= 0 && wrapped < 2; type = next) {
 		si = swap_info[type];
@@ -435,20 +493,114 @@ swp_entry_t get_swap_page(void)
 			continue;
 
 		swap_list.next = next;
-		/* This is called for allocating swap entry for cache */
-		offset = scan_swap_map(si, SWAP_HAS_CACHE);
-		if (offset) {
-			spin_unlock(&swap_lock);
-			return swp_entry(type, offset);
+		while (nr < n) {
+			/* This is called for allocating swap entry for cache */
+			offset = scan_swap_map(si, SWAP_HAS_CACHE);
+			if (!offset)
+				break;
+			entries[nr++] = swp_entry(type, offset);
 		}
+		if (nr == n)
+			break;
 		next = swap_list.next;
 	}
 
-	nr_swap_pages++;
+	nr_swap_pages += n - nr;
 noswap:
 	spin_unlock(&swap_lock);
-	return (swp_entry_t) {0};
+	return nr;
+}
+
+/*
+ * Each cpu keeps a few swap slots allocated ahead, so that most swapouts
+ * take neither swap_lock nor a scan of the swap map.  Cached slots are
+ * accounted as in use, and marked SWAP_HAS_CACHE in the swap map without
+ * a page in the swap cache.  The cache is under a mutex rather than a
+ * spinlock because refilling it may sleep in scan_swap_map().
+ */
+#define SWAP_SLOTS_CACHE_SIZE	64
+
+struct swap_slots_cache {
+	struct mutex	lock;
+	int		nr;
+	swp_entry_t	slots[SWAP_SLOTS_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct swap_slots_cache, swp_slots);
+
+/*
+ * When swap is nearly full, stop caching slots: the caches of idle cpus
+ * could otherwise hold on to the last free ones.
+ */
+static inline bool swap_slots_cache_worthwhile(void)
+{
+	return nr_swap_pages > num_online_cpus() * SWAP_SLOTS_CACHE_SIZE * 4;
+}
+
+static void drain_swap_slots_cpu(unsigned int cpu)
+{
+	struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+	mutex_lock(&cache->lock);
+	while (cache->nr)
+		swapcache_free(cache->slots[--cache->nr], NULL);
+	mutex_unlock(&cache->lock);
+}
+
+/* Return the slots of all caches, for swapoff */
+static void drain_swap_slots(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		drain_swap_slots_cpu(cpu);
+}
+
+swp_entry_t get_swap_page(void)
+{
+	struct swap_slots_cache *cache;
+	swp_entry_t entry = { 0 };
+	unsigned int cpu;
+
+	cache = &per_cpu(swp_slots, raw_smp_processor_id());
+	mutex_lock(&cache->lock);
+	if (!cache->nr && swap_slots_cache_worthwhile())
+		cache->nr = get_swap_pages(SWAP_SLOTS_CACHE_SIZE, cache->slots);
+	if (cache->nr)
+		entry = cache->slots[--cache->nr];
+	mutex_unlock(&cache->lock);
+	if (entry.val)
+		return entry;
+
+	if (get_swap_pages(1, &entry))
+		return entry;
+
+	/* The last free slots may be sitting in the caches of other cpus */
+	for_each_online_cpu(cpu)
+		if (per_cpu(swp_slots, cpu).nr)
+			drain_swap_slots_cpu(cpu);
+	get_swap_pages(1, &entry);
+	return entry;
+}
+
+static int __cpuinit swap_slots_cpu_callback(struct notifier_block *nfb,
+					     unsigned long action, void *hcpu)
+{
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN)
+		drain_swap_slots_cpu((long)hcpu);
+	return NOTIFY_OK;
+}
+
+static int __init swap_slots_init(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		mutex_init(&per_cpu(swp_slots, cpu).lock);
+	hotcpu_notifier(swap_slots_cpu_callback, 0);
+	return 0;
 }
+__initcall(swap_slots_init);
 
 /* The only caller of this function is now susupend routine */
 swp_entry_t get_swap_page_of_type(int type)
@@ -547,6 +699,7 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 	/* free if no reference */
 	if (!usage) {
 		struct gendisk *disk = p->bdev->bd_disk;
+		dec_cluster_info_page(p, offset);
 		if (offset < p->lowest_bit)
 			p->lowest_bit = offset;
 		if (offset > p->highest_bit)
@@ -1551,6 +1704,8 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 {
 	struct swap_info_struct *p = NULL;
 	unsigned char *swap_map;
+	struct swap_cluster_info *cluster_info;
+	struct percpu_cluster __percpu *percpu_cluster;
 	struct file *swap_file, *victim;
 	struct address_space *mapping;
 	struct inode *inode;
@@ -1613,6 +1768,9 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->flags &= ~SWP_WRITEOK;
 	spin_unlock(&swap_lock);
 
+	/* No slot can be cached from here on, return the cached ones */
+	drain_swap_slots();
+
 	current->flags |= PF_OOM_ORIGIN;
 	err = try_to_unuse(type);
 	current->flags &= ~PF_OOM_ORIGIN;
@@ -1629,6 +1787,8 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 		goto out_dput;
 	}
 
+	flush_work_sync(&p->discard_work);
+
 	destroy_swap_extents(p);
 	if (p->flags & SWP_CONTINUED)
 		free_swap_count_continuations(p);
@@ -1650,9 +1810,15 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->max = 0;
 	swap_map = p->swap_map;
 	p->swap_map = NULL;
+	cluster_info = p->cluster_info;
+	p->cluster_info = NULL;
+	percpu_cluster = p->percpu_cluster;
+	p->percpu_cluster = NULL;
 	p->flags = 0;
 	spin_unlock(&swap_lock);
 	mutex_unlock(&swapon_mutex);
+	free_percpu(percpu_cluster);
+	vfree(cluster_info);
 	vfree(swap_map);
 	/* Destroy swap account informatin */
 	swap_cgroup_swapoff(type);
@@ -1864,6 +2030,9 @@ static struct swap_info_struct *alloc_swap_info(void)
 		 */
 	}
 	INIT_LIST_HEAD(&p->first_swap_extent.list);
+	INIT_LIST_HEAD(&p->free_clusters);
+	INIT_LIST_HEAD(&p->discard_clusters);
+	INIT_WORK(&p->discard_work, swap_discard_work);
 	p->flags = SWP_USED;
 	p->next = -1;
 	spin_unlock(&swap_lock);
@@ -2012,6 +2181,42 @@ static int setup_swap_map_and_extents(struct swap_info_struct *p,
 	return nr_extents;
 }
 
+/*
+ * Set up the clusters of a solid state device.  Slots of the swap map
+ * that are not free, and those beyond its end in the last cluster, count
+ * as in use, so that a cluster on the free list is entirely free.
+ */
+static int setup_swap_clusters(struct swap_info_struct *p,
+			       unsigned char *swap_map)
+{
+	unsigned long nr_clusters = DIV_ROUND_UP(p->max, SWAPFILE_CLUSTER);
+	unsigned long i;
+	unsigned int cpu;
+
+	p->cluster_info = vzalloc(nr_clusters * sizeof(*p->cluster_info));
+	if (!p->cluster_info)
+		return -ENOMEM;
+	p->percpu_cluster = alloc_percpu(struct percpu_cluster);
+	if (!p->percpu_cluster) {
+		vfree(p->cluster_info);
+		p->cluster_info = NULL;
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(p->percpu_cluster, cpu)->index = CLUSTER_NONE;
+
+	for (i = 0; i < nr_clusters * SWAPFILE_CLUSTER; i++)
+		if (i >= p->max || swap_map[i])
+			p->cluster_info[i / SWAPFILE_CLUSTER].count++;
+	for (i = 0; i < nr_clusters; i++) {
+		INIT_LIST_HEAD(&p->cluster_info[i].list);
+		if (!p->cluster_info[i].count)
+			list_add_tail(&p->cluster_info[i].list,
+				      &p->free_clusters);
+	}
+	return 0;
+}
+
 SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 {
 	struct swap_info_struct *p;
@@ -2111,6 +2316,9 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 		if (blk_queue_nonrot(bdev_get_queue(p->bdev))) {
 			p->flags |= SWP_SOLIDSTATE;
 			p->cluster_next = 1 + (random32() % p->highest_bit);
+			error = setup_swap_clusters(p, swap_map);
+			if (error)
+				goto bad_swap;
 		}
 		if (discard_swap(p) == 0 && (swap_flags & SWAP_FLAG_DISCARD))
 			p->flags |= SWP_DISCARDABLE;
@@ -2149,6 +2357,10 @@ bad_swap:
 	p->swap_file = NULL;
 	p->flags = 0;
 	spin_unlock(&swap_lock);
+	free_percpu(p->percpu_cluster);
+	p->percpu_cluster = NULL;
+	vfree(p->cluster_info);
+	p->cluster_info = NULL;
 	vfree(swap_map);
 	if (swap_file) {
 		if (inode && S_ISREG(inode->i_mode)) {
@@ -2322,10 +2534,14 @@ int valid_swaphandles(swp_entry_t entry, unsigned long *offset)
 	if (end > si->max)	/* don't go beyond end of map */
 		end = si->max;
 
-	/* Count contiguous allocated slots above our target */
+	/*
+	 * Count contiguous allocated slots above our target.  Slots with
+	 * no swap count are either free or only in the swap cache, or
+	 * sitting in a cpu's slot cache without a page to read yet.
+	 */
 	for (toff = target; ++toff < end; nr_pages++) {
 		/* Don't read in free or bad pages */
-		if (!si->swap_map[toff])
+		if (!swap_count(si->swap_map[toff]))
 			break;
 		if (swap_count(si->swap_map[toff]) == SWAP_MAP_BAD)
 			break;
@@ -2333,7 +2549,7 @@ int valid_swaphandles(swp_entry_t entry, unsigned long *offset)
 	/* Count contiguous allocated slots below our target */
 	for (toff = target; --toff >= base; nr_pages++) {
 		/* Don't read in free or bad pages */
-		if (!si->swap_map[toff])
+		if (!swap_count(si->swap_map[toff]))
 			break;
 		if (swap_count(si->swap_map[toff]) == SWAP_MAP_BAD)
 			break;
@@ -184,6 +184,14 @@ static unsigned long zone_nr_lru_pages(struct zone *zone,
 void register_shrinker(struct shrinker *shrinker)
 {
 	shrinker->nr = 0;
+	/*
+	 * Without the per node counts, the work a node defers is shared
+	 * with the others, which is what shrinkers got before.
+	 */
+	shrinker->nr_node = NULL;
+	if (shrinker->shrink_node)
+		shrinker->nr_node = kcalloc(nr_node_ids, sizeof(long),
+					    GFP_KERNEL);
 	down_write(&shrinker_rwsem);
 	list_add_tail(&shrinker->list, &shrinker_list);
 	up_write(&shrinker_rwsem);
@@ -198,10 +206,80 @@ void unregister_shrinker(struct shrinker *shrinker)
 	down_write(&shrinker_rwsem);
 	list_del(&shrinker->list);
 	up_write(&shrinker_rwsem);
+	kfree(shrinker->nr_node);
 }
 EXPORT_SYMBOL(unregister_shrinker);
 
 #define SHRINK_BATCH 128
+
+static int do_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	if (shrinker->shrink_node)
+		return shrinker->shrink_node(shrinker, sc);
+	return shrinker->shrink(shrinker, sc->nr_to_scan, sc->gfp_mask);
+}
+
+/*
+ * Scan the share of a shrinker's objects that corresponds to the
+ * pressure on the LRU pages, and carry what is left over in *nr.
+ */
+static unsigned long shrink_one(struct shrinker *shrinker,
+				struct shrink_control *sc, long *nr,
+				unsigned long scanned, unsigned long lru_pages)
+{
+	unsigned long long delta;
+	unsigned long total_scan;
+	unsigned long max_pass;
+	unsigned long ret = 0;
+
+	sc->nr_to_scan = 0;
+	max_pass = do_shrink(shrinker, sc);
+	delta = (4 * scanned) / shrinker->seeks;
+	delta *= max_pass;
+	do_div(delta, lru_pages + 1);
+	*nr += delta;
+	if (*nr < 0) {
+		printk(KERN_ERR "shrink_slab: %pF negative objects to "
+		       "delete nr=%ld\n",
+		       shrinker->shrink_node ? (void *)shrinker->shrink_node :
+					       (void *)shrinker->shrink, *nr);
+		*nr = max_pass;
+	}
+
+	/*
+	 * Avoid risking looping forever due to too large nr value:
+	 * never try to free more than twice the estimate number of
+	 * freeable entries.
+	 */
+	if (*nr > max_pass * 2)
+		*nr = max_pass * 2;
+
+	total_scan = *nr;
+	*nr = 0;
+
+	while (total_scan >= SHRINK_BATCH) {
+		long this_scan = SHRINK_BATCH;
+		int shrink_ret;
+		int nr_before;
+
+		sc->nr_to_scan = 0;
+		nr_before = do_shrink(shrinker, sc);
+		sc->nr_to_scan = this_scan;
+		shrink_ret = do_shrink(shrinker, sc);
+		if (shrink_ret == -1)
+			break;
+		if (shrink_ret < nr_before)
+			ret += nr_before - shrink_ret;
+		count_vm_events(SLABS_SCANNED, this_scan);
+		total_scan -= this_scan;
+
+		cond_resched();
+	}
+
+	*nr += total_scan;
+	return ret;
+}
+
 /*
  * Call the shrink functions to age shrinkable caches
  *
@@ -219,11 +297,16 @@ EXPORT_SYMBOL(unregister_shrinker);
  * are eligible for the caller's allocation attempt.  It is used for balancing
  * slab reclaim versus page reclaim.
  *
+ * `nodes' are the nodes of those zones, NULL for all of them.  Shrinkers
+ * with a shrink_node method are only asked to shrink their objects on
+ * these nodes, each in proportion to the objects it has there.
+ *
  * Returns the number of slab objects which we shrunk.
  */
 unsigned long shrink_slab(unsigned long scanned, gfp_t gfp_mask,
-			unsigned long lru_pages)
+			unsigned long lru_pages, const nodemask_t *nodes)
 {
+	struct shrink_control sc = { .gfp_mask = gfp_mask };
 	struct shrinker *shrinker;
 	unsigned long ret = 0;
 
@@ -233,53 +316,26 @@ unsigned long shrink_slab(unsigned long scanned, gfp_t gfp_mask,
 	if (!down_read_trylock(&shrinker_rwsem))
 		return 1;	/* Assume we'll be able to shrink next time */
 
-	list_for_each_entry(shrinker, &shrinker_list, list) {
-		unsigned long long delta;
-		unsigned long total_scan;
-		unsigned long max_pass;
-
-		max_pass = (*shrinker->shrink)(shrinker, 0, gfp_mask);
-		delta = (4 * scanned) / shrinker->seeks;
-		delta *= max_pass;
-		do_div(delta, lru_pages + 1);
-		shrinker->nr += delta;
-		if (shrinker->nr < 0) {
-			printk(KERN_ERR "shrink_slab: %pF negative objects to "
-			       "delete nr=%ld\n",
-			       shrinker->shrink, shrinker->nr);
-			shrinker->nr = max_pass;
-		}
-
-		/*
-		 * Avoid risking looping forever due to too large nr value:
-		 * never try to free more than twice the estimate number of
-		 * freeable entries.
-		 */
-		if (shrinker->nr > max_pass * 2)
-			shrinker->nr = max_pass * 2;
-
-		total_scan = shrinker->nr;
-		shrinker->nr = 0;
+	if (!nodes)
+		nodes = &node_online_map;
 
-		while (total_scan >= SHRINK_BATCH) {
-			long this_scan = SHRINK_BATCH;
-			int shrink_ret;
-			int nr_before;
-
-			nr_before = (*shrinker->shrink)(shrinker, 0, gfp_mask);
-			shrink_ret = (*shrinker->shrink)(shrinker, this_scan,
-								gfp_mask);
-			if (shrink_ret == -1)
-				break;
-			if (shrink_ret < nr_before)
-				ret += nr_before - shrink_ret;
-			count_vm_events(SLABS_SCANNED, this_scan);
-			total_scan -= this_scan;
+	list_for_each_entry(shrinker, &shrinker_list, list) {
+		int nid;
 
-			cond_resched();
+		if (!shrinker->shrink_node) {
+			sc.nid = numa_node_id();
+			ret += shrink_one(shrinker, &sc, &shrinker->nr,
+					  scanned, lru_pages);
+			continue;
 		}
+		for_each_node_mask(nid, *nodes) {
+			long *nr = &shrinker->nr;
 
-		shrinker->nr += total_scan;
+			if (shrinker->nr_node)
+				nr = &shrinker->nr_node[nid];
+			sc.nid = nid;
+			ret += shrink_one(shrinker, &sc, nr, scanned, lru_pages);
+		}
 	}
 	up_read(&shrinker_rwsem);
 	return ret;
@@ -466,7 +522,8 @@ static pageout_t pageout(struct page *page, struct address_space *mapping,
  * Same as remove_mapping, but if the page is removed from the mapping, it
  * gets returned with a refcount of 0.
  */
-static int __remove_mapping(struct address_space *mapping, struct page *page)
+static int __remove_mapping(struct address_space *mapping, struct page *page,
+			    bool reclaimed)
 {
 	BUG_ON(!PageLocked(page));
 	BUG_ON(mapping != page_mapping(page));
@@ -512,10 +569,17 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 		swapcache_free(swap, page);
 	} else {
 		void (*freepage)(struct page *);
+		void *shadow = NULL;
 
 		freepage = mapping->a_ops->freepage;
 
-		__delete_from_page_cache(page);
+		/*
+		 * Remember when a page cache page was reclaimed, to tell
+		 * whether it was part of the workingset if it refaults.
+		 */
+		if (reclaimed && page_is_file_cache(page))
+			shadow = workingset_eviction(page);
+		__delete_from_page_cache(page, shadow);
 		spin_unlock_irq(&mapping->tree_lock);
 		mem_cgroup_uncharge_cache_page(page);
 
@@ -538,7 +602,7 @@ cannot_free:
  */
 int remove_mapping(struct address_space *mapping, struct page *page)
 {
-	if (__remove_mapping(mapping, page)) {
+	if (__remove_mapping(mapping, page, false)) {
 		/*
 		 * Unfreezing the refcount with 1 rather than 2 effectively
 		 * drops the pagecache ref for us without requiring another
@@ -886,7 +950,7 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 			}
 		}
 
-		if (!mapping || !__remove_mapping(mapping, page))
+		if (!mapping || !__remove_mapping(mapping, page, true))
 			goto keep_locked;
 
 		/*
@@ -2052,15 +2116,19 @@ static unsigned long do_try_to_free_pages(struct zonelist *zonelist,
 		 */
 		if (scanning_global_lru(sc)) {
 			unsigned long lru_pages = 0;
+			nodemask_t nodes = NODE_MASK_NONE;
+
 			for_each_zone_zonelist(zone, z, zonelist,
 					gfp_zone(sc->gfp_mask)) {
 				if (!cpuset_zone_allowed_hardwall(zone, GFP_KERNEL))
 					continue;
 
 				lru_pages += zone_reclaimable_pages(zone);
+				node_set(zone_to_nid(zone), nodes);
 			}
 
-			shrink_slab(sc->nr_scanned, sc->gfp_mask, lru_pages);
+			shrink_slab(sc->nr_scanned, sc->gfp_mask, lru_pages,
+				    &nodes);
 			if (reclaim_state) {
 				sc->nr_reclaimed += reclaim_state->reclaimed_slab;
 				reclaim_state->reclaimed_slab = 0;
@@ -2322,6 +2390,7 @@ static unsigned long balance_pgdat(pg_data_t *pgdat, int order,
 	int end_zone = 0;	/* Inclusive.  0 = ZONE_DMA */
 	unsigned long total_scanned;
 	struct reclaim_state *reclaim_state = current->reclaim_state;
+	nodemask_t nodes = nodemask_of_node(pgdat->node_id);
 	struct scan_control sc = {
 		.gfp_mask = GFP_KERNEL,
 		.may_unmap = 1,
@@ -2435,7 +2504,7 @@ loop_again:
 				shrink_zone(priority, zone, &sc);
 			reclaim_state->reclaimed_slab = 0;
 			nr_slab = shrink_slab(sc.nr_scanned, GFP_KERNEL,
-						lru_pages);
+						lru_pages, &nodes);
 			sc.nr_reclaimed += reclaim_state->reclaimed_slab;
 			total_scanned += sc.nr_scanned;
 
@@ -3005,14 +3074,17 @@ static int __zone_reclaim(struct zone *zone, gfp_t gfp_mask, unsigned int order)
 		 * by the same nr_pages that we used for reclaiming unmapped
 		 * pages.
 		 *
-		 * Note that shrink_slab will free memory on all zones and may
-		 * take a long time.
+		 * Note that shrink_slab will free memory on all zones of the
+		 * node and may take a long time.
 		 */
+		nodemask_t nodes = nodemask_of_node(zone_to_nid(zone));
+
 		for (;;) {
 			unsigned long lru_pages = zone_reclaimable_pages(zone);
 
 			/* No reclaimable slab or very low memory pressure */
-			if (!shrink_slab(sc.nr_scanned, gfp_mask, lru_pages))
+			if (!shrink_slab(sc.nr_scanned, gfp_mask, lru_pages,
+					 &nodes))
 				break;
 
 			/* Freed enough memory */
@@ -0,0 +1,296 @@
+/*
+ *  linux/mm/workingset.c
+ *
+ *  Workingset detection for the page cache.
+ *
+ *  A file page starts out on the inactive list and is only promoted to
+ *  the active list when it is referenced a second time while still on
+ *  it.  When the inactive list is too short for a workingset that does
+ *  not fit into memory, its pages keep being evicted before that second
+ *  reference, and the workingset thrashes without ever being promoted,
+ *  looking no different from a stream of cold pages.
+ *
+ *  Every zone counts its evictions and activations in inactive_age.  An
+ *  evicted page leaves a shadow entry in its slot of the page cache radix
+ *  tree recording that count.  When the page is faulted back in, the
+ *  difference between the count and the one recorded is its refault
+ *  distance: roughly how many more inactive list slots the page would
+ *  have needed to stay cached.  If that is no more than the size of the
+ *  active list, the page could have stayed resident by taking the place
+ *  of an active page, so it is activated right away and has to compete
+ *  with the established workingset.  Pages refaulting from further away
+ *  start out inactive again, as if they had never been seen.
+ *
+ *  Shadow entries are dropped when the page comes back, when the file is
+ *  truncated, and by a shrinker once there are more of them than file
+ *  pages on the LRU lists: entries older than that can not yield a
+ *  distance short enough to activate anything.
+ */
+
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/swap.h>
+#include <linux/sched.h>
+#include <linux/module.h>
+#include <linux/pagemap.h>
+#include <linux/vmstat.h>
+#include <linux/spinlock.h>
+#include <linux/radix-tree.h>
+
+/*
+ * The eviction counter is stored in a shadow entry along with the node
+ * and zone of the evicted page, above the exceptional entry marker.
+ */
+#define EVICTION_SHIFT	(RADIX_TREE_EXCEPTIONAL_SHIFT + \
+			 NODES_SHIFT + ZONES_SHIFT)
+#define EVICTION_MASK	(~0UL >> EVICTION_SHIFT)
+
+static void *pack_shadow(unsigned long eviction, struct zone *zone)
+{
+	eviction = (eviction << NODES_SHIFT) | zone_to_nid(zone);
+	eviction = (eviction << ZONES_SHIFT) | zone_idx(zone);
+	eviction = (eviction << RADIX_TREE_EXCEPTIONAL_SHIFT);
+
+	return (void *)(eviction | RADIX_TREE_EXCEPTIONAL_ENTRY);
+}
+
+static void unpack_shadow(void *shadow, struct zone **zone,
+			  unsigned long *distance)
+{
+	unsigned long entry = (unsigned long)shadow;
+	unsigned long eviction, refault;
+	int zid, nid;
+
+	entry >>= RADIX_TREE_EXCEPTIONAL_SHIFT;
+	zid = entry & ((1UL << ZONES_SHIFT) - 1);
+	entry >>= ZONES_SHIFT;
+	nid = entry & ((1UL << NODES_SHIFT) - 1);
+	entry >>= NODES_SHIFT;
+	eviction = entry;
+
+	*zone = NODE_DATA(nid)->node_zones + zid;
+
+	refault = atomic_long_read(&(*zone)->inactive_age);
+	/* The counter wraps within the bits the shadow entry has room for */
+	*distance = (refault - eviction) & EVICTION_MASK;
+}
+
+/**
+ * workingset_eviction - note the eviction of a page from the page cache
+ * @page: the page being evicted
+ *
+ * Returns a shadow entry to be stored in place of @page.  The caller
+ * holds the tree_lock of its mapping.
+ */
+void *workingset_eviction(struct page *page)
+{
+	struct zone *zone = page_zone(page);
+	unsigned long eviction;
+
+	eviction = atomic_long_inc_return(&zone->inactive_age);
+	return pack_shadow(eviction, zone);
+}
+
+/**
+ * workingset_refault - evaluate the refault of a previously evicted page
+ * @shadow: shadow entry of the evicted page
+ *
+ * Returns %true if the page should be activated, %false if it should go
+ * on the inactive list like any other new page.
+ */
+bool workingset_refault(void *shadow)
+{
+	unsigned long refault_distance;
+	struct zone *zone;
+
+	unpack_shadow(shadow, &zone, &refault_distance);
+	inc_zone_state(zone, WORKINGSET_REFAULT);
+
+	if (refault_distance <= zone_page_state(zone, NR_ACTIVE_FILE)) {
+		inc_zone_state(zone, WORKINGSET_ACTIVATE);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * workingset_activation - note a page activation
+ * @page: page that is being activated
+ */
+void workingset_activation(struct page *page)
+{
+	atomic_long_inc(&page_zone(page)->inactive_age);
+}
+
+/*
+ * Mappings that hold shadow entries are kept on a list for the shrinker
+ * to walk.  shadow_lock nests inside the tree_lock of a mapping; the
+ * shrinker, which goes the other way, only trylocks the tree_lock.
+ */
+static DEFINE_SPINLOCK(shadow_lock);
+static LIST_HEAD(shadow_mappings);
+static atomic_long_t nr_shadow_entries;
+
+/**
+ * workingset_shadow_added - account a shadow entry stored in a mapping
+ * @mapping: the mapping, whose tree_lock the caller holds
+ */
+void workingset_shadow_added(struct address_space *mapping)
+{
+	if (!mapping->nrshadows++) {
+		spin_lock(&shadow_lock);
+		list_add_tail(&mapping->shadow_list, &shadow_mappings);
+		spin_unlock(&shadow_lock);
+	}
+	atomic_long_inc(&nr_shadow_entries);
+}
+
+static void __workingset_shadows_removed(struct address_space *mapping,
+					 unsigned long nr, bool locked)
+{
+	mapping->nrshadows -= nr;
+	atomic_long_sub(nr, &nr_shadow_entries);
+	if (mapping->nrshadows || list_empty(&mapping->shadow_list))
+		return;
+
+	if (!locked)
+		spin_lock(&shadow_lock);
+	list_del_init(&mapping->shadow_list);
+	if (!locked)
+		spin_unlock(&shadow_lock);
+}
+
+/**
+ * workingset_shadow_removed - account a shadow entry replaced by a page
+ * @mapping: the mapping, whose tree_lock the caller holds
+ */
+void workingset_shadow_removed(struct address_space *mapping)
+{
+	__workingset_shadows_removed(mapping, 1, false);
+}
+
+#define SHADOW_BATCH	16
+
+/*
+ * Delete the shadow entries of @mapping from *@index up to @end, looking
+ * at no more than *@nr_to_scan slots.  Both are advanced past what was
+ * looked at.  Returns false once the range holds no more shadow entries.
+ * The caller holds the tree_lock.
+ */
+static bool __clear_shadow_entries(struct address_space *mapping,
+				   pgoff_t *index, pgoff_t end,
+				   long *nr_to_scan, bool locked)
+{
+	unsigned long indices[SHADOW_BATCH];
+	void **slots[SHADOW_BATCH];
+
+	while (*nr_to_scan > 0) {
+		unsigned int i, j, nr, nr_shadows = 0;
+		pgoff_t next;
+
+		if (!mapping->nrshadows)
+			return false;
+
+		nr = radix_tree_gang_lookup_slot(&mapping->page_tree, slots,
+						 indices, *index, SHADOW_BATCH);
+		if (!nr)
+			return false;
+		next = indices[nr - 1] + 1;
+
+		for (i = 0; i < nr && indices[i] <= end; i++) {
+			void *entry;
+
+			entry = radix_tree_deref_slot_protected(slots[i],
+							&mapping->tree_lock);
+			if (radix_tree_exceptional_entry(entry))
+				indices[nr_shadows++] = indices[i];
+		}
+		*nr_to_scan -= i;
+
+		/* Look at every slot before deleting frees any node */
+		for (j = 0; j < nr_shadows; j++)
+			radix_tree_delete(&mapping->page_tree, indices[j]);
+		if (nr_shadows)
+			__workingset_shadows_removed(mapping, nr_shadows,
+						     locked);
+
+		if (i < nr || !next || next > end)
+			return false;
+		*index = next;
+	}
+	return true;
+}
+
+/**
+ * clear_shadow_entries - delete the shadow entries in a range of a mapping
+ * @mapping: the mapping
+ * @start: first page index
+ * @end: last page index, inclusive
+ *
+ * Called after the pages of the range have been truncated.
+ */
+void clear_shadow_entries(struct address_space *mapping,
+			  pgoff_t start, pgoff_t end)
+{
+	bool more;
+
+	do {
+		long nr_to_scan = SHADOW_BATCH * 4;
+
+		spin_lock_irq(&mapping->tree_lock);
+		more = __clear_shadow_entries(mapping, &start, end,
+					      &nr_to_scan, false);
+		spin_unlock_irq(&mapping->tree_lock);
+		cond_resched();
+	} while (more);
+}
+
+/*
+ * Shadow entries beyond the number of file pages on the LRU lists are of
+ * no use; report those to the VM, and delete entries round robin over
+ * the mappings when asked to, each mapping resuming where it was left.
+ */
+static int shrink_shadow_entries(struct shrinker *shrink, int nr_to_scan,
+				 gfp_t gfp_mask)
+{
+	long nr = nr_to_scan;
+	long excess;
+
+	if (nr) {
+		spin_lock_irq(&shadow_lock);
+		while (nr > 0 && !list_empty(&shadow_mappings)) {
+			struct address_space *mapping;
+
+			mapping = list_first_entry(&shadow_mappings,
+					struct address_space, shadow_list);
+			list_move_tail(&mapping->shadow_list, &shadow_mappings);
+			/* Count every mapping visited, so as to terminate */
+			nr--;
+			if (!spin_trylock(&mapping->tree_lock))
+				continue;
+			if (!__clear_shadow_entries(mapping,
+					&mapping->shadow_index, ULONG_MAX,
+					&nr, true))
+				mapping->shadow_index = 0;
+			spin_unlock(&mapping->tree_lock);
+		}
+		spin_unlock_irq(&shadow_lock);
+	}
+
+	excess = atomic_long_read(&nr_shadow_entries) -
+		 global_page_state(NR_ACTIVE_FILE) -
+		 global_page_state(NR_INACTIVE_FILE);
+	return clamp_t(long, excess, 0, INT_MAX);
+}
+
+static struct shrinker shadow_shrinker = {
+	.shrink = shrink_shadow_entries,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int __init workingset_init(void)
+{
+	register_shrinker(&shadow_shrinker);
+	return 0;
+}
+module_init(workingset_init);
@@ -1216,7 +1216,13 @@ static const struct tcp_request_sock_ops tcp_request_sock_ipv4_ops = {
 };
 #endif
 
-int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
+/*
+ * With @lockless set the listener is not locked: only SYNs which leave no
+ * state behind (dropped, or answered with a syncookie) are handled, and
+ * -EAGAIN is returned for everything else.
+ */
+static int __tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb,
+				 bool lockless)
 {
 	struct tcp_extend_values tmp_ext;
 	struct tcp_options_received tmp_opt;
@@ -1310,6 +1316,9 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	}
 	tmp_ext.cookie_in_always = tp->rx_opt.cookie_in_always;
 
+	if (lockless && !want_cookie)
+		goto locked_retry;
+
 	if (want_cookie && !tmp_opt.saw_tstamp)
 		tcp_clear_options(&tmp_opt);
 
@@ -1392,6 +1401,15 @@ drop_and_free:
 	reqsk_free(req);
 drop:
 	return 0;
+
+locked_retry:
+	reqsk_free(req);
+	return -EAGAIN;
+}
+
+int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
+{
+	return __tcp_v4_conn_request(sk, skb, false);
 }
 EXPORT_SYMBOL(tcp_v4_conn_request);
 
@@ -1610,6 +1628,46 @@ csum_err:
 }
 EXPORT_SYMBOL(tcp_v4_do_rcv);
 
+/*
+ * Under a SYN flood the SYN queue of a listener is full, and SYNs are either
+ * dropped or answered with a syncookie.  Neither changes the listener, so
+ * handle them without its socket lock and let a flood against a single
+ * listener scale beyond one CPU.  syn_wait_lock keeps listen_opt and the
+ * SYN table stable meanwhile.  Returns true if the skb has been consumed.
+ */
+static bool tcp_v4_syn_lockless(struct sock *sk, struct sk_buff *skb)
+{
+	struct request_sock_queue *queue = &inet_csk(sk)->icsk_accept_queue;
+	const struct iphdr *iph = ip_hdr(skb);
+	struct tcphdr *th = tcp_hdr(skb);
+	struct request_sock **prev;
+	bool consumed = false;
+
+	if (!th->syn || th->ack || th->rst || th->fin)
+		return false;
+
+	/* Keys and cookie values may change under the socket lock */
+	if (tcp_sk(sk)->cookie_values)
+		return false;
+#ifdef CONFIG_TCP_MD5SIG
+	/* tcp_v4_inbound_md5_hash() drops unexpected MD5 options */
+	if (tcp_sk(sk)->md5sig_info || tcp_parse_md5sig_option(th))
+		return false;
+#endif
+
+	read_lock(&queue->syn_wait_lock);
+	if (sk->sk_state == TCP_LISTEN && queue->listen_opt &&
+	    inet_csk_reqsk_queue_is_full(sk) &&
+	    skb->len >= tcp_hdrlen(skb) && !tcp_checksum_complete(skb) &&
+	    !inet_csk_search_req(sk, &prev, th->source, iph->saddr, iph->daddr))
+		consumed = __tcp_v4_conn_request(sk, skb, true) == 0;
+	read_unlock(&queue->syn_wait_lock);
+
+	if (consumed)
+		kfree_skb(skb);
+	return consumed;
+}
+
 /*
  *	From tcp_input.c
  */
@@ -1677,6 +1735,11 @@ process:
 
 	skb->dev = NULL;
 
+	if (sk->sk_state == TCP_LISTEN && tcp_v4_syn_lockless(sk, skb)) {
+		sock_put(sk);
+		return 0;
+	}
+
 	bh_lock_sock_nested(sk);
 	ret = 0;
 	if (!sock_owned_by_user(sk)) {
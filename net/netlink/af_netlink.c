@@ -56,6 +56,8 @@
 #include <linux/audit.h>
 #include <linux/mutex.h>
 
+#include <asm/cacheflush.h>
+
 #include <net/net_namespace.h>
 #include <net/sock.h>
 #include <net/scm.h>
@@ -64,6 +66,20 @@
 #define NLGRPSZ(x)	(ALIGN(x, sizeof(unsigned long) * 8) / 8)
 #define NLGRPLONGS(x)	(NLGRPSZ(x)/sizeof(unsigned long))
 
+#ifdef CONFIG_NETLINK_MMAP
+struct netlink_ring {
+	void			**pg_vec;
+	unsigned int		head;
+	unsigned int		frames_per_block;
+	unsigned int		frame_size;
+	unsigned int		frame_max;
+
+	unsigned int		pg_vec_order;
+	unsigned int		pg_vec_pages;
+	unsigned int		pg_vec_len;
+};
+#endif
+
 struct netlink_sock {
 	/* struct sock has to be the first member of netlink_sock */
 	struct sock		sk;
@@ -81,6 +97,11 @@ struct netlink_sock {
 	struct mutex		cb_def_mutex;
 	void			(*netlink_rcv)(struct sk_buff *skb);
 	struct module		*module;
+#ifdef CONFIG_NETLINK_MMAP
+	struct mutex		pg_vec_lock;
+	struct netlink_ring	rx_ring;
+	atomic_t		mapped;
+#endif
 };
 
 struct listeners {
@@ -149,6 +170,424 @@ static struct hlist_head *nl_pid_hashfn(struct nl_pid_hash *hash, u32 pid)
 	return &hash->table[jhash_1word(pid, hash->rnd) & hash->mask];
 }
 
+static void netlink_overrun(struct sock *sk);
+
+#ifdef CONFIG_NETLINK_MMAP
+static inline bool netlink_rx_is_mmaped(struct sock *sk)
+{
+	return nlk_sk(sk)->rx_ring.pg_vec != NULL;
+}
+
+static void netlink_mm_open(struct vm_area_struct *vma)
+{
+	struct socket *sock = vma->vm_file->private_data;
+	struct sock *sk = sock->sk;
+
+	if (sk)
+		atomic_inc(&nlk_sk(sk)->mapped);
+}
+
+static void netlink_mm_close(struct vm_area_struct *vma)
+{
+	struct socket *sock = vma->vm_file->private_data;
+	struct sock *sk = sock->sk;
+
+	if (sk)
+		atomic_dec(&nlk_sk(sk)->mapped);
+}
+
+static const struct vm_operations_struct netlink_mmap_ops = {
+	.open	= netlink_mm_open,
+	.close	= netlink_mm_close,
+};
+
+static void free_pg_vec(void **pg_vec, unsigned int order, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		if (pg_vec[i] != NULL)
+			free_pages((unsigned long)pg_vec[i], order);
+	}
+	kfree(pg_vec);
+}
+
+static void *alloc_one_pg_vec_page(unsigned long order)
+{
+	gfp_t gfp_flags = GFP_KERNEL | __GFP_COMP | __GFP_ZERO |
+			  __GFP_NOWARN | __GFP_NORETRY;
+	void *buffer;
+
+	buffer = (void *)__get_free_pages(gfp_flags, order);
+	if (buffer != NULL)
+		return buffer;
+
+	gfp_flags &= ~__GFP_NORETRY;
+	return (void *)__get_free_pages(gfp_flags, order);
+}
+
+static void **alloc_pg_vec(struct nl_mmap_req *req, unsigned int order)
+{
+	unsigned int block_nr = req->nm_block_nr;
+	unsigned int i;
+	void **pg_vec;
+
+	pg_vec = kcalloc(block_nr, sizeof(void *), GFP_KERNEL);
+	if (pg_vec == NULL)
+		return NULL;
+
+	for (i = 0; i < block_nr; i++) {
+		pg_vec[i] = alloc_one_pg_vec_page(order);
+		if (pg_vec[i] == NULL)
+			goto err1;
+	}
+
+	return pg_vec;
+err1:
+	free_pg_vec(pg_vec, order, block_nr);
+	return NULL;
+}
+
+static int netlink_set_ring(struct sock *sk, struct nl_mmap_req *req,
+			    bool closing)
+{
+	struct netlink_sock *nlk = nlk_sk(sk);
+	struct netlink_ring *ring = &nlk->rx_ring;
+	unsigned int frames_per_block = 0;
+	unsigned int order = 0;
+	void **pg_vec = NULL;
+	int err;
+
+	if (!closing && atomic_read(&nlk->mapped))
+		return -EBUSY;
+
+	if (req->nm_block_nr) {
+		if (ring->pg_vec != NULL)
+			return -EBUSY;
+
+		if ((int)req->nm_block_size <= 0)
+			return -EINVAL;
+		if (!IS_ALIGNED(req->nm_block_size, PAGE_SIZE))
+			return -EINVAL;
+		if (req->nm_frame_size < NL_MMAP_HDRLEN)
+			return -EINVAL;
+		if (!IS_ALIGNED(req->nm_frame_size, NL_MMAP_MSG_ALIGNMENT))
+			return -EINVAL;
+
+		frames_per_block = req->nm_block_size / req->nm_frame_size;
+		if (frames_per_block == 0)
+			return -EINVAL;
+		if (frames_per_block * req->nm_block_nr != req->nm_frame_nr)
+			return -EINVAL;
+
+		order = get_order(req->nm_block_size);
+		pg_vec = alloc_pg_vec(req, order);
+		if (pg_vec == NULL)
+			return -ENOMEM;
+	} else {
+		if (req->nm_frame_nr)
+			return -EINVAL;
+	}
+
+	err = -EBUSY;
+	mutex_lock(&nlk->pg_vec_lock);
+	if (closing || atomic_read(&nlk->mapped) == 0) {
+		err = 0;
+		spin_lock_bh(&sk->sk_receive_queue.lock);
+		ring->frame_max		= req->nm_frame_nr - 1;
+		ring->head		= 0;
+		ring->frame_size	= req->nm_frame_size;
+		ring->frames_per_block	= frames_per_block;
+		ring->pg_vec_pages	= req->nm_block_size / PAGE_SIZE;
+
+		swap(ring->pg_vec_len, req->nm_block_nr);
+		swap(ring->pg_vec_order, order);
+		swap(ring->pg_vec, pg_vec);
+		spin_unlock_bh(&sk->sk_receive_queue.lock);
+
+		skb_queue_purge(&sk->sk_receive_queue);
+		WARN_ON(atomic_read(&nlk->mapped));
+	}
+	mutex_unlock(&nlk->pg_vec_lock);
+
+	if (pg_vec)
+		free_pg_vec(pg_vec, order, req->nm_block_nr);
+	return err;
+}
+
+static int netlink_mmap(struct file *file, struct socket *sock,
+			struct vm_area_struct *vma)
+{
+	struct sock *sk = sock->sk;
+	struct netlink_sock *nlk = nlk_sk(sk);
+	struct netlink_ring *ring = &nlk->rx_ring;
+	unsigned long start, size, expected;
+	unsigned int i;
+	int err = -EINVAL;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	mutex_lock(&nlk->pg_vec_lock);
+
+	if (ring->pg_vec == NULL)
+		goto out;
+
+	expected = ring->pg_vec_len * ring->pg_vec_pages * PAGE_SIZE;
+	size = vma->vm_end - vma->vm_start;
+	if (size != expected)
+		goto out;
+
+	start = vma->vm_start;
+	for (i = 0; i < ring->pg_vec_len; i++) {
+		void *kaddr = ring->pg_vec[i];
+		unsigned int pg_num;
+
+		for (pg_num = 0; pg_num < ring->pg_vec_pages; pg_num++) {
+			err = vm_insert_page(vma, start, virt_to_page(kaddr));
+			if (err < 0)
+				goto out;
+			start += PAGE_SIZE;
+			kaddr += PAGE_SIZE;
+		}
+	}
+
+	atomic_inc(&nlk->mapped);
+	vma->vm_ops = &netlink_mmap_ops;
+	err = 0;
+out:
+	mutex_unlock(&nlk->pg_vec_lock);
+	return err;
+}
+
+static void netlink_frame_flush_dcache(const struct nl_mmap_hdr *hdr,
+				       unsigned int nm_len)
+{
+#if ARCH_IMPLEMENTS_FLUSH_DCACHE_PAGE == 1
+	struct page *p_start, *p_end;
+
+	/* First page is flushed through netlink_set_status() */
+	p_start = virt_to_page((void *)hdr + PAGE_SIZE);
+	p_end   = virt_to_page((void *)hdr + NL_MMAP_HDRLEN + nm_len - 1);
+	while (p_start <= p_end) {
+		flush_dcache_page(p_start);
+		p_start++;
+	}
+#endif
+}
+
+static enum nl_mmap_status netlink_get_status(const struct nl_mmap_hdr *hdr)
+{
+	smp_rmb();
+	flush_dcache_page(virt_to_page(hdr));
+	return ACCESS_ONCE(hdr->nm_status);
+}
+
+static void netlink_set_status(struct nl_mmap_hdr *hdr,
+			       enum nl_mmap_status status)
+{
+	smp_wmb();
+	hdr->nm_status = status;
+	flush_dcache_page(virt_to_page(hdr));
+}
+
+static struct nl_mmap_hdr *
+__netlink_lookup_frame(const struct netlink_ring *ring, unsigned int pos)
+{
+	unsigned int pg_vec_pos, frame_off;
+
+	pg_vec_pos = pos / ring->frames_per_block;
+	frame_off  = pos % ring->frames_per_block;
+
+	return ring->pg_vec[pg_vec_pos] + (frame_off * ring->frame_size);
+}
+
+static struct nl_mmap_hdr *
+netlink_lookup_frame(const struct netlink_ring *ring, unsigned int pos,
+		     enum nl_mmap_status status)
+{
+	struct nl_mmap_hdr *hdr;
+
+	hdr = __netlink_lookup_frame(ring, pos);
+	if (netlink_get_status(hdr) != status)
+		return NULL;
+
+	return hdr;
+}
+
+static struct nl_mmap_hdr *
+netlink_current_frame(const struct netlink_ring *ring,
+		      enum nl_mmap_status status)
+{
+	return netlink_lookup_frame(ring, ring->head, status);
+}
+
+static struct nl_mmap_hdr *
+netlink_previous_frame(const struct netlink_ring *ring,
+		       enum nl_mmap_status status)
+{
+	unsigned int prev;
+
+	prev = ring->head ? ring->head - 1 : ring->frame_max;
+	return netlink_lookup_frame(ring, prev, status);
+}
+
+static void netlink_increment_head(struct netlink_ring *ring)
+{
+	ring->head = ring->head != ring->frame_max ? ring->head + 1 : 0;
+}
+
+static bool netlink_rx_has_free_frame(struct sock *sk)
+{
+	struct netlink_ring *ring = &nlk_sk(sk)->rx_ring;
+	bool ret;
+
+	spin_lock_bh(&sk->sk_receive_queue.lock);
+	ret = ring->pg_vec != NULL &&
+	      netlink_current_frame(ring, NL_MMAP_STATUS_UNUSED) != NULL;
+	spin_unlock_bh(&sk->sk_receive_queue.lock);
+
+	return ret;
+}
+
+static void netlink_ring_fill_hdr(struct nl_mmap_hdr *hdr, struct sk_buff *skb)
+{
+	hdr->nm_len	= skb->len;
+	hdr->nm_group	= NETLINK_CB(skb).dst_group;
+	hdr->nm_pid	= NETLINK_CREDS(skb)->pid;
+	hdr->nm_uid	= NETLINK_CREDS(skb)->uid;
+	hdr->nm_gid	= NETLINK_CREDS(skb)->gid;
+}
+
+/*
+ * Place a message in the next unused frame of the receive ring. Messages
+ * which don't fit into a frame are queued to the socket and their frame is
+ * marked NL_MMAP_STATUS_COPY, userspace has to use recvmsg() to fetch them.
+ */
+static void netlink_ring_queue_skb(struct sock *sk, struct sk_buff *skb)
+{
+	struct netlink_ring *ring = &nlk_sk(sk)->rx_ring;
+	struct nl_mmap_hdr *hdr;
+	int len = skb->len;
+
+	spin_lock_bh(&sk->sk_receive_queue.lock);
+	if (ring->pg_vec == NULL) {
+		__skb_queue_tail(&sk->sk_receive_queue, skb);
+		goto out;
+	}
+
+	hdr = netlink_current_frame(ring, NL_MMAP_STATUS_UNUSED);
+	if (hdr == NULL) {
+		spin_unlock_bh(&sk->sk_receive_queue.lock);
+		kfree_skb(skb);
+		netlink_overrun(sk);
+		return;
+	}
+	netlink_increment_head(ring);
+	netlink_ring_fill_hdr(hdr, skb);
+
+	if (NL_MMAP_HDRLEN + len <= ring->frame_size) {
+		skb_copy_bits(skb, 0, (void *)hdr + NL_MMAP_HDRLEN, len);
+		netlink_frame_flush_dcache(hdr, len);
+		netlink_set_status(hdr, NL_MMAP_STATUS_VALID);
+		spin_unlock_bh(&sk->sk_receive_queue.lock);
+
+		consume_skb(skb);
+		sk->sk_data_ready(sk, len);
+		return;
+	}
+
+	netlink_set_status(hdr, NL_MMAP_STATUS_COPY);
+	__skb_queue_tail(&sk->sk_receive_queue, skb);
+out:
+	spin_unlock_bh(&sk->sk_receive_queue.lock);
+	sk->sk_data_ready(sk, len);
+}
+
+static unsigned int netlink_poll(struct file *file, struct socket *sock,
+				 poll_table *wait)
+{
+	struct sock *sk = sock->sk;
+	struct netlink_sock *nlk = nlk_sk(sk);
+	unsigned int mask;
+	int err;
+
+	if (nlk->rx_ring.pg_vec != NULL) {
+		/* Memory mapped sockets don't call recvmsg(), so continue
+		 * a dump in progress as soon as frames have been released.
+		 */
+		if (nlk->cb != NULL && netlink_rx_has_free_frame(sk)) {
+			err = netlink_dump(sk);
+			if (err < 0) {
+				sk->sk_err = -err;
+				sk->sk_error_report(sk);
+			}
+		}
+		if (netlink_rx_has_free_frame(sk)) {
+			clear_bit(0, &nlk->state);
+			wake_up_interruptible(&nlk->wait);
+		}
+	}
+
+	mask = datagram_poll(file, sock, wait);
+
+	spin_lock_bh(&sk->sk_receive_queue.lock);
+	if (nlk->rx_ring.pg_vec) {
+		if (netlink_previous_frame(&nlk->rx_ring, NL_MMAP_STATUS_VALID) ||
+		    netlink_previous_frame(&nlk->rx_ring, NL_MMAP_STATUS_COPY))
+			mask |= POLLIN | POLLRDNORM;
+	}
+	spin_unlock_bh(&sk->sk_receive_queue.lock);
+
+	return mask;
+}
+
+/*
+ * Dumps to a mapped socket are built in skbs sized to the ring frames, so
+ * that each dump round fills one frame instead of one NLMSG_GOODSIZE chunk.
+ */
+static struct sk_buff *netlink_ring_alloc_skb(struct sock *sk)
+{
+	unsigned int size = nlk_sk(sk)->rx_ring.frame_size - NL_MMAP_HDRLEN;
+	struct sk_buff *skb;
+
+	skb = alloc_skb(max_t(unsigned int, size, NLMSG_GOODSIZE), GFP_KERNEL);
+	if (skb)
+		skb_set_owner_r(skb, sk);
+	return skb;
+}
+#else /* CONFIG_NETLINK_MMAP */
+#define netlink_rx_is_mmaped(sk)	false
+#define netlink_rx_has_free_frame(sk)	false
+#define netlink_ring_alloc_skb(sk)	NULL
+#define netlink_mmap			sock_no_mmap
+#define netlink_poll			datagram_poll
+#endif /* CONFIG_NETLINK_MMAP */
+
+static void __netlink_sendskb(struct sock *sk, struct sk_buff *skb)
+{
+	int len = skb->len;
+
+#ifdef CONFIG_NETLINK_MMAP
+	if (netlink_rx_is_mmaped(sk)) {
+		netlink_ring_queue_skb(sk, skb);
+		return;
+	}
+#endif
+	skb_queue_tail(&sk->sk_receive_queue, skb);
+	sk->sk_data_ready(sk, len);
+}
+
+/* A receive ring without a free frame is as congested as a full queue */
+static inline bool netlink_rx_is_congested(struct sock *sk)
+{
+	if (atomic_read(&sk->sk_rmem_alloc) > sk->sk_rcvbuf ||
+	    test_bit(0, &nlk_sk(sk)->state))
+		return true;
+
+	return netlink_rx_is_mmaped(sk) && !netlink_rx_has_free_frame(sk);
+}
+
 static void netlink_sock_destruct(struct sock *sk)
 {
 	struct netlink_sock *nlk = nlk_sk(sk);
@@ -422,6 +861,9 @@ static int __netlink_create(struct net *net, struct socket *sock,
 		mutex_init(nlk->cb_mutex);
 	}
 	init_waitqueue_head(&nlk->wait);
+#ifdef CONFIG_NETLINK_MMAP
+	mutex_init(&nlk->pg_vec_lock);
+#endif
 
 	sk->sk_destruct = netlink_sock_destruct;
 	sk->sk_protocol = protocol;
@@ -503,6 +945,15 @@ static int netlink_release(struct socket *sock)
 
 	skb_queue_purge(&sk->sk_write_queue);
 
+#ifdef CONFIG_NETLINK_MMAP
+	if (nlk->rx_ring.pg_vec) {
+		struct nl_mmap_req req;
+
+		memset(&req, 0, sizeof(req));
+		netlink_set_ring(sk, &req, true);
+	}
+#endif
+
 	if (nlk->pid) {
 		struct netlink_notify n = {
 						.net = sock_net(sk),
@@ -797,8 +1248,7 @@ int netlink_attachskb(struct sock *sk, struct sk_buff *skb,
 
 	nlk = nlk_sk(sk);
 
-	if (atomic_read(&sk->sk_rmem_alloc) > sk->sk_rcvbuf ||
-	    test_bit(0, &nlk->state)) {
+	if (netlink_rx_is_congested(sk)) {
 		DECLARE_WAITQUEUE(wait, current);
 		if (!*timeo) {
 			if (!ssk || netlink_is_kernel(ssk))
@@ -811,9 +1261,7 @@ int netlink_attachskb(struct sock *sk, struct sk_buff *skb,
 		__set_current_state(TASK_INTERRUPTIBLE);
 		add_wait_queue(&nlk->wait, &wait);
 
-		if ((atomic_read(&sk->sk_rmem_alloc) > sk->sk_rcvbuf ||
-		     test_bit(0, &nlk->state)) &&
-		    !sock_flag(sk, SOCK_DEAD))
+		if (netlink_rx_is_congested(sk) && !sock_flag(sk, SOCK_DEAD))
 			*timeo = schedule_timeout(*timeo);
 
 		__set_current_state(TASK_RUNNING);
@@ -834,8 +1282,7 @@ int netlink_sendskb(struct sock *sk, struct sk_buff *skb)
 {
 	int len = skb->len;
 
-	skb_queue_tail(&sk->sk_receive_queue, skb);
-	sk->sk_data_ready(sk, len);
+	__netlink_sendskb(sk, skb);
 	sock_put(sk);
 	return len;
 }
@@ -955,13 +1402,9 @@ EXPORT_SYMBOL_GPL(netlink_has_listeners);
 static inline int netlink_broadcast_deliver(struct sock *sk,
 					    struct sk_buff *skb)
 {
-	struct netlink_sock *nlk = nlk_sk(sk);
-
-	if (atomic_read(&sk->sk_rmem_alloc) <= sk->sk_rcvbuf &&
-	    !test_bit(0, &nlk->state)) {
+	if (!netlink_rx_is_congested(sk)) {
 		skb_set_owner_r(skb, sk);
-		skb_queue_tail(&sk->sk_receive_queue, skb);
-		sk->sk_data_ready(sk, skb->len);
+		__netlink_sendskb(sk, skb);
 		return atomic_read(&sk->sk_rmem_alloc) > sk->sk_rcvbuf;
 	}
 	return -1;
@@ -1242,6 +1685,23 @@ static int netlink_setsockopt(struct socket *sock, int level, int optname,
 			nlk->flags &= ~NETLINK_RECV_NO_ENOBUFS;
 		err = 0;
 		break;
+#ifdef CONFIG_NETLINK_MMAP
+	case NETLINK_RX_RING: {
+		struct nl_mmap_req req;
+
+		/* Rings might consume more memory than queue limits, require
+		 * CAP_NET_ADMIN.
+		 */
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+		if (optlen < sizeof(req))
+			return -EINVAL;
+		if (copy_from_user(&req, optval, sizeof(req)))
+			return -EFAULT;
+		err = netlink_set_ring(sk, &req, false);
+		break;
+	}
+#endif /* CONFIG_NETLINK_MMAP */
 	default:
 		err = -ENOPROTOOPT;
 	}
@@ -1669,7 +2129,16 @@ static int netlink_dump(struct sock *sk)
 	struct nlmsghdr *nlh;
 	int len, err = -ENOBUFS;
 
-	skb = sock_rmalloc(sk, NLMSG_GOODSIZE, 0, GFP_KERNEL);
+again:
+	if (netlink_rx_is_mmaped(sk)) {
+		/* Only fill the ring as far as userspace has released
+		 * frames, the dump is continued from netlink_poll().
+		 */
+		if (!netlink_rx_has_free_frame(sk))
+			return 0;
+		skb = netlink_ring_alloc_skb(sk);
+	} else
+		skb = sock_rmalloc(sk, NLMSG_GOODSIZE, 0, GFP_KERNEL);
 	if (!skb)
 		goto errout;
 
@@ -1688,9 +2157,12 @@ static int netlink_dump(struct sock *sk)
 
 		if (sk_filter(sk, skb))
 			kfree_skb(skb);
-		else {
-			skb_queue_tail(&sk->sk_receive_queue, skb);
-			sk->sk_data_ready(sk, skb->len);
+		else
+			__netlink_sendskb(sk, skb);
+
+		if (netlink_rx_is_mmaped(sk)) {
+			cond_resched();
+			goto again;
 		}
 		return 0;
 	}
@@ -1703,10 +2175,8 @@ static int netlink_dump(struct sock *sk)
 
 	if (sk_filter(sk, skb))
 		kfree_skb(skb);
-	else {
-		skb_queue_tail(&sk->sk_receive_queue, skb);
-		sk->sk_data_ready(sk, skb->len);
-	}
+	else
+		__netlink_sendskb(sk, skb);
 
 	if (cb->done)
 		cb->done(cb);
@@ -2053,7 +2523,7 @@ static const struct proto_ops netlink_ops = {
 	.socketpair =	sock_no_socketpair,
 	.accept =	sock_no_accept,
 	.getname =	netlink_getname,
-	.poll =		datagram_poll,
+	.poll =		netlink_poll,
 	.ioctl =	sock_no_ioctl,
 	.listen =	sock_no_listen,
 	.shutdown =	sock_no_shutdown,
@@ -2061,7 +2531,7 @@ static const struct proto_ops netlink_ops = {
 	.getsockopt =	netlink_getsockopt,
 	.sendmsg =	netlink_sendmsg,
 	.recvmsg =	netlink_recvmsg,
-	.mmap =		sock_no_mmap,
+	.mmap =		netlink_mmap,
 	.sendpage =	sock_no_sendpage,
 };
 
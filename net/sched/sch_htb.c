@@ -37,6 +37,8 @@
 #include <linux/rbtree.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 
@@ -51,6 +53,14 @@
     Each class is assigned level. Leaf has ALWAYS level 0 and root
     classes have level TC_HTB_MAXDEPTH-1. Interior nodes has level
     one less than their parent.
+
+    Shared buckets:
+    HTB instances created with TCA_HTB_SHARED, typically one per tx queue
+    under mq, share the token buckets of classes with the same minor id
+    on the same device. Each instance keeps running under its own queue
+    lock; only the bucket state is serialized, by a per-bucket lock.
+    Every instance still decides on its own cached copy of the tokens, so
+    a rate can be overshot by at most one packet per instance.
 */
 
 static int htb_hysteresis __read_mostly = 0; /* whether to use mode hysteresis for speedup */
@@ -64,6 +74,20 @@ static int htb_hysteresis __read_mostly = 0; /* whether to use mode hysteresis f
 module_param    (htb_hysteresis, int, 0640);
 MODULE_PARM_DESC(htb_hysteresis, "Hysteresis mode, less CPU load, less accurate");
 
+/* token bucket state of a class shared by several HTB instances */
+struct htb_shared_bucket {
+	struct list_head	list;
+	struct net_device	*dev;
+	u32			minor;
+	int			refcnt;		/* protected by RTNL */
+
+	spinlock_t		lock;
+	long			tokens, ctokens;
+	psched_time_t		t_c;
+};
+
+static LIST_HEAD(htb_shared_buckets);
+
 /* used internaly to keep status of single class */
 enum htb_cmode {
 	HTB_CANT_SEND,		/* class can't send and can't borrow */
@@ -124,6 +148,7 @@ struct htb_class {
 	psched_tdiff_t mbuffer;	/* max wait time */
 	long tokens, ctokens;	/* current number of tokens */
 	psched_time_t t_c;	/* checkpoint time */
+	struct htb_shared_bucket *shared; /* bucket state shared with peers */
 };
 
 struct htb_sched {
@@ -148,6 +173,7 @@ struct htb_sched {
 	struct tcf_proto *filter_list;
 
 	int rate2quantum;	/* quant = rate / rate2quantum */
+	int shared;		/* classes share buckets with peers */
 	psched_time_t now;	/* cached dequeue time */
 	struct qdisc_watchdog watchdog;
 
@@ -162,6 +188,69 @@ struct htb_sched {
 	struct work_struct work;
 };
 
+static struct htb_shared_bucket *htb_shared_get(struct Qdisc *sch, u32 classid,
+					       const struct tc_htb_opt *hopt)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct htb_shared_bucket *b;
+
+	ASSERT_RTNL();
+	list_for_each_entry(b, &htb_shared_buckets, list) {
+		if (b->dev == dev && b->minor == TC_H_MIN(classid)) {
+			b->refcnt++;
+			return b;
+		}
+	}
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return NULL;
+	b->dev = dev;
+	b->minor = TC_H_MIN(classid);
+	b->refcnt = 1;
+	spin_lock_init(&b->lock);
+	b->tokens = hopt->buffer;
+	b->ctokens = hopt->cbuffer;
+	b->t_c = psched_get_time();
+	list_add(&b->list, &htb_shared_buckets);
+	return b;
+}
+
+static void htb_shared_put(struct htb_shared_bucket *b)
+{
+	ASSERT_RTNL();
+	if (b && --b->refcnt == 0) {
+		list_del(&b->list);
+		kfree(b);
+	}
+}
+
+/* refresh the cached bucket state of cl from its peers */
+static inline void htb_shared_sync(struct htb_class *cl)
+{
+	struct htb_shared_bucket *b = cl->shared;
+
+	if (b) {
+		spin_lock(&b->lock);
+		cl->tokens = b->tokens;
+		cl->ctokens = b->ctokens;
+		cl->t_c = b->t_c;
+		spin_unlock(&b->lock);
+	}
+}
+
+/*
+ * Time elapsed since the checkpoint of cl.  A peer sharing its bucket may
+ * have moved t_c past our q->now; that time was credited already and must
+ * not be credited again, nor wrap around to a full mbuffer.
+ */
+static inline long htb_class_tdiff(struct htb_sched *q, struct htb_class *cl)
+{
+	if (cl->t_c >= q->now)
+		return 0;
+	return psched_tdiff_bounded(q->now, cl->t_c, cl->mbuffer);
+}
+
 /* find class in global hash table using given handle */
 static inline struct htb_class *htb_find(u32 handle, struct Qdisc *sch)
 {
@@ -629,7 +718,15 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
 	long diff;
 
 	while (cl) {
-		diff = psched_tdiff_bounded(q->now, cl->t_c, cl->mbuffer);
+		struct htb_shared_bucket *b = cl->shared;
+
+		if (b) {
+			spin_lock(&b->lock);
+			cl->tokens = b->tokens;
+			cl->ctokens = b->ctokens;
+			cl->t_c = b->t_c;
+		}
+		diff = htb_class_tdiff(q, cl);
 		if (cl->level >= level) {
 			if (cl->level == level)
 				cl->xstats.lends++;
@@ -639,7 +736,14 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
 			cl->tokens += diff;	/* we moved t_c; update tokens */
 		}
 		htb_accnt_ctokens(cl, bytes, diff);
-		cl->t_c = q->now;
+		/* never move the shared checkpoint backwards */
+		cl->t_c = max(cl->t_c, q->now);
+		if (b) {
+			b->tokens = cl->tokens;
+			b->ctokens = cl->ctokens;
+			b->t_c = cl->t_c;
+			spin_unlock(&b->lock);
+		}
 
 		old_mode = cl->cmode;
 		diff = 0;
@@ -687,7 +791,8 @@ static psched_time_t htb_do_events(struct htb_sched *q, int level,
 			return cl->pq_key;
 
 		htb_safe_rb_erase(p, q->wait_pq + level);
-		diff = psched_tdiff_bounded(q->now, cl->t_c, cl->mbuffer);
+		htb_shared_sync(cl);
+		diff = htb_class_tdiff(q, cl);
 		htb_change_class_mode(q, cl, &diff);
 		if (cl->cmode != HTB_CAN_SEND)
 			htb_add_to_wait_tree(q, cl, diff);
@@ -976,6 +1081,7 @@ static const struct nla_policy htb_policy[TCA_HTB_MAX + 1] = {
 	[TCA_HTB_INIT]	= { .len = sizeof(struct tc_htb_glob) },
 	[TCA_HTB_CTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
 	[TCA_HTB_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+	[TCA_HTB_SHARED] = { .type = NLA_U32 },
 };
 
 static void htb_work_func(struct work_struct *work)
@@ -989,7 +1095,7 @@ static void htb_work_func(struct work_struct *work)
 static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 {
 	struct htb_sched *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_HTB_INIT + 1];
+	struct nlattr *tb[TCA_HTB_MAX + 1];
 	struct tc_htb_glob *gopt;
 	int err;
 	int i;
@@ -997,7 +1103,7 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 	if (!opt)
 		return -EINVAL;
 
-	err = nla_parse_nested(tb, TCA_HTB_INIT, opt, htb_policy);
+	err = nla_parse_nested(tb, TCA_HTB_MAX, opt, htb_policy);
 	if (err < 0)
 		return err;
 
@@ -1029,6 +1135,8 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 	if ((q->rate2quantum = gopt->rate2quantum) < 1)
 		q->rate2quantum = 1;
 	q->defcls = gopt->defcls;
+	if (tb[TCA_HTB_SHARED])
+		q->shared = !!nla_get_u32(tb[TCA_HTB_SHARED]);
 
 	return 0;
 }
@@ -1052,6 +1160,8 @@ static int htb_dump(struct Qdisc *sch, struct sk_buff *skb)
 	if (nest == NULL)
 		goto nla_put_failure;
 	NLA_PUT(skb, TCA_HTB_INIT, sizeof(gopt), &gopt);
+	if (q->shared)
+		NLA_PUT_U32(skb, TCA_HTB_SHARED, 1);
 	nla_nest_end(skb, nest);
 
 	spin_unlock_bh(root_lock);
@@ -1205,6 +1315,7 @@ static void htb_destroy_class(struct Qdisc *sch, struct htb_class *cl)
 	gen_kill_estimator(&cl->bstats, &cl->rate_est);
 	qdisc_put_rtab(cl->rate);
 	qdisc_put_rtab(cl->ceil);
+	htb_shared_put(cl->shared);
 
 	tcf_destroy_chain(&cl->filter_list);
 	kfree(cl);
@@ -1365,10 +1476,19 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 		if (!cl)
 			goto failure;
 
+		if (q->shared) {
+			cl->shared = htb_shared_get(sch, classid, hopt);
+			if (!cl->shared) {
+				kfree(cl);
+				goto failure;
+			}
+		}
+
 		err = gen_new_estimator(&cl->bstats, &cl->rate_est,
 					qdisc_root_sleeping_lock(sch),
 					tca[TCA_RATE] ? : &est.nla);
 		if (err) {
+			htb_shared_put(cl->shared);
 			kfree(cl);
 			goto failure;
 		}
@@ -1419,6 +1539,7 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 		cl->mbuffer = 60 * PSCHED_TICKS_PER_SEC;	/* 1min */
 		cl->t_c = psched_get_time();
 		cl->cmode = HTB_CAN_SEND;
+		htb_shared_sync(cl);
 
 		/* attach to the hash list and parent's family */
 		qdisc_class_hash_insert(&q->clhash, &cl->common);
@@ -443,7 +443,7 @@ static int unix_release_sock(struct sock *sk, int embrion)
 	 */
 
 	if (unix_tot_inflight)
-		unix_gc();		/* Garbage collect fds */
+		unix_schedule_gc();	/* Garbage collect fds */
 
 	return 0;
 }
@@ -1324,6 +1324,8 @@ static void unix_detach_fds(struct scm_cookie *scm, struct sk_buff *skb)
 {
 	int i;
 
+	unix_gc_unqueue_skb(skb);
+
 	scm->fp = UNIXCB(skb).fp;
 	UNIXCB(skb).fp = NULL;
 
@@ -1388,6 +1390,8 @@ static int unix_scm_to_skb(struct scm_cookie *scm, struct sk_buff *skb, bool sen
 	UNIXCB(skb).pid  = get_pid(scm->pid);
 	UNIXCB(skb).cred = get_cred(scm->cred);
 	UNIXCB(skb).fp = NULL;
+	UNIXCB(skb).gc_owner = NULL;
+	UNIXCB(skb).gc_embryo = false;
 	if (scm->fp && send_fds)
 		err = unix_attach_fds(scm, skb);
 
@@ -1418,10 +1422,11 @@ static int unix_dgram_sendmsg(struct kiocb *kiocb, struct socket *sock,
 
 	if (NULL == siocb->scm)
 		siocb->scm = &tmp_scm;
-	wait_for_unix_gc();
 	err = scm_send(sock, msg, siocb->scm);
 	if (err < 0)
 		return err;
+	if (siocb->scm->fp)
+		wait_for_unix_gc();
 
 	err = -EOPNOTSUPP;
 	if (msg->msg_flags&MSG_OOB)
@@ -1542,6 +1547,8 @@ restart:
 
 	if (sock_flag(other, SOCK_RCVTSTAMP))
 		__net_timestamp(skb);
+	if (UNIXCB(skb).fp)
+		unix_gc_queue_skb(other, skb);
 	skb_queue_tail(&other->sk_receive_queue, skb);
 	if (max_level > unix_sk(other)->recursion_level)
 		unix_sk(other)->recursion_level = max_level;
@@ -1578,10 +1585,11 @@ static int unix_stream_sendmsg(struct kiocb *kiocb, struct socket *sock,
 
 	if (NULL == siocb->scm)
 		siocb->scm = &tmp_scm;
-	wait_for_unix_gc();
 	err = scm_send(sock, msg, siocb->scm);
 	if (err < 0)
 		return err;
+	if (siocb->scm->fp)
+		wait_for_unix_gc();
 
 	err = -EOPNOTSUPP;
 	if (msg->msg_flags&MSG_OOB)
@@ -1656,6 +1664,8 @@ static int unix_stream_sendmsg(struct kiocb *kiocb, struct socket *sock,
 		    (other->sk_shutdown & RCV_SHUTDOWN))
 			goto pipe_err_free;
 
+		if (UNIXCB(skb).fp)
+			unix_gc_queue_skb(other, skb);
 		skb_queue_tail(&other->sk_receive_queue, skb);
 		if (max_level > unix_sk(other)->recursion_level)
 			unix_sk(other)->recursion_level = max_level;
@@ -2370,6 +2380,7 @@ out:
 static void __exit af_unix_exit(void)
 {
 	sock_unregister(PF_UNIX);
+	unix_flush_gc();
 	proto_unregister(&unix_proto);
 	unregister_pernet_subsys(&unix_net_ops);
 }
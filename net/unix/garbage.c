@@ -79,7 +79,7 @@
 #include <linux/file.h>
 #include <linux/proc_fs.h>
 #include <linux/mutex.h>
-#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <net/sock.h>
 #include <net/af_unix.h>
@@ -91,10 +91,20 @@
 static LIST_HEAD(gc_inflight_list);
 static LIST_HEAD(gc_candidates);
 static DEFINE_SPINLOCK(unix_gc_lock);
-static DECLARE_WAIT_QUEUE_HEAD(unix_gc_wait);
 
 unsigned int unix_tot_inflight;
 
+/*
+ * A reference cycle needs an in-flight socket whose receive queue holds
+ * skbs passing other sockets.  Count the in-flight sockets with such
+ * "edges", and the edges queued on embryos (which are reached through an
+ * in-flight listener), so that the collector can tell cheaply whether a
+ * cycle is possible at all.  Edges queued on an embryo count in its
+ * gc_edges as well, so that they are still seen once it is accepted.
+ */
+static unsigned long unix_gc_cyclic_socks;
+static unsigned long unix_gc_embryo_edges;
+
 
 struct sock *unix_get_socket(struct file *filp)
 {
@@ -131,6 +141,8 @@ void unix_inflight(struct file *fp)
 		if (atomic_long_inc_return(&u->inflight) == 1) {
 			BUG_ON(!list_empty(&u->link));
 			list_add_tail(&u->link, &gc_inflight_list);
+			if (u->gc_edges)
+				unix_gc_cyclic_socks++;
 		} else {
 			BUG_ON(list_empty(&u->link));
 		}
@@ -146,13 +158,73 @@ void unix_notinflight(struct file *fp)
 		struct unix_sock *u = unix_sk(s);
 		spin_lock(&unix_gc_lock);
 		BUG_ON(list_empty(&u->link));
-		if (atomic_long_dec_and_test(&u->inflight))
+		if (atomic_long_dec_and_test(&u->inflight)) {
 			list_del_init(&u->link);
+			if (u->gc_edges)
+				unix_gc_cyclic_socks--;
+		}
 		unix_tot_inflight--;
 		spin_unlock(&unix_gc_lock);
 	}
 }
 
+static bool unix_skb_passes_sockets(struct sk_buff *skb)
+{
+	struct scm_fp_list *fpl = UNIXCB(skb).fp;
+	int i;
+
+	for (i = 0; fpl && i < fpl->count; i++) {
+		if (unix_get_socket(fpl->fp[i]))
+			return true;
+	}
+	return false;
+}
+
+/*
+ *	Account an skb passing AF_UNIX sockets which is about to be
+ *	queued on sk.  Called with the unix state lock of sk held.
+ */
+
+void unix_gc_queue_skb(struct sock *sk, struct sk_buff *skb)
+{
+	struct unix_sock *u = unix_sk(sk);
+
+	if (!unix_skb_passes_sockets(skb))
+		return;
+
+	spin_lock(&unix_gc_lock);
+	UNIXCB(skb).gc_owner = u;
+	if (!sk->sk_socket) {
+		UNIXCB(skb).gc_embryo = true;
+		unix_gc_embryo_edges++;
+	}
+	if (u->gc_edges++ == 0 && atomic_long_read(&u->inflight))
+		unix_gc_cyclic_socks++;
+	spin_unlock(&unix_gc_lock);
+}
+
+static void __unix_gc_unqueue_skb(struct sk_buff *skb)
+{
+	struct unix_sock *u = UNIXCB(skb).gc_owner;
+
+	UNIXCB(skb).gc_owner = NULL;
+	if (UNIXCB(skb).gc_embryo) {
+		UNIXCB(skb).gc_embryo = false;
+		unix_gc_embryo_edges--;
+	}
+	if (--u->gc_edges == 0 && atomic_long_read(&u->inflight))
+		unix_gc_cyclic_socks--;
+}
+
+void unix_gc_unqueue_skb(struct sk_buff *skb)
+{
+	if (UNIXCB(skb).gc_owner) {
+		spin_lock(&unix_gc_lock);
+		__unix_gc_unqueue_skb(skb);
+		spin_unlock(&unix_gc_lock);
+	}
+}
+
 static void scan_inflight(struct sock *x, void (*func)(struct unix_sock *),
 			  struct sk_buff_head *hitlist)
 {
@@ -203,9 +275,11 @@ static void scan_inflight(struct sock *x, void (*func)(struct unix_sock *),
 static void scan_children(struct sock *x, void (*func)(struct unix_sock *),
 			  struct sk_buff_head *hitlist)
 {
-	if (x->sk_state != TCP_LISTEN)
-		scan_inflight(x, func, hitlist);
-	else {
+	if (x->sk_state != TCP_LISTEN) {
+		/* Nothing to find on queues which pass no sockets */
+		if (unix_sk(x)->gc_edges)
+			scan_inflight(x, func, hitlist);
+	} else {
 		struct sk_buff *skb;
 		struct sk_buff *next;
 		struct unix_sock *u;
@@ -261,23 +335,50 @@ static void inc_inflight_move_tail(struct unix_sock *u)
 static bool gc_in_progress = false;
 #define UNIX_INFLIGHT_TRIGGER_GC 16000
 
+static void unix_gc_work_fn(struct work_struct *work)
+{
+	unix_gc();
+}
+
+static DECLARE_WORK(unix_gc_work, unix_gc_work_fn);
+
+/*
+ *	Collection runs asynchronously, so that neither the task closing a
+ *	socket nor unrelated senders wait for a walk of the in-flight sockets.
+ */
+
+void unix_schedule_gc(void)
+{
+	queue_work(system_unbound_wq, &unix_gc_work);
+}
+
+/* Wait for a queued collection, before the module goes away */
+void unix_flush_gc(void)
+{
+	flush_work(&unix_gc_work);
+}
+
+/*
+ *	Called by senders passing descriptors.  If the number of inflight
+ *	sockets is insane, force a garbage collect right now and throttle
+ *	the sender until it has finished.
+ */
+
 void wait_for_unix_gc(void)
 {
-	/*
-	 * If number of inflight sockets is insane,
-	 * force a garbage collect right now.
-	 */
-	if (unix_tot_inflight > UNIX_INFLIGHT_TRIGGER_GC && !gc_in_progress)
-		unix_gc();
-	wait_event(unix_gc_wait, gc_in_progress == false);
+	if (unix_tot_inflight > UNIX_INFLIGHT_TRIGGER_GC) {
+		unix_schedule_gc();
+		flush_work(&unix_gc_work);
+	}
 }
 
-/* The external entry point: unix_gc() */
+/* The garbage collector proper, run from unix_gc_work */
 void unix_gc(void)
 {
 	struct unix_sock *u;
 	struct unix_sock *next;
 	struct sk_buff_head hitlist;
+	struct sk_buff *skb;
 	struct list_head cursor;
 	LIST_HEAD(not_cycle_list);
 
@@ -287,6 +388,10 @@ void unix_gc(void)
 	if (gc_in_progress)
 		goto out;
 
+	/* No in-flight socket can be reached from another one. */
+	if (!unix_gc_cyclic_socks && !unix_gc_embryo_edges)
+		goto out;
+
 	gc_in_progress = true;
 	/*
 	 * First, select candidates for garbage collection.  Only
@@ -369,6 +474,15 @@ void unix_gc(void)
 	list_for_each_entry(u, &gc_candidates, link)
 	scan_children(&u->sk, inc_inflight, &hitlist);
 
+	/*
+	 * The skbs are off their queues now, drop their edges once all
+	 * inflight counters are back in place.
+	 */
+	skb_queue_walk(&hitlist, skb) {
+		if (UNIXCB(skb).gc_owner)
+			__unix_gc_unqueue_skb(skb);
+	}
+
 	spin_unlock(&unix_gc_lock);
 
 	/* Here we are. Hitlist is filled. Die. */
@@ -379,7 +493,6 @@ void unix_gc(void)
 	/* All candidates should have been detached by now. */
 	BUG_ON(!list_empty(&gc_candidates));
 	gc_in_progress = false;
-	wake_up(&unix_gc_wait);
 
  out:
 	spin_unlock(&unix_gc_lock);
@@ -0,0 +1,251 @@
+/*
+ *
+ * sched-fdpass.c
+ *
+ * fdpass: Benchmark for passing descriptors over AF_UNIX sockets
+ *
+ * Each worker owns a ring of socketpairs and keeps passing the descriptor
+ * of one pair through the next pair, so that thousands of AF_UNIX sockets
+ * are in flight at any time.  Optionally workers also leave unreachable
+ * cycles behind, which have to be reclaimed by the unix garbage collector
+ * while the other workers keep sending.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static int nr_pairs = 1000;
+static int nr_workers = 4;
+static int loops = 100000;
+static int garbage_interval;
+
+static const struct option options[] = {
+	OPT_INTEGER('n', "pairs", &nr_pairs,
+		    "Specify number of socketpairs per worker"),
+	OPT_INTEGER('w', "workers", &nr_workers,
+		    "Specify number of worker processes"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of descriptors passed per worker"),
+	OPT_INTEGER('g', "garbage", &garbage_interval,
+		    "Leave an unreachable cycle behind every N passes (0: never)"),
+	OPT_END()
+};
+
+static const char * const bench_sched_fdpass_usage[] = {
+	"perf bench sched fdpass <options>",
+	NULL
+};
+
+static int send_fd(int sock, int fd)
+{
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char c = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock)
+{
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char c;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	if (recvmsg(sock, &msg, 0) != 1)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* A socketpair whose ends are only referenced from their own queues */
+static void leave_garbage(void)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv))
+		return;
+	send_fd(sv[0], sv[1]);
+	send_fd(sv[1], sv[0]);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void worker(void)
+{
+	int (*pairs)[2];
+	int i, cur, next, fd;
+
+	pairs = calloc(nr_pairs, sizeof(*pairs));
+	assert(pairs);
+
+	for (i = 0; i < nr_pairs; i++)
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pairs[i]))
+			err(EXIT_FAILURE, "socketpair #%d", i);
+
+	/* Put one end of every pair in flight on the next pair */
+	for (i = 0; i < nr_pairs; i++)
+		assert(!send_fd(pairs[(i + 1) % nr_pairs][0], pairs[i][1]));
+
+	for (i = 0; i < loops; i++) {
+		cur = i % nr_pairs;
+		next = (cur + 1) % nr_pairs;
+
+		fd = recv_fd(pairs[next][1]);
+		assert(fd >= 0);
+		assert(!send_fd(pairs[next][0], fd));
+		close(fd);
+
+		if (garbage_interval && !(i % garbage_interval))
+			leave_garbage();
+	}
+
+	exit(0);
+}
+
+/*
+ * Every worker keeps both ends of its pairs open, plus a received
+ * descriptor and a garbage pair at times: raise the soft limit on open
+ * files as far as the hard limit allows.
+ */
+static void raise_nofile_limit(void)
+{
+	struct rlimit rlim;
+	rlim_t needed = 2 * (rlim_t)nr_pairs + 16;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim))
+		err(EXIT_FAILURE, "getrlimit");
+	/* RLIM_INFINITY is larger than any limit */
+	if (rlim.rlim_cur >= needed)
+		return;
+	if (rlim.rlim_max < needed)
+		errx(EXIT_FAILURE, "%d pairs need %llu open files, "
+		     "the hard limit is %llu", nr_pairs,
+		     (unsigned long long)needed,
+		     (unsigned long long)rlim.rlim_max);
+
+	rlim.rlim_cur = needed;
+	if (setrlimit(RLIMIT_NOFILE, &rlim))
+		err(EXIT_FAILURE, "setrlimit");
+}
+
+int bench_sched_fdpass(int argc, const char **argv,
+		       const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	unsigned long long result_usec = 0;
+	unsigned long long total;
+	int i, wait_stat;
+	pid_t pid;
+
+	argc = parse_options(argc, argv, options,
+			     bench_sched_fdpass_usage, 0);
+
+	if (nr_pairs < 1 || nr_workers < 1 || loops < 1) {
+		fprintf(stderr, "Invalid number of pairs, workers or loops\n");
+		return 1;
+	}
+
+	raise_nofile_limit();
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_workers; i++) {
+		pid = fork();
+		assert(pid >= 0);
+		if (!pid)
+			worker();
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		assert(wait(&wait_stat) > 0);
+		assert(WIFEXITED(wait_stat) && !WEXITSTATUS(wait_stat));
+	}
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	total = (unsigned long long)loops * nr_workers;
+	result_usec = diff.tv_sec * 1000000;
+	result_usec += diff.tv_usec;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d workers passed %d descriptors each over %d socketpairs\n",
+		       nr_workers, loops, nr_pairs);
+		if (garbage_interval)
+			printf("# leaving a garbage cycle every %d passes\n",
+			       garbage_interval);
+		printf("\n %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec/1000));
+
+		printf(" %14lf usecs/op\n",
+		       (double)result_usec / (double)total);
+		printf(" %14d ops/sec\n",
+		       (int)((double)total /
+			     ((double)result_usec / (double)1000000)));
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec / 1000));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
@@ -42,6 +42,9 @@ static struct bench_suite sched_suites[] = {
 	{ "pipe",
 	  "Flood of communication over pipe() between two processes",
 	  bench_sched_pipe      },
+	{ "fdpass",
+	  "Pass descriptors of AF_UNIX sockets over many socketpairs",
+	  bench_sched_fdpass    },
 	suite_all,
 	{ NULL,
 	  NULL,
@@ -39,6 +39,10 @@ struct slabinfo {
 	unsigned long cpuslab_flush, deactivate_full, deactivate_empty;
 	unsigned long deactivate_to_head, deactivate_to_tail;
 	unsigned long deactivate_remote_frees, order_fallback;
+	unsigned long cpu_partial_alloc, cpu_partial_free;
+	unsigned long cpu_partial_node, cpu_partial_drain;
+	unsigned long cpu_partial_objects, cpu_partial_slabs;
+	int cpu_partial;
 	int numa[MAX_NODES];
 	int numa_partial[MAX_NODES];
 } slabinfo[MAX_SLABS];
@@ -457,6 +461,11 @@ static void slab_stats(struct slabinfo *s)
 		s->deactivate_remote_frees * 100 / total_alloc,
 		s->free_frozen * 100 / total_free);
 
+	printf("Cpu partial list     %8lu %8lu %3lu %3lu\n",
+		s->cpu_partial_alloc, s->cpu_partial_free,
+		s->cpu_partial_alloc * 100 / total_alloc,
+		s->cpu_partial_free * 100 / total_free);
+
 	printf("Total                %8lu %8lu\n\n", total_alloc, total_free);
 
 	if (s->cpuslab_flush)
@@ -465,6 +474,10 @@ static void slab_stats(struct slabinfo *s)
 	if (s->alloc_refill)
 		printf("Refill %8lu\n", s->alloc_refill);
 
+	if (s->cpu_partial_node || s->cpu_partial_drain)
+		printf("Cpu partial slabs from node %8lu, drains to node %8lu\n",
+			s->cpu_partial_node, s->cpu_partial_drain);
+
 	total = s->deactivate_full + s->deactivate_empty +
 			s->deactivate_to_head + s->deactivate_to_tail;
 
@@ -499,7 +512,8 @@ static void report(struct slabinfo *s)
 			s->object_size, s->slabs, onoff(s->sanity_checks),
 			s->slabs * (page_size << s->order));
 	printf("SlabObj: %7d  Full   : %7ld   Redzoning     : %s  Used : %7ld\n",
-			s->slab_size, s->slabs - s->partial - s->cpu_slabs,
+			s->slab_size,
+			s->slabs - s->partial - s->cpu_slabs - s->cpu_partial_slabs,
 			onoff(s->red_zone), s->objects * s->object_size);
 	printf("SlabSiz: %7d  Partial: %7ld   Poisoning     : %s  Loss : %7ld\n",
 			page_size << s->order, s->partial, onoff(s->poison),
@@ -511,6 +525,9 @@ static void report(struct slabinfo *s)
 			s->align, s->objs_per_slab, onoff(s->trace),
 			((page_size << s->order) - s->objs_per_slab * s->slab_size) *
 			s->slabs);
+	printf("CpuPartial: %lu slabs with %lu free objects (%d per cpu at most)\n",
+			s->cpu_partial_slabs, s->cpu_partial_objects,
+			s->cpu_partial);
 
 	ops(s);
 	show_tracking(s);
@@ -1150,6 +1167,13 @@ static void read_slab_dir(void)
 			slab->align = get_obj("align");
 			slab->cache_dma = get_obj("cache_dma");
 			slab->cpu_slabs = get_obj("cpu_slabs");
+			slab->cpu_partial = get_obj("cpu_partial");
+			slab->cpu_partial_objects = 0;
+			slab->cpu_partial_slabs = 0;
+			if (read_obj("slabs_cpu_partial"))
+				sscanf(buffer, "%lu(%lu)",
+					&slab->cpu_partial_objects,
+					&slab->cpu_partial_slabs);
 			slab->destroy_by_rcu = get_obj("destroy_by_rcu");
 			slab->hwcache_align = get_obj("hwcache_align");
 			slab->object_size = get_obj("object_size");
@@ -1190,6 +1214,10 @@ static void read_slab_dir(void)
 			slab->deactivate_to_tail = get_obj("deactivate_to_tail");
 			slab->deactivate_remote_frees = get_obj("deactivate_remote_frees");
 			slab->order_fallback = get_obj("order_fallback");
+			slab->cpu_partial_alloc = get_obj("cpu_partial_alloc");
+			slab->cpu_partial_free = get_obj("cpu_partial_free");
+			slab->cpu_partial_node = get_obj("cpu_partial_node");
+			slab->cpu_partial_drain = get_obj("cpu_partial_drain");
 			chdir("..");
 			if (slab->name[0] == ':')
 				alias_targets++;